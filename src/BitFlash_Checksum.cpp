@@ -0,0 +1,98 @@
+#include "BitFlash_Checksum.h"
+#include <esp_rom_crc.h>
+
+static constexpr uint32_t kAdlerModulus = 65521;
+// Largest run for which the Adler-32 sums stay within 32 bits
+static constexpr size_t kAdlerBlock = 5552;
+
+#if !BITFLASH_SMALL_CHECKSUMS
+struct CrcTables {
+    uint32_t table[8][256];
+    
+    // Built by the compiler, so the tables live in flash
+    constexpr CrcTables() : table() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            }
+            table[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+static constexpr CrcTables kCrc;
+#endif
+
+uint32_t BitFlash_Checksum::crc32(uint32_t crc, const uint8_t* data, size_t len) {
+#if BITFLASH_SMALL_CHECKSUMS
+    return esp_rom_crc32_le(crc, data, len);
+#else
+    const auto& t = kCrc.table;
+    crc = ~crc;
+    
+    // Bytes up to a word boundary, then two words per step
+    while (len > 0 && ((uintptr_t)data & 3)) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+        len--;
+    }
+    
+    while (len >= 8) {
+        // Both targets are little endian
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+              t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+        data += 8;
+        len -= 8;
+    }
+    
+    while (len > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+        len--;
+    }
+    return ~crc;
+#endif
+}
+
+uint32_t BitFlash_Checksum::adler32(uint32_t adler, const uint8_t* data, size_t len) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    
+    while (len > 0) {
+        size_t n = min(len, kAdlerBlock);
+        len -= n;
+        
+#if !BITFLASH_SMALL_CHECKSUMS
+        while (n >= 8) {
+            a += data[0]; b += a;
+            a += data[1]; b += a;
+            a += data[2]; b += a;
+            a += data[3]; b += a;
+            a += data[4]; b += a;
+            a += data[5]; b += a;
+            a += data[6]; b += a;
+            a += data[7]; b += a;
+            data += 8;
+            n -= 8;
+        }
+#endif
+        while (n > 0) {
+            a += *data++;
+            b += a;
+            n--;
+        }
+        
+        a %= kAdlerModulus;
+        b %= kAdlerModulus;
+    }
+    return (b << 16) | a;
+}
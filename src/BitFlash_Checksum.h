@@ -0,0 +1,20 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Define as 1 to use the ROM CRC-32 and a plain Adler-32 loop instead of
+// the faster kernels, saving the 8 KB of CRC tables in flash.
+#ifndef BITFLASH_SMALL_CHECKSUMS
+#define BITFLASH_SMALL_CHECKSUMS 0
+#endif
+
+// zlib-compatible running checksums: pass the previous result to continue,
+// 0 (CRC-32) or 1 (Adler-32) to start.
+class BitFlash_Checksum {
+public:
+    // Slice-by-8: eight table lookups per eight bytes instead of per byte.
+    static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t len);
+    // Sums eight bytes per step and reduces modulo 65521 only once per
+    // block that cannot overflow.
+    static uint32_t adler32(uint32_t adler, const uint8_t* data, size_t len);
+};
@@ -1,17 +1,152 @@
 #include "BitFlash_Client.h"
+#include <esp_idf_version.h>
+#include <esp_ota_ops.h>
+#include <esp_rom_crc.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include <hal/efuse_hal.h>
+#endif
+
+static const char* kResponseHeaders[] = {
+    "X-Signature", "Cache-Control", "Expires", "Retry-After", "Date"
+};
+
+// Clears the pipeline when a download returns, however it ended. The sinks
+// go with it, so the pointers to them are reset as well.
+class PipelineGuard {
+public:
+    PipelineGuard(BitFlash_Pipeline& pipeline, BitFlash_PartitionSink*& partitionSink, BitFlash_PatchSink*& patchSink)
+        : _pipeline(pipeline), _partitionSink(partitionSink), _patchSink(patchSink) {}
+    ~PipelineGuard() {
+        if (_dismissed) return;
+        _pipeline.clear();
+        _partitionSink = nullptr;
+        _patchSink = nullptr;
+    }
+
+    // Keeps the pipeline for a download that goes on after the call returns.
+    void dismiss() { _dismissed = true; }
+
+private:
+    bool _dismissed = false;
+    BitFlash_Pipeline& _pipeline;
+    BitFlash_PartitionSink*& _partitionSink;
+    BitFlash_PatchSink*& _patchSink;
+};
 
 BitFlash_Client::BitFlash_Client(const Config& config) 
-    : _config(config), _lastCheck(0), _updateInProgress(false) {
+    : _config(config), _lastCheck(0), _nextCheckDelay(config.checkInterval), _updateInProgress(false) {
 }
 
 void BitFlash_Client::begin() {
     if (_config.autoConnect) {
         connectWiFi();
     }
+    
+    _prefetch.begin();
+    
+    IPAddress dnsServer;
+    if (_config.dnsCache && _config.dnsServer && dnsServer.fromString(_config.dnsServer)) {
+        _dnsCache.setServer(dnsServer);
+    }
+    
+    // Any host on the LAN could win the election, so followers only take
+    // manifests from the leader when they can check the signature
+    _lanElect = _config.lanCoordination && _config.manifestPublicKey;
+    if (_config.lanCoordination && !_lanElect) {
+        notifyCallback("LAN coordination needs manifestPublicKey");
+    }
+    
+    if ((_lanElect || _config.lanGossipFanout > 0) && !_lan) {
+        _lan.reset(new BitFlash_Lan());
+        _lan->setManifestHandler([this](const char* body, size_t length, const String& signature) {
+            // Left for a later heartbeat while busy, and after a failed
+            // attempt until the check delay has passed
+            if (_updateInProgress || (_lanRetry && millis() - _lastCheck < _nextCheckDelay)) {
+                return false;
+            }
+            _updateInProgress = true;
+            _lastCheck = millis();
+            if (processManifest(body, length, signature)) {
+                notifyCallback("Update available");
+                _lanRetry = false;
+                return true;
+            }
+            // Nothing newer counts as done
+            _lanRetry = !_manifestCurrent;
+            return _manifestCurrent;
+        });
+        _lan->setAnnounceHandler([this](const char* version) {
+            // A peer heard of a newer release: check on the next handle(),
+            // unless the server told us to stay away or a rumor already
+            // triggered a check recently
+            if (compareVersions(installedVersion(), version) >= 0 || _serverBackoff ||
+                (_announceCheckAt && millis() - _announceCheckAt < kAnnounceCheckInterval)) {
+                return;
+            }
+            _announceCheckAt = millis();
+            _lastCheck = millis() - _nextCheckDelay;
+        });
+    }
 }
 
 void BitFlash_Client::handle() {
-    if (!_updateInProgress && millis() - _lastCheck >= _config.checkInterval) {
+    // A staged release goes live at its activation time without a download;
+    // until it is complete, one slice is fetched per prefetchInterval
+    if (!_updateInProgress && _prefetch.ready() && _prefetch.due()) {
+        _updateInProgress = true;
+        activateStaged();
+    } else if (!_updateInProgress && _prefetch.pending() && isWiFiConnected() &&
+               millis() - _lastPrefetch >= _config.prefetchInterval) {
+        prefetchChunk();
+        _lastPrefetch = millis();
+    }
+    
+    // Renew the addresses of the update hosts while nothing is waiting on them
+    if (_config.dnsCache && !_updateInProgress && isWiFiConnected()) {
+        _dnsCache.refresh();
+        recordDnsStats();
+    }
+    
+    // Over MQTT, releases are pushed to us and nothing is polled
+    if (_mqtt) {
+        handleMqtt();
+        return;
+    }
+    
+    if (_lan && isWiFiConnected()) {
+        if (!_lan->running()) {
+            _lan->begin(_config.lanPort, ESP.getEfuseMac(), _lanElect, _config.lanGossipFanout);
+        }
+        _lan->poll();
+        
+        // Followers hear about releases from the site leader instead of the
+        // origin, unless its manifest is too big to relay
+        if (_lan->isFollower() && _lan->leaderRelaysManifest()) {
+            return;
+        }
+    }
+    
+    // While the control channel is up the server pushes releases and
+    // commands, so there is nothing to poll
+    if (_config.controlUrl && isWiFiConnected() && serviceControl()) {
+        return;
+    }
+    
+    // The CoAP server tells us about changes to an observed manifest
+    if (_config.coapObserve && isCoapUrl(_config.jsonEndpoint) && isWiFiConnected()) {
+        if (!coap().observing() && millis() - _lastObserve >= _config.checkInterval) {
+            coap().observe(_config.jsonEndpoint);
+            _lastObserve = millis();
+        }
+        // A notification brings the next check forward; the pace after it
+        // stays the same
+        if (coap().poll()) {
+            _lastCheck = millis() - _nextCheckDelay;
+        }
+        recordCoapStats();
+    }
+    
+    if (!_updateInProgress && millis() - _lastCheck >= _nextCheckDelay) {
         checkForUpdate();
         _lastCheck = millis();
     }
@@ -26,21 +161,41 @@ void BitFlash_Client::checkForUpdate() {
     if (checkVersion()) {
         notifyCallback("Update available");
     }
+    recordDnsStats();
 }
 std::unique_ptr<Client> BitFlash_Client::createClient(const String& url) {
-    if (url.startsWith("https://")) {
-        auto secureClient = std::make_unique<WiFiClientSecure>();
+    if ((url.startsWith("https://") || url.startsWith("wss://")) && _config.lowMemoryTls) {
+        if (_config.verifySSL && !_clock.ensure()) {
+            notifyCallback("Clock not set, certificate check may fail");
+        }
+        return std::unique_ptr<Client>(new BitFlash_TlsClient(_config.verifySSL, _config.caCert,
+                                                              _config.tlsFragmentLength,
+                                                              _config.dnsCache ? &_dnsCache : nullptr));
+    } else if (url.startsWith("https://") || url.startsWith("wss://")) {
+        std::unique_ptr<WiFiClientSecure> secureClient;
+        if (_config.dnsCache) {
+            secureClient.reset(new BitFlash_CachedSecureClient(_dnsCache));
+        } else {
+            secureClient.reset(new WiFiClientSecure());
+        }
         
         // SSL verification settings
         if (_config.verifySSL) {
-            // Add root CA certificate if verification is needed
-            // secureClient->setCACert(rootCACertificate);
+            if (!_clock.ensure()) {
+                notifyCallback("Clock not set, certificate check may fail");
+            }
+            if (_config.caCert) {
+                secureClient->setCACert(_config.caCert);
+            }
         } else {
             secureClient->setInsecure();
         }
         
         return secureClient;
-    } else if (url.startsWith("http://")) {
+    } else if (url.startsWith("http://") || url.startsWith("ws://")) {
+        if (_config.dnsCache) {
+            return std::unique_ptr<Client>(new BitFlash_CachedClient(_dnsCache));
+        }
         return std::make_unique<WiFiClient>();
     } else {
         notifyCallback("Invalid URL protocol");
@@ -54,7 +209,8 @@ HTTPClient* BitFlash_Client::createHTTPClient(Client* client, const String& url)
     HTTPClient* https = new HTTPClient();
     
     if (url.startsWith("https://")) {
-        WiFiClientSecure* secureClient = static_cast<WiFiClientSecure*>(client);
+        // WiFiClientSecure or BitFlash_TlsClient
+        WiFiClient* secureClient = static_cast<WiFiClient*>(client);
         if (secureClient) {
             https->begin(*secureClient, url);
         } else {
@@ -83,43 +239,131 @@ HTTPClient* BitFlash_Client::createHTTPClient(Client* client, const String& url)
 bool BitFlash_Client::checkVersion() {
     _updateInProgress = true;
     
+    // With a TXT record, the full manifest is fetched only when DNS says the
+    // latest version differs from ours
+    const char* manifestUrl = _config.jsonEndpoint;
+    bool fromRecord = _config.versionTxtRecord && refreshVersionRecord();
+    if (fromRecord) {
+        // While v is current the manifest is still read once per record, for
+        // an "upcoming" release to stage
+        bool current = compareVersions(installedVersion(), _txt.version.c_str()) >= 0;
+        if (current && (_txt.manifestSeen || _config.inPlacePartition)) {
+            _updateInProgress = false;
+            return false;
+        }
+        
+        // DNS answers are not authenticated: u= may only lead elsewhere when
+        // the manifest it points to has to be signed
+        if (_txt.url.length() > 0 && (_config.manifestPublicKey ||
+                                      urlOrigin(_txt.url.c_str()) == urlOrigin(_config.jsonEndpoint))) {
+            manifestUrl = _txt.url.c_str();
+        }
+    }
+    
+    if (isCoapUrl(manifestUrl)) {
+        String body;
+        String signature;
+        if (!fetchCoapManifest(manifestUrl, body, signature)) {
+            notifyCallback("Failed to fetch version info");
+            _updateInProgress = false;
+            return false;
+        }
+        return acceptManifest(body, signature, fromRecord);
+    }
+    
+    if (_config.singleRoundTrip) {
+        return checkAndDownload();
+    }
+    
     // Create appropriate client
-    auto client = createClient(_config.jsonEndpoint);
+    auto client = createClient(manifestUrl);
     if (!client) {
         _updateInProgress = false;
         return false;
     }
     
     // Create HTTPClient
-    HTTPClient* https = createHTTPClient(client.get(), _config.jsonEndpoint);
+    HTTPClient* https = createHTTPClient(client.get(), manifestUrl);
     if (!https) {
         _updateInProgress = false;
         return false;
     }
     
+    // Lets the server count the installed base and offer a matching patch
+    addDeviceHeaders(https);
+    https->collectHeaders(kResponseHeaders, sizeof(kResponseHeaders) / sizeof(kResponseHeaders[0]));
+    
     int httpCode = https->GET();
+    _stats.versionChecks++;
+    recordHeap(_stats.checkHeapLow);
+    applyFreshness(https, httpCode);
     if (httpCode != HTTP_CODE_OK) {
-        notifyCallback("Failed to fetch version info");
+        notifyCallback(BitFlash_Freshness::isBusy(httpCode) ? "Update server busy" : "Failed to fetch version info");
         https->end();
         delete https;
         _updateInProgress = false;
         return false;
     }
     
-    StaticJsonDocument<1024> doc;
-    DeserializationError error = deserializeJson(doc, https->getString());
+    String body = https->getString();
+    String signature = https->header("X-Signature");
     
     https->end();
     delete https;
     
+    return acceptManifest(body, signature, fromRecord);
+}
+
+bool BitFlash_Client::acceptManifest(const String& body, const String& signature, bool fromRecord) {
+    if (fromRecord && !manifestMatchesRecord(body.c_str(), body.length())) {
+        notifyCallback("Manifest does not match DNS record");
+        _updateInProgress = false;
+        return false;
+    }
+    if (fromRecord) {
+        _txt.manifestSeen = true;
+    }
+    
+    if (_lan) {
+        _lan->publishManifest(body.c_str(), body.length(), signature);
+    }
+    
+    return processManifest(body.c_str(), body.length(), signature);
+}
+
+bool BitFlash_Client::processManifest(const char* body, size_t length, const String& signature) {
+    _manifestCurrent = false;
+    if (_config.manifestPublicKey && !verifyManifest(body, length, signature)) {
+        notifyCallback("Invalid manifest signature");
+        _updateInProgress = false;
+        return false;
+    }
+    
+    // Chunk hash lists make manifests too big for the stack
+    DynamicJsonDocument doc(4096);
+    DeserializationError error = deserializeJson(doc, body, length);
+    recordHeap(_stats.checkHeapLow);
+    
     if (error) {
         notifyCallback("Failed to parse version info");
         _updateInProgress = false;
         return false;
     }
     
-    const char* latestVersion = doc["version"];
-    const char* firmwareUrl = doc["firmware_url"];
+    // Pick the image built for this hardware before anything is downloaded
+    JsonObjectConst entry = doc.as<JsonObjectConst>();
+    JsonArrayConst variants = doc["variants"];
+    if (!variants.isNull()) {
+        entry = selectVariant(variants);
+        if (entry.isNull()) {
+            notifyCallback("No firmware for this hardware");
+            _updateInProgress = false;
+            return false;
+        }
+    }
+    
+    const char* latestVersion = entry["version"] | doc["version"].as<const char*>();
+    const char* firmwareUrl = entry["firmware_url"];
     
     if (!latestVersion || !firmwareUrl) {
         notifyCallback("Invalid version info format");
@@ -127,136 +371,1472 @@ bool BitFlash_Client::checkVersion() {
         return false;
     }
     
-    if (compareVersions(_config.currentVersion, latestVersion) < 0) {
-        return performUpdate(firmwareUrl);
+    const char* installed = installedVersion();
+    if (compareVersions(installed, latestVersion) < 0) {
+        if (_lan) {
+            announceRelease(latestVersion, body, length);
+        }
+        
+        // Staged ahead of its rollout: only the boot partition has to change
+        uint8_t hash[32];
+        const char* sha256 = entry["sha256"];
+        if (_prefetch.ready() && _prefetch.version() == latestVersion &&
+            (!sha256 || (decodeHex(sha256, hash, sizeof(hash)) && memcmp(hash, _prefetch.hash(), sizeof(hash)) == 0))) {
+            return activateStaged();
+        }
+        
+        // Prefer a delta against exactly the image we have
+        JsonObjectConst patch = selectPatch(entry, installed);
+        if (!patch.isNull()) {
+            return performUpdate(patch["url"], entry, patch);
+        }
+        return performUpdate(firmwareUrl, entry, JsonObjectConst());
     }
     
+    _manifestCurrent = true;
+    stageUpcoming(entry["upcoming"], installed);
     _updateInProgress = false;
     return false;
 }
 
-bool BitFlash_Client::performUpdate(const char* firmwareUrl) {
-    // Create appropriate client for firmware download
-    auto client = createClient(firmwareUrl);
+// "upcoming": {"version", "firmware_url", "sha256", "size", "activate_at"}, with
+// activate_at in Unix seconds. A release that is withdrawn from the manifest
+// is dropped from staging too.
+void BitFlash_Client::stageUpcoming(JsonObjectConst upcoming, const char* installed) {
+    const char* version = upcoming["version"];
+    const char* url = upcoming["firmware_url"];
+    const char* sha256 = upcoming["sha256"];
+    size_t size = upcoming["size"] | 0u;
+    uint32_t activateAt = upcoming["activate_at"] | 0u;
+    uint8_t hash[32];
+    
+    // In-place devices have no spare partition to stage into
+    if (!version || !url || !sha256 || size == 0 || _config.inPlacePartition ||
+        compareVersions(installed, version) >= 0 || !decodeHex(sha256, hash, sizeof(hash))) {
+        _prefetch.clear();
+        return;
+    }
+    
+    _prefetch.announce(version, url, hash, size, activateAt);
+}
+
+// Fetches the next slice of the staged release with a Range request.
+void BitFlash_Client::prefetchChunk() {
+    String url = _prefetch.url();
+    auto client = createClient(url);
+    if (!client) return;
+    
+    HTTPClient* https = createHTTPClient(client.get(), url);
+    if (!https) return;
+    
+    size_t from = _prefetch.offset();
+    size_t length = min<size_t>(_config.prefetchChunkSize, _prefetch.size() - from);
+    https->addHeader("Range", "bytes=" + String(from) + "-" + String(from + length - 1));
+    
+    // Anything but a partial response would mean downloading the whole image now
+    int httpCode = https->GET();
+    if (httpCode != HTTP_CODE_PARTIAL_CONTENT || https->getSize() != (int)length) {
+        https->end();
+        delete https;
+        return;
+    }
+    
+    WiFiClient* stream = https->getStreamPtr();
+    size_t received = 0;
+    uint8_t buff[1024];
+    
+    while (https->connected() && received < length) {
+        size_t size = stream->available();
+        if (size) {
+            int c = stream->readBytes(buff, min(size, min(sizeof(buff), length - received)));
+            if (!_prefetch.write(buff, c)) {
+                break;
+            }
+            received += c;
+        }
+        yield();
+    }
+    
+    https->end();
+    delete https;
+    
+    // Whatever arrived is kept; a short slice just continues next time
+    bool complete = _prefetch.offset() == _prefetch.size();
+    if (!_prefetch.commit()) {
+        notifyCallback("Staged update failed verification");
+    } else if (complete) {
+        notifyCallback("Update staged");
+    }
+}
+
+bool BitFlash_Client::activateStaged() {
+    notifyCallback("Activating staged update");
+    if (!_prefetch.activate()) {
+        notifyCallback("Staged update failed");
+        _updateInProgress = false;
+        return false;
+    }
+    
+    notifyCallback("Update complete, restarting...");
+    delay(1000);
+    ESP.restart();
+    return true;
+}
+
+// An entry offers one "patch" or a "patches" list, each from one earlier version.
+JsonObjectConst BitFlash_Client::selectPatch(JsonObjectConst entry, const char* installed) {
+    // An interrupted in-place patch has to be finished; if the manifest no
+    // longer offers it, only the full image can repair the partition
+    uint32_t pending;
+    if (_config.inPlacePartition && BitFlash_PatchSink::pendingPatch(scratchPartition(), pending)) {
+        JsonObjectConst single = entry["patch"];
+        if (!single.isNull() && single["url"] && patchId(single) == pending) {
+            return single;
+        }
+        for (JsonObjectConst patch : entry["patches"].as<JsonArrayConst>()) {
+            if (patch["url"] && patchId(patch) == pending) {
+                return patch;
+            }
+        }
+        return JsonObjectConst();
+    }
+    
+    JsonObjectConst single = entry["patch"];
+    if (!single.isNull() && single["url"] && strcmp(single["from"] | "", installed) == 0) {
+        return single;
+    }
+    
+    for (JsonObjectConst patch : entry["patches"].as<JsonArrayConst>()) {
+        if (patch["url"] && strcmp(patch["from"] | "", installed) == 0) {
+            return patch;
+        }
+    }
+    return JsonObjectConst();
+}
+
+// Variants are tried in order; keys a variant leaves out match any device.
+// flash_size is the minimum flash the image needs.
+JsonObjectConst BitFlash_Client::selectVariant(JsonArrayConst variants) {
+    for (JsonObjectConst variant : variants) {
+        const char* chip = variant["chip"];
+        if (chip && strcasecmp(chip, ESP.getChipModel()) != 0) continue;
+        
+        uint32_t flashSize = variant["flash_size"] | 0u;
+        if (flashSize && ESP.getFlashChipSize() < flashSize) continue;
+        
+        JsonVariantConst psram = variant["psram"];
+        if (!psram.isNull() && psram.as<bool>() != (ESP.getPsramSize() > 0)) continue;
+        
+        const char* board = variant["board"];
+        if (board && (!_config.boardId || strcmp(board, _config.boardId) != 0)) continue;
+        
+        return variant;
+    }
+    return JsonObjectConst();
+}
+
+// TXT record format: "v=<version>[;h=<manifest sha256 hex prefix>][;u=<manifest url>]".
+// The record is reused until its TTL runs out, so most checks cost nothing.
+bool BitFlash_Client::refreshVersionRecord() {
+    if (_txt.valid && millis() - _txt.fetchedAt < _stats.txtTtl * 1000UL) {
+        _stats.txtCacheHits++;
+        return true;
+    }
+    
+    BitFlash_Dns dns;
+    IPAddress server;
+    if (_config.dnsServer && server.fromString(_config.dnsServer)) {
+        dns.setServer(server);
+    }
+    
+    String record;
+    uint32_t ttl = 0;
+    _stats.txtQueries++;
+    if (!dns.queryTxt(_config.versionTxtRecord, "v=", record, ttl)) {
+        _txt.valid = false;
+        return false;
+    }
+    
+    _txt.version = String();
+    _txt.hash = String();
+    _txt.url = String();
+    _txt.manifestSeen = false;
+    
+    int start = 0;
+    while (start < (int)record.length()) {
+        int end = record.indexOf(';', start);
+        if (end < 0) end = record.length();
+        String field = record.substring(start, end);
+        
+        if (field.startsWith("v=")) _txt.version = field.substring(2);
+        else if (field.startsWith("h=")) _txt.hash = field.substring(2);
+        else if (field.startsWith("u=")) _txt.url = field.substring(2);
+        start = end + 1;
+    }
+    
+    _txt.valid = _txt.version.length() > 0;
+    _txt.fetchedAt = millis();
+    _stats.txtTtl = min<uint32_t>(ttl, kMaxFreshnessSeconds);
+    return _txt.valid;
+}
+
+bool BitFlash_Client::manifestMatchesRecord(const char* body, size_t length) {
+    size_t hashLength = _txt.hash.length() / 2;
+    if (hashLength == 0) return true;
+    
+    uint8_t expected[32];
+    uint8_t digest[32];
+    if (hashLength > sizeof(expected) || !decodeHex(_txt.hash.c_str(), expected, hashLength) ||
+        mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)body, length, digest) != 0) {
+        return false;
+    }
+    return memcmp(digest, expected, hashLength) == 0;
+}
+
+// Tells LAN peers about the release, identified by version and manifest hash.
+void BitFlash_Client::announceRelease(const char* version, const char* body, size_t length) {
+    uint8_t digest[32];
+    if (mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)body, length, digest) != 0) {
+        return;
+    }
+    
+    char hash[17];
+    for (int i = 0; i < 8; i++) {
+        snprintf(hash + i * 2, 3, "%02x", digest[i]);
+    }
+    _lan->announce(version, hash);
+}
+
+// Single round trip: the server sees our version in the request headers and
+// answers 204 when we are current, or with one manifest line followed
+// directly by the image. When the line lists a patch from our version, the
+// patch follows instead.
+bool BitFlash_Client::checkAndDownload() {
+    auto client = createClient(_config.jsonEndpoint);
     if (!client) {
         _updateInProgress = false;
         return false;
     }
     
-    // Create HTTPClient
-    HTTPClient* https = createHTTPClient(client.get(), firmwareUrl);
+    HTTPClient* https = createHTTPClient(client.get(), _config.jsonEndpoint);
     if (!https) {
         _updateInProgress = false;
         return false;
     }
     
+    addDeviceHeaders(https);
+    https->collectHeaders(kResponseHeaders, sizeof(kResponseHeaders) / sizeof(kResponseHeaders[0]));
+    
     int httpCode = https->GET();
+    _stats.versionChecks++;
+    recordHeap(_stats.checkHeapLow);
+    applyFreshness(https, httpCode);
+    if (httpCode == HTTP_CODE_NO_CONTENT) {
+        https->end();
+        delete https;
+        _updateInProgress = false;
+        return false;
+    }
+    
     if (httpCode != HTTP_CODE_OK) {
-        notifyCallback("Failed to download firmware");
+        notifyCallback(BitFlash_Freshness::isBusy(httpCode) ? "Update server busy" : "Failed to fetch version info");
         https->end();
         delete https;
         _updateInProgress = false;
         return false;
     }
     
-    int contentLength = https->getSize();
-    if (contentLength <= 0) {
-        notifyCallback("Invalid firmware size");
+    WiFiClient* stream = https->getStreamPtr();
+    char line[1024];
+    size_t lineLength = stream->readBytesUntil('\n', line, sizeof(line) - 1);
+    String signature = https->header("X-Signature");
+    
+    if (lineLength == 0 || lineLength >= sizeof(line) - 1) {
+        notifyCallback("Invalid version info format");
         https->end();
         delete https;
         _updateInProgress = false;
         return false;
     }
     
-    if (!Update.begin(contentLength)) {
-        notifyCallback("Not enough space for update");
+    if (_config.manifestPublicKey && !verifyManifest(line, lineLength, signature)) {
+        notifyCallback("Invalid manifest signature");
         https->end();
         delete https;
         _updateInProgress = false;
         return false;
     }
     
-    WiFiClient* stream = https->getStreamPtr();
-    size_t written = 0;
-    uint8_t buff[1024] = { 0 };
+    StaticJsonDocument<1024> doc;
+    DeserializationError error = deserializeJson(doc, line, lineLength);
+    JsonObjectConst entry = doc.as<JsonObjectConst>();
+    const char* latestVersion = entry["version"];
     
-    while (https->connected() && (written < contentLength)) {
-        size_t size = stream->available();
-        if (size) {
-            int c = stream->readBytes(buff, ((size > sizeof(buff)) ? sizeof(buff) : size));
-            written += Update.write(buff, c);
-            int progress = (written * 100) / contentLength;
-            notifyCallback("Downloading update", progress);
-        }
-        yield();
+    if (error || !latestVersion) {
+        notifyCallback("Invalid version info format");
+        https->end();
+        delete https;
+        _updateInProgress = false;
+        return false;
     }
     
-    https->end();
-    delete https;
+    const char* installed = installedVersion();
+    if (compareVersions(installed, latestVersion) >= 0) {
+        https->end();
+        delete https;
+        _updateInProgress = false;
+        return false;
+    }
     
-    if (written != contentLength) {
-        notifyCallback("Download incomplete");
-        Update.abort();
+    // What the server sent after the line
+    JsonObjectConst sent = entry["patch"];
+    if (sent.isNull() || strcmp(sent["from"] | "", installed) != 0) {
+        sent = JsonObjectConst();
+    }
+    size_t declared = sent.isNull() ? (entry["size"] | 0u) : (sent["size"] | 0u);
+    
+    // Without a length, as with a chunked response, a cut-off body would
+    // look complete
+    int contentLength = https->getSize();
+    size_t bodyLength = contentLength > (int)lineLength + 1 ? contentLength - lineLength - 1 : 0;
+    if (bodyLength == 0 || (declared > 0 && declared != bodyLength)) {
+        notifyCallback("Invalid firmware size");
+        https->end();
+        delete https;
         _updateInProgress = false;
         return false;
     }
     
-    if (!Update.end()) {
-        notifyCallback("Update failed");
+    // The same choice processManifest() makes. An unfinished in-place patch
+    // may need another patch than the one sent; fetch that one separately.
+    JsonObjectConst patch = selectPatch(entry, installed);
+    bool usable = patch.isNull() ? sent.isNull() : !sent.isNull() && patchId(patch) == patchId(sent);
+    if (!usable) {
+        https->end();
+        delete https;
+        const char* url = patch.isNull() ? entry["firmware_url"] : patch["url"];
+        if (!url) {
+            notifyCallback("Invalid version info format");
+            _updateInProgress = false;
+            return false;
+        }
+        return performUpdate(url, entry, patch);
+    }
+    
+    PipelineGuard guard(_pipeline, _partitionSink, _patchSink);
+    if (!buildPipeline(_config.jsonEndpoint, entry, patch)) {
+        https->end();
+        delete https;
         _updateInProgress = false;
         return false;
     }
     
-    notifyCallback("Update complete, restarting...");
-    delay(1000);
-    ESP.restart();
-    return true;
+    // A journal to continue needs a range request for the patch
+    if (_patchSink && (_patchSink->complete() || _patchSink->resumeOffset() > 0)) {
+        https->end();
+        delete https;
+        return performUpdate(patch["url"], entry, patch);
+    }
+    
+    if (_patchSink) {
+        _patchSink->setStreamStart(0);
+    }
+    return installFromStream(https, stream, bodyLength);
 }
 
-bool BitFlash_Client::connectWiFi() {
-    if (isWiFiConnected()) return true;
+// Asks the server for one of its download slots. When none is free the
+// server names a wait time and the next automatic check is pushed back to it.
+bool BitFlash_Client::acquireSlot(const char* slotUrl, String& token) {
+    auto client = createClient(slotUrl);
+    if (!client) return false;
     
-    WiFi.begin(_config.ssid, _config.password);
+    HTTPClient* https = createHTTPClient(client.get(), slotUrl);
+    if (!https) return false;
     
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-        delay(500);
-        attempts++;
+    addDeviceHeaders(https);
+    https->collectHeaders(kResponseHeaders, sizeof(kResponseHeaders) / sizeof(kResponseHeaders[0]));
+    
+    int httpCode = https->GET();
+    if (BitFlash_Freshness::isBusy(httpCode)) {
+        applyFreshness(https, httpCode);
+        notifyCallback("Waiting for download slot");
+        https->end();
+        delete https;
+        return false;
     }
     
-    if (isWiFiConnected()) {
-        setClock();
+    if (httpCode != HTTP_CODE_OK) {
+        notifyCallback("Failed to acquire download slot");
+        https->end();
+        delete https;
+        return false;
+    }
+    
+    StaticJsonDocument<256> doc;
+    DeserializationError error = deserializeJson(doc, https->getString());
+    https->end();
+    delete https;
+    
+    const char* granted = doc["token"];
+    long wait = doc["wait"] | 0;
+    
+    if (!error && granted) {
+        token = granted;
         return true;
     }
     
+    if (!error && wait > 0) {
+        _nextCheckDelay = (uint32_t)min<long>(wait, kMaxFreshnessSeconds) * 1000;
+        _serverBackoff = true;
+        notifyCallback("Waiting for download slot");
+        return false;
+    }
+    
+    notifyCallback("Failed to acquire download slot");
     return false;
 }
 
-void BitFlash_Client::disconnectWiFi() {
-    WiFi.disconnect();
+void BitFlash_Client::addDeviceHeaders(HTTPClient* https) {
+    char deviceId[17];
+    snprintf(deviceId, sizeof(deviceId), "%016llx", (unsigned long long)ESP.getEfuseMac());
+    https->addHeader("X-BitFlash-Device", deviceId);
+    https->addHeader("X-BitFlash-Version", installedVersion());
+    https->addHeader("X-BitFlash-Chip", ESP.getChipModel());
+    https->addHeader("X-BitFlash-Flash-Size", String(ESP.getFlashChipSize()));
+    https->addHeader("X-BitFlash-Psram", ESP.getPsramSize() > 0 ? "1" : "0");
+    if (_config.boardId) {
+        https->addHeader("X-BitFlash-Board", _config.boardId);
+    }
+    https->addHeader("X-BitFlash-Partition-Size", String(ESP.getFreeSketchSpace()));
+    https->addHeader("X-BitFlash-Patch", "bfp1");
 }
 
-bool BitFlash_Client::isWiFiConnected() {
-    return WiFi.status() == WL_CONNECTED;
-}
+bool BitFlash_Client::performUpdate(const char* firmwareUrl, JsonObjectConst entry, JsonObjectConst patch) {
+    if (isCoapUrl(firmwareUrl)) {
+        return performCoapUpdate(firmwareUrl, entry, patch);
+    }
+    if (isMqttUrl(firmwareUrl)) {
+        return startMqttDownload(firmwareUrl, entry, patch);
+    }
+    if (strncmp(firmwareUrl, "control:", 8) == 0) {
+        return performControlDownload(firmwareUrl + 8, entry, patch);
+    }
+    
+    // Collect the image on storage first; flash only once it is all there
+    if (_config.stagingFs && patch.isNull() && (entry["size"] | 0u) > 0) {
+        return performStoredUpdate(firmwareUrl, entry);
+    }
+    
+    // A device that has to wait leaves a staged release and an in-place
+    // journal alone, and holds no buffers while it waits
+    String slotToken;
+    const char* slotUrl = entry["slot_url"];
+    if (slotUrl && !acquireSlot(slotUrl, slotToken)) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    PipelineGuard guard(_pipeline, _partitionSink, _patchSink);
+    if (!buildPipeline(firmwareUrl, entry, patch)) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    // Create appropriate client for firmware download
+    auto client = createClient(firmwareUrl);
+    if (!client) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    // Create HTTPClient
+    HTTPClient* https = createHTTPClient(client.get(), firmwareUrl);
+    if (!https) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    if (slotToken.length() > 0) {
+        https->addHeader("X-BitFlash-Token", slotToken);
+    }
+    
+    // The journal already holds the whole image, so a range request would
+    // only get a 416: finish without downloading
+    if (_patchSink && _patchSink->complete()) {
+        https->end();
+        delete https;
+        return installFromStream(nullptr, nullptr, 0);
+    }
+    
+    // An interrupted in-place patch continues where its journal stopped
+    size_t resumeAt = _patchSink ? _patchSink->resumeOffset() : 0;
+    if (resumeAt > 0) {
+        https->addHeader("Range", "bytes=" + String(resumeAt) + "-");
+    }
+    
+    int httpCode = https->GET();
+    if (httpCode != HTTP_CODE_OK && !(resumeAt > 0 && httpCode == HTTP_CODE_PARTIAL_CONTENT)) {
+        notifyCallback("Failed to download firmware");
+        https->end();
+        delete https;
+        _updateInProgress = false;
+        return false;
+    }
+    
+    if (_patchSink) {
+        _patchSink->setStreamStart(httpCode == HTTP_CODE_PARTIAL_CONTENT ? resumeAt : 0);
+    }
+    
+    int contentLength = https->getSize();
+    if (contentLength <= 0) {
+        notifyCallback("Invalid firmware size");
+        https->end();
+        delete https;
+        _updateInProgress = false;
+        return false;
+    }
+    
+    return installFromStream(https, https->getStreamPtr(), contentLength);
+}
+
+// Downloads the image chunk by chunk into stagingFs, over as many checks as
+// it takes, and installs it from there once every chunk has been verified.
+bool BitFlash_Client::performStoredUpdate(const char* firmwareUrl, JsonObjectConst entry) {
+    size_t size = entry["size"];
+    size_t chunkSize = entry["chunk_size"] | _config.stagingChunkSize;
+    JsonArrayConst chunkHashes = entry["chunks"];
+    
+    BitFlash_FileStore store(*_config.stagingFs, _config.stagingPath);
+    if (!store.open(entry["sha256"] | firmwareUrl, size, chunkSize)) {
+        notifyCallback("Failed to open update storage");
+        _updateInProgress = false;
+        return false;
+    }
+    
+    String slotToken;
+    const char* slotUrl = entry["slot_url"];
+    if (!store.complete() && slotUrl && !acquireSlot(slotUrl, slotToken)) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    while (!store.complete()) {
+        if (!fetchStoredChunk(store, firmwareUrl, slotToken, chunkHashes)) {
+            // Verified chunks stay on storage; the next check continues from there
+            notifyCallback("Download paused", store.verified() * 100 / size);
+            _updateInProgress = false;
+            return false;
+        }
+        notifyCallback("Downloading update", store.verified() * 100 / size);
+    }
+    
+    PipelineGuard guard(_pipeline, _partitionSink, _patchSink);
+    fs::File file = store.read();
+    if (!file || !buildPipeline(firmwareUrl, entry, JsonObjectConst())) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    // A complete image that still fails is not worth keeping
+    bool ok = installFromStream(nullptr, &file, size);
+    file.close();
+    store.remove();
+    return ok;
+}
+
+bool BitFlash_Client::fetchStoredChunk(BitFlash_FileStore& store, const char* url, const String& slotToken,
+                                       JsonArrayConst chunkHashes) {
+    size_t from = store.verified();
+    size_t length = min<size_t>(store.chunkSize(), store.size() - from);
+    
+    uint8_t expected[32];
+    const char* chunkHash = chunkHashes[from / store.chunkSize()];
+    if (chunkHash && !decodeHex(chunkHash, expected, sizeof(expected))) {
+        return false;
+    }
+    
+    auto client = createClient(url);
+    if (!client) return false;
+    
+    HTTPClient* https = createHTTPClient(client.get(), url);
+    if (!https) return false;
+    
+    if (slotToken.length() > 0) {
+        https->addHeader("X-BitFlash-Token", slotToken);
+    }
+    https->addHeader("Range", "bytes=" + String(from) + "-" + String(from + length - 1));
+    
+    int httpCode = https->GET();
+    bool whole = httpCode == HTTP_CODE_OK && from == 0 && length == store.size();
+    if ((httpCode != HTTP_CODE_PARTIAL_CONTENT && !whole) || https->getSize() != (int)length || !store.beginChunk()) {
+        https->end();
+        delete https;
+        return false;
+    }
+    
+    WiFiClient* stream = https->getStreamPtr();
+    size_t received = 0;
+    uint8_t buff[1024];
+    
+    while (https->connected() && received < length) {
+        size_t size = stream->available();
+        if (size) {
+            int c = stream->readBytes(buff, min(size, sizeof(buff)));
+            if (!store.write(buff, c)) {
+                break;
+            }
+            received += c;
+        }
+        yield();
+    }
+    
+    https->end();
+    delete https;
+    return store.endChunk(chunkHash ? expected : nullptr);
+}
+
+bool BitFlash_Client::isCoapUrl(const char* url) {
+    return url && strncmp(url, "coap://", 7) == 0;
+}
+
+// Scheme, host and port: "https://example.com:8443/a" gives
+// "https://example.com:8443".
+String BitFlash_Client::urlOrigin(const char* url) {
+    String text = url ? url : "";
+    int scheme = text.indexOf("://");
+    if (scheme < 0) return String();
+    int path = text.indexOf('/', scheme + 3);
+    String origin = path < 0 ? text : text.substring(0, path);
+    origin.toLowerCase();
+    return origin;
+}
+
+BitFlash_Coap& BitFlash_Client::coap() {
+    if (!_coap) {
+        _coap.reset(new BitFlash_Coap());
+        _coap->setBlockSize(_config.coapBlockSize);
+    }
+    return *_coap;
+}
+
+void BitFlash_Client::recordCoapStats() {
+    _stats.coapBytesSent = _coap ? _coap->bytesSent() : 0;
+    _stats.coapBytesReceived = _coap ? _coap->bytesReceived() : 0;
+}
+
+// CoAP has no headers, so a signed manifest's signature is its own
+// resource next to it: <url>.sig.
+bool BitFlash_Client::fetchCoapManifest(const char* url, String& body, String& signature) {
+    auto append = [](String& target) {
+        return [&target](uint8_t* data, size_t len, size_t total) {
+            return target.concat((const char*)data, len);
+        };
+    };
+    
+    bool ok = coap().get(url, append(body));
+    if (ok && _config.manifestPublicKey) {
+        ok = coap().get((String(url) + ".sig").c_str(), append(signature));
+        signature.trim();
+    }
+    _stats.versionChecks++;
+    recordCoapStats();
+    return ok;
+}
+
+bool BitFlash_Client::performCoapUpdate(const char* firmwareUrl, JsonObjectConst entry, JsonObjectConst patch) {
+    PipelineGuard guard(_pipeline, _partitionSink, _patchSink);
+    if (!buildPipeline(firmwareUrl, entry, patch)) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    // Block-wise transfer always starts at the beginning
+    if (_patchSink) {
+        _patchSink->setStreamStart(0);
+    }
+    
+    _block = {};
+    _block.size = entry["size"] | 0u;
+    bool ok = coap().get(firmwareUrl, [this](uint8_t* data, size_t len, size_t total) {
+        return writeBlock(data, len, total);
+    });
+    recordCoapStats();
+    return finishBlocks(ok);
+}
+
+// Feeds one piece of a download that arrives in blocks. The pipeline begins
+// with the first one, once the image size is known.
+bool BitFlash_Client::writeBlock(uint8_t* data, size_t len, size_t total) {
+    if (!_block.started) {
+        _block.size = _block.size ? _block.size : total;
+        if (_block.size == 0 || !_pipeline.begin(_block.size)) {
+            _block.noSpace = _block.size > 0;
+            return false;
+        }
+        _block.started = true;
+    }
+    
+    if (_block.written + len > _block.size || !_pipeline.write(data, len)) {
+        return false;
+    }
+    _block.written += len;
+    notifyCallback("Downloading update", _block.written * 100 / _block.size);
+    return true;
+}
+
+bool BitFlash_Client::finishBlocks(bool ok) {
+    if (!_block.started) {
+        notifyCallback(_block.noSpace ? "Not enough space for update" : "Failed to download firmware");
+        _updateInProgress = false;
+        return false;
+    }
+    return finishInstall(ok && _block.written == _block.size);
+}
+
+// Keeps the control channel connected, reconnecting with exponential
+// backoff, and runs the commands that arrive on it. Returns false while it
+// is down, so the caller falls back to polling.
+bool BitFlash_Client::serviceControl() {
+    if (!_control) {
+        _control.reset(new BitFlash_WebSocket());
+    }
+    
+    if (!_control->connected()) {
+        if ((long)(millis() - _controlRetryAt) < 0) {
+            return false;
+        }
+        
+        _stats.controlConnects++;
+        if (!_control->connect(_config.controlUrl, createClient(_config.controlUrl))) {
+            _controlBackoff = _controlBackoff ? min<uint32_t>(_controlBackoff * 2, kMaxControlBackoff) : 1000;
+            _controlRetryAt = millis() + _controlBackoff + random(_controlBackoff / 2);
+            recordControlStats();
+            return false;
+        }
+        
+        // Catch up on whatever was announced while we were away
+        _controlBackoff = 0;
+        _controlCheck = true;
+    }
+    
+    uint8_t* data;
+    size_t length;
+    BitFlash_WebSocket::Opcode opcode;
+    while (_control->receive(data, length, opcode, 0)) {
+        if (opcode == BitFlash_WebSocket::kText) {
+            handleControlMessage((const char*)data, length);
+        }
+    }
+    
+    if (_controlCheck && !_updateInProgress) {
+        _controlCheck = false;
+        checkForUpdate();
+        _lastCheck = millis();
+    }
+    
+    recordControlStats();
+    return _control->connected();
+}
+
+// Commands: "check", "install", or "manifest\n<signature>\n<manifest>" to
+// push a release without a round trip.
+void BitFlash_Client::handleControlMessage(const char* text, size_t length) {
+    if (length >= 9 && strncmp(text, "manifest\n", 9) == 0) {
+        const char* signatureEnd = (const char*)memchr(text + 9, '\n', length - 9);
+        if (!signatureEnd || _updateInProgress) return;
+        
+        // Copied out, as a download over the channel reuses its buffer
+        String signature;
+        String body;
+        signature.concat(text + 9, signatureEnd - text - 9);
+        body.concat(signatureEnd + 1, text + length - signatureEnd - 1);
+        _updateInProgress = true;
+        if (processManifest(body.c_str(), body.length(), signature)) {
+            notifyCallback("Update available");
+        }
+    } else if (length == 7 && strncmp(text, "install", 7) == 0 && _prefetch.ready() && !_updateInProgress) {
+        // Skip the wait for a staged release's activation time
+        _updateInProgress = true;
+        activateStaged();
+    } else if ((length == 5 && strncmp(text, "check", 5) == 0) || (length == 7 && strncmp(text, "install", 7) == 0)) {
+        _controlCheck = true;
+    }
+}
+
+// Streams the image over the control channel. The server answers "get
+// <image>" with binary messages: offset (u32) | image size (u32) | data.
+bool BitFlash_Client::performControlDownload(const char* image, JsonObjectConst entry, JsonObjectConst patch) {
+    if (!_control || !_control->connected()) {
+        notifyCallback("Control channel not connected");
+        _updateInProgress = false;
+        return false;
+    }
+    
+    PipelineGuard guard(_pipeline, _partitionSink, _patchSink);
+    if (!buildPipeline(image, entry, patch)) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    if (_patchSink) {
+        _patchSink->setStreamStart(0);
+    }
+    
+    _block = {};
+    _block.size = entry["size"] | 0u;
+    bool ok = _control->sendText(String("get ") + image);
+    
+    while (ok && !(_block.started && _block.written == _block.size)) {
+        uint8_t* data;
+        size_t length;
+        BitFlash_WebSocket::Opcode opcode;
+        if (!_control->receive(data, length, opcode, kControlChunkTimeout)) {
+            ok = false;
+        } else if (opcode == BitFlash_WebSocket::kBinary && length <= 8) {
+            // Too short for the header, let alone data
+            ok = false;
+        } else if (opcode == BitFlash_WebSocket::kBinary) {
+            uint32_t offset = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+            uint32_t total = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+            ok = offset == _block.written && writeBlock(data + 8, length - 8, total);
+        }
+    }
+    
+    recordControlStats();
+    return finishBlocks(ok);
+}
+
+void BitFlash_Client::recordControlStats() {
+    _stats.controlBytesSent = _control ? _control->bytesSent() : 0;
+    _stats.controlBytesReceived = _control ? _control->bytesReceived() : 0;
+}
+
+void BitFlash_Client::recordHeap(uint32_t& low) {
+    uint32_t free = ESP.getFreeHeap();
+    if (low == 0 || free < low) {
+        low = free;
+    }
+}
+
+void BitFlash_Client::recordDnsStats() {
+    _stats.dnsCacheHits = _dnsCache.hits();
+    _stats.dnsCacheMisses = _dnsCache.misses();
+    _stats.dnsRefreshes = _dnsCache.refreshes();
+}
+
+bool BitFlash_Client::isMqttUrl(const char* url) {
+    return url && strncmp(url, "mqtt:", 5) == 0;
+}
+
+// The download continues in handle() as chunks arrive.
+bool BitFlash_Client::startMqttDownload(const char* firmwareUrl, JsonObjectConst entry, JsonObjectConst patch) {
+    if (!_mqtt) {
+        notifyCallback("MQTT delivery not configured");
+        _updateInProgress = false;
+        return false;
+    }
+    
+    PipelineGuard guard(_pipeline, _partitionSink, _patchSink);
+    if (!buildPipeline(firmwareUrl, entry, patch)) {
+        _updateInProgress = false;
+        return false;
+    }
+    
+    if (_patchSink) {
+        _patchSink->setStreamStart(0);
+    }
+    
+    _block = {};
+    _block.size = entry["size"] | 0u;
+    bool started = _mqtt->begin(firmwareUrl + 5, _config.mqttChunkSize, _config.mqttWindow,
+                                [this](uint8_t* data, size_t len, size_t total) {
+        return writeBlock(data, len, total);
+    });
+    if (!started) {
+        notifyCallback("Not enough memory for MQTT download");
+        _mqtt->cancel();
+        _updateInProgress = false;
+        return false;
+    }
+    
+    // handleMqtt() finishes the download and clears the pipeline
+    guard.dismiss();
+    return true;
+}
+
+// Manifests and chunks are only acted on here, not in the MQTT callback, so
+// neither a download over another transport nor flash writes block the
+// application's MQTT loop.
+void BitFlash_Client::handleMqtt() {
+    if (_mqttPending && !_updateInProgress && (long)(millis() - _mqttRetryAt) >= 0) {
+        _mqttPending = false;
+        
+        // "<signature>\n<manifest>", or just the manifest when it is unsigned
+        int newline = _mqttManifest[0] == '{' ? -1 : _mqttManifest.indexOf('\n');
+        String signature = newline >= 0 ? _mqttManifest.substring(0, newline) : String();
+        String body = newline >= 0 ? _mqttManifest.substring(newline + 1) : _mqttManifest;
+        
+        _updateInProgress = true;
+        if (processManifest(body.c_str(), body.length(), signature)) {
+            notifyCallback("Update available");
+        } else if (!_manifestCurrent) {
+            retryMqtt();
+        }
+    }
+    
+    if (_mqtt->active()) {
+        _mqtt->poll();
+    } else if (_mqtt->complete() || _mqtt->failed()) {
+        bool ok = _mqtt->complete();
+        _mqtt->cancel();
+        PipelineGuard guard(_pipeline, _partitionSink, _patchSink);
+        if (!finishBlocks(ok)) {
+            retryMqtt();
+        }
+    }
+}
+
+// The manifest stays retained on the broker, so nothing would bring it back
+// after a failed attempt: it is tried again with exponential backoff until
+// a new one arrives.
+void BitFlash_Client::retryMqtt() {
+    _mqttBackoff = _mqttBackoff ? min<uint32_t>(_mqttBackoff * 2, kMaxMqttBackoff) : kMqttRetryDelay;
+    _mqttRetryAt = millis() + _mqttBackoff + random(_mqttBackoff / 2);
+    _mqttPending = true;
+}
+
+void BitFlash_Client::setMqttPublisher(MqttPublisher publish) {
+    char deviceId[17];
+    snprintf(deviceId, sizeof(deviceId), "%016llx", (unsigned long long)ESP.getEfuseMac());
+    _mqtt.reset(_config.mqttTopicPrefix ? new BitFlash_Mqtt(_config.mqttTopicPrefix, deviceId, publish) : nullptr);
+}
+
+void BitFlash_Client::handleMqttMessage(const char* topic, uint8_t* payload, size_t length) {
+    if (!_mqtt) return;
+    
+    // An empty retained message only clears the topic
+    if (_mqtt->manifestTopic() == topic && length > 0) {
+        _mqttManifest = String();
+        _mqttManifest.concat((const char*)payload, length);
+        _mqttPending = true;
+        _mqttRetryAt = millis();
+        _mqttBackoff = 0;
+    } else if (_mqtt->chunkTopic() == topic) {
+        _mqtt->onChunk(payload, length);
+    }
+}
+
+String BitFlash_Client::mqttManifestTopic() const {
+    return _mqtt ? _mqtt->manifestTopic() : String();
+}
+
+String BitFlash_Client::mqttChunkTopic() const {
+    return _mqtt ? _mqtt->chunkTopic() : String();
+}
+
+// https is null when the stream is a file that was downloaded earlier.
+bool BitFlash_Client::installFromStream(HTTPClient* https, Stream* stream, size_t contentLength) {
+    if (!_pipeline.begin(contentLength)) {
+        notifyCallback("Not enough space for update");
+        if (https) {
+            https->end();
+            delete https;
+        }
+        _updateInProgress = false;
+        return false;
+    }
+    
+    size_t written = 0;
+    uint8_t buff[1024] = { 0 };
+    
+    while ((!https || https->connected()) && (written < contentLength)) {
+        size_t size = stream->available();
+        if (size) {
+            // Straight into the sink's sector buffer when no stage needs a copy
+            size_t room = 0;
+            uint8_t* target = _pipeline.writeBuffer(room);
+            bool direct = target != nullptr;
+            if (!direct) {
+                target = buff;
+                room = sizeof(buff);
+            }
+            
+            int c = stream->readBytes(target, min(size, room));
+            if (!_pipeline.write(target, c)) {
+                break;
+            }
+            written += c;
+            _stats.bytesDownloaded += c;
+            if (direct) {
+                _stats.bytesReceivedInPlace += c;
+            }
+            recordHeap(_stats.downloadHeapLow);
+            int progress = (written * 100) / contentLength;
+            notifyCallback(https ? "Downloading update" : "Installing update", progress);
+        } else if (!https) {
+            break;
+        }
+        yield();
+    }
+    
+    if (https) {
+        https->end();
+        delete https;
+    }
+    
+    return finishInstall(written == contentLength);
+}
+
+bool BitFlash_Client::finishInstall(bool complete) {
+    if (!complete) {
+        notifyCallback("Download incomplete");
+        _pipeline.abort();
+        recordFlashStats();
+        _updateInProgress = false;
+        return false;
+    }
+    
+    bool ok = _pipeline.end();
+    recordFlashStats();
+    if (!ok) {
+        notifyCallback("Update failed");
+        _updateInProgress = false;
+        return false;
+    }
+    
+    // A full image replaced whatever an interrupted patch left behind
+    uint32_t pending;
+    if (_partitionSink && _config.inPlacePartition &&
+        BitFlash_PatchSink::pendingPatch(scratchPartition(), pending)) {
+        BitFlash_PatchSink::clearJournal(scratchPartition());
+    }
+    
+    notifyCallback("Update complete, restarting...");
+    delay(1000);
+    ESP.restart();
+    return true;
+}
+
+bool BitFlash_Client::buildPipeline(const char* firmwareUrl, JsonObjectConst entry, JsonObjectConst patch) {
+    // The download goes where a staged release is kept
+    _prefetch.clear();
+    _pipeline.clear();
+    _partitionSink = nullptr;
+    _patchSink = nullptr;
+    
+    if (!patch.isNull()) {
+        return buildPatchPipeline(firmwareUrl, entry, patch);
+    }
+    
+    if (_config.compareBeforeWrite || _config.inPlacePartition || _config.zeroCopy) {
+        const esp_partition_t* target = nullptr;
+        if (_config.inPlacePartition && !(target = inPlaceTarget())) {
+            return false;
+        }
+        bool compare = _config.compareBeforeWrite || _config.inPlacePartition;
+        _partitionSink = new BitFlash_PartitionSink(target, compare);
+        _pipeline.setSink(_partitionSink);
+    }
+    
+    if (!addWorkerStage()) {
+        return false;
+    }
+    
+    JsonObjectConst encryption = entry["encryption"];
+    if (!encryption.isNull() && !addDecryptStage(encryption)) {
+        return false;
+    }
+    
+    JsonObjectConst compression = entry["compression"];
+    if (!compression.isNull() && !addInflateStage(compression)) {
+        return false;
+    }
+    
+    const char* sha256 = entry["sha256"];
+    if (sha256) {
+        uint8_t digest[32];
+        if (!decodeHex(sha256, digest, sizeof(digest))) {
+            notifyCallback("Invalid firmware hash");
+            return false;
+        }
+        _pipeline.add(new BitFlash_HashStage(digest));
+    } else if (_config.manifestPublicKey && !String(firmwareUrl).startsWith("https://")) {
+        // A signed manifest only vouches for an image on plain HTTP or CoAP through its hash
+        notifyCallback("Unverified firmware over plain HTTP");
+        return false;
+    }
+    
+    if (!addChecksumStage(entry)) {
+        return false;
+    }
+    
+    if (_pipelineBuilder && !_pipelineBuilder(_pipeline, entry)) {
+        notifyCallback("Failed to build update pipeline");
+        return false;
+    }
+    
+    // Last before flash, so it sees the decrypted, decoded image header
+    _pipeline.add(new BitFlash_ImageCheckStage(CONFIG_IDF_FIRMWARE_CHIP_ID, chipRevision()));
+    
+    return true;
+}
+
+// Major * 100 + minor, the form the image header's revision range uses.
+// Before ESP-IDF 5 only the major revision is known.
+uint16_t BitFlash_Client::chipRevision() {
+#if ESP_IDF_VERSION_MAJOR >= 5
+    return efuse_hal_chip_revision();
+#else
+    return ESP.getChipRevision() * 100;
+#endif
+}
 
-void BitFlash_Client::setClock() {
-    configTime(0, 0, "pool.ntp.org");
-    time_t now = time(nullptr);
-    while (now < 8 * 3600 * 2) {
+// The patch is applied into the next OTA slot from the running image, or,
+// with inPlacePartition, into that partition from its own contents.
+bool BitFlash_Client::buildPatchPipeline(const char* patchUrl, JsonObjectConst entry, JsonObjectConst patch) {
+    const esp_partition_t* source = esp_ota_get_running_partition();
+    const esp_partition_t* target = esp_ota_get_next_update_partition(nullptr);
+    const esp_partition_t* scratch = nullptr;
+    
+    if (_config.inPlacePartition) {
+        source = target = inPlaceTarget();
+        scratch = scratchPartition();
+        if (!target) {
+            return false;
+        }
+        if (!scratch) {
+            notifyCallback("No scratch partition for in-place update");
+            return false;
+        }
+    }
+    
+    if (!source || !target) {
+        notifyCallback("No partition to patch");
+        return false;
+    }
+    
+    const char* patchHash = patch["sha256"];
+    _patchSink = new BitFlash_PatchSink(source, target, scratch, patchId(patch));
+    _pipeline.setSink(_patchSink);
+    if (_patchSink->foreignJournal()) {
+        notifyCallback("Another in-place patch is unfinished");
+        return false;
+    }
+    
+    if (!addWorkerStage()) {
+        return false;
+    }
+    
+    // A resumed download only sees the tail, so then the image hash has to do
+    if (patchHash && _patchSink->resumeOffset() == 0) {
+        uint8_t digest[32];
+        if (!decodeHex(patchHash, digest, sizeof(digest))) {
+            notifyCallback("Invalid patch hash");
+            return false;
+        }
+        _pipeline.add(new BitFlash_HashStage(digest));
+    }
+    
+    // The rebuilt image is hashed by reading it back, which also covers resumed patches
+    const char* sha256 = entry["sha256"];
+    if (sha256) {
+        uint8_t digest[32];
+        if (!decodeHex(sha256, digest, sizeof(digest))) {
+            notifyCallback("Invalid firmware hash");
+            return false;
+        }
+        _patchSink->setImageHash(digest);
+    } else if (_config.manifestPublicKey && !String(patchUrl).startsWith("https://")) {
+        notifyCallback("Unverified firmware over plain HTTP");
+        return false;
+    }
+    
+    if (_pipelineBuilder && !_pipelineBuilder(_pipeline, entry)) {
+        notifyCallback("Failed to build update pipeline");
+        return false;
+    }
+    
+    return true;
+}
+
+// Patches are content addressed by their hash, which also keys the journal.
+uint32_t BitFlash_Client::patchId(JsonObjectConst patch) {
+    const char* key = patch["sha256"];
+    if (!key) key = patch["url"] | "";
+    return esp_rom_crc32_le(0, (const uint8_t*)key, strlen(key));
+}
+
+const esp_partition_t* BitFlash_Client::scratchPartition() {
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, _config.scratchPartition);
+}
+
+// The app partition named by inPlacePartition. It must not be the one we are
+// running from: code cannot rewrite the flash it executes.
+const esp_partition_t* BitFlash_Client::inPlaceTarget() {
+    const esp_partition_t* target = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY,
+                                                             _config.inPlacePartition);
+    if (!target) {
+        notifyCallback("In-place partition not found");
+        return nullptr;
+    }
+    if (target == esp_ota_get_running_partition()) {
+        notifyCallback("Cannot update the running partition in place");
+        return nullptr;
+    }
+    return target;
+}
+
+// Version of the image an update replaces: our own, or in in-place mode the
+// one stored in the target partition.
+const char* BitFlash_Client::installedVersion() {
+    if (!_config.inPlacePartition) {
+        return _config.currentVersion;
+    }
+    
+    // Half patched: the description may already be the new one
+    uint32_t pending;
+    if (BitFlash_PatchSink::pendingPatch(scratchPartition(), pending)) {
+        return "0.0.0";
+    }
+    
+    const esp_partition_t* target = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY,
+                                                             _config.inPlacePartition);
+    esp_app_desc_t desc;
+    if (!target || esp_ota_get_partition_description(target, &desc) != ESP_OK) {
+        return "0.0.0";
+    }
+    
+    strncpy(_installedVersion, desc.version, sizeof(_installedVersion) - 1);
+    _installedVersion[sizeof(_installedVersion) - 1] = '\0';
+    return _installedVersion;
+}
+
+void BitFlash_Client::recordFlashStats() {
+    if (_partitionSink) {
+        _stats.sectorsWritten += _partitionSink->sectorsWritten();
+        _stats.sectorsSkipped += _partitionSink->sectorsSkipped();
+    }
+}
+
+// Everything after this stage runs on workerCore while the caller receives.
+bool BitFlash_Client::addWorkerStage() {
+    if (_config.workerCore < 0 || _config.workerCore >= portNUM_PROCESSORS) {
+        return true;
+    }
+    
+    BitFlash_WorkerStage* worker = new BitFlash_WorkerStage(_config.workerCore);
+    if (!worker->valid()) {
+        delete worker;
+        notifyCallback("Not enough memory for worker buffers");
+        return false;
+    }
+    _pipeline.add(worker);
+    return true;
+}
+
+// "crc32" or "adler32" as 8 hex digits, over the image as flashed. Cheaper
+// than sha256 per byte, but it only catches corruption, not tampering.
+bool BitFlash_Client::addChecksumStage(JsonObjectConst entry) {
+    const char* crc32 = entry["crc32"];
+    const char* adler32 = entry["adler32"];
+    const char* hex = crc32 ? crc32 : adler32;
+    if (!hex) {
+        return true;
+    }
+    
+    uint8_t value[4];
+    if (!decodeHex(hex, value, sizeof(value))) {
+        notifyCallback("Invalid firmware checksum");
+        return false;
+    }
+    
+    uint32_t expected = ((uint32_t)value[0] << 24) | (value[1] << 16) | (value[2] << 8) | value[3];
+    _pipeline.add(new BitFlash_ChecksumStage(crc32 ? BitFlash_ChecksumStage::kCrc32 : BitFlash_ChecksumStage::kAdler32,
+                                             expected));
+    return true;
+}
+
+bool BitFlash_Client::addDecryptStage(JsonObjectConst encryption) {
+    const char* alg = encryption["alg"];
+    const char* ivHex = encryption["iv"];
+    uint8_t iv[16];
+    
+    if (!alg || strcmp(alg, "aes-ctr") != 0 || !ivHex || !decodeHex(ivHex, iv, sizeof(iv))) {
+        notifyCallback("Unsupported image encryption");
+        return false;
+    }
+    
+    if (!_config.imageKey) {
+        notifyCallback("No image key configured");
+        return false;
+    }
+    
+    auto stage = new BitFlash_DecryptStage(_config.imageKey, _config.imageKeyLength, iv);
+    if (!stage->valid()) {
+        notifyCallback("Invalid image key");
+        delete stage;
+        return false;
+    }
+    
+    _pipeline.add(stage);
+    return true;
+}
+
+// "compression": {"format": "deflate", "size": <image size>, "dict": <sha256>, "dict_url": ...}
+// The dictionary is downloaded once and kept until a manifest names another.
+bool BitFlash_Client::addInflateStage(JsonObjectConst compression) {
+    const char* format = compression["format"] | "deflate";
+    size_t size = compression["size"] | 0u;
+    if (strcmp(format, "deflate") != 0 || size == 0) {
+        notifyCallback("Unsupported image compression");
+        return false;
+    }
+    
+    auto stage = new BitFlash_InflateStage(size);
+    if (!stage->valid()) {
+        notifyCallback("Not enough memory to decompress");
+        delete stage;
+        return false;
+    }
+    _pipeline.add(stage);
+    
+    const char* dictHash = compression["dict"];
+    if (!dictHash) {
+        return true;
+    }
+    
+    uint8_t id[32];
+    if (!decodeHex(dictHash, id, sizeof(id))) {
+        notifyCallback("Invalid dictionary hash");
+        return false;
+    }
+    
+    BitFlash_Dictionary dictionary(_config.dictionaryPartition);
+    if (!dictionary.available()) {
+        notifyCallback("No dictionary partition");
+        return false;
+    }
+    if (!dictionary.has(id) && !fetchDictionary(dictionary, compression["dict_url"], id)) {
+        return false;
+    }
+    
+    size_t length = 0;
+    const uint8_t* data = dictionary.map(length);
+    if (!data) {
+        notifyCallback("Failed to read dictionary");
+        return false;
+    }
+    stage->setDictionary(data, length);
+    return true;
+}
+
+// The dictionary is trusted through its hash, which the manifest supplies.
+bool BitFlash_Client::fetchDictionary(BitFlash_Dictionary& dictionary, const char* url, const uint8_t id[32]) {
+    if (!url) {
+        notifyCallback("Dictionary not cached");
+        return false;
+    }
+    
+    auto client = createClient(url);
+    if (!client) return false;
+    
+    HTTPClient* https = createHTTPClient(client.get(), url);
+    if (!https) return false;
+    
+    notifyCallback("Downloading dictionary");
+    int httpCode = https->GET();
+    int length = https->getSize();
+    if (httpCode != HTTP_CODE_OK || length <= 0 || !dictionary.begin(length)) {
+        notifyCallback("Failed to download dictionary");
+        https->end();
+        delete https;
+        return false;
+    }
+    
+    WiFiClient* stream = https->getStreamPtr();
+    int received = 0;
+    uint8_t buff[1024];
+    
+    while (https->connected() && received < length) {
+        size_t size = stream->available();
+        if (size) {
+            int c = stream->readBytes(buff, min(size, sizeof(buff)));
+            if (!dictionary.write(buff, c)) {
+                break;
+            }
+            received += c;
+        }
+        yield();
+    }
+    
+    https->end();
+    delete https;
+    
+    if (received != length || !dictionary.end(id)) {
+        notifyCallback("Invalid dictionary");
+        return false;
+    }
+    return true;
+}
+
+bool BitFlash_Client::verifyManifest(const char* body, size_t length, const String& signature) {
+    return BitFlash_Signature::verify(_config.manifestPublicKey, body, length, signature);
+}
+
+bool BitFlash_Client::connectWiFi() {
+    if (isWiFiConnected()) return true;
+    
+    WiFi.begin(_config.ssid, _config.password);
+    
+    int attempts = 0;
+    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
         delay(500);
-        now = time(nullptr);
+        attempts++;
+    }
+    
+    if (isWiFiConnected()) {
+        // Only certificate checks need the time; NTP runs in the background
+        if (_config.verifySSL) {
+            _clock.start();
+        }
+        return true;
     }
+    
+    return false;
+}
+
+void BitFlash_Client::disconnectWiFi() {
+    WiFi.disconnect();
+}
+
+bool BitFlash_Client::isWiFiConnected() {
+    return WiFi.status() == WL_CONNECTED;
 }
 
 void BitFlash_Client::setCheckInterval(uint32_t interval) {
     _config.checkInterval = interval;
+    _nextCheckDelay = interval;
+    _serverBackoff = false;
+}
+
+// Lets the version endpoint pace the fleet, see BitFlash_Freshness.
+void BitFlash_Client::applyFreshness(HTTPClient* https, int httpCode) {
+    BitFlash_Freshness freshness;
+    freshness.parse(httpCode, https->header("Date"), https->header("Retry-After"),
+                    https->header("Cache-Control"), https->header("Expires"));
+    BitFlash_Clock::bootstrap(freshness.date());
+    _serverBackoff = freshness.backoff();
+    _nextCheckDelay = freshness.nextCheckDelay(_config.checkInterval);
 }
 
 void BitFlash_Client::setCallback(std::function<void(const char* status, int progress)> callback) {
     _callback = callback;
 }
 
+void BitFlash_Client::setPipelineBuilder(PipelineBuilder builder) {
+    _pipelineBuilder = builder;
+}
+
 void BitFlash_Client::notifyCallback(const char* status, int progress) {
     if (_callback) {
         _callback(status, progress);
@@ -283,4 +1863,21 @@ int BitFlash_Client::compareVersions(const char* v1, const char* v2) {
     
     // Compare patch version
     return patch1 - patch2;
+}
+
+bool BitFlash_Client::decodeHex(const char* hex, uint8_t* out, size_t len) {
+    if (strlen(hex) != len * 2) return false;
+    
+    for (size_t i = 0; i < len * 2; i++) {
+        char c = hex[i];
+        uint8_t nibble;
+        if (c >= '0' && c <= '9') nibble = c - '0';
+        else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else return false;
+        
+        if (i % 2 == 0) out[i / 2] = nibble << 4;
+        else out[i / 2] |= nibble;
+    }
+    return true;
 }
\ No newline at end of file
@@ -8,6 +8,23 @@
 #include <time.h>
 #include <ArduinoJson.h>
 #include <functional>
+#include "BitFlash_Pipeline.h"
+#include "BitFlash_Stages.h"
+#include "BitFlash_Partition.h"
+#include "BitFlash_Patch.h"
+#include "BitFlash_Signature.h"
+#include "BitFlash_Dictionary.h"
+#include "BitFlash_Prefetch.h"
+#include "BitFlash_FileStore.h"
+#include "BitFlash_Coap.h"
+#include "BitFlash_Mqtt.h"
+#include "BitFlash_WebSocket.h"
+#include "BitFlash_Lan.h"
+#include "BitFlash_Dns.h"
+#include "BitFlash_DnsCache.h"
+#include "BitFlash_Tls.h"
+#include "BitFlash_Freshness.h"
+#include "BitFlash_Clock.h"
 
 class BitFlash_Client {
 public:
@@ -19,8 +36,64 @@ public:
         uint32_t checkInterval;  // In milliseconds
         bool autoConnect;        // Whether to auto-connect to WiFi
         bool verifySSL = false; // Whether to verify SSL certificates
+        const char* caCert = nullptr; // PEM root certificate checked when verifySSL is set
+        bool lowMemoryTls = false;    // Smaller TLS client: short fragments, one key exchange, one cipher
+        uint16_t tlsFragmentLength = 4096; // Max fragment length asked for by lowMemoryTls: 512 to 4096
+        const uint8_t* imageKey = nullptr; // AES key for encrypted images (16, 24 or 32 bytes)
+        size_t imageKeyLength = 0;
+        const char* manifestPublicKey = nullptr; // PEM key; when set, manifests must carry a valid X-Signature
+        bool singleRoundTrip = false; // Check and download in one request to jsonEndpoint
+        bool lanCoordination = false; // Elect one device per LAN to poll the origin
+        uint8_t lanGossipFanout = 0;  // Peers told about each new release; 0 disables gossip
+        uint16_t lanPort = 4766;      // UDP port for LAN coordination and gossip
+        const char* versionTxtRecord = nullptr; // DNS name whose TXT record holds the latest version
+        const char* dnsServer = nullptr;        // Resolver to use instead of the DHCP one
+        bool dnsCache = false;                  // Reuse resolved addresses for their TTL, across deep sleep
+        const char* boardId = nullptr;          // Matched against "board" in manifest variants
+        bool compareBeforeWrite = false;        // Skip erasing and writing sectors that are already identical
+        bool zeroCopy = false;                  // Receive straight into the flash sector buffer
+        int8_t workerCore = -1;                 // Decrypt, inflate, hash and flash on this core; -1 for the caller's
+        const char* inPlacePartition = nullptr; // App partition to update in place, from a recovery app
+        const char* scratchPartition = "bfscratch"; // Data partition for the in-place patch journal
+        const char* dictionaryPartition = "bfdict"; // Data partition caching the compression dictionary
+        uint32_t prefetchChunkSize = 16384;     // Bytes per request when staging an upcoming release
+        uint32_t prefetchInterval = 10000;      // Milliseconds between those requests
+        fs::FS* stagingFs = nullptr;            // Collect images here (SD, LittleFS) before flashing
+        const char* stagingPath = "/bitflash.bin";
+        uint32_t stagingChunkSize = 65536;      // Bytes per request and per verified chunk
+        uint16_t coapBlockSize = 512;           // Block size for coap:// transfers, 16 to 1024
+        bool coapObserve = false;               // Observe a coap:// jsonEndpoint instead of only polling it
+        const char* mqttTopicPrefix = nullptr;  // Receive updates over the application's MQTT session
+        uint16_t mqttChunkSize = 4096;          // Bytes per chunk request for mqtt: images
+        uint8_t mqttWindow = 4;                 // Chunk requests in flight
+        const char* controlUrl = nullptr;       // ws:// or wss:// control channel; polling resumes while it is down
     };
 
+    struct Stats {
+        uint32_t versionChecks = 0;    // Manifests fetched from the version endpoint
+        uint32_t txtQueries = 0;       // TXT lookups sent to the resolver
+        uint32_t txtCacheHits = 0;     // Checks answered from an unexpired TXT record
+        uint32_t txtTtl = 0;           // TTL of the last TXT record, in seconds
+        uint32_t sectorsWritten = 0;   // Flash sectors erased and programmed (compareBeforeWrite)
+        uint32_t sectorsSkipped = 0;   // Flash sectors left alone because they already matched
+        uint32_t coapBytesSent = 0;    // UDP payload bytes sent over CoAP
+        uint32_t coapBytesReceived = 0;
+        uint32_t controlConnects = 0;  // Control channel connection attempts
+        uint32_t controlBytesSent = 0; // Bytes on the control channel, handshakes included
+        uint32_t controlBytesReceived = 0;
+        uint32_t dnsCacheHits = 0;     // Connections that reused a cached address (dnsCache)
+        uint32_t dnsCacheMisses = 0;   // Connections that needed a lookup
+        uint32_t dnsRefreshes = 0;     // Records looked up again before they expired
+        uint32_t checkHeapLow = 0;     // Least free heap seen while checking, in bytes
+        uint32_t downloadHeapLow = 0;  // Least free heap seen while downloading
+        uint32_t bytesDownloaded = 0;  // Image bytes read from HTTP streams
+        uint32_t bytesReceivedInPlace = 0; // Of those, read straight into the sector buffer (zeroCopy)
+    };
+
+    // Assembles the stages for one manifest entry; return false to refuse it.
+    typedef std::function<bool(BitFlash_Pipeline& pipeline, JsonObjectConst entry)> PipelineBuilder;
+    typedef BitFlash_Mqtt::Publisher MqttPublisher;
+
     BitFlash_Client(const Config& config);
     
     void begin();
@@ -28,21 +101,133 @@ public:
     void checkForUpdate();
     void setCheckInterval(uint32_t interval);
     void setCallback(std::function<void(const char* status, int progress)> callback);
+    void setPipelineBuilder(PipelineBuilder builder);
+    // Enables MQTT delivery under mqttTopicPrefix. Subscribe to both topics
+    // below and pass their messages to handleMqttMessage().
+    void setMqttPublisher(MqttPublisher publish);
+    void handleMqttMessage(const char* topic, uint8_t* payload, size_t length);
+    String mqttManifestTopic() const;
+    String mqttChunkTopic() const;
     bool connectWiFi();
     void disconnectWiFi();
     bool isWiFiConnected();
+    const Stats& getStats() const { return _stats; }
 
 private:
+    static constexpr long kMaxFreshnessSeconds = BitFlash_Freshness::kMaxSeconds;
+    static constexpr uint32_t kMaxControlBackoff = 300000;
+    static constexpr uint32_t kControlChunkTimeout = 10000;
+    static constexpr uint32_t kAnnounceCheckInterval = 60000;
+    static constexpr uint32_t kMqttRetryDelay = 10000;
+    static constexpr uint32_t kMaxMqttBackoff = 600000;
+
     Config _config;
     unsigned long _lastCheck;
+    uint32_t _nextCheckDelay;  // checkInterval, or what the server asked for
+    bool _serverBackoff = false;  // _nextCheckDelay is a Retry-After or slot wait
+    unsigned long _announceCheckAt = 0;
     std::function<void(const char* status, int progress)> _callback;
     bool _updateInProgress;
+    PipelineBuilder _pipelineBuilder;
+    BitFlash_Pipeline _pipeline;
+    BitFlash_PartitionSink* _partitionSink = nullptr;  // Owned by _pipeline
+    BitFlash_PatchSink* _patchSink = nullptr;          // Owned by _pipeline
+    char _installedVersion[32];
+    std::unique_ptr<BitFlash_Lan> _lan;
+    bool _lanElect = false;
+    bool _lanRetry = false;         // The last relayed manifest failed
+    bool _manifestCurrent = false;  // processManifest() found nothing newer
+    BitFlash_Prefetch _prefetch;
+    std::unique_ptr<BitFlash_Coap> _coap;
+    unsigned long _lastObserve = 0;
+    std::unique_ptr<BitFlash_Mqtt> _mqtt;
+    String _mqttManifest;  // Last retained manifest, kept for retries
+    bool _mqttPending = false;  // _mqttManifest waits for handle()
+    unsigned long _mqttRetryAt = 0;
+    uint32_t _mqttBackoff = 0;
+    std::unique_ptr<BitFlash_WebSocket> _control;
+    unsigned long _controlRetryAt = 0;
+    uint32_t _controlBackoff = 0;
+    bool _controlCheck = false;
+    BitFlash_Clock _clock;
+    BitFlash_DnsCache _dnsCache;
+    
+    // Download that arrives in blocks (CoAP, MQTT)
+    struct {
+        size_t size;
+        size_t written;
+        bool started;
+        bool noSpace;
+    } _block = {};
+    unsigned long _lastPrefetch = 0;
+    Stats _stats;
+
+    // Latest release as published in DNS, kept for the record's TTL
+    struct {
+        String version;
+        String hash;
+        String url;
+        unsigned long fetchedAt = 0;
+        bool valid = false;
+        bool manifestSeen = false;  // Manifest read since the record was fetched
+    } _txt;
     
-    void setClock();
     bool checkVersion();
-    bool performUpdate(const char* firmwareUrl);
+    bool acceptManifest(const String& body, const String& signature, bool fromRecord);
+    bool processManifest(const char* body, size_t length, const String& signature);
+    JsonObjectConst selectVariant(JsonArrayConst variants);
+    JsonObjectConst selectPatch(JsonObjectConst entry, const char* installed);
+    bool refreshVersionRecord();
+    bool manifestMatchesRecord(const char* body, size_t length);
+    void announceRelease(const char* version, const char* body, size_t length);
+    void stageUpcoming(JsonObjectConst upcoming, const char* installed);
+    void prefetchChunk();
+    bool activateStaged();
+    bool checkAndDownload();
+    bool performUpdate(const char* firmwareUrl, JsonObjectConst entry, JsonObjectConst patch);
+    bool performStoredUpdate(const char* firmwareUrl, JsonObjectConst entry);
+    bool fetchStoredChunk(BitFlash_FileStore& store, const char* url, const String& slotToken,
+                          JsonArrayConst chunkHashes);
+    bool installFromStream(HTTPClient* https, Stream* stream, size_t contentLength);
+    bool finishInstall(bool complete);
+    static bool isCoapUrl(const char* url);
+    static String urlOrigin(const char* url);
+    BitFlash_Coap& coap();
+    void recordCoapStats();
+    bool fetchCoapManifest(const char* url, String& body, String& signature);
+    bool performCoapUpdate(const char* firmwareUrl, JsonObjectConst entry, JsonObjectConst patch);
+    bool writeBlock(uint8_t* data, size_t len, size_t total);
+    bool finishBlocks(bool ok);
+    static bool isMqttUrl(const char* url);
+    bool startMqttDownload(const char* firmwareUrl, JsonObjectConst entry, JsonObjectConst patch);
+    void handleMqtt();
+    void retryMqtt();
+    bool serviceControl();
+    void handleControlMessage(const char* text, size_t length);
+    bool performControlDownload(const char* image, JsonObjectConst entry, JsonObjectConst patch);
+    void recordControlStats();
+    void recordDnsStats();
+    static void recordHeap(uint32_t& low);
+    bool acquireSlot(const char* slotUrl, String& token);
+    void addDeviceHeaders(HTTPClient* https);
     void notifyCallback(const char* status, int progress = -1);
     int compareVersions(const char* v1, const char* v2);
+    void applyFreshness(HTTPClient* https, int httpCode);
+    bool buildPipeline(const char* firmwareUrl, JsonObjectConst entry, JsonObjectConst patch);
+    bool buildPatchPipeline(const char* patchUrl, JsonObjectConst entry, JsonObjectConst patch);
+    static uint16_t chipRevision();
+    static uint32_t patchId(JsonObjectConst patch);
+    const esp_partition_t* scratchPartition();
+    const esp_partition_t* inPlaceTarget();
+    const char* installedVersion();
+    void recordFlashStats();
+    bool addWorkerStage();
+    bool addChecksumStage(JsonObjectConst entry);
+    bool addDecryptStage(JsonObjectConst encryption);
+    bool addInflateStage(JsonObjectConst compression);
+    bool fetchDictionary(BitFlash_Dictionary& dictionary, const char* url, const uint8_t id[32]);
+    bool verifyManifest(const char* body, size_t length, const String& signature);
+    static bool decodeHex(const char* hex, uint8_t* out, size_t len);
     
     // Helper method to create appropriate client based on URL
     std::unique_ptr<Client> createClient(const String& url);
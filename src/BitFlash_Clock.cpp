@@ -0,0 +1,32 @@
+#include "BitFlash_Clock.h"
+#include <sys/time.h>
+
+void BitFlash_Clock::start() {
+    if (!_started) {
+        configTime(0, 0, "pool.ntp.org");
+        _started = true;
+    }
+}
+
+// An unset clock counts from 1970
+bool BitFlash_Clock::valid() {
+    return time(nullptr) > 8 * 3600 * 2;
+}
+
+bool BitFlash_Clock::ensure() {
+    if (valid()) return true;
+    
+    start();
+    unsigned long begin = millis();
+    while (!valid() && millis() - begin < kTimeout) {
+        delay(100);
+    }
+    return valid();
+}
+
+void BitFlash_Clock::bootstrap(time_t date) {
+    if (date && !valid()) {
+        timeval now = { date, 0 };
+        settimeofday(&now, nullptr);
+    }
+}
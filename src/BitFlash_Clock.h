@@ -0,0 +1,24 @@
+#pragma once
+
+#include <Arduino.h>
+#include <time.h>
+
+// Wall-clock time for certificate checks, without blocking on NTP at
+// startup. The first Date header sets an unset clock to within a second;
+// SNTP, started only when certificates are verified, refines it later.
+class BitFlash_Clock {
+public:
+    static constexpr uint32_t kTimeout = 10000;
+
+    // Starts SNTP in the background, once.
+    void start();
+    // Waits for SNTP, up to kTimeout, only if no Date header has set the
+    // clock yet.
+    bool ensure();
+    // Sets an unset clock from a Date header; a set one is left to SNTP.
+    static void bootstrap(time_t date);
+    static bool valid();
+
+private:
+    bool _started = false;
+};
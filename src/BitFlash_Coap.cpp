@@ -0,0 +1,324 @@
+#include "BitFlash_Coap.h"
+
+// Appends one option, delta-encoded against the previous option number.
+static size_t putOption(uint8_t* p, uint16_t& last, uint16_t number, const uint8_t* value, size_t len) {
+    size_t n = 0;
+    uint16_t delta = number - last;
+    last = number;
+    
+    uint8_t deltaNibble = delta < 13 ? delta : delta < 269 ? 13 : 14;
+    uint8_t lengthNibble = len < 13 ? len : len < 269 ? 13 : 14;
+    p[n++] = (deltaNibble << 4) | lengthNibble;
+    
+    if (deltaNibble == 13) p[n++] = delta - 13;
+    if (deltaNibble == 14) { p[n++] = (delta - 269) >> 8; p[n++] = (delta - 269) & 0xff; }
+    if (lengthNibble == 13) p[n++] = len - 13;
+    if (lengthNibble == 14) { p[n++] = (len - 269) >> 8; p[n++] = (len - 269) & 0xff; }
+    
+    memcpy(p + n, value, len);
+    return n + len;
+}
+
+// Unsigned option values use as few bytes as possible; zero is empty.
+static size_t putUintOption(uint8_t* p, uint16_t& last, uint16_t number, uint32_t value) {
+    uint8_t bytes[4] = {};
+    size_t len = 0;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        if (len > 0 || (value >> shift) & 0xff) {
+            bytes[len++] = (value >> shift) & 0xff;
+        }
+    }
+    return putOption(p, last, number, bytes, len);
+}
+
+void BitFlash_Coap::setBlockSize(uint16_t size) {
+    _szx = 0;
+    while (_szx < 6 && (16u << (_szx + 1)) <= size) {
+        _szx++;
+    }
+}
+
+bool BitFlash_Coap::open() {
+    if (!_open) {
+        _open = _udp.begin(49152 + random(16384));
+        _messageId = random(0x10000);
+    }
+    return _open;
+}
+
+void BitFlash_Coap::stop() {
+    if (_open) {
+        _udp.stop();
+        _open = false;
+    }
+    _observing = false;
+}
+
+// coap://host[:port]/path[?query]
+bool BitFlash_Coap::resolve(const char* url, Endpoint& endpoint) {
+    if (strncmp(url, "coap://", 7) != 0) return false;
+    
+    const char* host = url + 7;
+    const char* pathStart = strchr(host, '/');
+    String authority = pathStart ? String(host).substring(0, pathStart - host) : String(host);
+    endpoint.path = pathStart ? String(pathStart + 1) : String();
+    endpoint.port = kDefaultPort;
+    
+    int colon = authority.indexOf(':');
+    if (colon >= 0) {
+        endpoint.port = authority.substring(colon + 1).toInt();
+        authority = authority.substring(0, colon);
+    }
+    
+    return endpoint.port != 0 && WiFi.hostByName(authority.c_str(), endpoint.ip) == 1;
+}
+
+size_t BitFlash_Coap::buildGet(const Endpoint& endpoint, const uint8_t token[4], uint16_t id, bool observe,
+                               bool block, uint32_t blockNumber, uint8_t szx) {
+    uint8_t* p = _request;
+    *p++ = 0x40 | (kCon << 4) | 4;
+    *p++ = kGet;
+    *p++ = id >> 8;
+    *p++ = id & 0xff;
+    memcpy(p, token, 4);
+    p += 4;
+    
+    uint16_t last = 0;
+    if (observe) {
+        p += putUintOption(p, last, kOptionObserve, 0);
+    }
+    
+    // Path segments, then query parameters, each as its own option
+    int query = endpoint.path.indexOf('?');
+    String path = query >= 0 ? endpoint.path.substring(0, query) : endpoint.path;
+    String params = query >= 0 ? endpoint.path.substring(query + 1) : String();
+    
+    struct { const String& text; char separator; uint16_t option; } parts[] = {
+        { path, '/', kOptionUriPath }, { params, '&', kOptionUriQuery }
+    };
+    for (auto& part : parts) {
+        int start = 0;
+        while (start < (int)part.text.length()) {
+            int end = part.text.indexOf(part.separator, start);
+            if (end < 0) end = part.text.length();
+            size_t len = end - start;
+            if (len > 0) {
+                if ((size_t)(p - _request) + len + 8 > kMaxRequest - 16) return 0;
+                p += putOption(p, last, part.option, (const uint8_t*)part.text.c_str() + start, len);
+            }
+            start = end + 1;
+        }
+    }
+    
+    if (block) {
+        p += putUintOption(p, last, kOptionBlock2, (blockNumber << 4) | szx);
+        // Asks the server for the total size along with the first block
+        if (blockNumber == 0) {
+            p += putUintOption(p, last, kOptionSize2, 0);
+        }
+    }
+    
+    return p - _request;
+}
+
+bool BitFlash_Coap::parse(size_t length, Message& message) {
+    if (length < 4 || (_message[0] >> 6) != 1) return false;
+    
+    message.type = (_message[0] >> 4) & 0x03;
+    message.tokenLength = _message[0] & 0x0f;
+    message.code = _message[1];
+    message.id = (_message[2] << 8) | _message[3];
+    message.hasBlock2 = false;
+    message.block2 = 0;
+    message.size2 = 0;
+    message.hasObserve = false;
+    message.payload = nullptr;
+    message.payloadLength = 0;
+    
+    if (message.tokenLength > 8 || 4 + (size_t)message.tokenLength > length) return false;
+    memcpy(message.token, _message + 4, message.tokenLength);
+    
+    size_t offset = 4 + message.tokenLength;
+    uint16_t number = 0;
+    while (offset < length) {
+        uint8_t byte = _message[offset++];
+        if (byte == 0xff) {
+            message.payload = _message + offset;
+            message.payloadLength = length - offset;
+            return message.payloadLength > 0;
+        }
+        
+        uint32_t delta = byte >> 4;
+        uint32_t len = byte & 0x0f;
+        if (delta == 15 || len == 15) return false;
+        if (delta == 13) { if (offset + 1 > length) return false; delta = 13 + _message[offset++]; }
+        else if (delta == 14) { if (offset + 2 > length) return false; delta = 269 + ((_message[offset] << 8) | _message[offset + 1]); offset += 2; }
+        if (len == 13) { if (offset + 1 > length) return false; len = 13 + _message[offset++]; }
+        else if (len == 14) { if (offset + 2 > length) return false; len = 269 + ((_message[offset] << 8) | _message[offset + 1]); offset += 2; }
+        if (offset + len > length) return false;
+        
+        number += delta;
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < len && i < 4; i++) {
+            value = (value << 8) | _message[offset + i];
+        }
+        
+        if (number == kOptionBlock2) { message.hasBlock2 = true; message.block2 = value; }
+        else if (number == kOptionSize2) message.size2 = value;
+        else if (number == kOptionObserve) message.hasObserve = true;
+        offset += len;
+    }
+    return true;
+}
+
+bool BitFlash_Coap::receive(Message& message) {
+    int size = _udp.parsePacket();
+    if (size <= 0) return false;
+    
+    int length = _udp.read(_message, kMaxMessage);
+    if (length <= 0) return false;
+    _bytesReceived += length;
+    return parse(length, message);
+}
+
+void BitFlash_Coap::sendEmptyAck(const Endpoint& endpoint, uint16_t id) {
+    uint8_t ack[4] = { (uint8_t)(0x40 | (kAck << 4)), 0, (uint8_t)(id >> 8), (uint8_t)(id & 0xff) };
+    _udp.beginPacket(endpoint.ip, endpoint.port);
+    _udp.write(ack, sizeof(ack));
+    _udp.endPacket();
+    _bytesSent += sizeof(ack);
+}
+
+// Anything that is not the response we wait for: notifications for the
+// observed resource are remembered, everything else is dropped.
+void BitFlash_Coap::handleStray(const Message& message) {
+    bool observed = _observing && message.tokenLength == 4 && memcmp(message.token, _observeToken, 4) == 0;
+    if (observed && (message.code >> 5) == 2) {
+        _notified = true;
+    } else if (observed) {
+        _observing = false;
+    }
+    
+    if (message.type == kCon) {
+        Endpoint sender = { _udp.remoteIP(), _udp.remotePort(), String() };
+        sendEmptyAck(sender, message.id);
+    }
+}
+
+// Sends a confirmable request and waits for its response, retransmitting
+// with exponential backoff. A server may acknowledge first and send the
+// response separately.
+bool BitFlash_Coap::exchange(const Endpoint& endpoint, size_t length, const uint8_t token[4], uint16_t id,
+                             Message& response) {
+    uint32_t timeout = kAckTimeout + random(kAckTimeout / 2);
+    bool acknowledged = false;
+    
+    for (uint8_t attempt = 0; attempt <= kMaxRetransmit; attempt++) {
+        if (!acknowledged) {
+            _udp.beginPacket(endpoint.ip, endpoint.port);
+            _udp.write(_request, length);
+            if (_udp.endPacket()) _bytesSent += length;
+        }
+        
+        unsigned long start = millis();
+        while (millis() - start < timeout) {
+            if (!receive(response)) {
+                delay(1);
+                continue;
+            }
+            
+            bool ours = response.tokenLength == 4 && memcmp(response.token, token, 4) == 0;
+            if (response.type == kRst && response.id == id) return false;
+            if (response.type == kAck && response.id == id && response.code == 0) {
+                acknowledged = true;
+                continue;
+            }
+            if (ours && (response.type != kAck || response.id == id)) {
+                if (response.type == kCon) sendEmptyAck(endpoint, response.id);
+                return true;
+            }
+            handleStray(response);
+        }
+        timeout *= 2;
+    }
+    return false;
+}
+
+bool BitFlash_Coap::get(const char* url, BlockHandler handler) {
+    Endpoint endpoint;
+    if (!open() || !resolve(url, endpoint)) return false;
+    
+    uint8_t token[4];
+    uint32_t tokenValue = esp_random();
+    memcpy(token, &tokenValue, sizeof(token));
+    
+    uint8_t szx = _szx;
+    uint32_t blockNumber = 0;
+    size_t offset = 0;
+    
+    for (;;) {
+        uint16_t id = _messageId++;
+        size_t length = buildGet(endpoint, token, id, false, true, blockNumber, szx);
+        Message response;
+        if (length == 0 || !exchange(endpoint, length, token, id, response) || response.code != kContent) {
+            return false;
+        }
+        
+        // A server without block-wise transfer answers in one piece
+        if (!response.hasBlock2) {
+            return offset == 0 && handler(response.payload, response.payloadLength, response.payloadLength);
+        }
+        
+        // The server may pick smaller blocks than we asked for
+        uint8_t responseSzx = response.block2 & 0x07;
+        uint32_t responseNumber = response.block2 >> 4;
+        if (responseSzx > szx || responseSzx == 7 || (responseNumber << (responseSzx + 4)) != offset) {
+            return false;
+        }
+        szx = responseSzx;
+        
+        if (!handler(response.payload, response.payloadLength, response.size2)) {
+            return false;
+        }
+        offset += response.payloadLength;
+        
+        if (!(response.block2 & 0x08)) {
+            return true;
+        }
+        blockNumber = offset >> (szx + 4);
+    }
+}
+
+bool BitFlash_Coap::observe(const char* url) {
+    Endpoint endpoint;
+    if (!open() || !resolve(url, endpoint)) return false;
+    
+    uint32_t tokenValue = esp_random();
+    memcpy(_observeToken, &tokenValue, sizeof(_observeToken));
+    _observeUrl = url;
+    _observedAt = millis();
+    
+    uint16_t id = _messageId++;
+    size_t length = buildGet(endpoint, _observeToken, id, true, false, 0, _szx);
+    Message response;
+    _observing = length > 0 && exchange(endpoint, length, _observeToken, id, response) &&
+                 response.code == kContent && response.hasObserve;
+    return _observing;
+}
+
+bool BitFlash_Coap::poll() {
+    if (!_open) return false;
+    
+    if (_observing && millis() - _observedAt >= kObserveRefresh) {
+        observe(_observeUrl.c_str());
+    }
+    
+    Message message;
+    while (receive(message)) {
+        handleStray(message);
+    }
+    
+    bool notified = _notified;
+    _notified = false;
+    return notified;
+}
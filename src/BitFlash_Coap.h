@@ -0,0 +1,94 @@
+#pragma once
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <functional>
+
+// Minimal CoAP client (RFC 7252) for constrained links. Requests are
+// confirmable GETs; responses larger than one block are fetched block by
+// block (RFC 7959), and a resource can be observed for changes (RFC 7641).
+// There is no DTLS: content is trusted through the signed manifest and the
+// image hashes it carries.
+class BitFlash_Coap {
+public:
+    // Called per block with the payload and the total size from Size2, or 0
+    // when the server did not send it. Return false to stop the transfer.
+    typedef std::function<bool(uint8_t* data, size_t len, size_t total)> BlockHandler;
+
+    ~BitFlash_Coap() { stop(); }
+
+    // 16 to 1024 bytes, rounded down to a power of two.
+    void setBlockSize(uint16_t size);
+    bool get(const char* url, BlockHandler handler);
+    // Registers for notifications about url; poll() reports them.
+    bool observe(const char* url);
+    bool observing() const { return _observing; }
+    // True when the observed resource changed since the last call.
+    bool poll();
+    void stop();
+
+    uint32_t bytesSent() const { return _bytesSent; }
+    uint32_t bytesReceived() const { return _bytesReceived; }
+
+private:
+    static constexpr uint16_t kDefaultPort = 5683;
+    static constexpr uint32_t kAckTimeout = 2000;
+    static constexpr uint8_t kMaxRetransmit = 4;
+    static constexpr uint32_t kObserveRefresh = 600000;  // Re-register, in case the server forgot us
+    static constexpr size_t kMaxMessage = 1024 + 64;
+    static constexpr size_t kMaxRequest = 320;
+
+    enum Type : uint8_t { kCon = 0, kNon = 1, kAck = 2, kRst = 3 };
+    static constexpr uint8_t kGet = 0x01;
+    static constexpr uint8_t kContent = 0x45;  // 2.05
+    static constexpr uint16_t kOptionObserve = 6;
+    static constexpr uint16_t kOptionUriPath = 11;
+    static constexpr uint16_t kOptionUriQuery = 15;
+    static constexpr uint16_t kOptionBlock2 = 23;
+    static constexpr uint16_t kOptionSize2 = 28;
+
+    struct Endpoint {
+        IPAddress ip;
+        uint16_t port;
+        String path;
+    };
+
+    struct Message {
+        uint8_t type;
+        uint8_t code;
+        uint16_t id;
+        uint8_t token[8];
+        uint8_t tokenLength;
+        bool hasBlock2;
+        uint32_t block2;
+        uint32_t size2;
+        bool hasObserve;
+        uint8_t* payload;
+        size_t payloadLength;
+    };
+
+    WiFiUDP _udp;
+    bool _open = false;
+    uint8_t _szx = 5;  // 512-byte blocks
+    uint16_t _messageId = 0;
+    uint8_t _request[kMaxRequest];
+    uint8_t _message[kMaxMessage];
+    uint32_t _bytesSent = 0;
+    uint32_t _bytesReceived = 0;
+
+    String _observeUrl;
+    uint8_t _observeToken[4];
+    bool _observing = false;
+    bool _notified = false;
+    unsigned long _observedAt = 0;
+
+    bool open();
+    static bool resolve(const char* url, Endpoint& endpoint);
+    size_t buildGet(const Endpoint& endpoint, const uint8_t token[4], uint16_t id, bool observe,
+                    bool block, uint32_t blockNumber, uint8_t szx);
+    bool exchange(const Endpoint& endpoint, size_t length, const uint8_t token[4], uint16_t id, Message& response);
+    bool receive(Message& message);
+    bool parse(size_t length, Message& message);
+    void sendEmptyAck(const Endpoint& endpoint, uint16_t id);
+    void handleStray(const Message& message);
+};
@@ -0,0 +1,88 @@
+#include "BitFlash_Dictionary.h"
+#include <esp_idf_version.h>
+
+#if ESP_IDF_VERSION_MAJOR < 5
+#include <esp_spi_flash.h>
+#define ESP_PARTITION_MMAP_DATA SPI_FLASH_MMAP_DATA
+#define esp_partition_munmap spi_flash_munmap
+typedef spi_flash_mmap_handle_t esp_partition_mmap_handle_t;
+#endif
+
+BitFlash_Dictionary::BitFlash_Dictionary(const char* label)
+    : _partition(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label)) {
+    mbedtls_md_init(&_md);
+}
+
+BitFlash_Dictionary::~BitFlash_Dictionary() {
+    if (_mapped) {
+        esp_partition_munmap(_mapHandle);
+    }
+    mbedtls_md_free(&_md);
+}
+
+bool BitFlash_Dictionary::readHeader(Header& header) {
+    return _partition &&
+           esp_partition_read(_partition, 0, &header, sizeof(header)) == ESP_OK &&
+           header.magic == kMagic && header.length <= _partition->size - kSectorSize;
+}
+
+bool BitFlash_Dictionary::has(const uint8_t id[32]) {
+    Header header;
+    return readHeader(header) && memcmp(header.id, id, sizeof(header.id)) == 0;
+}
+
+const uint8_t* BitFlash_Dictionary::map(size_t& len) {
+    Header header;
+    if (!_mapped && readHeader(header)) {
+        esp_partition_mmap_handle_t handle;
+        if (esp_partition_mmap(_partition, kSectorSize, header.length, ESP_PARTITION_MMAP_DATA, &_mapped, &handle) != ESP_OK) {
+            _mapped = nullptr;
+            return nullptr;
+        }
+        _mapHandle = handle;
+        _length = header.length;
+    }
+    
+    len = _length;
+    return (const uint8_t*)_mapped;
+}
+
+bool BitFlash_Dictionary::begin(size_t len) {
+    if (!_partition || len == 0 || len > _partition->size - kSectorSize || _mapped) {
+        return false;
+    }
+    
+    // Erasing the header sector first drops the old entry
+    size_t eraseSize = (kSectorSize + len + kSectorSize - 1) / kSectorSize * kSectorSize;
+    if (esp_partition_erase_range(_partition, 0, eraseSize) != ESP_OK) {
+        return false;
+    }
+    
+    _length = len;
+    _written = 0;
+    return mbedtls_md_setup(&_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) == 0 &&
+           mbedtls_md_starts(&_md) == 0;
+}
+
+bool BitFlash_Dictionary::write(const uint8_t* data, size_t len) {
+    if (_written + len > _length ||
+        esp_partition_write(_partition, kSectorSize + _written, data, len) != ESP_OK) {
+        return false;
+    }
+    _written += len;
+    return mbedtls_md_update(&_md, data, len) == 0;
+}
+
+bool BitFlash_Dictionary::end(const uint8_t id[32]) {
+    uint8_t digest[32];
+    if (_written != _length || mbedtls_md_finish(&_md, digest) != 0 ||
+        memcmp(digest, id, sizeof(digest)) != 0) {
+        return false;
+    }
+    
+    Header header;
+    header.magic = kMagic;
+    header.length = _length;
+    memcpy(header.id, id, sizeof(header.id));
+    return esp_partition_write(_partition, 0, &header, sizeof(header)) == ESP_OK;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <mbedtls/md.h>
+
+// Keeps one compression dictionary in a data partition, identified by its
+// SHA-256. The first sector holds a header, the dictionary follows. The
+// header is written last, so an interrupted download leaves no entry.
+class BitFlash_Dictionary {
+public:
+    explicit BitFlash_Dictionary(const char* label);
+    ~BitFlash_Dictionary();
+
+    bool available() const { return _partition != nullptr; }
+    bool has(const uint8_t id[32]);
+    // Valid until the object is destroyed.
+    const uint8_t* map(size_t& len);
+
+    // Replaces the cached dictionary; end() checks the data against id.
+    bool begin(size_t len);
+    bool write(const uint8_t* data, size_t len);
+    bool end(const uint8_t id[32]);
+
+private:
+    static constexpr size_t kSectorSize = 4096;
+    static constexpr uint32_t kMagic = 0x31444642;  // "BFD1"
+
+    struct Header {
+        uint32_t magic;
+        uint32_t length;
+        uint8_t id[32];
+    };
+
+    const esp_partition_t* _partition;
+    const void* _mapped = nullptr;
+    uint32_t _mapHandle = 0;
+    mbedtls_md_context_t _md;
+    size_t _length = 0;
+    size_t _written = 0;
+
+    bool readHeader(Header& header);
+};
@@ -0,0 +1,143 @@
+#include "BitFlash_Dns.h"
+
+static uint16_t readU16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t readU32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+bool BitFlash_Dns::queryTxt(const char* name, const char* prefix, String& value, uint32_t& ttl) {
+    int length = query(name, kTypeTxt);
+    if (length < 0) return false;
+    
+    uint16_t answers = readU16(_message + 6);
+    int offset = skipName(_message, length, 12);
+    if (offset < 0) return false;
+    offset += 4;  // QTYPE, QCLASS
+    
+    for (uint16_t i = 0; i < answers; i++) {
+        offset = skipName(_message, length, offset);
+        if (offset < 0 || offset + 10 > length) return false;
+        
+        uint16_t type = readU16(_message + offset);
+        uint32_t recordTtl = readU32(_message + offset + 4);
+        uint16_t dataLength = readU16(_message + offset + 8);
+        offset += 10;
+        if (offset + dataLength > length) return false;
+        
+        if (type == kTypeTxt) {
+            // RDATA is one or more length-prefixed strings, joined here
+            String text;
+            for (int p = offset; p < offset + dataLength; ) {
+                uint8_t chunk = _message[p++];
+                if (p + chunk > offset + dataLength) break;
+                text.concat((const char*)_message + p, chunk);
+                p += chunk;
+            }
+            
+            if (text.startsWith(prefix)) {
+                value = text;
+                ttl = recordTtl;
+                return true;
+            }
+        }
+        offset += dataLength;
+    }
+    
+    return false;
+}
+
+bool BitFlash_Dns::queryA(const char* name, IPAddress& address, uint32_t& ttl) {
+    int length = query(name, kTypeA);
+    if (length < 0) return false;
+    
+    uint16_t answers = readU16(_message + 6);
+    int offset = skipName(_message, length, 12);
+    if (offset < 0) return false;
+    offset += 4;  // QTYPE, QCLASS
+    
+    uint32_t chainTtl = UINT32_MAX;
+    for (uint16_t i = 0; i < answers; i++) {
+        offset = skipName(_message, length, offset);
+        if (offset < 0 || offset + 10 > length) return false;
+        
+        uint16_t type = readU16(_message + offset);
+        uint32_t recordTtl = readU32(_message + offset + 4);
+        uint16_t dataLength = readU16(_message + offset + 8);
+        offset += 10;
+        if (offset + dataLength > length) return false;
+        
+        chainTtl = min(chainTtl, recordTtl);
+        if (type == kTypeA && dataLength == 4) {
+            address = IPAddress(_message[offset], _message[offset + 1], _message[offset + 2], _message[offset + 3]);
+            ttl = chainTtl;
+            return true;
+        }
+        offset += dataLength;
+    }
+    
+    return false;
+}
+
+int BitFlash_Dns::query(const char* name, uint16_t type) {
+    IPAddress server = _hasServer ? _server : WiFi.dnsIP();
+    uint16_t id = random(0x10000);
+    
+    // Header: ID, recursion desired, one question
+    uint8_t question[12 + 256 + 4] = { (uint8_t)(id >> 8), (uint8_t)id, 0x01, 0x00, 0x00, 0x01 };
+    size_t length = 12;
+    
+    for (const char* label = name; *label; ) {
+        const char* dot = strchr(label, '.');
+        size_t labelLength = dot ? (size_t)(dot - label) : strlen(label);
+        if (labelLength == 0 || labelLength > 63 || length + labelLength + 6 > sizeof(question)) return -1;
+        
+        question[length++] = labelLength;
+        memcpy(question + length, label, labelLength);
+        length += labelLength;
+        label += labelLength + (dot ? 1 : 0);
+    }
+    question[length++] = 0;
+    question[length++] = type >> 8;
+    question[length++] = type & 0xff;
+    question[length++] = 0x00;
+    question[length++] = 0x01;  // IN
+    
+    WiFiUDP udp;
+    if (!udp.begin(49152 + random(16384))) return -1;
+    
+    for (uint8_t attempt = 0; attempt < kAttempts; attempt++) {
+        udp.beginPacket(server, 53);
+        udp.write(question, length);
+        if (!udp.endPacket()) continue;
+        
+        unsigned long start = millis();
+        while (millis() - start < kTimeout) {
+            if (udp.parsePacket() > 0) {
+                int received = udp.read(_message, kMaxMessage);
+                // Matching ID, a response, no error, not truncated
+                if (received >= 12 && readU16(_message) == id && (_message[2] & 0x80) &&
+                    !(_message[2] & 0x02) && (_message[3] & 0x0f) == 0) {
+                    udp.stop();
+                    return received;
+                }
+            }
+            delay(10);
+        }
+    }
+    
+    udp.stop();
+    return -1;
+}
+
+int BitFlash_Dns::skipName(const uint8_t* message, size_t length, size_t offset) {
+    while (offset < length) {
+        uint8_t label = message[offset];
+        if (label == 0) return offset + 1;
+        if ((label & 0xc0) == 0xc0) return offset + 2;
+        offset += label + 1;
+    }
+    return -1;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+
+// Minimal stub resolver for record types lwIP does not expose, sent over UDP
+// to the network's DNS server (or an explicit one). Blocks for at most
+// kTimeout per attempt.
+class BitFlash_Dns {
+public:
+    void setServer(const IPAddress& server) { _server = server; _hasServer = true; }
+
+    // Finds the TXT record starting with prefix and returns its text and TTL.
+    bool queryTxt(const char* name, const char* prefix, String& value, uint32_t& ttl);
+    // First IPv4 address for name. Following a CNAME, the TTL is the
+    // shortest along the chain.
+    bool queryA(const char* name, IPAddress& address, uint32_t& ttl);
+
+private:
+    static constexpr uint16_t kTypeA = 1;
+    static constexpr uint16_t kTypeTxt = 16;
+    static constexpr uint32_t kTimeout = 1500;
+    static constexpr uint8_t kAttempts = 2;
+    static constexpr size_t kMaxMessage = 512;
+
+    IPAddress _server;
+    bool _hasServer = false;
+    uint8_t _message[kMaxMessage];
+
+    // Sends the question and leaves the answer in _message.
+    int query(const char* name, uint16_t type);
+    static int skipName(const uint8_t* message, size_t length, size_t offset);
+};
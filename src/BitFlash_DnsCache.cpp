@@ -0,0 +1,121 @@
+#include "BitFlash_DnsCache.h"
+#include <time.h>
+
+RTC_DATA_ATTR BitFlash_DnsCache::Entry BitFlash_DnsCache::_entries[BitFlash_DnsCache::kEntries];
+
+bool BitFlash_DnsCache::resolve(const char* host, IPAddress& address) {
+    if (address.fromString(host)) return true;
+    
+    uint32_t now = time(nullptr);
+    Entry* entry = find(host);
+    if (entry && fresh(*entry, now)) {
+        _hits++;
+        entry->usedAt = now;
+        address = IPAddress(entry->address);
+        return true;
+    }
+    
+    _misses++;
+    if (!entry) entry = allocate(host);
+    if (!entry) {
+        // Name too long to keep
+        return WiFi.hostByName(host, address);
+    }
+    
+    if (!lookup(*entry, now)) {
+        entry->host[0] = '\0';
+        return false;
+    }
+    entry->usedAt = now;
+    address = IPAddress(entry->address);
+    return true;
+}
+
+// At most one lookup per call, so handle() never stalls for long.
+void BitFlash_DnsCache::refresh() {
+    uint32_t now = time(nullptr);
+    
+    for (Entry& entry : _entries) {
+        if (!entry.host[0] || now - entry.usedAt > kRecentUse) continue;
+        // Short-lived records are only looked up when they are used
+        if (entry.ttl < 2 * kRefreshMargin) continue;
+        if (fresh(entry, now) && entry.expiresAt - now > kRefreshMargin) continue;
+        
+        if (lookup(entry, now)) {
+            _refreshes++;
+        } else {
+            entry.host[0] = '\0';
+        }
+        return;
+    }
+}
+
+void BitFlash_DnsCache::clear() {
+    memset(_entries, 0, sizeof(_entries));
+}
+
+BitFlash_DnsCache::Entry* BitFlash_DnsCache::find(const char* host) {
+    for (Entry& entry : _entries) {
+        if (entry.host[0] && strcmp(entry.host, host) == 0) return &entry;
+    }
+    return nullptr;
+}
+
+// An empty slot, or the one used least recently.
+BitFlash_DnsCache::Entry* BitFlash_DnsCache::allocate(const char* host) {
+    if (strlen(host) >= kMaxHost) return nullptr;
+    
+    Entry* slot = &_entries[0];
+    for (Entry& entry : _entries) {
+        if (!entry.host[0]) {
+            slot = &entry;
+            break;
+        }
+        if (entry.usedAt < slot->usedAt) slot = &entry;
+    }
+    
+    memset(slot, 0, sizeof(Entry));
+    strcpy(slot->host, host);
+    return slot;
+}
+
+bool BitFlash_DnsCache::lookup(Entry& entry, uint32_t now) {
+    IPAddress address;
+    uint32_t ttl = 0;
+    if (!_dns.queryA(entry.host, address, ttl)) {
+        if (!WiFi.hostByName(entry.host, address)) return false;
+        ttl = kFallbackTtl;
+    }
+    
+    entry.address = (uint32_t)address;
+    entry.ttl = min(ttl, kMaxTtl);
+    entry.expiresAt = now + entry.ttl;
+    return true;
+}
+
+// A record that claims to last longer than its TTL means the clock was set
+// back since it was stored, so it is not trusted either.
+bool BitFlash_DnsCache::fresh(const Entry& entry, uint32_t now) {
+    return now < entry.expiresAt && entry.expiresAt - now <= entry.ttl;
+}
+
+int BitFlash_CachedClient::connect(const char* host, uint16_t port) {
+    IPAddress address;
+    if (!_cache.resolve(host, address)) return 0;
+    return WiFiClient::connect(address, port);
+}
+
+int BitFlash_CachedClient::connect(const char* host, uint16_t port, int32_t timeout) {
+    IPAddress address;
+    if (!_cache.resolve(host, address)) return 0;
+    return WiFiClient::connect(address, port, timeout);
+}
+
+// WiFiClientSecure's timeout overload ends up here as well. The CA and
+// client certificate set on this client are passed on, as the base class
+// does for its own lookups.
+int BitFlash_CachedSecureClient::connect(const char* host, uint16_t port) {
+    IPAddress address;
+    if (!_cache.resolve(host, address)) return 0;
+    return WiFiClientSecure::connect(address, port, host, _CA_cert, _cert, _private_key);
+}
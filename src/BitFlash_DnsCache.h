@@ -0,0 +1,81 @@
+#pragma once
+
+#include "BitFlash_Dns.h"
+#include <WiFiClient.h>
+#include <WiFiClientSecure.h>
+
+// Remembers the A records of the few hosts the client talks to for as long
+// as their TTL allows. The table lives in RTC memory, so it survives deep
+// sleep and a device that wakes up to check for updates usually connects
+// without a lookup. Expiry is kept in time() seconds, which keep counting
+// through deep sleep.
+class BitFlash_DnsCache {
+public:
+    void setServer(const IPAddress& server) { _dns.setServer(server); }
+
+    // The cached address while the record is fresh, otherwise a new lookup.
+    bool resolve(const char* host, IPAddress& address);
+    // Looks up again one recently used host whose record is about to run
+    // out, so the next connection still finds it cached.
+    void refresh();
+    // Forgets every record, e.g. after joining another network.
+    void clear();
+
+    uint32_t hits() const { return _hits; }
+    uint32_t misses() const { return _misses; }
+    uint32_t refreshes() const { return _refreshes; }
+
+private:
+    static constexpr size_t kEntries = 4;
+    static constexpr size_t kMaxHost = 64;
+    static constexpr uint32_t kFallbackTtl = 60;   // lwIP does not tell us the real one
+    static constexpr uint32_t kMaxTtl = 24 * 3600;
+    static constexpr uint32_t kRefreshMargin = 30; // Seconds before expiry
+    static constexpr uint32_t kRecentUse = 3600;   // Hosts idle longer than this are left to expire
+
+    struct Entry {
+        char host[kMaxHost];
+        uint32_t address;
+        uint32_t ttl;
+        uint32_t expiresAt;
+        uint32_t usedAt;
+    };
+
+    static Entry _entries[kEntries];
+
+    BitFlash_Dns _dns;
+    uint32_t _hits = 0;
+    uint32_t _misses = 0;
+    uint32_t _refreshes = 0;
+
+    Entry* find(const char* host);
+    Entry* allocate(const char* host);
+    bool lookup(Entry& entry, uint32_t now);
+    static bool fresh(const Entry& entry, uint32_t now);
+};
+
+// WiFiClient that resolves through a BitFlash_DnsCache.
+class BitFlash_CachedClient : public WiFiClient {
+public:
+    explicit BitFlash_CachedClient(BitFlash_DnsCache& cache) : _cache(cache) {}
+
+    using WiFiClient::connect;
+    int connect(const char* host, uint16_t port) override;
+    int connect(const char* host, uint16_t port, int32_t timeout) override;
+
+private:
+    BitFlash_DnsCache& _cache;
+};
+
+// WiFiClientSecure that resolves through a BitFlash_DnsCache. The host name
+// still goes into SNI and the certificate check; only the lookup is skipped.
+class BitFlash_CachedSecureClient : public WiFiClientSecure {
+public:
+    explicit BitFlash_CachedSecureClient(BitFlash_DnsCache& cache) : _cache(cache) {}
+
+    using WiFiClientSecure::connect;
+    int connect(const char* host, uint16_t port) override;
+
+private:
+    BitFlash_DnsCache& _cache;
+};
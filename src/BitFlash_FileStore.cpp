@@ -0,0 +1,118 @@
+#include "BitFlash_FileStore.h"
+
+BitFlash_FileStore::BitFlash_FileStore(fs::FS& fs, const char* path)
+    : _fs(fs), _path(path), _statePath(String(path) + ".state") {
+    mbedtls_md_init(&_md);
+    mbedtls_md_setup(&_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+}
+
+BitFlash_FileStore::~BitFlash_FileStore() {
+    if (_file) {
+        _file.close();
+    }
+    mbedtls_md_free(&_md);
+}
+
+bool BitFlash_FileStore::open(const char* id, size_t size, size_t chunkSize) {
+    char idHash[sizeof(_state.id)];
+    if (size == 0 || chunkSize == 0 || !id || !hashId(id, idHash)) {
+        return false;
+    }
+    
+    fs::File stateFile = _fs.open(_statePath, FILE_READ);
+    if (stateFile) {
+        size_t n = stateFile.read((uint8_t*)&_state, sizeof(_state));
+        stateFile.close();
+        if (n == sizeof(_state) && _state.magic == kMagic && _state.size == size &&
+            _state.chunkSize == chunkSize && memcmp(_state.id, idHash, sizeof(idHash)) == 0 &&
+            _state.verified <= size && _fs.exists(_path)) {
+            return true;
+        }
+    }
+    
+    // Something else is stored: start over with an empty image
+    fs::File file = _fs.open(_path, FILE_WRITE);
+    if (!file) {
+        return false;
+    }
+    file.close();
+    
+    memset(&_state, 0, sizeof(_state));
+    _state.magic = kMagic;
+    _state.size = size;
+    _state.chunkSize = chunkSize;
+    memcpy(_state.id, idHash, sizeof(idHash));
+    return saveState();
+}
+
+void BitFlash_FileStore::remove() {
+    if (_file) {
+        _file.close();
+    }
+    _fs.remove(_statePath);
+    _fs.remove(_path);
+    memset(&_state, 0, sizeof(_state));
+}
+
+bool BitFlash_FileStore::beginChunk() {
+    if (complete()) {
+        return false;
+    }
+    
+    // Overwrites whatever an unverified chunk left after the verified part
+    _file = _fs.open(_path, "r+");
+    _chunkWritten = 0;
+    return _file && _file.seek(_state.verified) && mbedtls_md_starts(&_md) == 0;
+}
+
+bool BitFlash_FileStore::write(const uint8_t* data, size_t len) {
+    size_t chunkLength = min<size_t>(_state.chunkSize, _state.size - _state.verified);
+    if (!_file || _chunkWritten + len > chunkLength || _file.write(data, len) != len) {
+        return false;
+    }
+    _chunkWritten += len;
+    return mbedtls_md_update(&_md, data, len) == 0;
+}
+
+bool BitFlash_FileStore::endChunk(const uint8_t* expected) {
+    if (!_file) {
+        return false;
+    }
+    _file.close();
+    
+    uint8_t digest[32];
+    size_t chunkLength = min<size_t>(_state.chunkSize, _state.size - _state.verified);
+    if (_chunkWritten != chunkLength || mbedtls_md_finish(&_md, digest) != 0 ||
+        (expected && memcmp(digest, expected, sizeof(digest)) != 0)) {
+        return false;
+    }
+    
+    _state.verified += chunkLength;
+    return saveState();
+}
+
+fs::File BitFlash_FileStore::read() {
+    return complete() ? _fs.open(_path, FILE_READ) : fs::File();
+}
+
+bool BitFlash_FileStore::saveState() {
+    fs::File stateFile = _fs.open(_statePath, FILE_WRITE);
+    if (!stateFile) {
+        return false;
+    }
+    bool ok = stateFile.write((const uint8_t*)&_state, sizeof(_state)) == sizeof(_state);
+    stateFile.close();
+    return ok;
+}
+
+bool BitFlash_FileStore::hashId(const char* id, char hex[65]) {
+    uint8_t digest[32];
+    if (mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)id, strlen(id), digest) != 0) {
+        return false;
+    }
+    
+    for (int i = 0; i < 32; i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <mbedtls/md.h>
+
+// Accumulates an image on a filesystem (SD, LittleFS, FFat) over many short
+// sessions. Each chunk is hashed as it is written and only counts once it
+// has been verified; a state file next to the image records how much that
+// is, so a dropped connection loses at most one chunk.
+class BitFlash_FileStore {
+public:
+    BitFlash_FileStore(fs::FS& fs, const char* path);
+    ~BitFlash_FileStore();
+
+    // Keeps what is stored when it belongs to the same image (id, size and
+    // chunk size), otherwise starts over. The id may be of any length, such
+    // as a URL; only its SHA-256 is stored.
+    bool open(const char* id, size_t size, size_t chunkSize);
+    void remove();
+
+    size_t size() const { return _state.size; }
+    size_t chunkSize() const { return _state.chunkSize; }
+    size_t verified() const { return _state.verified; }
+    bool complete() const { return _state.size > 0 && _state.verified == _state.size; }
+
+    // Writes the next chunk; endChunk() checks it against expected, when
+    // given, and records it.
+    bool beginChunk();
+    bool write(const uint8_t* data, size_t len);
+    bool endChunk(const uint8_t* expected);
+
+    // The complete image, opened for reading.
+    fs::File read();
+
+private:
+    static constexpr uint32_t kMagic = 0x32534642;  // "BFS2"
+
+    struct State {
+        uint32_t magic;
+        uint32_t size;
+        uint32_t chunkSize;
+        uint32_t verified;
+        char id[65];  // SHA-256 of the image id, in hex
+    };
+
+    fs::FS& _fs;
+    String _path;
+    String _statePath;
+    State _state = {};
+    fs::File _file;
+    mbedtls_md_context_t _md;
+    size_t _chunkWritten = 0;
+
+    bool saveState();
+    static bool hashId(const char* id, char hex[65]);
+};
@@ -0,0 +1,65 @@
+#include "BitFlash_Freshness.h"
+
+void BitFlash_Freshness::parse(int httpCode, const String& date, const String& retryAfter,
+                               const String& cacheControl, const String& expires) {
+    _date = parseHttpDate(date);
+    _delaySeconds = -1;
+    
+    if (retryAfter.length() > 0 && (isBusy(httpCode) || httpCode == 200)) {
+        if (isdigit((unsigned char)retryAfter[0])) {
+            _delaySeconds = retryAfter.toInt();
+        } else {
+            time_t until = parseHttpDate(retryAfter);
+            if (until && _date) _delaySeconds = until - _date;
+        }
+    }
+    _backoff = _delaySeconds > 0;
+    
+    int maxAge = cacheControl.indexOf("max-age=");
+    if (_delaySeconds < 0 && maxAge >= 0 && cacheControl.indexOf("no-cache") < 0) {
+        _delaySeconds = cacheControl.substring(maxAge + 8).toInt();
+        if (_delaySeconds == 0) _delaySeconds = -1;
+    }
+    
+    if (_delaySeconds < 0 && maxAge < 0) {
+        time_t until = parseHttpDate(expires);
+        if (until && _date && until > _date) _delaySeconds = until - _date;
+    }
+}
+
+uint32_t BitFlash_Freshness::nextCheckDelay(uint32_t checkInterval) const {
+    if (_delaySeconds <= 0) {
+        return checkInterval;
+    }
+    return (uint32_t)min<long>(_delaySeconds, kMaxSeconds) * 1000;
+}
+
+// 429 Too Many Requests and 503 Service Unavailable
+bool BitFlash_Freshness::isBusy(int httpCode) {
+    return httpCode == 429 || httpCode == 503;
+}
+
+// Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"); returns 0 on failure.
+time_t BitFlash_Freshness::parseHttpDate(const String& value) {
+    static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4] = { 0 };
+    int day, year, hour, minute, second;
+    
+    if (sscanf(value.c_str(), "%*3s, %d %3s %d %d:%d:%d", &day, month, &year, &hour, &minute, &second) != 6) {
+        return 0;
+    }
+    
+    const char* found = strstr(months, month);
+    if (strlen(month) != 3 || !found) return 0;
+    int m = (found - months) / 3 + 1;
+    
+    // Days since the epoch for a proleptic Gregorian date
+    int y = year - (m <= 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = (long)era * 146097 + doe - 719468;
+    
+    return (time_t)days * 86400 + hour * 3600 + minute * 60 + second;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+#include <time.h>
+
+// What the headers of a version check say about the next one. Retry-After
+// wins, then a positive max-age, then Expires; without any of them the
+// client keeps its checkInterval.
+class BitFlash_Freshness {
+public:
+    static constexpr long kMaxSeconds = 7 * 24 * 3600;
+
+    void parse(int httpCode, const String& date, const String& retryAfter,
+               const String& cacheControl, const String& expires);
+
+    // Milliseconds until the next check
+    uint32_t nextCheckDelay(uint32_t checkInterval) const;
+    // The delay is a Retry-After: the server wants devices to stay away
+    bool backoff() const { return _backoff; }
+    // The response's Date, 0 when it had none
+    time_t date() const { return _date; }
+
+    static bool isBusy(int httpCode);
+    static time_t parseHttpDate(const String& value);
+
+private:
+    long _delaySeconds = -1;
+    bool _backoff = false;
+    time_t _date = 0;
+};
@@ -0,0 +1,258 @@
+#include "BitFlash_Lan.h"
+
+// Every packet starts with "BF1<type> <sender id>".
+//   L  leader heartbeat: " <manifest seq> <offset> <total>\n<fragment>", where
+//      the fragments make up "<signature>\n<manifest body>"
+//   H  hello, so peers can pick us for gossip
+//   A  release rumor: " <version> <manifest hash>"
+static const char kMagic[] = "BF1";
+
+bool BitFlash_Lan::begin(uint16_t port, uint64_t deviceId, bool elect, uint8_t gossipFanout) {
+    _port = port;
+    _deviceId = deviceId;
+    _elect = elect;
+    _gossipFanout = gossipFanout;
+    _running = _udp.beginMulticast(_group, _port);
+    _startedAt = millis();
+    _leaderId = 0;
+    _leaderSeq = 0;
+    _leaderRelays = true;
+    // Start from a random sequence so followers notice a rebooted leader
+    _manifestSeq = random(1, 0x7fffffff);
+    return _running;
+}
+
+void BitFlash_Lan::end() {
+    _udp.stop();
+    _running = false;
+}
+
+bool BitFlash_Lan::isLeader() const {
+    if (!_running || !_elect) return false;
+    
+    // Listen for a full timeout after joining before claiming leadership
+    if (millis() - _startedAt < kLeaderTimeout) return false;
+    
+    bool leaderAlive = _leaderId != 0 && millis() - _leaderSeenAt < kLeaderTimeout;
+    return !leaderAlive || _leaderId > _deviceId;
+}
+
+void BitFlash_Lan::poll() {
+    if (!_running) return;
+    
+    while (_udp.parsePacket() > 0) {
+        int length = _udp.read(_packet, kMaxPacket);
+        if (length > 0) {
+            _packet[length] = '\0';
+            handlePacket(_packet, length);
+        }
+    }
+    
+    if (isLeader() && millis() - _lastHeartbeatSent >= kHeartbeatInterval) {
+        sendHeartbeat();
+    }
+    
+    if (_gossipFanout > 0 && (_lastHelloSent == 0 || millis() - _lastHelloSent >= kHelloInterval)) {
+        sendHello();
+    }
+}
+
+void BitFlash_Lan::publishManifest(const char* body, size_t length, const String& signature) {
+    if (!_elect) return;
+    
+    String payload = signature + "\n";
+    payload.concat(body, length);
+    if (payload == _payload) {
+        return;
+    }
+    
+    _payload = payload;
+    _manifestSeq++;
+    
+    if (isLeader()) {
+        sendHeartbeat();
+    }
+}
+
+// One packet per fragment, back to back. A manifest too big for followers
+// to reassemble is announced by its size only.
+void BitFlash_Lan::sendHeartbeat() {
+    size_t total = _payload.length();
+    bool relay = total <= kMaxManifest;
+    size_t offset = 0;
+    
+    do {
+        char header[64];
+        int headerLength = snprintf(header, sizeof(header), "%sL %016llx %lu %u %u\n", kMagic,
+                                    (unsigned long long)_deviceId, (unsigned long)_manifestSeq,
+                                    (unsigned)offset, (unsigned)total);
+        size_t n = relay ? min(total - offset, kMaxPacket - headerLength) : 0;
+        
+        _udp.beginPacket(_group, _port);
+        _udp.write((const uint8_t*)header, headerLength);
+        _udp.write((const uint8_t*)_payload.c_str() + offset, n);
+        _udp.endPacket();
+        offset += n;
+    } while (relay && offset < total);
+    
+    _lastHeartbeatSent = millis();
+}
+
+void BitFlash_Lan::sendHello() {
+    char hello[32];
+    int length = snprintf(hello, sizeof(hello), "%sH %016llx", kMagic, (unsigned long long)_deviceId);
+    
+    _udp.beginPacket(_group, _port);
+    _udp.write((const uint8_t*)hello, length);
+    _udp.endPacket();
+    
+    _lastHelloSent = millis();
+}
+
+void BitFlash_Lan::announce(const char* version, const char* hash) {
+    char rumor[sizeof(_rumor)];
+    snprintf(rumor, sizeof(rumor), "%s %s", version, hash);
+    if (_gossipFanout == 0 || strcmp(rumor, _rumor) == 0) {
+        return;
+    }
+    
+    strcpy(_rumor, rumor);
+    spreadRumor(_deviceId);
+}
+
+// Sends the current rumor to up to _gossipFanout distinct random live peers.
+void BitFlash_Lan::spreadRumor(uint64_t except) {
+    size_t candidates[kMaxPeers];
+    size_t count = 0;
+    for (size_t i = 0; i < kMaxPeers; i++) {
+        if (_peers[i].id != 0 && _peers[i].id != except && millis() - _peers[i].seenAt < kPeerTimeout) {
+            candidates[count++] = i;
+        }
+    }
+    
+    char packet[96];
+    int length = snprintf(packet, sizeof(packet), "%sA %016llx %s", kMagic, (unsigned long long)_deviceId, _rumor);
+    
+    for (size_t sent = 0; sent < _gossipFanout && count > 0; sent++) {
+        size_t pick = random(count);
+        const Peer& peer = _peers[candidates[pick]];
+        candidates[pick] = candidates[--count];
+        
+        _udp.beginPacket(peer.ip, _port);
+        _udp.write((const uint8_t*)packet, length);
+        _udp.endPacket();
+    }
+}
+
+void BitFlash_Lan::rememberPeer(uint64_t id, const IPAddress& ip) {
+    // Refresh the existing slot, else take an empty or the stalest one
+    size_t slot = 0;
+    for (size_t i = 0; i < kMaxPeers; i++) {
+        if (_peers[i].id == id) {
+            slot = i;
+            break;
+        }
+        if (_peers[i].id == 0 || _peers[i].seenAt < _peers[slot].seenAt) {
+            slot = i;
+        }
+    }
+    
+    _peers[slot].id = id;
+    _peers[slot].ip = ip;
+    _peers[slot].seenAt = millis();
+}
+
+void BitFlash_Lan::handlePacket(char* packet, size_t length) {
+    if (length < 6 || memcmp(packet, kMagic, sizeof(kMagic) - 1) != 0 || packet[4] != ' ') {
+        return;
+    }
+    
+    char type = packet[3];
+    char* rest;
+    unsigned long long id = strtoull(packet + 5, &rest, 16);
+    if (id == 0 || id == _deviceId) {
+        return;
+    }
+    
+    if (_gossipFanout > 0) {
+        rememberPeer(id, _udp.remoteIP());
+    }
+    
+    if (type == 'L' && _elect) {
+        handleHeartbeat(id, rest, length - (rest - packet));
+    } else if (type == 'A' && *rest == ' ') {
+        handleAnnounce(id, rest + 1);
+    }
+}
+
+void BitFlash_Lan::handleHeartbeat(uint64_t id, char* packet, size_t length) {
+    char* data;
+    unsigned long seq = strtoul(packet, &data, 10);
+    unsigned long offset = strtoul(data, &data, 10);
+    unsigned long total = strtoul(data, &data, 10);
+    if (*data != '\n') {
+        return;
+    }
+    data++;
+    size_t dataLength = length - (data - packet);
+    
+    // Lowest live ID wins; a higher one only replaces a leader that went quiet
+    bool leaderAlive = _leaderId != 0 && millis() - _leaderSeenAt < kLeaderTimeout;
+    if (leaderAlive && id > _leaderId) {
+        return;
+    }
+    
+    if (id != _leaderId) {
+        _leaderId = id;
+        _leaderSeq = 0;
+    }
+    _leaderSeenAt = millis();
+    
+    if (isLeader()) {
+        return;
+    }
+    _leaderRelays = total <= kMaxManifest;
+    if (seq == _leaderSeq || total == 0 || !_leaderRelays) {
+        return;
+    }
+    
+    // Fragments are taken in order; after a lost one, the next heartbeat
+    // starts over
+    if (offset == 0) {
+        _assembly = String();
+        _assembly.reserve(total);
+        _assemblySeq = seq;
+    }
+    if (seq != _assemblySeq || offset != _assembly.length() || offset + dataLength > total) {
+        return;
+    }
+    _assembly.concat(data, dataLength);
+    if (_assembly.length() < total) {
+        return;
+    }
+    
+    int split = _assembly.indexOf('\n');
+    bool consumed = split < 0 || !_manifestHandler ||
+                    _manifestHandler(_assembly.c_str() + split + 1, total - split - 1, _assembly.substring(0, split));
+    _assembly = String();
+    
+    // Not yet acted on: the next heartbeat delivers it again
+    if (consumed) {
+        _leaderSeq = seq;
+    }
+}
+
+void BitFlash_Lan::handleAnnounce(uint64_t id, const char* rumor) {
+    if (_gossipFanout == 0 || strlen(rumor) >= sizeof(_rumor) || strcmp(rumor, _rumor) == 0) {
+        return;
+    }
+    
+    // New rumor: pass it on once, then let the client check
+    strcpy(_rumor, rumor);
+    spreadRumor(id);
+    
+    char version[sizeof(_rumor)];
+    if (sscanf(rumor, "%63s", version) == 1 && _announceHandler) {
+        _announceHandler(version);
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <functional>
+
+// Site-local coordination over UDP multicast. The device with the lowest ID
+// that is alive becomes leader; only it polls the origin and it repeats the
+// latest manifest in every heartbeat, split over as many packets as it
+// takes. Followers that miss heartbeats for kLeaderTimeout take over.
+//
+// Independently, release news spreads by gossip: a device that learns of a
+// new (version, manifest hash) tells a few random peers once, and so on.
+class BitFlash_Lan {
+public:
+    // Returns false when the manifest could not be acted on yet; the next
+    // heartbeat then offers it again.
+    typedef std::function<bool(const char* body, size_t length, const String& signature)> ManifestHandler;
+    typedef std::function<void(const char* version)> AnnounceHandler;
+
+    // elect enables leader election; gossipFanout 0 disables gossip.
+    bool begin(uint16_t port, uint64_t deviceId, bool elect, uint8_t gossipFanout);
+    void end();
+    bool running() const { return _running; }
+
+    // Receives packets and sends our heartbeat when leading.
+    void poll();
+
+    bool isLeader() const;
+    bool isFollower() const { return _running && _elect && !isLeader(); }
+    // False while the leader's manifest is too big to relay, so followers
+    // have to poll the origin themselves.
+    bool leaderRelaysManifest() const { return _leaderRelays; }
+
+    void publishManifest(const char* body, size_t length, const String& signature);
+    void setManifestHandler(ManifestHandler handler) { _manifestHandler = handler; }
+
+    // Starts a rumor unless this (version, hash) was already heard.
+    void announce(const char* version, const char* hash);
+    void setAnnounceHandler(AnnounceHandler handler) { _announceHandler = handler; }
+
+private:
+    static constexpr uint32_t kHeartbeatInterval = 5000;
+    static constexpr uint32_t kLeaderTimeout = 3 * kHeartbeatInterval;
+    static constexpr uint32_t kHelloInterval = 30000;
+    static constexpr uint32_t kPeerTimeout = 4 * kHelloInterval;
+    static constexpr size_t kMaxPacket = 1472;
+    static constexpr size_t kMaxManifest = 8192;  // Signature and body, as reassembled by followers
+    static constexpr size_t kMaxPeers = 16;
+
+    struct Peer {
+        uint64_t id;
+        IPAddress ip;
+        unsigned long seenAt;
+    };
+
+    WiFiUDP _udp;
+    IPAddress _group = IPAddress(239, 255, 66, 70);
+    uint16_t _port = 0;
+    bool _running = false;
+    bool _elect = false;
+    uint8_t _gossipFanout = 0;
+    uint64_t _deviceId = 0;
+    unsigned long _startedAt = 0;
+    unsigned long _lastHeartbeatSent = 0;
+
+    uint64_t _leaderId = 0;
+    unsigned long _leaderSeenAt = 0;
+    uint32_t _leaderSeq = 0;
+    bool _leaderRelays = true;
+
+    String _payload;  // "<signature>\n<manifest body>" we relay when leading
+    uint32_t _manifestSeq = 0;
+    String _assembly;  // Heartbeat fragments received so far
+    uint32_t _assemblySeq = 0;
+
+    Peer _peers[kMaxPeers] = {};
+    unsigned long _lastHelloSent = 0;
+    char _rumor[64] = { 0 };  // "<version> <hash>" last heard
+
+    ManifestHandler _manifestHandler;
+    AnnounceHandler _announceHandler;
+    char _packet[kMaxPacket + 1];
+
+    void sendHeartbeat();
+    void sendHello();
+    void spreadRumor(uint64_t except);
+    void rememberPeer(uint64_t id, const IPAddress& ip);
+    void handlePacket(char* packet, size_t length);
+    void handleHeartbeat(uint64_t id, char* packet, size_t length);
+    void handleAnnounce(uint64_t id, const char* rumor);
+};
@@ -0,0 +1,142 @@
+#include "BitFlash_Mqtt.h"
+#include <new>
+
+static uint32_t readLE32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+BitFlash_Mqtt::BitFlash_Mqtt(const char* prefix, const char* deviceId, Publisher publish)
+    : _deviceId(deviceId),
+      _manifestTopic(String(prefix) + "/manifest"),
+      _chunkTopic(String(prefix) + "/" + deviceId + "/chunk"),
+      _requestTopic(String(prefix) + "/request"),
+      _publish(publish) {
+    mbedtls_md_init(&_md);
+    mbedtls_md_setup(&_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+}
+
+BitFlash_Mqtt::~BitFlash_Mqtt() {
+    mbedtls_md_free(&_md);
+}
+
+bool BitFlash_Mqtt::begin(const char* image, size_t chunkSize, uint8_t window, DataHandler handler) {
+    if (!_publish || chunkSize == 0) {
+        return false;
+    }
+    
+    _image = image;
+    _chunkSize = chunkSize;
+    _window = window ? window : 1;
+    _capacity = _window * _chunkSize;
+    _queue.reset(new (std::nothrow) uint8_t[_capacity]);
+    if (!_queue) {
+        _state = kFailed;
+        return false;
+    }
+    
+    _handler = handler;
+    _total = 0;
+    _next = 0;
+    _received = 0;
+    _requested = 0;
+    _retries = 0;
+    _progressAt = millis();
+    _state = kActive;
+    return true;
+}
+
+void BitFlash_Mqtt::cancel() {
+    _state = kIdle;
+    _handler = nullptr;
+    _queue.reset();
+}
+
+bool BitFlash_Mqtt::request(size_t offset, size_t length) {
+    String message = _deviceId + " " + _image + " " + String(offset) + " " + String(length);
+    return _publish(_requestTopic.c_str(), (const uint8_t*)message.c_str(), message.length());
+}
+
+// Passes the queued data to the handler, in at most two pieces where the
+// ring wraps around.
+bool BitFlash_Mqtt::handOn() {
+    while (_next < _received) {
+        size_t at = _next % _capacity;
+        size_t length = min(_received - _next, _capacity - at);
+        if (!_handler(_queue.get() + at, length, _total)) {
+            return false;
+        }
+        _next += length;
+    }
+    return true;
+}
+
+void BitFlash_Mqtt::poll() {
+    if (_state != kActive) return;
+    
+    if (!handOn()) {
+        _state = kFailed;
+        return;
+    }
+    if (_total && _next == _total) {
+        _state = kComplete;
+        return;
+    }
+    
+    // Nothing in order for a while: ask again for everything outstanding
+    if (millis() - _progressAt >= kChunkTimeout) {
+        if (++_retries > kMaxRetries) {
+            _state = kFailed;
+            return;
+        }
+        _requested = _received;
+        _progressAt = millis();
+    }
+    
+    // Until the first reply says how big the image is, one chunk at a time.
+    // What is requested always fits in the queue once it arrives.
+    size_t window = _total ? _capacity : _chunkSize;
+    size_t end = _total ? _total : _chunkSize;
+    while (_requested < end && _requested - _next < window) {
+        size_t length = min(_chunkSize, end - _requested);
+        if (!request(_requested, length)) break;
+        _requested += length;
+    }
+}
+
+void BitFlash_Mqtt::onChunk(const uint8_t* payload, size_t length) {
+    if (_state != kActive || length <= kChunkHeader) return;
+    
+    size_t offset = readLE32(payload);
+    size_t total = readLE32(payload + 4);
+    const uint8_t* data = payload + kChunkHeader;
+    size_t dataLength = length - kChunkHeader;
+    
+    // Duplicates, chunks that overtook a lost one and chunks bigger than
+    // the room left in the queue are dropped
+    if (offset != _received || total == 0 || (_total && total != _total) || offset + dataLength > total ||
+        _received + dataLength - _next > _capacity) {
+        return;
+    }
+    
+    uint8_t digest[32];
+    if (mbedtls_md_starts(&_md) != 0 || mbedtls_md_update(&_md, data, dataLength) != 0 ||
+        mbedtls_md_finish(&_md, digest) != 0 || memcmp(digest, payload + 8, sizeof(digest)) != 0) {
+        return;
+    }
+    
+    _total = total;
+    while (dataLength > 0) {
+        size_t at = _received % _capacity;
+        size_t n = min(dataLength, _capacity - at);
+        memcpy(_queue.get() + at, data, n);
+        data += n;
+        dataLength -= n;
+        _received += n;
+    }
+    
+    _progressAt = millis();
+    _retries = 0;
+    if (_requested < _received) {
+        _requested = _received;
+    }
+}
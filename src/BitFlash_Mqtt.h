@@ -0,0 +1,75 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <mbedtls/md.h>
+#include <memory>
+
+// Image download over an MQTT session the application already holds. The
+// library does not talk to the broker: requests go out through the
+// application's publish function, and replies come back through onChunk().
+//
+//   <prefix>/request        "<device> <image> <offset> <length>"
+//   <prefix>/<device>/chunk offset (u32) | image size (u32) | SHA-256 of data | data
+//
+// Integers are little endian. Up to `window` chunks are requested ahead;
+// a chunk is accepted only in order and with a matching hash, and anything
+// missing is requested again after kChunkTimeout. Accepted chunks wait in a
+// queue of `window` chunks until poll() hands them on, so the handler never
+// runs inside the application's MQTT callback.
+class BitFlash_Mqtt {
+public:
+    typedef std::function<bool(const char* topic, const uint8_t* payload, size_t length)> Publisher;
+    // Receives the image in order; return false to abort.
+    typedef std::function<bool(uint8_t* data, size_t len, size_t total)> DataHandler;
+
+    BitFlash_Mqtt(const char* prefix, const char* deviceId, Publisher publish);
+    ~BitFlash_Mqtt();
+
+    const String& manifestTopic() const { return _manifestTopic; }
+    const String& chunkTopic() const { return _chunkTopic; }
+
+    // False when the queue cannot be allocated.
+    bool begin(const char* image, size_t chunkSize, uint8_t window, DataHandler handler);
+    // Checks a chunk and queues its data; nothing is handed on here.
+    void onChunk(const uint8_t* payload, size_t length);
+    // Hands queued data on, sends requests as the window allows and
+    // retries stalled ones.
+    void poll();
+    void cancel();
+
+    bool active() const { return _state == kActive; }
+    bool complete() const { return _state == kComplete; }
+    bool failed() const { return _state == kFailed; }
+
+private:
+    static constexpr uint32_t kChunkTimeout = 5000;
+    static constexpr uint8_t kMaxRetries = 5;
+    static constexpr size_t kChunkHeader = 8 + 32;
+
+    enum State : uint8_t { kIdle, kActive, kComplete, kFailed };
+
+    String _deviceId;
+    String _manifestTopic;
+    String _chunkTopic;
+    String _requestTopic;
+    Publisher _publish;
+    DataHandler _handler;
+    mbedtls_md_context_t _md;
+
+    State _state = kIdle;
+    String _image;
+    size_t _chunkSize = 0;
+    uint8_t _window = 1;
+    size_t _total = 0;
+    size_t _next = 0;       // Next offset handed on
+    size_t _received = 0;   // End of what has been queued
+    size_t _requested = 0;  // End of what has been asked for
+    std::unique_ptr<uint8_t[]> _queue;  // Ring of window * chunkSize bytes, by offset
+    size_t _capacity = 0;
+    unsigned long _progressAt = 0;
+    uint8_t _retries = 0;
+
+    bool request(size_t offset, size_t length);
+    bool handOn();
+};
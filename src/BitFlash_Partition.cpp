@@ -0,0 +1,124 @@
+#include "BitFlash_Partition.h"
+#include <esp_ota_ops.h>
+#include <esp_idf_version.h>
+
+#if ESP_IDF_VERSION_MAJOR < 5
+#include <esp_spi_flash.h>
+#define ESP_PARTITION_MMAP_DATA SPI_FLASH_MMAP_DATA
+#define esp_partition_munmap spi_flash_munmap
+typedef spi_flash_mmap_handle_t esp_partition_mmap_handle_t;
+#endif
+
+BitFlash_PartitionSink::BitFlash_PartitionSink(const esp_partition_t* partition, bool compare)
+    : _partition(partition ? partition : esp_ota_get_next_update_partition(nullptr)), _compare(compare) {
+}
+
+BitFlash_PartitionSink::~BitFlash_PartitionSink() {
+    release();
+}
+
+bool BitFlash_PartitionSink::begin(size_t size) {
+    if (!_partition || size > _partition->size) {
+        return false;
+    }
+    
+    _sector = (uint8_t*)malloc(kSectorSize);
+    if (!_sector) {
+        return false;
+    }
+    
+    // Without a mapping the comparison falls back to reading the flash
+    esp_partition_mmap_handle_t handle;
+    const void* mapped = nullptr;
+    if (_compare && esp_partition_mmap(_partition, 0, size, ESP_PARTITION_MMAP_DATA, &mapped, &handle) == ESP_OK) {
+        _mapped = (const uint8_t*)mapped;
+        _mapHandle = handle;
+    }
+    
+    _size = size;
+    _fill = 0;
+    _offset = 0;
+    _sectorsWritten = 0;
+    _sectorsSkipped = 0;
+    return true;
+}
+
+bool BitFlash_PartitionSink::write(uint8_t* data, size_t len) {
+    while (len > 0) {
+        size_t n = min(len, kSectorSize - _fill);
+        // Received into writeBuffer(), already in place
+        if (data != _sector + _fill) {
+            memcpy(_sector + _fill, data, n);
+        }
+        _fill += n;
+        data += n;
+        len -= n;
+        
+        if (_fill == kSectorSize && !flushSector()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BitFlash_PartitionSink::end() {
+    bool ok = _fill == 0 || flushSector();
+    ok = ok && _offset == _size;
+    release();
+    return ok && esp_ota_set_boot_partition(_partition) == ESP_OK;
+}
+
+void BitFlash_PartitionSink::abort() {
+    release();
+}
+
+uint8_t* BitFlash_PartitionSink::writeBuffer(size_t& len) {
+    if (!_sector) return nullptr;
+    len = kSectorSize - _fill;
+    return _sector + _fill;
+}
+
+bool BitFlash_PartitionSink::flushSector() {
+    if (_offset + _fill > _size) {
+        return false;
+    }
+    
+    if (_compare && sectorUnchanged()) {
+        _sectorsSkipped++;
+    } else {
+        if (esp_partition_erase_range(_partition, _offset, kSectorSize) != ESP_OK ||
+            esp_partition_write(_partition, _offset, _sector, _fill) != ESP_OK) {
+            return false;
+        }
+        _sectorsWritten++;
+    }
+    
+    _offset += _fill;
+    _fill = 0;
+    return true;
+}
+
+bool BitFlash_PartitionSink::sectorUnchanged() {
+    if (_mapped) {
+        return memcmp(_mapped + _offset, _sector, _fill) == 0;
+    }
+    
+    uint8_t chunk[256];
+    for (size_t pos = 0; pos < _fill; pos += sizeof(chunk)) {
+        size_t n = min(sizeof(chunk), _fill - pos);
+        if (esp_partition_read(_partition, _offset + pos, chunk, n) != ESP_OK ||
+            memcmp(chunk, _sector + pos, n) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void BitFlash_PartitionSink::release() {
+    if (_mapped) {
+        esp_partition_munmap(_mapHandle);
+        _mapped = nullptr;
+    }
+    free(_sector);
+    _sector = nullptr;
+}
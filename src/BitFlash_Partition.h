@@ -0,0 +1,45 @@
+#pragma once
+
+#include "BitFlash_Pipeline.h"
+#include <esp_partition.h>
+
+// Writes the image straight into an app partition, one flash sector at a
+// time. Each incoming sector is compared with what the partition already
+// holds through a memory mapping; identical sectors are neither erased nor
+// programmed. end() makes the partition the boot partition, which also
+// validates the image. The sector buffer is offered as the pipeline's
+// writeBuffer(), so the download can be received straight into it.
+class BitFlash_PartitionSink : public BitFlash_Stage {
+public:
+    // nullptr selects the next OTA partition. Without compare, every sector
+    // is written.
+    explicit BitFlash_PartitionSink(const esp_partition_t* partition = nullptr, bool compare = true);
+    ~BitFlash_PartitionSink();
+
+    bool begin(size_t size) override;
+    bool write(uint8_t* data, size_t len) override;
+    bool end() override;
+    void abort() override;
+    uint8_t* writeBuffer(size_t& len) override;
+
+    uint32_t sectorsWritten() const { return _sectorsWritten; }
+    uint32_t sectorsSkipped() const { return _sectorsSkipped; }
+
+private:
+    static constexpr size_t kSectorSize = 4096;
+
+    const esp_partition_t* _partition;
+    bool _compare;
+    const uint8_t* _mapped = nullptr;
+    uint32_t _mapHandle = 0;
+    uint8_t* _sector = nullptr;
+    size_t _fill = 0;
+    size_t _offset = 0;
+    size_t _size = 0;
+    uint32_t _sectorsWritten = 0;
+    uint32_t _sectorsSkipped = 0;
+
+    bool flushSector();
+    bool sectorUnchanged();
+    void release();
+};
@@ -0,0 +1,388 @@
+#include "BitFlash_Patch.h"
+#include <esp_ota_ops.h>
+#include <esp_rom_crc.h>
+#include <mbedtls/md.h>
+#include <stddef.h>
+
+static uint32_t readLE32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+BitFlash_PatchSink::BitFlash_PatchSink(const esp_partition_t* source, const esp_partition_t* target,
+                                       const esp_partition_t* scratch, uint32_t patchId)
+    : _source(source), _target(target), _scratch(scratch), _patchId(patchId) {
+    if (inPlace() && _scratch) {
+        loadJournal();
+    }
+}
+
+BitFlash_PatchSink::~BitFlash_PatchSink() {
+    free(_sector);
+}
+
+void BitFlash_PatchSink::setImageHash(const uint8_t hash[32]) {
+    memcpy(_imageHash, hash, sizeof(_imageHash));
+    _hasImageHash = true;
+}
+
+void BitFlash_PatchSink::setStreamStart(size_t offset) {
+    _position = offset;
+}
+
+bool BitFlash_PatchSink::complete() const {
+    return _resume.magic == kRecordMagic && (_resume.sector + 1) * kSectorSize >= _resume.newSize;
+}
+
+bool BitFlash_PatchSink::begin(size_t size) {
+    if (!_source || !_target) return false;
+    if (inPlace() && (!_scratch || _scratch->size < (kJournalSectors + 1) * kSectorSize)) return false;
+    if (_foreignJournal) return false;
+    
+    _sector = (uint8_t*)malloc(kSectorSize);
+    if (!_sector) return false;
+    
+    _fill = 0;
+    if (_resume.magic != kRecordMagic) {
+        // Records of a patch that finished without clearing them would
+        // otherwise outlive this one's
+        if (inPlace() && !clearJournal(_scratch)) {
+            return false;
+        }
+        _state = kHeader;
+        _headerFill = 0;
+        _outputOffset = 0;
+        _consumed = 0;
+        return true;
+    }
+    
+    // Pick up after the last journaled sector, finishing its write if the
+    // power went out between staging and programming it
+    if (_resume.done != 0 && !restoreStaged()) {
+        return false;
+    }
+    
+    _newSize = _resume.newSize;
+    _outputOffset = min<size_t>((_resume.sector + 1) * kSectorSize, _newSize);
+    _consumed = _resume.patchOffset;
+    _state = _outputOffset == _newSize ? kDone : (State)_resume.state;
+    _opRemaining = _resume.opRemaining;
+    _copySource = _resume.copySource;
+    _headerFill = sizeof(_header);
+    return true;
+}
+
+bool BitFlash_PatchSink::write(uint8_t* data, size_t len) {
+    // Drop what a server that ignored our Range request sends again
+    if (_position < _consumed) {
+        size_t skip = min(len, _consumed - _position);
+        _position += skip;
+        data += skip;
+        len -= skip;
+    }
+    
+    while (_state != kFailed) {
+        if (_state == kCopy) {
+            if (!runCopy()) _state = kFailed;
+            continue;
+        }
+        if (len == 0) break;
+    
+        size_t n = 0;
+        bool sectorReady = false;
+    
+        switch (_state) {
+        case kHeader:
+            n = min(len, sizeof(_header) - _headerFill);
+            memcpy(_header + _headerFill, data, n);
+            _headerFill += n;
+            break;
+    
+        case kOpHeader:
+            n = 1;
+            _op[_opFill++] = *data;
+            break;
+    
+        case kData:
+            n = min(min<size_t>(len, _opRemaining), kSectorSize - _fill);
+            n = min(n, _newSize - _outputOffset - _fill);
+            memcpy(_sector + _fill, data, n);
+            _fill += n;
+            _opRemaining -= n;
+            if (_opRemaining == 0) _state = kOpHeader;
+            sectorReady = _fill == kSectorSize || _outputOffset + _fill == _newSize;
+            break;
+    
+        default:
+            // Bytes after the image is complete
+            _state = kFailed;
+            continue;
+        }
+    
+        if (n == 0) {
+            _state = kFailed;
+            break;
+        }
+    
+        data += n;
+        len -= n;
+        _consumed += n;
+        _position += n;
+    
+        if (_state == kHeader && _headerFill == sizeof(_header) && !parseHeader()) _state = kFailed;
+        if (_state == kOpHeader && _opFill > 0 && !parseOp()) _state = kFailed;
+        if (sectorReady && !commitSector()) _state = kFailed;
+    }
+    
+    return _state != kFailed;
+}
+
+bool BitFlash_PatchSink::end() {
+    bool ok = _state == kDone && _outputOffset == _newSize;
+    if (ok && _hasImageHash) {
+        ok = imageHashMatches();
+    }
+    if (ok) {
+        ok = esp_ota_set_boot_partition(_target) == ESP_OK;
+    }
+    if (ok && inPlace()) {
+        clearJournal(_scratch);
+    }
+    
+    free(_sector);
+    _sector = nullptr;
+    return ok;
+}
+
+void BitFlash_PatchSink::abort() {
+    // The journal stays, so the next attempt resumes where this one stopped
+    free(_sector);
+    _sector = nullptr;
+}
+
+bool BitFlash_PatchSink::parseHeader() {
+    if (memcmp(_header, "BFP1", 4) != 0 || readLE32(_header + 8) != kSectorSize) {
+        return false;
+    }
+    
+    _newSize = readLE32(_header + 4);
+    if (_newSize == 0 || _newSize > _target->size) {
+        return false;
+    }
+    
+    _state = kOpHeader;
+    _opFill = 0;
+    return true;
+}
+
+// Called after each op byte; acts once the op header is complete.
+bool BitFlash_PatchSink::parseOp() {
+    uint8_t type = _op[0];
+    size_t needed = type == 0x01 ? 9 : type == 0x02 ? 5 : 0;
+    if (needed == 0) return false;
+    if (_opFill < needed) return true;
+    
+    _opFill = 0;
+    if (type == 0x01) {
+        _copySource = readLE32(_op + 1);
+        _opRemaining = readLE32(_op + 5);
+        _state = kCopy;
+    } else {
+        _opRemaining = readLE32(_op + 1);
+        _state = kData;
+    }
+    
+    if (_opRemaining == 0) {
+        _state = kOpHeader;
+    }
+    return true;
+}
+
+bool BitFlash_PatchSink::runCopy() {
+    while (_opRemaining > 0) {
+        size_t n = min(min<size_t>(_opRemaining, kSectorSize - _fill), _newSize - _outputOffset - _fill);
+        if (n == 0 || _copySource + n > _source->size) return false;
+    
+        // In place, sectors before the one being built already hold new data
+        if (inPlace() && _copySource < _outputOffset) return false;
+    
+        if (esp_partition_read(_source, _copySource, _sector + _fill, n) != ESP_OK) return false;
+    
+        _copySource += n;
+        _opRemaining -= n;
+        _fill += n;
+        if (_opRemaining == 0) _state = kOpHeader;
+    
+        if ((_fill == kSectorSize || _outputOffset + _fill == _newSize) && !commitSector()) {
+            return false;
+        }
+    }
+    
+    if (_state == kCopy) _state = kOpHeader;
+    return true;
+}
+
+bool BitFlash_PatchSink::commitSector() {
+    size_t sector = _outputOffset / kSectorSize;
+    
+    if (inPlace()) {
+        // Stage, journal, then overwrite: every step can be redone after a power cut
+        JournalRecord record = {};
+        record.sector = sector;
+        record.patchOffset = _consumed;
+        record.opRemaining = _opRemaining;
+        record.copySource = _copySource;
+        record.newSize = _newSize;
+        record.state = _state;
+        record.stagedCrc = esp_rom_crc32_le(0, _sector, _fill);
+    
+        size_t staging = stagingSector(sector) * kSectorSize;
+        if (esp_partition_erase_range(_scratch, staging, kSectorSize) != ESP_OK ||
+            esp_partition_write(_scratch, staging, _sector, _fill) != ESP_OK ||
+            !appendRecord(record)) {
+            return false;
+        }
+    
+        size_t slot = _journalSlot - 1;
+        if (!writeTarget(sector, _sector, _fill) || !markDone(slot)) {
+            return false;
+        }
+    } else if (!writeTarget(sector, _sector, _fill)) {
+        return false;
+    }
+    
+    _outputOffset += _fill;
+    _fill = 0;
+    if (_outputOffset == _newSize) {
+        _state = kDone;
+    }
+    return true;
+}
+
+bool BitFlash_PatchSink::writeTarget(size_t sector, const uint8_t* data, size_t len) {
+    size_t offset = sector * kSectorSize;
+    return esp_partition_erase_range(_target, offset, kSectorSize) == ESP_OK &&
+           esp_partition_write(_target, offset, data, len) == ESP_OK;
+}
+
+bool BitFlash_PatchSink::appendRecord(JournalRecord& record) {
+    const size_t perSector = kSectorSize / sizeof(JournalRecord);
+    size_t slot = _journalSlot % (perSector * kJournalSectors);
+    size_t offset = (slot / perSector) * kSectorSize + (slot % perSector) * sizeof(JournalRecord);
+    
+    // Entering a journal sector erases it; the latest records live in the other one
+    if (slot % perSector == 0 && esp_partition_erase_range(_scratch, offset, kSectorSize) != ESP_OK) {
+        return false;
+    }
+    
+    record.magic = kRecordMagic;
+    record.seq = ++_seq;
+    record.patchId = _patchId;
+    record.crc = recordCrc(record);
+    record.done = 0xFFFFFFFF;
+    
+    if (esp_partition_write(_scratch, offset, &record, sizeof(record)) != ESP_OK) {
+        return false;
+    }
+    _journalSlot = slot + 1;
+    return true;
+}
+
+bool BitFlash_PatchSink::markDone(size_t slot) {
+    const size_t perSector = kSectorSize / sizeof(JournalRecord);
+    size_t offset = (slot / perSector) * kSectorSize + (slot % perSector) * sizeof(JournalRecord);
+    uint32_t done = 0;
+    
+    // Programming only clears bits, so no erase is needed
+    return esp_partition_write(_scratch, offset + offsetof(JournalRecord, done), &done, sizeof(done)) == ESP_OK;
+}
+
+// The journal only ever holds one patch's records: a fresh start clears it.
+void BitFlash_PatchSink::loadJournal() {
+    JournalRecord record;
+    size_t slot;
+    if (!latestRecord(_scratch, record, slot)) {
+        return;
+    }
+    
+    if (record.patchId != _patchId) {
+        _foreignJournal = true;
+        return;
+    }
+    _resume = record;
+    _seq = record.seq;
+    _journalSlot = slot + 1;
+}
+
+bool BitFlash_PatchSink::pendingPatch(const esp_partition_t* scratch, uint32_t& patchId) {
+    JournalRecord record;
+    size_t slot;
+    if (!scratch || !latestRecord(scratch, record, slot)) {
+        return false;
+    }
+    patchId = record.patchId;
+    return true;
+}
+
+bool BitFlash_PatchSink::latestRecord(const esp_partition_t* scratch, JournalRecord& latest, size_t& latestSlot) {
+    const size_t perSector = kSectorSize / sizeof(JournalRecord);
+    bool found = false;
+    
+    for (size_t slot = 0; slot < perSector * kJournalSectors; slot++) {
+        size_t offset = (slot / perSector) * kSectorSize + (slot % perSector) * sizeof(JournalRecord);
+        JournalRecord record;
+        if (esp_partition_read(scratch, offset, &record, sizeof(record)) != ESP_OK) {
+            continue;
+        }
+    
+        if (record.magic == kRecordMagic && record.crc == recordCrc(record) && (!found || record.seq > latest.seq)) {
+            latest = record;
+            latestSlot = slot;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool BitFlash_PatchSink::restoreStaged() {
+    size_t length = min<size_t>(kSectorSize, _resume.newSize - _resume.sector * kSectorSize);
+    size_t staging = stagingSector(_resume.sector) * kSectorSize;
+    
+    if (esp_partition_read(_scratch, staging, _sector, length) != ESP_OK ||
+        esp_rom_crc32_le(0, _sector, length) != _resume.stagedCrc) {
+        return false;
+    }
+    
+    return writeTarget(_resume.sector, _sector, length) && markDone(_journalSlot - 1);
+}
+
+// Staging rotates over the scratch sectors after the journal to spread wear.
+size_t BitFlash_PatchSink::stagingSector(size_t sector) const {
+    size_t stagingSectors = _scratch->size / kSectorSize - kJournalSectors;
+    return kJournalSectors + sector % stagingSectors;
+}
+
+bool BitFlash_PatchSink::imageHashMatches() {
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    bool ok = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) == 0 &&
+              mbedtls_md_starts(&md) == 0;
+    
+    for (size_t offset = 0; ok && offset < _newSize; offset += kSectorSize) {
+        size_t n = min<size_t>(kSectorSize, _newSize - offset);
+        ok = esp_partition_read(_target, offset, _sector, n) == ESP_OK &&
+             mbedtls_md_update(&md, _sector, n) == 0;
+    }
+    
+    uint8_t digest[32];
+    ok = ok && mbedtls_md_finish(&md, digest) == 0 && memcmp(digest, _imageHash, sizeof(digest)) == 0;
+    mbedtls_md_free(&md);
+    return ok;
+}
+
+bool BitFlash_PatchSink::clearJournal(const esp_partition_t* scratch) {
+    return esp_partition_erase_range(scratch, 0, kJournalSectors * kSectorSize) == ESP_OK;
+}
+
+uint32_t BitFlash_PatchSink::recordCrc(const JournalRecord& record) {
+    return esp_rom_crc32_le(0, (const uint8_t*)&record, offsetof(JournalRecord, crc));
+}
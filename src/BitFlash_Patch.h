@@ -0,0 +1,117 @@
+#pragma once
+
+#include "BitFlash_Pipeline.h"
+#include <esp_partition.h>
+
+// Applies a BFP1 delta patch while it streams in. The patch rebuilds the new
+// image front to back from two operations:
+//
+//   header  "BFP1" | new size (u32) | sector size (u32, 4096) | reserved (u32)
+//   0x01    COPY   source offset (u32) | length (u32)   bytes of the old image
+//   0x02    DATA   length (u32) | bytes                  literal bytes
+//
+// All integers are little endian. When source and target are different
+// partitions (A/B), sectors are written directly. When they are the same
+// partition, the patch is applied in place: a COPY may only read from the
+// sector being built or later ones, and every sector is staged in a scratch
+// partition and journaled before the target sector is erased. A power cut
+// at any step then resumes from the last journal record; resumeOffset()
+// says where in the patch stream to continue.
+class BitFlash_PatchSink : public BitFlash_Stage {
+public:
+    BitFlash_PatchSink(const esp_partition_t* source, const esp_partition_t* target,
+                       const esp_partition_t* scratch, uint32_t patchId);
+    ~BitFlash_PatchSink();
+
+    // Expected SHA-256 of the rebuilt image, checked by reading it back.
+    void setImageHash(const uint8_t hash[32]);
+
+    bool inPlace() const { return _source == _target; }
+    size_t resumeOffset() const { return _resume.patchOffset; }
+    // The journal already covers the whole image; begin() and end() finish
+    // the update without any more patch data.
+    bool complete() const;
+    // The journal belongs to an interrupted patch other than this one. The
+    // target then holds parts of two images, so begin() refuses.
+    bool foreignJournal() const { return _foreignJournal; }
+    // Patch offset of the first byte the stream will deliver: resumeOffset()
+    // after a 206 response, 0 when the server sent the whole patch again.
+    void setStreamStart(size_t offset);
+
+    bool begin(size_t size) override;
+    bool write(uint8_t* data, size_t len) override;
+    bool end() override;
+    void abort() override;
+
+    // The ID of the patch an interrupted in-place update was applying.
+    static bool pendingPatch(const esp_partition_t* scratch, uint32_t& patchId);
+    // Forgets an interrupted patch once its target was rewritten some other way.
+    static bool clearJournal(const esp_partition_t* scratch);
+
+private:
+    static constexpr size_t kSectorSize = 4096;
+    static constexpr uint32_t kRecordMagic = 0x314a4642;  // "BFJ1"
+    static constexpr uint8_t kJournalSectors = 2;
+
+    enum State : uint8_t { kHeader, kOpHeader, kCopy, kData, kDone, kFailed };
+
+    // One record per committed sector, appended to alternating journal
+    // sectors. done is programmed from all ones to zero once the target
+    // sector holds the staged data.
+    struct JournalRecord {
+        uint32_t magic;
+        uint32_t seq;
+        uint32_t patchId;
+        uint32_t sector;
+        uint32_t patchOffset;
+        uint32_t opRemaining;
+        uint32_t copySource;
+        uint32_t newSize;
+        uint32_t stagedCrc;
+        uint8_t state;
+        uint8_t reserved[3];
+        uint32_t crc;
+        uint32_t done;
+    };
+
+    const esp_partition_t* _source;
+    const esp_partition_t* _target;
+    const esp_partition_t* _scratch;
+    uint32_t _patchId;
+
+    uint8_t* _sector = nullptr;
+    size_t _fill = 0;
+    size_t _outputOffset = 0;
+    uint8_t _header[16];
+    size_t _headerFill = 0;
+    uint8_t _op[9];
+    size_t _opFill = 0;
+
+    State _state = kHeader;
+    uint32_t _newSize = 0;
+    uint32_t _opRemaining = 0;
+    uint32_t _copySource = 0;
+    size_t _consumed = 0;
+    size_t _position = 0;
+
+    JournalRecord _resume = {};
+    bool _foreignJournal = false;
+    uint32_t _seq = 0;
+    size_t _journalSlot = 0;
+    bool _hasImageHash = false;
+    uint8_t _imageHash[32];
+
+    bool parseHeader();
+    bool parseOp();
+    bool runCopy();
+    bool commitSector();
+    bool writeTarget(size_t sector, const uint8_t* data, size_t len);
+    bool appendRecord(JournalRecord& record);
+    bool markDone(size_t slot);
+    void loadJournal();
+    bool restoreStaged();
+    size_t stagingSector(size_t sector) const;
+    bool imageHashMatches();
+    static bool latestRecord(const esp_partition_t* scratch, JournalRecord& latest, size_t& slot);
+    static uint32_t recordCrc(const JournalRecord& record);
+};
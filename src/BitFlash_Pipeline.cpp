@@ -0,0 +1,79 @@
+#include "BitFlash_Pipeline.h"
+
+bool BitFlash_UpdateSink::begin(size_t size) {
+    _written = 0;
+    return Update.begin(size);
+}
+
+bool BitFlash_UpdateSink::write(uint8_t* data, size_t len) {
+    size_t n = Update.write(data, len);
+    _written += n;
+    return n == len;
+}
+
+bool BitFlash_UpdateSink::end() {
+    return Update.end();
+}
+
+void BitFlash_UpdateSink::abort() {
+    Update.abort();
+}
+
+void BitFlash_Pipeline::add(BitFlash_Stage* stage) {
+    if (!stage) return;
+    _stages.emplace_back(stage);
+    link();
+}
+
+void BitFlash_Pipeline::setSink(BitFlash_Stage* sink) {
+    _customSink.reset(sink);
+    link();
+}
+
+void BitFlash_Pipeline::clear() {
+    _stages.clear();
+    _customSink.reset();
+}
+
+BitFlash_Stage* BitFlash_Pipeline::sink() {
+    return _customSink ? _customSink.get() : static_cast<BitFlash_Stage*>(&_updateSink);
+}
+
+BitFlash_Stage* BitFlash_Pipeline::head() {
+    return _stages.empty() ? sink() : _stages.front().get();
+}
+
+void BitFlash_Pipeline::link() {
+    for (size_t i = 0; i < _stages.size(); i++) {
+        _stages[i]->_next = i + 1 < _stages.size() ? _stages[i + 1].get() : sink();
+    }
+}
+
+bool BitFlash_Pipeline::begin(size_t size) {
+    return head()->begin(size);
+}
+
+uint8_t* BitFlash_Pipeline::writeBuffer(size_t& len) {
+    for (auto& stage : _stages) {
+        uint8_t* buffer = stage->writeBuffer(len);
+        if (buffer) return buffer;
+        if (!stage->passesInPlace()) return nullptr;
+    }
+    return sink()->writeBuffer(len);
+}
+
+bool BitFlash_Pipeline::write(uint8_t* data, size_t len) {
+    return head()->write(data, len);
+}
+
+bool BitFlash_Pipeline::end() {
+    if (!head()->end()) {
+        head()->abort();
+        return false;
+    }
+    return true;
+}
+
+void BitFlash_Pipeline::abort() {
+    head()->abort();
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Update.h>
+#include <memory>
+#include <vector>
+
+// One step between the socket and flash. Buffers are pushed through by
+// pointer; a stage either transforms them in place or hands them straight
+// on with emit(), so adding a stage never adds a copy. Stages must not
+// allocate inside write().
+class BitFlash_Stage {
+public:
+    virtual ~BitFlash_Stage() {}
+
+    // Called once before the first write with the size this stage will
+    // receive. Stages that change the length forward the new size instead.
+    virtual bool begin(size_t size) { return !_next || _next->begin(size); }
+    virtual bool write(uint8_t* data, size_t len) { return emit(data, len); }
+    // Flush anything held back and validate; forwards to the next stage.
+    virtual bool end() { return !_next || _next->end(); }
+    virtual void abort() { if (_next) _next->abort(); }
+
+    // True for stages that hand on exactly the bytes they were given, at the
+    // same address. Only then may the pipeline receive into the sink.
+    virtual bool passesInPlace() const { return false; }
+    // Where the next bytes can be received directly and how many fit, or
+    // nullptr. A write() of that pointer then needs no copy.
+    virtual uint8_t* writeBuffer(size_t& len) { return nullptr; }
+
+protected:
+    bool emit(uint8_t* data, size_t len) { return !_next || _next->write(data, len); }
+
+private:
+    friend class BitFlash_Pipeline;
+    BitFlash_Stage* _next = nullptr;
+};
+
+// Final stage, writes into the inactive OTA partition through Update.
+class BitFlash_UpdateSink : public BitFlash_Stage {
+public:
+    bool begin(size_t size) override;
+    bool write(uint8_t* data, size_t len) override;
+    bool end() override;
+    void abort() override;
+
+    size_t written() const { return _written; }
+
+private:
+    size_t _written = 0;
+};
+
+class BitFlash_Pipeline {
+public:
+    // Takes ownership; stages run in the order they were added, ahead of
+    // the flash sink.
+    void add(BitFlash_Stage* stage);
+    // Replaces the Update sink; takes ownership. nullptr restores Update.
+    void setSink(BitFlash_Stage* sink);
+    void clear();
+    bool empty() const { return _stages.empty(); }
+
+    bool begin(size_t size);
+    // Space to receive the next bytes into: the first buffer a stage or the
+    // sink offers with only in-place stages ahead of it. Pass the filled
+    // part to write(). nullptr when there is none.
+    uint8_t* writeBuffer(size_t& len);
+    bool write(uint8_t* data, size_t len);
+    bool end();
+    void abort();
+
+private:
+    std::vector<std::unique_ptr<BitFlash_Stage>> _stages;
+    BitFlash_UpdateSink _updateSink;
+    std::unique_ptr<BitFlash_Stage> _customSink;
+
+    BitFlash_Stage* sink();
+    BitFlash_Stage* head();
+    void link();
+};
@@ -0,0 +1,148 @@
+#include "BitFlash_Prefetch.h"
+#include <esp_ota_ops.h>
+#include <mbedtls/md.h>
+
+void BitFlash_Prefetch::begin() {
+    _prefs.begin("bitflash-pf");
+    _partition = esp_ota_get_next_update_partition(nullptr);
+    
+    // Staging belongs to the partition it was written into; after an update
+    // from elsewhere the next partition is a different one
+    if (!_partition || _prefs.getString("part") != _partition->label) {
+        _active = false;
+        return;
+    }
+    
+    _version = _prefs.getString("ver");
+    _url = _prefs.getString("url");
+    _size = _prefs.getUInt("size");
+    // Bytes past the recorded offset may have been programmed before the
+    // reboot, so their sector is erased and written again
+    _offset = _prefs.getUInt("off");
+    if (_offset < _size) _offset -= _offset % kSectorSize;
+    _activateAt = (time_t)_prefs.getULong64("at");
+    _ready = _prefs.getBool("ok");
+    _active = _version.length() > 0 && _size > 0 &&
+              _prefs.getBytes("hash", _hash, sizeof(_hash)) == sizeof(_hash);
+}
+
+bool BitFlash_Prefetch::announce(const char* version, const char* url, const uint8_t sha256[32], size_t size,
+                                 time_t activateAt) {
+    if (!_partition || size == 0 || size > _partition->size) {
+        return false;
+    }
+    
+    if (_active && _version == version && memcmp(_hash, sha256, sizeof(_hash)) == 0) {
+        // The rollout may be moved, and the image may have moved hosts
+        if (_activateAt != activateAt) _prefs.putULong64("at", activateAt);
+        if (_url != url) _prefs.putString("url", url);
+        _activateAt = activateAt;
+        _url = url;
+        return true;
+    }
+    
+    _version = version;
+    _url = url;
+    memcpy(_hash, sha256, sizeof(_hash));
+    _size = size;
+    _offset = 0;
+    _activateAt = activateAt;
+    _ready = false;
+    _active = true;
+    
+    _prefs.clear();
+    _prefs.putString("part", _partition->label);
+    _prefs.putString("ver", _version);
+    _prefs.putString("url", _url);
+    _prefs.putBytes("hash", _hash, sizeof(_hash));
+    _prefs.putUInt("size", _size);
+    _prefs.putUInt("off", 0);
+    _prefs.putULong64("at", _activateAt);
+    return true;
+}
+
+void BitFlash_Prefetch::clear() {
+    if (_active) {
+        _prefs.clear();
+    }
+    _active = false;
+    _ready = false;
+}
+
+bool BitFlash_Prefetch::due() const {
+    time_t now = time(nullptr);
+    return now > 8 * 3600 * 2 && now >= _activateAt;
+}
+
+bool BitFlash_Prefetch::write(const uint8_t* data, size_t len) {
+    if (!pending() || _offset + len > _size) {
+        return false;
+    }
+    
+    while (len > 0) {
+        // Each sector is erased when the first byte lands in it
+        if (_offset % kSectorSize == 0 &&
+            esp_partition_erase_range(_partition, _offset, kSectorSize) != ESP_OK) {
+            return false;
+        }
+        
+        size_t n = min(len, kSectorSize - _offset % kSectorSize);
+        if (esp_partition_write(_partition, _offset, data, n) != ESP_OK) {
+            // Start the sector over, erase included
+            _offset -= _offset % kSectorSize;
+            return false;
+        }
+        _offset += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool BitFlash_Prefetch::commit() {
+    if (!pending()) {
+        return false;
+    }
+    
+    // Only whole sectors count as done: the next boot would otherwise
+    // program more bytes into a sector it does not erase
+    if (_offset < _size) {
+        _prefs.putUInt("off", _offset - _offset % kSectorSize);
+        return true;
+    }
+    _prefs.putUInt("off", _offset);
+    
+    if (!imageHashMatches()) {
+        clear();
+        return false;
+    }
+    _ready = true;
+    _prefs.putBool("ok", true);
+    return true;
+}
+
+// Setting the boot partition also validates the image.
+bool BitFlash_Prefetch::activate() {
+    bool ok = ready() && esp_ota_set_boot_partition(_partition) == ESP_OK;
+    clear();
+    return ok;
+}
+
+bool BitFlash_Prefetch::imageHashMatches() {
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    bool ok = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) == 0 &&
+              mbedtls_md_starts(&md) == 0;
+    
+    uint8_t chunk[512];
+    for (size_t pos = 0; ok && pos < _size; pos += sizeof(chunk)) {
+        size_t n = min(sizeof(chunk), _size - pos);
+        ok = esp_partition_read(_partition, pos, chunk, n) == ESP_OK &&
+             mbedtls_md_update(&md, chunk, n) == 0;
+    }
+    
+    uint8_t digest[32];
+    ok = ok && mbedtls_md_finish(&md, digest) == 0 && memcmp(digest, _hash, sizeof(digest)) == 0;
+    mbedtls_md_free(&md);
+    return ok;
+}
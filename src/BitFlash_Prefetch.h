@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <esp_partition.h>
+#include <time.h>
+
+// Stages an announced release in the next OTA partition a slice at a time,
+// ahead of its activation time. Progress is kept in NVS, so the download
+// carries on across reboots. Once the whole image is written it is checked
+// against its SHA-256 by reading it back, and activate() only has to switch
+// the boot partition.
+class BitFlash_Prefetch {
+public:
+    // Restores any staging in progress from NVS.
+    void begin();
+
+    // Starts staging a release, or keeps the progress when it is the one
+    // already being staged.
+    bool announce(const char* version, const char* url, const uint8_t sha256[32], size_t size, time_t activateAt);
+    // Forgets the staged release; its partition may then be reused.
+    void clear();
+
+    bool pending() const { return _active && !_ready; }
+    bool ready() const { return _active && _ready; }
+    // True once the device clock has reached the activation time.
+    bool due() const;
+
+    const String& version() const { return _version; }
+    const String& url() const { return _url; }
+    const uint8_t* hash() const { return _hash; }
+    size_t offset() const { return _offset; }
+    size_t size() const { return _size; }
+
+    // Appends at offset(); commit() records the progress up to the last
+    // whole sector.
+    bool write(const uint8_t* data, size_t len);
+    bool commit();
+    bool activate();
+
+private:
+    static constexpr size_t kSectorSize = 4096;
+
+    Preferences _prefs;
+    const esp_partition_t* _partition = nullptr;
+    String _version;
+    String _url;
+    uint8_t _hash[32];
+    size_t _size = 0;
+    size_t _offset = 0;
+    time_t _activateAt = 0;
+    bool _active = false;
+    bool _ready = false;
+
+    bool imageHashMatches();
+};
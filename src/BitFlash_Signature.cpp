@@ -0,0 +1,37 @@
+#include "BitFlash_Signature.h"
+#include <mbedtls/base64.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#include <memory>
+
+bool BitFlash_Signature::verify(const char* publicKey, const char* body, size_t length, const String& signature) {
+    if (!publicKey || signature.length() == 0) {
+        return false;
+    }
+    
+    // Sized from the encoded length rather than a fixed buffer, so RSA
+    // signatures of any key size fit
+    size_t sigLength = 0;
+    mbedtls_base64_decode(nullptr, 0, &sigLength, (const uint8_t*)signature.c_str(), signature.length());
+    if (sigLength == 0 || sigLength > MBEDTLS_PK_SIGNATURE_MAX_SIZE) {
+        return false;
+    }
+    std::unique_ptr<uint8_t[]> sig(new uint8_t[sigLength]);
+    if (mbedtls_base64_decode(sig.get(), sigLength, &sigLength,
+                              (const uint8_t*)signature.c_str(), signature.length()) != 0) {
+        return false;
+    }
+    
+    uint8_t hash[32];
+    if (mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                   (const uint8_t*)body, length, hash) != 0) {
+        return false;
+    }
+    
+    mbedtls_pk_context pk;
+    mbedtls_pk_init(&pk);
+    bool valid = mbedtls_pk_parse_public_key(&pk, (const uint8_t*)publicKey, strlen(publicKey) + 1) == 0 &&
+                 mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, hash, sizeof(hash), sig.get(), sigLength) == 0;
+    mbedtls_pk_free(&pk);
+    return valid;
+}
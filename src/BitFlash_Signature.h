@@ -0,0 +1,12 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Manifest signatures: base64 of an ECDSA or RSA (PKCS#1 v1.5) signature
+// over the SHA-256 of the body.
+class BitFlash_Signature {
+public:
+    // publicKey is PEM. Signatures of any size mbedtls can check are
+    // accepted, up to RSA-8192.
+    static bool verify(const char* publicKey, const char* body, size_t length, const String& signature);
+};
@@ -0,0 +1,294 @@
+#include "BitFlash_Stages.h"
+
+BitFlash_DecryptStage::BitFlash_DecryptStage(const uint8_t* key, size_t keyLength, const uint8_t iv[16]) {
+    mbedtls_aes_init(&_aes);
+    memcpy(_counter, iv, sizeof(_counter));
+    memset(_streamBlock, 0, sizeof(_streamBlock));
+    if (keyLength == 16 || keyLength == 24 || keyLength == 32) {
+        _valid = mbedtls_aes_setkey_enc(&_aes, key, keyLength * 8) == 0;
+    }
+}
+
+BitFlash_DecryptStage::~BitFlash_DecryptStage() {
+    mbedtls_aes_free(&_aes);
+}
+
+bool BitFlash_DecryptStage::write(uint8_t* data, size_t len) {
+    if (mbedtls_aes_crypt_ctr(&_aes, len, &_offset, _counter, _streamBlock, data, data) != 0) {
+        return false;
+    }
+    return emit(data, len);
+}
+
+BitFlash_HashStage::BitFlash_HashStage(const uint8_t expected[32]) {
+    memcpy(_expected, expected, sizeof(_expected));
+    mbedtls_md_init(&_md);
+    mbedtls_md_setup(&_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+}
+
+BitFlash_HashStage::~BitFlash_HashStage() {
+    mbedtls_md_free(&_md);
+}
+
+bool BitFlash_HashStage::begin(size_t size) {
+    if (mbedtls_md_starts(&_md) != 0) {
+        return false;
+    }
+    return BitFlash_Stage::begin(size);
+}
+
+bool BitFlash_HashStage::write(uint8_t* data, size_t len) {
+    mbedtls_md_update(&_md, data, len);
+    return emit(data, len);
+}
+
+bool BitFlash_HashStage::end() {
+    uint8_t digest[32];
+    if (mbedtls_md_finish(&_md, digest) != 0 || memcmp(digest, _expected, sizeof(digest)) != 0) {
+        return false;
+    }
+    return BitFlash_Stage::end();
+}
+
+bool BitFlash_ChecksumStage::begin(size_t size) {
+    _value = _algorithm == kAdler32 ? 1 : 0;
+    return BitFlash_Stage::begin(size);
+}
+
+bool BitFlash_ChecksumStage::write(uint8_t* data, size_t len) {
+    if (_algorithm == kAdler32) {
+        _value = BitFlash_Checksum::adler32(_value, data, len);
+    } else {
+        _value = BitFlash_Checksum::crc32(_value, data, len);
+    }
+    return emit(data, len);
+}
+
+bool BitFlash_ChecksumStage::end() {
+    if (_value != _expected) {
+        return false;
+    }
+    return BitFlash_Stage::end();
+}
+
+bool BitFlash_ImageCheckStage::write(uint8_t* data, size_t len) {
+    if (_received < kHeaderSize) {
+        size_t n = min(len, kHeaderSize - _received);
+        memcpy(_header + _received, data, n);
+        _received += n;
+        
+        if (_received == kHeaderSize) {
+            uint16_t chipId = _header[12] | (_header[13] << 8);
+            uint16_t minRevision = _header[15] | (_header[16] << 8);
+            uint16_t maxRevision = _header[17] | (_header[18] << 8);
+            // Images from before ESP-IDF 5 only set the major revision in
+            // byte 14 and leave the full fields zero
+            if (minRevision == 0) minRevision = _header[14] * 100;
+            if (_header[0] != 0xE9 || chipId != _chipId || _chipRevision < minRevision ||
+                (maxRevision != 0 && maxRevision != 0xFFFF && _chipRevision > maxRevision)) {
+                return false;
+            }
+        }
+    }
+    return emit(data, len);
+}
+
+BitFlash_InflateStage::BitFlash_InflateStage(size_t outputSize)
+    : _inflator((tinfl_decompressor*)malloc(sizeof(tinfl_decompressor))),
+      _window((uint8_t*)malloc(TINFL_LZ_DICT_SIZE)),
+      _outputSize(outputSize) {
+}
+
+BitFlash_InflateStage::~BitFlash_InflateStage() {
+    free(_inflator);
+    free(_window);
+}
+
+void BitFlash_InflateStage::setDictionary(const uint8_t* data, size_t len) {
+    if (len > TINFL_LZ_DICT_SIZE) {
+        data += len - TINFL_LZ_DICT_SIZE;
+        len = TINFL_LZ_DICT_SIZE;
+    }
+    
+    // Output starts at the front of the circular window, so the dictionary
+    // goes at the back, right behind it
+    memcpy(_window + TINFL_LZ_DICT_SIZE - len, data, len);
+}
+
+bool BitFlash_InflateStage::begin(size_t size) {
+    tinfl_init(_inflator);
+    _windowPos = 0;
+    _produced = 0;
+    _done = false;
+    return BitFlash_Stage::begin(_outputSize);
+}
+
+bool BitFlash_InflateStage::write(uint8_t* data, size_t len) {
+    if (_done) {
+        return len == 0;
+    }
+    
+    for (;;) {
+        size_t in = len;
+        size_t out = TINFL_LZ_DICT_SIZE - _windowPos;
+        tinfl_status status = tinfl_decompress(_inflator, data, &in, _window, _window + _windowPos, &out,
+                                               TINFL_FLAG_HAS_MORE_INPUT);
+        data += in;
+        len -= in;
+        
+        if (out > 0) {
+            if (_produced + out > _outputSize || !emit(_window + _windowPos, out)) {
+                return false;
+            }
+            _produced += out;
+            _windowPos = (_windowPos + out) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+        
+        if (status == TINFL_STATUS_DONE) {
+            _done = true;
+            return len == 0;
+        }
+        if (status < 0) {
+            return false;
+        }
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            return true;
+        }
+    }
+}
+
+bool BitFlash_InflateStage::end() {
+    if (!_done || _produced != _outputSize) {
+        return false;
+    }
+    return BitFlash_Stage::end();
+}
+
+BitFlash_WorkerStage::BitFlash_WorkerStage(BaseType_t core, size_t bufferSize, uint8_t buffers)
+    : _core(core), _bufferSize(bufferSize),
+      _memory((uint8_t*)malloc(bufferSize * buffers)),
+      _free(xQueueCreate(buffers, sizeof(Block))),
+      _work(xQueueCreate(buffers + 1, sizeof(Block))),  // Room for the stop marker
+      _done(xSemaphoreCreateBinary()) {
+    for (uint8_t i = 0; valid() && i < buffers; i++) {
+        Block block = { _memory + i * bufferSize, 0 };
+        xQueueSend(_free, &block, 0);
+    }
+}
+
+BitFlash_WorkerStage::~BitFlash_WorkerStage() {
+    stopWorker(true);
+    free(_memory);
+    if (_free) vQueueDelete(_free);
+    if (_work) vQueueDelete(_work);
+    if (_done) vSemaphoreDelete(_done);
+}
+
+bool BitFlash_WorkerStage::begin(size_t size) {
+    if (!valid() || !BitFlash_Stage::begin(size)) {
+        return false;
+    }
+    
+    _failed = false;
+    _current = {};
+    // Same priority as the caller, so neither starves the other
+    if (xTaskCreatePinnedToCore(run, "bitflash", kStackSize, this, uxTaskPriorityGet(nullptr),
+                                &_task, _core) != pdPASS) {
+        _task = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool BitFlash_WorkerStage::write(uint8_t* data, size_t len) {
+    while (len > 0) {
+        if (_failed || !_task || (!_current.data && !acquire())) {
+            return false;
+        }
+    
+        size_t n = min(len, _bufferSize - _current.len);
+        // Received into writeBuffer(), already in place
+        if (data != _current.data + _current.len) {
+            memcpy(_current.data + _current.len, data, n);
+        }
+        _current.len += n;
+        data += n;
+        len -= n;
+    
+        if (_current.len == _bufferSize && !submit()) {
+            return false;
+        }
+    }
+    return !_failed;
+}
+
+bool BitFlash_WorkerStage::end() {
+    bool ok = _task && (_current.len == 0 || submit());
+    stopWorker(!ok);
+    if (!ok || _failed) {
+        return false;
+    }
+    return BitFlash_Stage::end();
+}
+
+void BitFlash_WorkerStage::abort() {
+    stopWorker(true);
+    BitFlash_Stage::abort();
+}
+
+uint8_t* BitFlash_WorkerStage::writeBuffer(size_t& len) {
+    if (_failed || !_task || (!_current.data && !acquire())) {
+        return nullptr;
+    }
+    len = _bufferSize - _current.len;
+    return _current.data + _current.len;
+}
+
+bool BitFlash_WorkerStage::acquire() {
+    if (xQueueReceive(_free, &_current, pdMS_TO_TICKS(kQueueTimeout)) != pdTRUE) {
+        _current = {};
+        return false;
+    }
+    _current.len = 0;
+    return true;
+}
+
+bool BitFlash_WorkerStage::submit() {
+    bool ok = xQueueSend(_work, &_current, pdMS_TO_TICKS(kQueueTimeout)) == pdTRUE;
+    _current = {};
+    return ok;
+}
+
+// Queues the stop marker behind pending work and waits for the task to
+// reach it. With discard, pending work is dropped instead of written.
+void BitFlash_WorkerStage::stopWorker(bool discard) {
+    if (!_task) return;
+    if (discard) _failed = true;
+    
+    if (_current.data) {
+        _current.len = 0;
+        xQueueSend(_free, &_current, 0);
+        _current = {};
+    }
+    
+    Block stop = {};
+    xQueueSend(_work, &stop, portMAX_DELAY);
+    xSemaphoreTake(_done, portMAX_DELAY);
+    _task = nullptr;
+}
+
+void BitFlash_WorkerStage::run(void* arg) {
+    BitFlash_WorkerStage* self = static_cast<BitFlash_WorkerStage*>(arg);
+    Block block;
+    
+    while (xQueueReceive(self->_work, &block, portMAX_DELAY) == pdTRUE && block.data) {
+        if (!self->_failed && !self->emit(block.data, block.len)) {
+            self->_failed = true;
+        }
+        block.len = 0;
+        xQueueSend(self->_free, &block, portMAX_DELAY);
+    }
+    
+    xSemaphoreGive(self->_done);
+    vTaskDelete(nullptr);
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "BitFlash_Pipeline.h"
+#include "BitFlash_Checksum.h"
+#include <mbedtls/aes.h>
+#include <mbedtls/md.h>
+#include <rom/miniz.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+// AES-CTR decryption of images encrypted at rest. Decrypts in place and
+// uses the hardware AES engine when mbedtls is built with it.
+class BitFlash_DecryptStage : public BitFlash_Stage {
+public:
+    BitFlash_DecryptStage(const uint8_t* key, size_t keyLength, const uint8_t iv[16]);
+    ~BitFlash_DecryptStage();
+
+    bool valid() const { return _valid; }
+
+    bool write(uint8_t* data, size_t len) override;
+    bool passesInPlace() const override { return true; }
+
+private:
+    mbedtls_aes_context _aes;
+    uint8_t _counter[16];
+    uint8_t _streamBlock[16];
+    size_t _offset = 0;
+    bool _valid = false;
+};
+
+// SHA-256 over the image as it streams past; end() fails on mismatch so
+// the sink never commits an image that does not match the manifest.
+class BitFlash_HashStage : public BitFlash_Stage {
+public:
+    BitFlash_HashStage(const uint8_t expected[32]);
+    ~BitFlash_HashStage();
+
+    bool begin(size_t size) override;
+    bool write(uint8_t* data, size_t len) override;
+    bool end() override;
+    bool passesInPlace() const override { return true; }
+
+private:
+    mbedtls_md_context_t _md;
+    uint8_t _expected[32];
+};
+
+// CRC-32 or Adler-32 over the image as it streams past, for manifests that
+// carry a cheap checksum; end() fails on mismatch like BitFlash_HashStage.
+class BitFlash_ChecksumStage : public BitFlash_Stage {
+public:
+    enum Algorithm : uint8_t { kCrc32, kAdler32 };
+
+    BitFlash_ChecksumStage(Algorithm algorithm, uint32_t expected)
+        : _algorithm(algorithm), _expected(expected) {}
+
+    bool begin(size_t size) override;
+    bool write(uint8_t* data, size_t len) override;
+    bool end() override;
+    bool passesInPlace() const override { return true; }
+
+private:
+    Algorithm _algorithm;
+    uint32_t _expected;
+    uint32_t _value = 0;
+};
+
+// Checks the ESP-IDF image header (magic, chip ID, supported chip revision
+// range) as soon as it has streamed past. Update only flushes whole sectors,
+// so a mismatch is caught before anything reaches flash.
+class BitFlash_ImageCheckStage : public BitFlash_Stage {
+public:
+    // chipRevision is major * 100 + minor, as efuse_hal_chip_revision()
+    // reports it.
+    BitFlash_ImageCheckStage(uint16_t chipId, uint16_t chipRevision)
+        : _chipId(chipId), _chipRevision(chipRevision) {}
+
+    bool write(uint8_t* data, size_t len) override;
+    bool passesInPlace() const override { return true; }
+
+private:
+    static constexpr size_t kHeaderSize = 24;
+
+    uint16_t _chipId;
+    uint16_t _chipRevision;
+    uint8_t _header[kHeaderSize];
+    size_t _received = 0;
+};
+
+// Raw deflate decompression with the ROM inflater. Output is handed on
+// straight from the 32 KB window, so later stages must not modify it. A
+// preset dictionary fills the window before the first byte, letting the
+// image refer back into data shared with earlier releases.
+class BitFlash_InflateStage : public BitFlash_Stage {
+public:
+    explicit BitFlash_InflateStage(size_t outputSize);
+    ~BitFlash_InflateStage();
+
+    bool valid() const { return _inflator && _window; }
+    // Only the last 32 KB of the dictionary can be referenced.
+    void setDictionary(const uint8_t* data, size_t len);
+
+    bool begin(size_t size) override;
+    bool write(uint8_t* data, size_t len) override;
+    bool end() override;
+
+private:
+    tinfl_decompressor* _inflator;
+    uint8_t* _window;
+    size_t _windowPos = 0;
+    size_t _outputSize;
+    size_t _produced = 0;
+    bool _done = false;
+};
+
+// Runs every later stage and the sink on a task pinned to another core, so
+// decrypting, inflating, hashing and flash writes overlap with receiving.
+// Data crosses over in a few fixed buffers. Once all of them are queued,
+// write() waits for the worker to free one, which holds back the socket.
+class BitFlash_WorkerStage : public BitFlash_Stage {
+public:
+    BitFlash_WorkerStage(BaseType_t core, size_t bufferSize = 4096, uint8_t buffers = 4);
+    ~BitFlash_WorkerStage();
+
+    bool valid() const { return _memory && _free && _work && _done; }
+
+    bool begin(size_t size) override;
+    bool write(uint8_t* data, size_t len) override;
+    bool end() override;
+    void abort() override;
+    // The buffer being filled, so the download can be received into it.
+    uint8_t* writeBuffer(size_t& len) override;
+
+private:
+    static constexpr uint32_t kStackSize = 8192;
+    static constexpr uint32_t kQueueTimeout = 30000;
+
+    struct Block {
+        uint8_t* data;
+        size_t len;
+    };
+
+    BaseType_t _core;
+    size_t _bufferSize;
+    uint8_t* _memory;
+    QueueHandle_t _free;
+    QueueHandle_t _work;
+    SemaphoreHandle_t _done;
+    TaskHandle_t _task = nullptr;
+    Block _current = {};
+    volatile bool _failed = false;
+
+    bool acquire();
+    bool submit();
+    void stopWorker(bool discard);
+    static void run(void* arg);
+};
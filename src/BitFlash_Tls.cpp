@@ -0,0 +1,263 @@
+#include "BitFlash_Tls.h"
+#include <esp_idf_version.h>
+#include <mbedtls/net_sockets.h>
+
+static const int kCiphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    0
+};
+
+#if ESP_IDF_VERSION_MAJOR < 5
+static const mbedtls_ecp_group_id kCurves[] = { MBEDTLS_ECP_DP_SECP256R1, MBEDTLS_ECP_DP_NONE };
+#else
+static const uint16_t kGroups[] = { MBEDTLS_SSL_IANA_TLS_GROUP_SECP256R1, MBEDTLS_SSL_IANA_TLS_GROUP_NONE };
+#endif
+
+static unsigned char fragmentCode(uint16_t length) {
+    switch (length) {
+    case 512: return MBEDTLS_SSL_MAX_FRAG_LEN_512;
+    case 1024: return MBEDTLS_SSL_MAX_FRAG_LEN_1024;
+    case 2048: return MBEDTLS_SSL_MAX_FRAG_LEN_2048;
+    default: return MBEDTLS_SSL_MAX_FRAG_LEN_4096;
+    }
+}
+
+BitFlash_TlsClient::BitFlash_TlsClient(bool verify, const char* caCert, uint16_t fragmentLength,
+                                       BitFlash_DnsCache* cache)
+    : _verify(verify), _caCert(caCert), _fragmentLength(fragmentLength), _cache(cache) {
+}
+
+BitFlash_TlsClient::~BitFlash_TlsClient() {
+    stop();
+}
+
+int BitFlash_TlsClient::connect(IPAddress ip, uint16_t port) {
+    if (!WiFiClient::connect(ip, port)) return 0;
+    if (!handshake(nullptr)) {
+        stop();
+        return 0;
+    }
+    return 1;
+}
+
+int BitFlash_TlsClient::connect(const char* host, uint16_t port) {
+    IPAddress address;
+    if (!resolve(host, address) || !WiFiClient::connect(address, port)) return 0;
+    if (!handshake(host)) {
+        stop();
+        return 0;
+    }
+    return 1;
+}
+
+int BitFlash_TlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout) {
+    if (!WiFiClient::connect(ip, port, timeout)) return 0;
+    if (!handshake(nullptr)) {
+        stop();
+        return 0;
+    }
+    return 1;
+}
+
+int BitFlash_TlsClient::connect(const char* host, uint16_t port, int32_t timeout) {
+    IPAddress address;
+    if (!resolve(host, address) || !WiFiClient::connect(address, port, timeout)) return 0;
+    if (!handshake(host)) {
+        stop();
+        return 0;
+    }
+    return 1;
+}
+
+size_t BitFlash_TlsClient::write(uint8_t data) {
+    return write(&data, 1);
+}
+
+size_t BitFlash_TlsClient::write(const uint8_t* buf, size_t size) {
+    if (!_established) return 0;
+    
+    size_t sent = 0;
+    unsigned long start = millis();
+    while (sent < size) {
+        int ret = mbedtls_ssl_write(&_ssl, buf + sent, size - sent);
+        if (ret > 0) {
+            sent += ret;
+            start = millis();
+            continue;
+        }
+        if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+            millis() - start > kWriteTimeout) {
+            break;
+        }
+        delay(1);
+    }
+    return sent;
+}
+
+int BitFlash_TlsClient::available() {
+    int peeked = _peeked >= 0 ? 1 : 0;
+    if (!_established) return peeked;
+    
+    size_t pending = mbedtls_ssl_get_bytes_avail(&_ssl);
+    if (pending == 0 && WiFiClient::available() > 0) {
+        // Decrypts the next record without consuming it
+        int ret = mbedtls_ssl_read(&_ssl, nullptr, 0);
+        if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            _established = false;
+            return peeked;
+        }
+        pending = mbedtls_ssl_get_bytes_avail(&_ssl);
+    }
+    return pending + peeked;
+}
+
+int BitFlash_TlsClient::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+// Like WiFiClient: 0 while nothing has arrived, -1 once the session is gone.
+int BitFlash_TlsClient::read(uint8_t* buf, size_t size) {
+    if (size == 0) return 0;
+    
+    size_t n = 0;
+    if (_peeked >= 0) {
+        buf[n++] = _peeked;
+        _peeked = -1;
+    }
+    if (n == size) return n;
+    if (!_established) return n > 0 ? (int)n : -1;
+    
+    int ret = mbedtls_ssl_read(&_ssl, buf + n, size - n);
+    if (ret > 0) return n + ret;
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        _established = false;
+        return n > 0 ? (int)n : -1;
+    }
+    return n;
+}
+
+int BitFlash_TlsClient::peek() {
+    if (_peeked < 0) {
+        uint8_t c;
+        if (read(&c, 1) == 1) _peeked = c;
+    }
+    return _peeked;
+}
+
+void BitFlash_TlsClient::flush() {
+    // Records go out as they are written; WiFiClient::flush() would discard
+    // received ciphertext instead
+}
+
+void BitFlash_TlsClient::stop() {
+    if (_established) {
+        mbedtls_ssl_close_notify(&_ssl);
+    }
+    _established = false;
+    _peeked = -1;
+    release();
+    WiFiClient::stop();
+}
+
+uint8_t BitFlash_TlsClient::connected() {
+    if (_peeked >= 0 || (_established && mbedtls_ssl_get_bytes_avail(&_ssl) > 0)) return 1;
+    return _established && WiFiClient::connected();
+}
+
+bool BitFlash_TlsClient::resolve(const char* host, IPAddress& address) {
+    if (_cache) return _cache->resolve(host, address);
+    return WiFi.hostByName(host, address);
+}
+
+bool BitFlash_TlsClient::handshake(const char* host) {
+    release();
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_config_init(&_conf);
+    mbedtls_x509_crt_init(&_ca);
+    _initialized = true;
+    
+    if (mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+        return false;
+    }
+    
+    mbedtls_ssl_conf_rng(&_conf, randomBytes, nullptr);
+    mbedtls_ssl_conf_ciphersuites(&_conf, kCiphersuites);
+#if ESP_IDF_VERSION_MAJOR < 5
+    mbedtls_ssl_conf_curves(&_conf, kCurves);
+    mbedtls_ssl_conf_max_version(&_conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+#else
+    mbedtls_ssl_conf_groups(&_conf, kGroups);
+    mbedtls_ssl_conf_max_tls_version(&_conf, MBEDTLS_SSL_VERSION_TLS1_2);
+#endif
+#ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+    mbedtls_ssl_conf_max_frag_len(&_conf, fragmentCode(_fragmentLength));
+#endif
+    
+    if (_verify) {
+        if (!_caCert ||
+            mbedtls_x509_crt_parse(&_ca, (const unsigned char*)_caCert, strlen(_caCert) + 1) != 0) {
+            return false;
+        }
+        mbedtls_ssl_conf_ca_chain(&_conf, &_ca, nullptr);
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else {
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    
+    if (mbedtls_ssl_setup(&_ssl, &_conf) != 0 || (host && mbedtls_ssl_set_hostname(&_ssl, host) != 0)) {
+        return false;
+    }
+    mbedtls_ssl_set_bio(&_ssl, this, send, receive, nullptr);
+    
+    unsigned long start = millis();
+    int ret;
+    while ((ret = mbedtls_ssl_handshake(&_ssl)) != 0) {
+        if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+            millis() - start > kHandshakeTimeout) {
+            return false;
+        }
+        delay(1);
+    }
+    
+    // Nothing renegotiates, so the chain is not needed again
+    mbedtls_ssl_conf_ca_chain(&_conf, nullptr, nullptr);
+    mbedtls_x509_crt_free(&_ca);
+    _established = true;
+    return true;
+}
+
+void BitFlash_TlsClient::release() {
+    if (!_initialized) return;
+    mbedtls_ssl_free(&_ssl);
+    mbedtls_ssl_config_free(&_conf);
+    mbedtls_x509_crt_free(&_ca);
+    _initialized = false;
+}
+
+int BitFlash_TlsClient::send(void* context, const unsigned char* buf, size_t len) {
+    BitFlash_TlsClient* self = static_cast<BitFlash_TlsClient*>(context);
+    size_t n = self->WiFiClient::write(buf, len);
+    if (n > 0) return n;
+    return self->WiFiClient::connected() ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+int BitFlash_TlsClient::receive(void* context, unsigned char* buf, size_t len) {
+    BitFlash_TlsClient* self = static_cast<BitFlash_TlsClient*>(context);
+    int n = self->WiFiClient::read(buf, len);
+    if (n > 0) return n;
+    return self->WiFiClient::connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+}
+
+int BitFlash_TlsClient::randomBytes(void* context, unsigned char* out, size_t len) {
+    while (len > 0) {
+        uint32_t r = esp_random();
+        size_t n = min(len, sizeof(r));
+        memcpy(out, &r, n);
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
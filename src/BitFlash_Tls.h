@@ -0,0 +1,61 @@
+#pragma once
+
+#include "BitFlash_DnsCache.h"
+#include <WiFiClient.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+// TLS client for tight heaps, on mbedtls directly because WiFiClientSecure
+// fixes its settings inside the core. Compared with it, this client:
+//   - asks for a maximum fragment length, so records stay small and, with
+//     CONFIG_MBEDTLS_DYNAMIC_BUFFER, so do the record buffers
+//   - offers TLS 1.2 with ECDHE over P-256 and AES-128-GCM only, which keeps
+//     the handshake short and the bulk cipher on the AES accelerator
+//   - frees the CA chain as soon as the handshake is done
+// The TCP side is the WiFiClient it derives from, so HTTPClient takes it
+// like WiFiClientSecure.
+class BitFlash_TlsClient : public WiFiClient {
+public:
+    // Without verify the certificate is not checked. fragmentLength is 512,
+    // 1024, 2048 or 4096.
+    BitFlash_TlsClient(bool verify, const char* caCert, uint16_t fragmentLength,
+                       BitFlash_DnsCache* cache = nullptr);
+    ~BitFlash_TlsClient();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char* host, uint16_t port) override;
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) override;
+    int connect(const char* host, uint16_t port, int32_t timeout) override;
+    size_t write(uint8_t data) override;
+    size_t write(const uint8_t* buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buf, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+
+private:
+    static constexpr uint32_t kHandshakeTimeout = 15000;
+    static constexpr uint32_t kWriteTimeout = 5000;
+
+    bool _verify;
+    const char* _caCert;
+    uint16_t _fragmentLength;
+    BitFlash_DnsCache* _cache;
+
+    mbedtls_ssl_context _ssl;
+    mbedtls_ssl_config _conf;
+    mbedtls_x509_crt _ca;
+    bool _initialized = false;
+    bool _established = false;
+    int _peeked = -1;
+
+    bool resolve(const char* host, IPAddress& address);
+    bool handshake(const char* host);
+    void release();
+    static int send(void* context, const unsigned char* buf, size_t len);
+    static int receive(void* context, unsigned char* buf, size_t len);
+    static int randomBytes(void* context, unsigned char* out, size_t len);
+};
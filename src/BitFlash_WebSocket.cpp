@@ -0,0 +1,223 @@
+#include "BitFlash_WebSocket.h"
+#include <mbedtls/base64.h>
+#include <mbedtls/md.h>
+
+BitFlash_WebSocket::~BitFlash_WebSocket() {
+    close();
+}
+
+bool BitFlash_WebSocket::connect(const char* url, std::unique_ptr<Client> client) {
+    close();
+    
+    bool secure = strncmp(url, "wss://", 6) == 0;
+    if (!client || (!secure && strncmp(url, "ws://", 5) != 0)) return false;
+    
+    const char* host = url + (secure ? 6 : 5);
+    const char* pathStart = strchr(host, '/');
+    String authority = pathStart ? String(host).substring(0, pathStart - host) : String(host);
+    String path = pathStart ? String(pathStart) : String("/");
+    uint16_t port = secure ? 443 : 80;
+    
+    String hostName = authority;
+    int colon = authority.indexOf(':');
+    if (colon >= 0) {
+        port = authority.substring(colon + 1).toInt();
+        hostName = authority.substring(0, colon);
+    }
+    
+    _buffer = (uint8_t*)malloc(kMaxMessage);
+    _client = std::move(client);
+    if (!_buffer || !_client->connect(hostName.c_str(), port) || !handshake(authority, path)) {
+        close();
+        return false;
+    }
+    
+    _fill = 0;
+    _lastReceived = _lastSent = millis();
+    return true;
+}
+
+bool BitFlash_WebSocket::handshake(const String& host, const String& path) {
+    uint8_t nonce[16];
+    for (size_t i = 0; i < sizeof(nonce); i += 4) {
+        uint32_t r = esp_random();
+        memcpy(nonce + i, &r, 4);
+    }
+    
+    unsigned char key[32];
+    size_t keyLength = 0;
+    mbedtls_base64_encode(key, sizeof(key), &keyLength, nonce, sizeof(nonce));
+    String keyText = String((const char*)key).substring(0, keyLength);
+    
+    String request = "GET " + path + " HTTP/1.1\r\nHost: " + host +
+                     "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: " + keyText +
+                     "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    _client->write((const uint8_t*)request.c_str(), request.length());
+    _bytesSent += request.length();
+    
+    // The server proves it speaks WebSocket by hashing our key
+    String accept = keyText + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t digest[20];
+    unsigned char expected[32];
+    size_t expectedLength = 0;
+    if (mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), (const uint8_t*)accept.c_str(), accept.length(), digest) != 0 ||
+        mbedtls_base64_encode(expected, sizeof(expected), &expectedLength, digest, sizeof(digest)) != 0) {
+        return false;
+    }
+    String expectedText = String((const char*)expected).substring(0, expectedLength);
+    
+    _client->setTimeout(kHandshakeTimeout);
+    String status = _client->readStringUntil('\n');
+    bool upgraded = status.startsWith("HTTP/1.1 101");
+    bool accepted = false;
+    
+    for (;;) {
+        String line = _client->readStringUntil('\n');
+        _bytesReceived += line.length() + 1;
+        line.trim();
+        if (line.length() == 0) break;
+        
+        int colon = line.indexOf(':');
+        if (colon > 0 && line.substring(0, colon).equalsIgnoreCase("Sec-WebSocket-Accept")) {
+            String value = line.substring(colon + 1);
+            value.trim();
+            accepted = value == expectedText;
+        }
+    }
+    
+    _client->setTimeout(1000);
+    return upgraded && accepted;
+}
+
+bool BitFlash_WebSocket::connected() {
+    if (!_client || !_client->connected()) return false;
+    
+    // Probe a quiet line; a dead one shows up as no traffic at all
+    if (millis() - _lastReceived >= kIdleTimeout) {
+        close();
+        return false;
+    }
+    if (millis() - _lastSent >= kPingInterval) {
+        sendFrame(kPing, nullptr, 0);
+    }
+    return true;
+}
+
+void BitFlash_WebSocket::close() {
+    if (_client) {
+        if (_client->connected()) {
+            sendFrame(kClose, nullptr, 0);
+        }
+        _client->stop();
+        _client.reset();
+    }
+    free(_buffer);
+    _buffer = nullptr;
+}
+
+bool BitFlash_WebSocket::sendText(const String& text) {
+    return sendFrame(kText, (const uint8_t*)text.c_str(), text.length());
+}
+
+// Client frames are always masked.
+bool BitFlash_WebSocket::sendFrame(uint8_t opcode, const uint8_t* data, size_t length) {
+    if (!_client) return false;
+    
+    uint8_t header[14];
+    size_t n = 0;
+    header[n++] = 0x80 | opcode;
+    if (length < 126) {
+        header[n++] = 0x80 | length;
+    } else if (length < 65536) {
+        header[n++] = 0x80 | 126;
+        header[n++] = length >> 8;
+        header[n++] = length & 0xff;
+    } else {
+        return false;
+    }
+    
+    uint32_t maskValue = esp_random();
+    uint8_t* mask = header + n;
+    memcpy(mask, &maskValue, 4);
+    n += 4;
+    
+    if (_client->write(header, n) != n) return false;
+    
+    uint8_t chunk[128];
+    for (size_t pos = 0; pos < length; pos += sizeof(chunk)) {
+        size_t len = min(sizeof(chunk), length - pos);
+        for (size_t i = 0; i < len; i++) {
+            chunk[i] = data[pos + i] ^ mask[(pos + i) & 3];
+        }
+        if (_client->write(chunk, len) != len) return false;
+    }
+    
+    _bytesSent += n + length;
+    _lastSent = millis();
+    return true;
+}
+
+bool BitFlash_WebSocket::readExactly(uint8_t* data, size_t length) {
+    size_t n = _client->readBytes(data, length);
+    _bytesReceived += n;
+    return n == length;
+}
+
+bool BitFlash_WebSocket::receive(uint8_t*& data, size_t& length, Opcode& opcode, uint32_t timeout) {
+    unsigned long start = millis();
+    
+    while (_client && _client->connected()) {
+        if (_client->available() < 2) {
+            if (millis() - start >= timeout) return false;
+            delay(1);
+            continue;
+        }
+        
+        uint8_t header[2];
+        if (!readExactly(header, 2)) break;
+        bool final = header[0] & 0x80;
+        uint8_t frameOpcode = header[0] & 0x0f;
+        uint64_t frameLength = header[1] & 0x7f;
+        
+        uint8_t extended[8];
+        if (frameLength == 126) {
+            if (!readExactly(extended, 2)) break;
+            frameLength = (extended[0] << 8) | extended[1];
+        } else if (frameLength == 127) {
+            if (!readExactly(extended, 8)) break;
+            frameLength = 0;
+            for (int i = 0; i < 8; i++) frameLength = (frameLength << 8) | extended[i];
+        }
+        
+        // Servers do not mask; a masked frame or one we cannot hold ends the session
+        bool control = frameOpcode & 0x08;
+        if ((header[1] & 0x80) || (control ? frameLength > 125 : _fill + frameLength > kMaxMessage)) break;
+        
+        _lastReceived = millis();
+        if (control) {
+            uint8_t payload[125];
+            if (!readExactly(payload, frameLength)) break;
+            if (frameOpcode == kPing) sendFrame(kPong, payload, frameLength);
+            if (frameOpcode == kClose) break;
+            continue;
+        }
+        
+        if (frameOpcode != 0) {
+            _fill = 0;
+            _messageOpcode = frameOpcode;
+        }
+        if (!readExactly(_buffer + _fill, frameLength)) break;
+        _fill += frameLength;
+        
+        if (final) {
+            data = _buffer;
+            length = _fill;
+            opcode = (Opcode)_messageOpcode;
+            _fill = 0;
+            return true;
+        }
+    }
+    
+    close();
+    return false;
+}
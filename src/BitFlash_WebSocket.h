@@ -0,0 +1,48 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Client.h>
+#include <memory>
+
+// Minimal WebSocket client (RFC 6455) over a Client the caller supplies,
+// plain or TLS. Text and binary messages up to kMaxMessage bytes, with
+// fragments reassembled; pings are answered, and a ping is sent when the
+// line has been quiet for a while so dead connections are noticed.
+class BitFlash_WebSocket {
+public:
+    enum Opcode : uint8_t { kText = 0x1, kBinary = 0x2, kClose = 0x8, kPing = 0x9, kPong = 0xA };
+
+    ~BitFlash_WebSocket();
+
+    // Takes ownership of client. url is ws://host[:port]/path or wss://...
+    bool connect(const char* url, std::unique_ptr<Client> client);
+    bool connected();
+    void close();
+
+    bool sendText(const String& text);
+    // Waits up to timeout ms for a text or binary message; data stays valid
+    // until the next call.
+    bool receive(uint8_t*& data, size_t& length, Opcode& opcode, uint32_t timeout);
+
+    uint32_t bytesSent() const { return _bytesSent; }
+    uint32_t bytesReceived() const { return _bytesReceived; }
+
+private:
+    static constexpr size_t kMaxMessage = 8192;
+    static constexpr uint32_t kPingInterval = 30000;
+    static constexpr uint32_t kIdleTimeout = 75000;
+    static constexpr uint32_t kHandshakeTimeout = 10000;
+
+    std::unique_ptr<Client> _client;
+    uint8_t* _buffer = nullptr;
+    size_t _fill = 0;
+    uint8_t _messageOpcode = 0;
+    unsigned long _lastReceived = 0;
+    unsigned long _lastSent = 0;
+    uint32_t _bytesSent = 0;
+    uint32_t _bytesReceived = 0;
+
+    bool handshake(const String& host, const String& path);
+    bool sendFrame(uint8_t opcode, const uint8_t* data, size_t length);
+    bool readExactly(uint8_t* data, size_t length);
+};
@@ -0,0 +1,108 @@
+// Cost of a version check over HTTPS against plain HTTP with a signed
+// manifest: bytes on the air and the client's CPU time. The HTTPS side runs
+// a TLS session in memory with the client's request headers and counts the
+// time spent in the client's TLS calls, handshake included. The signed side
+// counts the request and the response with its X-Signature header, and times
+// BitFlash_Signature::verify on the mbedtls fake. Times are host times; a
+// device is slower, but by the same factor on both sides.
+//   bench_check [repeats]
+
+#include "BitFlash_Signature.h"
+#include "tls_link.h"
+#include "wire_cost.h"
+#include <openssl/pem.h>
+#include <stdio.h>
+
+namespace {
+
+const char kManifest[] =
+    "{\"version\":\"1.0.1\",\"firmware_url\":\"http://ota.example.com/fw/app.bin\",\"size\":1048576,"
+    "\"sha256\":\"5e884898da28047151d0e56f8dc6292773603d0d6aabbdd62a11ef721d1542d8\"}";
+
+struct Cost {
+    size_t onAir = 0;
+    double seconds = 0;  // Client CPU, best of the repeats
+};
+
+// One check on a fresh connection, as the client makes them.
+bool httpsCheck(const char* cipher, int repeats, Cost& cost) {
+    std::string response = httpResponse("application/json", kManifest);
+    cost.seconds = 1e9;
+    for (int i = 0; i < repeats; i++) {
+        TlsLink link(cipher);
+        if (!link.handshake() || link.exchange(httpRequest("/manifest.json"), response) != response) return false;
+        link.close();
+        cost.onAir = link.clientBytes + link.serverBytes + tcpOverhead(link.clientBytes, link.serverBytes);
+        cost.seconds = std::min(cost.seconds, link.clientSeconds);
+    }
+    return true;
+}
+
+std::string base64(const unsigned char* data, size_t len) {
+    std::string out(4 * ((len + 2) / 3) + 1, '\0');
+    out.resize(EVP_EncodeBlock((unsigned char*)&out[0], data, len));
+    return out;
+}
+
+// A plain HTTP check whose manifest the server signed with key.
+bool signedCheck(EVP_PKEY* key, int repeats, Cost& cost) {
+    unsigned char sig[1024];
+    size_t sigLength = sizeof(sig);
+    EVP_MD_CTX* md = EVP_MD_CTX_new();
+    bool ok = EVP_DigestSignInit(md, nullptr, EVP_sha256(), nullptr, key) == 1 &&
+              EVP_DigestSign(md, sig, &sigLength, (const unsigned char*)kManifest, sizeof(kManifest) - 1) == 1;
+    EVP_MD_CTX_free(md);
+    if (!ok) return false;
+    std::string signature = base64(sig, sigLength);
+
+    BIO* pem = BIO_new(BIO_s_mem());
+    PEM_write_bio_PUBKEY(pem, key);
+    char* text;
+    long length = BIO_get_mem_data(pem, &text);
+    std::string publicKey(text, length);
+    BIO_free(pem);
+
+    size_t sent = httpRequest("/manifest.json").size();
+    size_t received = httpResponse("application/json", kManifest, "X-Signature: " + signature + "\r\n").size();
+    cost.onAir = sent + received + tcpOverhead(sent, received);
+    cost.seconds = 1e9;
+    for (int i = 0; i < repeats; i++) {
+        auto start = std::chrono::steady_clock::now();
+        ok = BitFlash_Signature::verify(publicKey.c_str(), kManifest, sizeof(kManifest) - 1,
+                                        String(signature.c_str()));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!ok) return false;
+        cost.seconds = std::min(cost.seconds, seconds);
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int repeats = argc > 1 ? atoi(argv[1]) : 20;
+    EVP_PKEY* ecKey = EVP_EC_gen("P-256");
+    EVP_PKEY* rsaKey = EVP_RSA_gen(2048);
+
+    Cost httpsEc, httpsRsa, signedEc, signedRsa;
+    bool ok = httpsCheck("ECDHE-ECDSA-AES128-GCM-SHA256", repeats, httpsEc) &&
+              httpsCheck("ECDHE-RSA-AES128-GCM-SHA256", repeats, httpsRsa) &&
+              signedCheck(ecKey, repeats, signedEc) && signedCheck(rsaKey, repeats, signedRsa);
+    EVP_PKEY_free(ecKey);
+    EVP_PKEY_free(rsaKey);
+    if (!ok) {
+        fprintf(stderr, "check failed\n");
+        return 1;
+    }
+
+    printf("Version check, HTTPS (TLS 1.2, AES-128-GCM) against signed plain HTTP\n");
+    printf("%-28s %10s %14s %10s\n", "", "on air", "a day, hourly", "client us");
+    auto row = [](const char* name, const Cost& cost) {
+        printf("%-28s %10zu %14zu %10.0f\n", name, cost.onAir, 24 * cost.onAir, cost.seconds * 1e6);
+    };
+    row("HTTPS, ECDSA P-256 chain", httpsEc);
+    row("HTTPS, RSA-2048 chain", httpsRsa);
+    row("HTTP, ECDSA P-256 signature", signedEc);
+    row("HTTP, RSA-2048 signature", signedRsa);
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Throughput of the CRC-32 and Adler-32 kernels against a byte-at-a-time
+// reference and zlib. Every result is compared with the reference first.
+//   bench_checksum [MB]
+
+#include "BitFlash_Checksum.h"
+#include <zlib.h>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <stdio.h>
+
+namespace {
+
+uint32_t referenceCrc(uint32_t crc, const uint8_t* data, size_t len) {
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = (crc >> 8) ^ table[(crc ^ data[i]) & 0xff];
+    return ~crc;
+}
+
+uint32_t referenceAdler(uint32_t adler, const uint8_t* data, size_t len) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    for (size_t i = 0; i < len; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+typedef std::function<uint32_t(uint32_t, const uint8_t*, size_t)> Kernel;
+
+// Best GB/s over a few runs; the result goes to value.
+double rate(const Kernel& kernel, uint32_t start, const std::vector<uint8_t>& data, size_t offset,
+            uint32_t& value) {
+    double best = 0;
+    for (int repeat = 0; repeat < 5; repeat++) {
+        auto begin = std::chrono::steady_clock::now();
+        value = kernel(start, data.data() + offset, data.size() - offset);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        best = std::max(best, (data.size() - offset) / std::max(seconds, 1e-9) / 1e9);
+    }
+    return best;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    // An odd length, so the tails run too
+    std::vector<uint8_t> data((megabytes << 20) + 13);
+    std::mt19937 generator(1);
+    for (uint8_t& b : data) b = generator();
+
+    struct Row {
+        const char* name;
+        Kernel kernel;
+        Kernel reference;
+        uint32_t start;
+    } rows[] = {
+        { "crc32", BitFlash_Checksum::crc32, referenceCrc, 0 },
+        { "crc32 zlib", [](uint32_t c, const uint8_t* p, size_t n) { return (uint32_t)::crc32(c, p, n); },
+          referenceCrc, 0 },
+        { "crc32 bytes", referenceCrc, referenceCrc, 0 },
+        { "adler32", BitFlash_Checksum::adler32, referenceAdler, 1 },
+        { "adler32 zlib", [](uint32_t a, const uint8_t* p, size_t n) { return (uint32_t)::adler32(a, p, n); },
+          referenceAdler, 1 },
+        { "adler32 bytes", referenceAdler, referenceAdler, 1 },
+    };
+
+    printf("%zu MB, GB/s (aligned / unaligned start)\n", megabytes);
+    int failures = 0;
+    for (const Row& row : rows) {
+        double rates[2];
+        for (size_t offset : { 0, 1 }) {
+            uint32_t value;
+            rates[offset] = rate(row.kernel, row.start, data, offset, value);
+            uint32_t expected = row.reference(row.start, data.data() + offset, data.size() - offset);
+            if (value != expected) {
+                fprintf(stderr, "%s: %08x, expected %08x\n", row.name, value, expected);
+                failures++;
+            }
+        }
+        printf("%-14s %8.2f %8.2f\n", row.name, rates[0], rates[1]);
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+// Bytes on the wire for a version check and an image download, over CoAP
+// from the test server and over HTTPS as the client sends it. The CoAP side
+// runs BitFlash_Coap against CoapServer; the HTTPS side runs a TLS session
+// in memory with the client's request headers. Payload is what UDP or TCP
+// carry; "on air" adds IPv4 and UDP or TCP headers, the TCP handshakes and
+// an ACK for every second segment.
+//   bench_coap [KB]
+
+#include "BitFlash_Coap.h"
+#include "coap_server.h"
+#include "tls_link.h"
+#include "wire_cost.h"
+#include <stdio.h>
+
+namespace {
+
+const char kManifest[] =
+    "{\"version\":\"1.0.1\",\"firmware_url\":\"%s://ota.example.com/fw/app.bin\",\"size\":%zu,"
+    "\"sha256\":\"5e884898da28047151d0e56f8dc6292773603d0d6aabbdd62a11ef721d1542d8\"}";
+
+std::string format(const char* pattern, const char* text, size_t number) {
+    char buff[1024];
+    snprintf(buff, sizeof(buff), pattern, text, number);
+    return buff;
+}
+
+struct Cost {
+    size_t payload = 0;
+    size_t onAir = 0;
+
+    Cost& operator+=(const Cost& other) {
+        payload += other.payload;
+        onAir += other.onAir;
+        return *this;
+    }
+};
+
+// One GET over CoAP: each request and each response is a datagram.
+bool coapGet(CoapServer& server, const char* url, uint16_t blockSize, const std::vector<uint8_t>& expected,
+             Cost& cost) {
+    BitFlash_Coap coap;
+    coap.setBlockSize(blockSize);
+    std::vector<uint8_t> got;
+    server.requests.clear();
+    bool ok = coap.get(url, [&got](uint8_t* data, size_t len, size_t) {
+        got.insert(got.end(), data, data + len);
+        return true;
+    });
+    cost.payload = coap.bytesSent() + coap.bytesReceived();
+    cost.onAir = cost.payload + 2 * server.requests.size() * kUdpHeaders;
+    return ok && got == expected;
+}
+
+// One GET over HTTPS on a fresh connection, as the client makes them.
+bool httpsGet(const char* path, const char* type, const std::vector<uint8_t>& body, Cost& cost) {
+    TlsLink link;
+    if (!link.handshake()) return false;
+    std::string response = httpResponse(type, std::string(body.begin(), body.end()));
+    bool ok = link.exchange(httpRequest(path), response) == response;
+    link.close();
+    cost.payload = link.clientBytes + link.serverBytes;
+    cost.onAir = cost.payload + tcpOverhead(link.clientBytes, link.serverBytes);
+    return ok;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t kilobytes = argc > 1 ? atoi(argv[1]) : 1024;
+    std::vector<uint8_t> image(kilobytes << 10);
+    for (size_t i = 0; i < image.size(); i++) image[i] = i * 31 + (i >> 8);
+    std::string coapManifest = format(kManifest, "coap", image.size());
+    std::string httpsManifest = format(kManifest, "https", image.size());
+
+    WiFi.hosts["ota.example.com"] = IPAddress(10, 0, 0, 5);
+    CoapServer server;
+    server.resources["manifest.json"].assign(coapManifest.begin(), coapManifest.end());
+    server.resources["fw/app.bin"] = image;
+
+    Cost coapCheck, coapImage, coapLargeBlocks, httpsCheck, httpsImage;
+    bool ok = coapGet(server, "coap://ota.example.com/manifest.json", 512, server.resources["manifest.json"],
+                      coapCheck) &&
+              coapGet(server, "coap://ota.example.com/fw/app.bin", 512, image, coapImage) &&
+              coapGet(server, "coap://ota.example.com/fw/app.bin", 1024, image, coapLargeBlocks) &&
+              httpsGet("/manifest.json", "application/json",
+                       std::vector<uint8_t>(httpsManifest.begin(), httpsManifest.end()), httpsCheck) &&
+              httpsGet("/fw/app.bin", "application/octet-stream", image, httpsImage);
+    if (!ok) {
+        fprintf(stderr, "transfer failed\n");
+        return 1;
+    }
+
+    Cost coapDay, httpsDay;
+    for (int hour = 0; hour < 24; hour++) {
+        coapDay += coapCheck;
+        httpsDay += httpsCheck;
+    }
+
+    printf("Bytes, CoAP against HTTPS (TLS 1.2, ECDSA, AES-128-GCM)\n");
+    printf("%-22s %10s %10s %10s %10s %11s\n", "", "CoAP", "on air", "HTTPS", "on air", "HTTPS/CoAP");
+    auto row = [](const char* name, const Cost& coap, const Cost& https) {
+        printf("%-22s %10zu %10zu %10zu %10zu %10.2fx\n", name, coap.payload, coap.onAir, https.payload,
+               https.onAir, (double)https.onAir / coap.onAir);
+    };
+    row("check", coapCheck, httpsCheck);
+    row("checks, hourly, a day", coapDay, httpsDay);
+    char name[32];
+    snprintf(name, sizeof(name), "%zu KB image", kilobytes);
+    row(name, coapImage, httpsImage);
+    row("  in 1024-byte blocks", coapLargeBlocks, httpsImage);
+    return 0;
+}
@@ -0,0 +1,214 @@
+// Download throughput with and without BitFlash_WorkerStage, on threads
+// standing in for the two cores. The receiving side decrypts a TLS-like
+// outer layer; the stages after it decrypt, optionally inflate, and hash
+// the image. The split helps as far as the two sides balance: inflating
+// on one side only leaves little to overlap.
+// A second table compares keeping the image secret with AES-CTR, sent over
+// plain HTTP, against sending it in the clear over TLS: MB/s of the
+// client's decryption and hashing, on one thread. DecryptStage runs on the
+// mbedtls fake, which calls OpenSSL once per block and so is slow here;
+// bulk CTR is OpenSSL's, the same AES code as the TLS session, and is the
+// fair comparison.
+// The last table is the client's time per MB to receive a plain image over
+// TLS into BitFlash_PartitionSink, hashing it on the way, with zeroCopy off
+// (through a 1 KB buffer, copied into the sector buffer) and on (read
+// straight into the sector buffer). Both include the fake flash writes.
+//   bench_pipeline [MB]
+
+#include "BitFlash_Partition.h"
+#include "BitFlash_Stages.h"
+#include "test_data.h"
+#include "tls_link.h"
+#include <openssl/evp.h>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+
+namespace {
+
+// AES-128-CTR; the same call encrypts and decrypts.
+struct Ctr {
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+    Ctr(const uint8_t key[16], const uint8_t iv[16]) { EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), nullptr, key, iv); }
+    ~Ctr() { EVP_CIPHER_CTX_free(ctx); }
+    void apply(uint8_t* data, size_t len) {
+        int n = 0;
+        EVP_EncryptUpdate(ctx, data, &n, data, len);
+    }
+};
+
+const uint8_t kImageKey[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+const uint8_t kLinkKey[16] = { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+const uint8_t kIv[16] = {};
+
+// Returns MB/s of image, or 0 when the image did not come out right.
+double run(const std::vector<uint8_t>& wire, const std::vector<uint8_t>& image, const uint8_t digest[32],
+           bool compressed, bool worker) {
+    Update.reset();
+    BitFlash_Pipeline pipeline;
+    if (worker) pipeline.add(new BitFlash_WorkerStage(0));
+    pipeline.add(new BitFlash_DecryptStage(kImageKey, sizeof(kImageKey), kIv));
+    if (compressed) pipeline.add(new BitFlash_InflateStage(image.size()));
+    pipeline.add(new BitFlash_HashStage(digest));
+
+    // The same AES code as the stage, standing in for TLS record decryption
+    BitFlash_DecryptStage link(kLinkKey, sizeof(kLinkKey), kIv);
+    uint8_t buff[1460];
+    auto start = std::chrono::steady_clock::now();
+    bool ok = pipeline.begin(wire.size());
+    for (size_t pos = 0; ok && pos < wire.size(); ) {
+        // One TCP segment at a time, received into the worker's buffer
+        // where there is one
+        size_t room = sizeof(buff);
+        uint8_t* target = pipeline.writeBuffer(room);
+        if (!target) {
+            target = buff;
+            room = sizeof(buff);
+        }
+        size_t n = std::min(std::min(room, sizeof(buff)), wire.size() - pos);
+        memcpy(target, wire.data() + pos, n);
+        link.write(target, n);
+        ok = pipeline.write(target, n);
+        pos += n;
+    }
+    ok = ok && pipeline.end();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return ok && Update.image == image ? image.size() / seconds / 1e6 : 0;
+}
+
+// Plain HTTP: the image arrives AES-CTR encrypted, one TCP segment at a time.
+double imagePath(const std::vector<uint8_t>& encrypted, const uint8_t digest[32], bool bulk) {
+    BitFlash_Pipeline pipeline;
+    if (!bulk) pipeline.add(new BitFlash_DecryptStage(kImageKey, sizeof(kImageKey), kIv));
+    pipeline.add(new BitFlash_HashStage(digest));
+    Ctr ctr(kImageKey, kIv);
+    uint8_t buff[1460];
+    auto start = std::chrono::steady_clock::now();
+    bool ok = pipeline.begin(encrypted.size());
+    for (size_t pos = 0; ok && pos < encrypted.size(); pos += sizeof(buff)) {
+        size_t n = std::min(sizeof(buff), encrypted.size() - pos);
+        memcpy(buff, encrypted.data() + pos, n);
+        if (bulk) ctr.apply(buff, n);
+        ok = pipeline.write(buff, n);
+    }
+    ok = ok && pipeline.end();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return ok ? encrypted.size() / seconds / 1e6 : 0;
+}
+
+// HTTPS: the image in the clear over TLS 1.2 with AES-128-GCM, decrypted
+// in the client's reads.
+double tlsPath(const std::vector<uint8_t>& image, const uint8_t digest[32]) {
+    TlsLink link;
+    if (!link.handshake()) return 0;
+    link.clientSeconds = 0;
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_HashStage(digest));
+    bool ok = pipeline.begin(image.size());
+    ok = ok && link.stream(image, 1460, [&](uint8_t* data, size_t len) { ok = ok && pipeline.write(data, len); });
+    ok = ok && pipeline.end();
+    return ok ? image.size() / link.clientSeconds / 1e6 : 0;
+}
+
+// Client time for the whole image, in ms per MB, or 0 when it did not come
+// out right.
+double receiveCost(const std::vector<uint8_t>& image, const uint8_t digest[32], bool zeroCopy) {
+    TlsLink link;
+    if (!link.handshake()) return 0;
+    link.clientSeconds = 0;
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_HashStage(digest));
+    pipeline.setSink(new BitFlash_PartitionSink(nullptr, false));
+    uint8_t buff[1024];
+    auto target = [&](size_t& room) {
+        uint8_t* into = zeroCopy ? pipeline.writeBuffer(room) : nullptr;
+        if (!into) {
+            room = sizeof(buff);
+            into = buff;
+        }
+        return into;
+    };
+    auto start = std::chrono::steady_clock::now();
+    bool ok = pipeline.begin(image.size());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ok = ok && link.streamInto(image, target, [&](uint8_t* data, size_t len) { ok = ok && pipeline.write(data, len); });
+    start = std::chrono::steady_clock::now();
+    ok = ok && pipeline.end();
+    seconds += link.clientSeconds + std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return ok ? seconds * 1e3 / (image.size() / 1048576.0) : 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t megabytes = argc > 1 ? atoi(argv[1]) : 16;
+    std::vector<uint8_t> image = codeLike(megabytes << 20, 1);
+    uint8_t digest[32];
+    EVP_Digest(image.data(), image.size(), digest, nullptr, EVP_sha256(), nullptr);
+
+    // Two threads can only beat one with two cores to run on
+    printf("%zu MB image, MB/s of image flashed, %u hardware threads\n", megabytes,
+           std::thread::hardware_concurrency());
+    printf("%-12s %10s %10s %8s\n", "image", "1 thread", "2 threads", "scaling");
+    for (bool compressed : { false, true }) {
+        // At rest: maybe deflated, then encrypted; on the wire: encrypted once more
+        std::vector<uint8_t> wire = compressed ? deflateRaw(image, {}, 6) : image;
+        Ctr(kImageKey, kIv).apply(wire.data(), wire.size());
+        Ctr(kLinkKey, kIv).apply(wire.data(), wire.size());
+
+        double best[2] = {};
+        for (int repeat = 0; repeat < 3; repeat++) {
+            for (int worker = 0; worker < 2; worker++) {
+                double rate = run(wire, image, digest, compressed, worker);
+                if (rate == 0) {
+                    fprintf(stderr, "image mismatch (%s)\n", worker ? "worker" : "one thread");
+                    return 1;
+                }
+                best[worker] = std::max(best[worker], rate);
+            }
+        }
+        printf("%-12s %10.1f %10.1f %7.2fx\n", compressed ? "deflated" : "full", best[0], best[1],
+               best[1] / best[0]);
+    }
+
+    std::vector<uint8_t> encrypted = image;
+    Ctr(kImageKey, kIv).apply(encrypted.data(), encrypted.size());
+    double best[3] = {};
+    for (int repeat = 0; repeat < 3; repeat++) {
+        best[0] = std::max(best[0], imagePath(encrypted, digest, false));
+        best[1] = std::max(best[1], imagePath(encrypted, digest, true));
+        best[2] = std::max(best[2], tlsPath(image, digest));
+    }
+    if (best[0] == 0 || best[1] == 0 || best[2] == 0) {
+        fprintf(stderr, "image mismatch (link)\n");
+        return 1;
+    }
+    printf("\n%-36s %10s\n", "decrypted and hashed", "MB/s");
+    printf("%-36s %10.1f\n", "AES-CTR image, HTTP, DecryptStage", best[0]);
+    printf("%-36s %10.1f\n", "AES-CTR image, HTTP, bulk CTR", best[1]);
+    printf("%-36s %10.1f\n", "plain image, HTTPS (AES-128-GCM)", best[2]);
+
+    // An app image, as far as the boot partition check looks
+    std::vector<uint8_t> app = image;
+    app[0] = 0xE9;
+    EVP_Digest(app.data(), app.size(), digest, nullptr, EVP_sha256(), nullptr);
+    size_t slot = (app.size() + 4095) / 4096 * 4096;
+    fake::resetFlash();
+    fake::addPartition("app0", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, slot);
+    fake::addPartition("app1", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, slot);
+    double cost[2] = { 1e9, 1e9 };
+    for (int repeat = 0; repeat < 7; repeat++) {
+        for (int zeroCopy = 0; zeroCopy < 2; zeroCopy++) {
+            double ms = receiveCost(app, digest, zeroCopy);
+            if (ms == 0) {
+                fprintf(stderr, "image mismatch (zero copy %s)\n", zeroCopy ? "on" : "off");
+                return 1;
+            }
+            cost[zeroCopy] = std::min(cost[zeroCopy], ms);
+        }
+    }
+    printf("\n%-36s %10s %10s %10s\n", "received over TLS, ms per MB", "off", "on", "saved");
+    printf("%-36s %10.2f %10.2f %9.1f%%\n", "zeroCopy", cost[0], cost[1], 100 * (1 - cost[1] / cost[0]));
+    return 0;
+}
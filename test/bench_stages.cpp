@@ -0,0 +1,120 @@
+// What each pipeline stage costs on its own: the image is received one TCP
+// segment at a time into a pipeline holding just that stage, ahead of a
+// sink that discards it, and the time is compared with no stage at all.
+// Eight stages that only hand data on give the cost of the pipeline itself.
+// The stages run on the fakes: AES on the mbedtls fake goes to OpenSSL a
+// block at a time, and inflation on miniz, so those rows say more about
+// the fakes than about the ESP32's hardware AES or ROM inflater.
+//   bench_stages [MB]
+
+#include "BitFlash_Stages.h"
+#include "test_data.h"
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+
+namespace {
+
+constexpr size_t kSegment = 1460;
+
+// Adds the stages under test to a pipeline.
+typedef std::function<void(BitFlash_Pipeline&)> Stages;
+
+// Seconds to push input through, or 0 when the pipeline failed.
+double run(const std::vector<uint8_t>& input, const Stages& stages) {
+    BitFlash_Pipeline pipeline;
+    stages(pipeline);
+    pipeline.setSink(new BitFlash_Stage());
+    uint8_t buff[kSegment];
+    auto start = std::chrono::steady_clock::now();
+    bool ok = pipeline.begin(input.size());
+    for (size_t pos = 0; ok && pos < input.size(); ) {
+        size_t room = 0;
+        uint8_t* target = pipeline.writeBuffer(room);
+        if (!target) {
+            target = buff;
+            room = sizeof(buff);
+        }
+        size_t n = std::min(std::min(room, kSegment), input.size() - pos);
+        memcpy(target, input.data() + pos, n);
+        ok = pipeline.write(target, n);
+        pos += n;
+    }
+    ok = ok && pipeline.end();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return ok ? seconds : 0;
+}
+
+double best(const std::vector<uint8_t>& input, const Stages& stages) {
+    double fastest = 1e9;
+    for (int repeat = 0; repeat < 5; repeat++) {
+        double seconds = run(input, stages);
+        if (seconds == 0) return 0;
+        fastest = std::min(fastest, seconds);
+    }
+    return fastest;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t megabytes = argc > 1 ? atoi(argv[1]) : 16;
+    std::vector<uint8_t> image = codeLike(megabytes << 20, 1);
+    // ESP32-S3, any revision
+    image[0] = 0xE9;
+    image[12] = 9;
+    image[13] = 0;
+    memset(&image[14], 0, 5);
+    std::vector<uint8_t> digest = sha256(image);
+    uint32_t crc = BitFlash_Checksum::crc32(0, image.data(), image.size());
+    uint32_t adler = BitFlash_Checksum::adler32(1, image.data(), image.size());
+    std::vector<uint8_t> deflated = deflateRaw(image, {}, 6);
+    const uint8_t key[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+    const uint8_t iv[16] = {};
+
+    struct Row {
+        const char* name;
+        const std::vector<uint8_t>* input;
+        Stages stages;
+    };
+    const Row rows[] = {
+        { "8 pass-through", &image,
+          [](BitFlash_Pipeline& p) { for (int i = 0; i < 8; i++) p.add(new BitFlash_Stage()); } },
+        { "image check", &image, [](BitFlash_Pipeline& p) { p.add(new BitFlash_ImageCheckStage(9, 0)); } },
+        { "CRC-32", &image,
+          [crc](BitFlash_Pipeline& p) { p.add(new BitFlash_ChecksumStage(BitFlash_ChecksumStage::kCrc32, crc)); } },
+        { "Adler-32", &image,
+          [adler](BitFlash_Pipeline& p) {
+              p.add(new BitFlash_ChecksumStage(BitFlash_ChecksumStage::kAdler32, adler));
+          } },
+        { "SHA-256", &image, [&digest](BitFlash_Pipeline& p) { p.add(new BitFlash_HashStage(digest.data())); } },
+        { "AES-128-CTR", &image,
+          [&key, &iv](BitFlash_Pipeline& p) { p.add(new BitFlash_DecryptStage(key, sizeof(key), iv)); } },
+        { "inflate", &deflated,
+          [&image](BitFlash_Pipeline& p) { p.add(new BitFlash_InflateStage(image.size())); } },
+        { "worker", &image, [](BitFlash_Pipeline& p) { p.add(new BitFlash_WorkerStage(0)); } },
+    };
+
+    double none = best(image, [](BitFlash_Pipeline&) {});
+    if (none == 0) {
+        fprintf(stderr, "pipeline failed (no stages)\n");
+        return 1;
+    }
+    size_t segments = (image.size() + kSegment - 1) / kSegment;
+    printf("%zu MB image in %zu-byte segments; ms per MB of image\n", megabytes, kSegment);
+    printf("%-16s %10s %10s %10s\n", "stage", "MB/s", "ms/MB", "added");
+    printf("%-16s %10.1f %10.3f %10s\n", "none", image.size() / none / 1e6, none * 1e3 / megabytes, "");
+    for (const Row& row : rows) {
+        double seconds = best(*row.input, row.stages);
+        if (seconds == 0) {
+            fprintf(stderr, "pipeline failed (%s)\n", row.name);
+            return 1;
+        }
+        printf("%-16s %10.1f %10.3f %10.3f\n", row.name, image.size() / seconds / 1e6, seconds * 1e3 / megabytes,
+               (seconds - none) * 1e3 / megabytes);
+        if (&row == &rows[0]) {
+            printf("%-16s %10s %10s %10.1f\n", "  ns per stage", "", "", (seconds - none) * 1e9 / 8 / segments);
+        }
+    }
+    return 0;
+}
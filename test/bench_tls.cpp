@@ -0,0 +1,202 @@
+// Client heap for an HTTPS download, with and without the low-memory TLS
+// profile. Both clients run on the mbedtls fake against TlsServer; the
+// full one is set up like the core's WiFiClientSecure (mbedtls defaults,
+// every cipher suite, the CA chain kept), the other is BitFlash_TlsClient.
+// Allocations are counted while the client's code runs, not the server's.
+// OpenSSL sizes its buffers differently from mbedtls, so the figures
+// compare the two profiles rather than predict a device's heap. In
+// particular its read buffer stays 16 KB whatever fragment length was
+// agreed; the last column is what mbedtls would hold for records instead,
+// with ESP-IDF's 16 KB in and 4 KB out and CONFIG_MBEDTLS_DYNAMIC_BUFFER.
+//   bench_tls [KB]
+
+#include "BitFlash_Tls.h"
+#include "tls_server.h"
+#include <mbedtls/net_sockets.h>
+#include <stdio.h>
+
+namespace {
+
+// Each block carries its size, and whether it was counted, in front of it
+struct Header {
+    size_t size;
+    bool counted;
+    alignas(16) char data[];
+};
+
+bool counting = false;
+// Signed: a block counted in one measurement may be freed in the next
+long current = 0;
+long peak = 0;
+
+void* countedMalloc(size_t n, const char*, int) {
+    Header* h = (Header*)malloc(sizeof(Header) + n);
+    if (!h) return nullptr;
+    h->size = n;
+    h->counted = counting;
+    if (counting) {
+        current += n;
+        peak = std::max(peak, current);
+    }
+    return h->data;
+}
+
+void countedFree(void* p, const char*, int) {
+    if (!p) return;
+    Header* h = (Header*)((char*)p - offsetof(Header, data));
+    if (h->counted) current -= h->size;
+    free(h);
+}
+
+void* countedRealloc(void* p, size_t n, const char* file, int line) {
+    if (!p) return countedMalloc(n, file, line);
+    Header* h = (Header*)((char*)p - offsetof(Header, data));
+    void* q = countedMalloc(n, file, line);
+    if (q) memcpy(q, p, std::min(n, h->size));
+    countedFree(p, file, line);
+    return q;
+}
+
+// The TLS client the core builds from mbedtls, reduced to what a download
+// needs: defaults throughout, with the CA chain kept for the session.
+class FullTlsClient {
+public:
+    explicit FullTlsClient(const char* caCert) : _caCert(caCert) {
+        mbedtls_ssl_init(&_ssl);
+        mbedtls_ssl_config_init(&_conf);
+        mbedtls_x509_crt_init(&_ca);
+    }
+
+    ~FullTlsClient() {
+        mbedtls_ssl_free(&_ssl);
+        mbedtls_ssl_config_free(&_conf);
+        mbedtls_x509_crt_free(&_ca);
+    }
+
+    bool connect(const char* host, uint16_t port) {
+        if (!_tcp.connect(host, port) ||
+            mbedtls_x509_crt_parse(&_ca, (const unsigned char*)_caCert, strlen(_caCert) + 1) != 0) {
+            return false;
+        }
+        mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT);
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&_conf, &_ca, nullptr);
+        if (mbedtls_ssl_setup(&_ssl, &_conf) != 0 || mbedtls_ssl_set_hostname(&_ssl, host) != 0) return false;
+        mbedtls_ssl_set_bio(&_ssl, &_tcp, send, receive, nullptr);
+        int ret;
+        while ((ret = mbedtls_ssl_handshake(&_ssl)) != 0) {
+            if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) return false;
+        }
+        return true;
+    }
+
+    size_t write(const uint8_t* buf, size_t size) {
+        int ret = mbedtls_ssl_write(&_ssl, buf, size);
+        return ret > 0 ? ret : 0;
+    }
+
+    int read(uint8_t* buf, size_t size) {
+        int ret = mbedtls_ssl_read(&_ssl, buf, size);
+        return ret > 0 ? ret : ret == MBEDTLS_ERR_SSL_WANT_READ ? 0 : -1;
+    }
+
+private:
+    const char* _caCert;
+    WiFiClient _tcp;
+    mbedtls_ssl_context _ssl;
+    mbedtls_ssl_config _conf;
+    mbedtls_x509_crt _ca;
+
+    static int send(void* context, const unsigned char* buf, size_t len) {
+        size_t n = static_cast<WiFiClient*>(context)->write(buf, len);
+        return n > 0 ? (int)n : MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+
+    static int receive(void* context, unsigned char* buf, size_t len) {
+        int n = static_cast<WiFiClient*>(context)->read(buf, len);
+        return n > 0 ? n : n == 0 ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+    }
+};
+
+struct Heap {
+    long handshake;  // Peak up to the end of the handshake
+    long held;       // Held between the handshake and the download
+    long download;   // Peak while the response is read
+};
+
+// Connects, sends a request and reads the response in TCP-segment-sized
+// reads, as the download loop does. False when the response did not arrive.
+template <typename TlsClient>
+bool measure(TlsClient& client, const std::string& expected, Heap& heap) {
+    long base = current;
+    peak = current;
+    counting = true;
+    bool ok = client.connect("ota.example.com", 443);
+    heap.handshake = peak - base;
+    heap.held = current - base;
+    peak = current;
+
+    const char request[] = "GET /fw/app.bin HTTP/1.1\r\nHost: ota.example.com\r\n\r\n";
+    ok = ok && client.write((const uint8_t*)request, sizeof(request) - 1) == sizeof(request) - 1;
+    std::string got;
+    uint8_t buff[1460];
+    while (ok && got.size() < expected.size()) {
+        int n = client.read(buff, sizeof(buff));
+        if (n <= 0) break;
+        got.append((const char*)buff, n);
+    }
+    heap.download = peak - base;
+    counting = false;
+    return ok && got == expected;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    // Before OpenSSL allocates anything
+    CRYPTO_set_mem_functions(countedMalloc, countedRealloc, countedFree);
+
+    size_t kilobytes = argc > 1 ? atoi(argv[1]) : 256;
+    WiFi.hosts["ota.example.com"] = IPAddress(10, 0, 0, 5);
+    TlsServer server;
+    server.serving = [](bool inside) {
+        static bool wasCounting;
+        if (inside) wasCounting = counting;
+        counting = inside ? false : wasCounting;
+    };
+    server.response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(kilobytes << 10) + "\r\n\r\n";
+    for (size_t i = 0; i < kilobytes << 10; i++) server.response += (char)(i * 31 + (i >> 8));
+
+    printf("Client heap in KB, %zu KB download; largest record from the server in bytes\n", kilobytes);
+    printf("%-22s %10s %10s %10s %10s %10s\n", "", "handshake", "held", "download", "record", "mbedtls");
+    auto row = [&server](const char* name, const Heap& heap) {
+        size_t in = server.maxFragment ? server.maxFragment : 16384;
+        size_t out = std::min<size_t>(in, 4096);
+        printf("%-22s %10.1f %10.1f %10.1f %10zu %10.1f\n", name, heap.handshake / 1024.0, heap.held / 1024.0,
+               heap.download / 1024.0, server.largestRecord, (in + out) / 1024.0);
+    };
+
+    Heap heap;
+    {
+        server.largestRecord = 0;
+        FullTlsClient client(server.caPem.c_str());
+        if (!measure(client, server.response, heap)) {
+            fprintf(stderr, "download failed (full)\n");
+            return 1;
+        }
+        row("full", heap);
+    }
+    for (uint16_t fragment : { 4096, 2048, 1024, 512 }) {
+        server.largestRecord = 0;
+        BitFlash_TlsClient client(true, server.caPem.c_str(), fragment);
+        if (!measure(client, server.response, heap)) {
+            fprintf(stderr, "download failed (%u)\n", fragment);
+            return 1;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "low memory, %u", fragment);
+        row(name, heap);
+    }
+    return 0;
+}
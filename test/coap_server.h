@@ -0,0 +1,180 @@
+#pragma once
+
+// A CoAP server on the fake network, serving resources whole or block by
+// block and notifying observers.
+
+#include <WiFi.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class CoapServer {
+public:
+    struct Request {
+        uint8_t type;
+        uint16_t id;
+        std::vector<uint8_t> token;
+        std::string path;
+        std::string query;
+        bool hasBlock2 = false;
+        uint32_t block2 = 0;
+        bool wantsSize2 = false;
+        bool observe = false;
+    };
+
+    IPAddress address;
+    uint16_t port;
+    std::map<std::string, std::vector<uint8_t>> resources;
+    bool blockwise = true;
+    uint8_t maxSzx = 6;
+    // Acknowledges first and sends the response as its own confirmable message
+    bool separate = false;
+    int dropRequests = 0;  // Requests that get lost before one arrives
+
+    std::vector<Request> requests;
+    std::vector<uint16_t> acks;  // Empty ACKs from the client, by message ID
+
+    explicit CoapServer(IPAddress address = IPAddress(10, 0, 0, 5), uint16_t port = 5683)
+        : address(address), port(port) {
+        fake::listenUdp(address, port, [this](const fake::Datagram& datagram) { answer(datagram); });
+    }
+
+    // Sends a notification to every observer of path: 2.05 with the new
+    // content's observe sequence, or the given error code.
+    void notify(const std::string& path, bool confirmable = false, uint8_t code = 0x45) {
+        for (const Observer& o : observers) {
+            if (o.path != path) continue;
+            std::vector<uint8_t> m = header(confirmable ? 0 : 1, code, _nextId++, o.token);
+            uint16_t last = 0;
+            putUint(m, last, 6, ++_sequence);
+            m.push_back(0xff);
+            m.push_back('x');
+            send(o.ip, o.port, m);
+        }
+    }
+
+    size_t observerCount() const { return observers.size(); }
+
+private:
+    struct Observer {
+        IPAddress ip;
+        uint16_t port;
+        std::vector<uint8_t> token;
+        std::string path;
+    };
+
+    std::vector<Observer> observers;
+    uint16_t _nextId = 0x7000;
+    uint32_t _sequence = 1;
+
+    static std::vector<uint8_t> header(uint8_t type, uint8_t code, uint16_t id, const std::vector<uint8_t>& token) {
+        std::vector<uint8_t> m = { (uint8_t)(0x40 | type << 4 | token.size()), code, (uint8_t)(id >> 8),
+                                   (uint8_t)id };
+        m.insert(m.end(), token.begin(), token.end());
+        return m;
+    }
+
+    static void putUint(std::vector<uint8_t>& m, uint16_t& last, uint16_t number, uint32_t value) {
+        uint8_t bytes[4];
+        size_t len = 0;
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            if (len > 0 || (value >> shift) & 0xff) bytes[len++] = value >> shift;
+        }
+        uint16_t delta = number - last;
+        last = number;
+        if (delta < 13) {
+            m.push_back(delta << 4 | len);
+        } else {
+            m.push_back(13 << 4 | len);
+            m.push_back(delta - 13);
+        }
+        m.insert(m.end(), bytes, bytes + len);
+    }
+
+    void send(IPAddress ip, uint16_t toPort, const std::vector<uint8_t>& m) {
+        fake::sendUdp({ address, port, ip, toPort, m });
+    }
+
+    static bool parse(const std::vector<uint8_t>& m, Request& request) {
+        if (m.size() < 4) return false;
+        request.type = (m[0] >> 4) & 3;
+        size_t tokenLength = m[0] & 0x0f;
+        request.id = m[2] << 8 | m[3];
+        request.token.assign(m.begin() + 4, m.begin() + 4 + tokenLength);
+        size_t offset = 4 + tokenLength;
+        uint16_t number = 0;
+        while (offset < m.size() && m[offset] != 0xff) {
+            uint32_t delta = m[offset] >> 4;
+            uint32_t len = m[offset] & 0x0f;
+            offset++;
+            if (delta == 13) delta = 13 + m[offset++];
+            if (len == 13) len = 13 + m[offset++];
+            number += delta;
+            std::string text(m.begin() + offset, m.begin() + offset + len);
+            uint32_t value = 0;
+            for (uint32_t i = 0; i < len; i++) value = value << 8 | m[offset + i];
+            if (number == 6) request.observe = true;
+            if (number == 11) request.path += (request.path.empty() ? "" : "/") + text;
+            if (number == 15) request.query += (request.query.empty() ? "" : "&") + text;
+            if (number == 23) { request.hasBlock2 = true; request.block2 = value; }
+            if (number == 28) request.wantsSize2 = true;
+            offset += len;
+        }
+        return true;
+    }
+
+    void answer(const fake::Datagram& datagram) {
+        Request request;
+        if (!parse(datagram.data, request)) return;
+        if (request.type == 2) {
+            acks.push_back(request.id);
+            return;
+        }
+        if (dropRequests > 0) {
+            dropRequests--;
+            return;
+        }
+        requests.push_back(request);
+
+        auto it = resources.find(request.path);
+        uint8_t code = it == resources.end() ? 0x84 : 0x45;
+        std::vector<uint8_t> payload;
+        std::vector<uint8_t> options;
+        uint16_t last = 0;
+
+        if (code == 0x45 && request.observe) {
+            observers.push_back({ datagram.from, datagram.fromPort, request.token, request.path });
+            putUint(options, last, 6, _sequence);
+        }
+        if (code == 0x45) {
+            const std::vector<uint8_t>& content = it->second;
+            if (blockwise && (request.hasBlock2 || content.size() > (16u << maxSzx))) {
+                uint8_t szx = std::min<uint8_t>(request.hasBlock2 ? request.block2 & 7 : maxSzx, maxSzx);
+                size_t blockSize = 16u << szx;
+                // A block number for a larger size maps onto smaller blocks
+                size_t offset = request.hasBlock2 ? (request.block2 >> 4) * (16u << (request.block2 & 7)) : 0;
+                size_t n = std::min(blockSize, content.size() - std::min(offset, content.size()));
+                payload.assign(content.begin() + offset, content.begin() + offset + n);
+                bool more = offset + n < content.size();
+                putUint(options, last, 23, (uint32_t)(offset / blockSize) << 4 | (more ? 8 : 0) | szx);
+                if (request.wantsSize2) putUint(options, last, 28, content.size());
+            } else {
+                payload = content;
+            }
+        }
+
+        std::vector<uint8_t> response;
+        if (separate) {
+            send(datagram.from, datagram.fromPort, header(2, 0, request.id, {}));
+            response = header(0, code, _nextId++, request.token);
+        } else {
+            response = header(2, code, request.id, request.token);
+        }
+        response.insert(response.end(), options.begin(), options.end());
+        if (!payload.empty()) {
+            response.push_back(0xff);
+            response.insert(response.end(), payload.begin(), payload.end());
+        }
+        send(datagram.from, datagram.fromPort, response);
+    }
+};
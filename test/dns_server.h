@@ -0,0 +1,134 @@
+#pragma once
+
+// A DNS server on the fake network, answering from a table of records.
+
+#include <WiFi.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class DnsServer {
+public:
+    static constexpr uint16_t kTypeA = 1;
+    static constexpr uint16_t kTypeCname = 5;
+    static constexpr uint16_t kTypeTxt = 16;
+
+    struct Record {
+        uint16_t type;
+        uint32_t ttl;
+        std::vector<uint8_t> data;
+    };
+
+    // How the next answers go wrong, if at all.
+    enum Fault { kNone, kSilent, kWrongId, kTruncated, kServerFailure };
+
+    IPAddress address;
+    std::map<std::string, std::vector<Record>> records;
+    Fault fault = kNone;
+    int faultCount = 0;  // Answers that get the fault before it clears
+    int queries = 0;
+
+    explicit DnsServer(IPAddress address = WiFi.dnsIP()) : address(address) {
+        fake::listenUdp(address, 53, [this](const fake::Datagram& datagram) { answer(datagram); });
+    }
+
+    void addA(const std::string& name, IPAddress ip, uint32_t ttl) {
+        records[name].push_back({ kTypeA, ttl, { ip[0], ip[1], ip[2], ip[3] } });
+    }
+
+    void addCname(const std::string& name, const std::string& target, uint32_t ttl) {
+        records[name].push_back({ kTypeCname, ttl, encodeName(target) });
+    }
+
+    // Each string becomes one length-prefixed character-string.
+    void addTxt(const std::string& name, const std::vector<std::string>& strings, uint32_t ttl) {
+        std::vector<uint8_t> data;
+        for (const std::string& s : strings) {
+            data.push_back(s.size());
+            data.insert(data.end(), s.begin(), s.end());
+        }
+        records[name].push_back({ kTypeTxt, ttl, data });
+    }
+
+    static std::vector<uint8_t> encodeName(const std::string& name) {
+        std::vector<uint8_t> out;
+        size_t start = 0;
+        while (start < name.size()) {
+            size_t dot = name.find('.', start);
+            if (dot == std::string::npos) dot = name.size();
+            out.push_back(dot - start);
+            out.insert(out.end(), name.begin() + start, name.begin() + dot);
+            start = dot + 1;
+        }
+        out.push_back(0);
+        return out;
+    }
+
+private:
+    void answer(const fake::Datagram& query) {
+        queries++;
+        const std::vector<uint8_t>& q = query.data;
+        if (q.size() < 17) return;
+
+        Fault now = faultCount > 0 ? fault : kNone;
+        if (faultCount > 0) faultCount--;
+        if (now == kSilent) return;
+
+        // Question name and type
+        std::string name;
+        size_t offset = 12;
+        while (offset < q.size() && q[offset] != 0) {
+            if (!name.empty()) name += '.';
+            name.append((const char*)&q[offset + 1], q[offset]);
+            offset += q[offset] + 1;
+        }
+        offset++;
+        uint16_t type = (q[offset] << 8) | q[offset + 1];
+        offset += 4;
+
+        // Follows CNAMEs the way a recursive server would, answer names
+        // all compressed to the question's
+        std::vector<const Record*> answers;
+        std::string current = name;
+        for (int hops = 0; hops < 8; hops++) {
+            auto it = records.find(current);
+            if (it == records.end()) break;
+            std::string next;
+            for (const Record& record : it->second) {
+                if (record.type == type) answers.push_back(&record);
+                if (record.type == kTypeCname && type != kTypeCname) {
+                    answers.push_back(&record);
+                    next = decodeName(record.data);
+                }
+            }
+            if (next.empty()) break;
+            current = next;
+        }
+
+        std::vector<uint8_t> r(q.begin(), q.begin() + offset);
+        if (now == kWrongId) r[0] ^= 0xff;
+        r[2] = 0x81 | (now == kTruncated ? 0x02 : 0);
+        r[3] = 0x80 | (now == kServerFailure ? 2 : 0);
+        r[6] = 0;
+        r[7] = answers.size();
+        for (const Record* record : answers) {
+            uint8_t head[] = { 0xc0, 0x0c, (uint8_t)(record->type >> 8), (uint8_t)record->type, 0, 1,
+                               (uint8_t)(record->ttl >> 24), (uint8_t)(record->ttl >> 16),
+                               (uint8_t)(record->ttl >> 8), (uint8_t)record->ttl,
+                               (uint8_t)(record->data.size() >> 8), (uint8_t)record->data.size() };
+            r.insert(r.end(), head, head + sizeof(head));
+            r.insert(r.end(), record->data.begin(), record->data.end());
+        }
+
+        fake::sendUdp({ address, 53, query.from, query.fromPort, r });
+    }
+
+    static std::string decodeName(const std::vector<uint8_t>& data) {
+        std::string name;
+        for (size_t i = 0; i < data.size() && data[i] != 0; i += data[i] + 1) {
+            if (!name.empty()) name += '.';
+            name.append((const char*)&data[i + 1], data[i]);
+        }
+        return name;
+    }
+};
@@ -0,0 +1,225 @@
+#include <Arduino.h>
+#include <stdarg.h>
+#include <chrono>
+#include <random>
+#include <thread>
+
+EspClass ESP;
+HardwareSerial Serial;
+
+// time() starts here so certificate and TTL arithmetic sees a plausible date
+static constexpr time_t kEpoch = 1700000000;
+
+static std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+static uint64_t skippedMicros = 0;
+static long clockOffset = 0;
+static bool clockUnset = false;
+static long ntpDelay = -1;
+static unsigned long ntpStartedAt = 0;
+static int ntpCalls = 0;
+static std::mt19937 generator(12345);
+
+void fake::advance(uint32_t ms) {
+    skippedMicros += (uint64_t)ms * 1000;
+}
+
+void fake::shiftClock(long seconds) {
+    clockOffset += seconds;
+}
+
+void fake::unsetClock() {
+    clockUnset = true;
+    clockOffset = 0;
+}
+
+void fake::ntpAnswerAfter(uint32_t ms) {
+    ntpDelay = ms;
+}
+
+int fake::ntpStarts() {
+    return ntpCalls;
+}
+
+void fake::resetClock() {
+    clockUnset = false;
+    clockOffset = 0;
+    ntpDelay = -1;
+    ntpCalls = 0;
+}
+
+void configTime(long gmtOffset, int daylightOffset, const char* server1, const char* server2, const char* server3) {
+    ntpCalls++;
+    ntpStartedAt = millis();
+}
+
+unsigned long micros() {
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() + skippedMicros;
+}
+
+unsigned long millis() {
+    return micros() / 1000;
+}
+
+// Skips ahead instead of sleeping, so retry loops run at full speed.
+void delay(uint32_t ms) {
+    fake::advance(ms);
+    std::this_thread::yield();
+}
+
+void yield() {
+    std::this_thread::yield();
+}
+
+// Replaces the C library's, so code under test sees the fake clock.
+extern "C" time_t time(time_t* t) {
+    if (clockUnset && ntpCalls > 0 && ntpDelay >= 0 && millis() - ntpStartedAt >= (unsigned long)ntpDelay) {
+        clockUnset = false;
+        clockOffset = 0;
+    }
+    time_t now = (clockUnset ? 0 : kEpoch) + clockOffset + (time_t)(micros() / 1000000);
+    if (t) *t = now;
+    return now;
+}
+
+extern "C" int settimeofday(const struct timeval* tv, const struct timezone* tz) noexcept {
+    clockUnset = false;
+    clockOffset = tv->tv_sec - kEpoch - (time_t)(micros() / 1000000);
+    return 0;
+}
+
+uint32_t esp_random() {
+    return generator();
+}
+
+long random(long max) {
+    return max > 0 ? (long)(generator() % max) : 0;
+}
+
+long random(long min, long max) {
+    return max > min ? min + random(max - min) : min;
+}
+
+std::string String::format(long value, unsigned char base) {
+    if (value < 0) return "-" + format((unsigned long)-value, base);
+    return format((unsigned long)value, base);
+}
+
+std::string String::format(unsigned long value, unsigned char base) {
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    std::string s;
+    do {
+        s.insert(s.begin(), digits[value % base]);
+        value /= base;
+    } while (value > 0);
+    return s;
+}
+
+bool String::equalsIgnoreCase(const String& s) const {
+    return _s.size() == s._s.size() && strncasecmp(_s.c_str(), s._s.c_str(), _s.size()) == 0;
+}
+
+bool String::endsWith(const String& suffix) const {
+    return _s.size() >= suffix._s.size() && _s.compare(_s.size() - suffix._s.size(), std::string::npos, suffix._s) == 0;
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+    if (from > to) std::swap(from, to);
+    if (from >= _s.size()) return String();
+    return String(_s.substr(from, min<size_t>(to, _s.size()) - from));
+}
+
+void String::getBytes(unsigned char* buf, unsigned int size, unsigned int index) const {
+    if (size == 0) return;
+    size_t n = index < _s.size() ? min<size_t>(size - 1, _s.size() - index) : 0;
+    memcpy(buf, _s.data() + index, n);
+    buf[n] = 0;
+}
+
+void String::trim() {
+    size_t begin = _s.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        _s.clear();
+        return;
+    }
+    _s = _s.substr(begin, _s.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+void String::toLowerCase() {
+    for (char& c : _s) c = tolower((unsigned char)c);
+}
+
+void String::toUpperCase() {
+    for (char& c : _s) c = toupper((unsigned char)c);
+}
+
+size_t Print::write(const uint8_t* buf, size_t size) {
+    size_t n = 0;
+    while (n < size && write(buf[n])) n++;
+    return n;
+}
+
+size_t Print::printf(const char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    return n > 0 ? write((const uint8_t*)buf, min<size_t>(n, sizeof(buf) - 1)) : 0;
+}
+
+int Stream::timedRead() {
+    unsigned long start = millis();
+    do {
+        int c = read();
+        if (c >= 0) return c;
+        yield();
+    } while (millis() - start < _timeout);
+    return -1;
+}
+
+size_t Stream::readBytes(char* buf, size_t length) {
+    size_t n = 0;
+    while (n < length) {
+        int c = timedRead();
+        if (c < 0) break;
+        buf[n++] = c;
+    }
+    return n;
+}
+
+size_t Stream::readBytesUntil(char terminator, char* buf, size_t length) {
+    size_t n = 0;
+    while (n < length) {
+        int c = timedRead();
+        if (c < 0 || c == terminator) break;
+        buf[n++] = c;
+    }
+    return n;
+}
+
+String Stream::readStringUntil(char terminator) {
+    String s;
+    int c;
+    while ((c = timedRead()) >= 0 && c != terminator) s += (char)c;
+    return s;
+}
+
+bool IPAddress::fromString(const char* s) {
+    uint32_t octets[4];
+    char end;
+    if (sscanf(s, "%u.%u.%u.%u%c", &octets[0], &octets[1], &octets[2], &octets[3], &end) != 4) {
+        return false;
+    }
+    for (uint32_t octet : octets) {
+        if (octet > 255) return false;
+    }
+    *this = IPAddress(octets[0], octets[1], octets[2], octets[3]);
+    return true;
+}
+
+String IPAddress::toString() const {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+    return String(buf);
+}
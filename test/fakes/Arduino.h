@@ -0,0 +1,214 @@
+#pragma once
+
+// Host stand-in for the parts of the Arduino-ESP32 core the library uses.
+// millis() follows the real clock plus whatever a test adds with
+// fake::advance(), so timed loops still end and tests can skip ahead.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+
+#define F(x) x
+#define RTC_DATA_ATTR
+#define IRAM_ATTR
+
+namespace fake {
+// Moves millis(), micros() and time() forward.
+void advance(uint32_t ms);
+// Moves time() alone, either way, as when SNTP corrects the clock.
+void shiftClock(long seconds);
+// time() counts from 1970 again, as on a device that has not synced yet.
+void unsetClock();
+// configTime() sets an unset clock this long after it is called; by
+// default SNTP never answers.
+void ntpAnswerAfter(uint32_t ms);
+// Calls to configTime()
+int ntpStarts();
+// The clock set and SNTP silent again, as at the start.
+void resetClock();
+}
+
+unsigned long millis();
+unsigned long micros();
+void configTime(long gmtOffset, int daylightOffset, const char* server1,
+                const char* server2 = nullptr, const char* server3 = nullptr);
+void delay(uint32_t ms);
+void yield();
+uint32_t esp_random();
+long random(long max);
+long random(long min, long max);
+
+class String {
+public:
+    String(const char* s = "") : _s(s ? s : "") {}
+    String(const std::string& s) : _s(s) {}
+    explicit String(char c) : _s(1, c) {}
+    explicit String(int value, unsigned char base = 10) : _s(format(value, base)) {}
+    explicit String(unsigned int value, unsigned char base = 10) : _s(format(value, base)) {}
+    explicit String(long value, unsigned char base = 10) : _s(format(value, base)) {}
+    explicit String(unsigned long value, unsigned char base = 10) : _s(format(value, base)) {}
+
+    const char* c_str() const { return _s.c_str(); }
+    unsigned int length() const { return _s.size(); }
+    bool isEmpty() const { return _s.empty(); }
+    bool reserve(unsigned int size) { _s.reserve(size); return true; }
+
+    bool concat(const char* s, unsigned int n) { _s.append(s, n); return true; }
+    bool concat(const String& s) { _s += s._s; return true; }
+    bool concat(const char* s) { _s += s; return true; }
+    bool concat(char c) { _s += c; return true; }
+    String& operator+=(const String& s) { _s += s._s; return *this; }
+    String& operator+=(const char* s) { _s += s; return *this; }
+    String& operator+=(char c) { _s += c; return *this; }
+    String& operator+=(int value) { _s += format(value, 10); return *this; }
+    String& operator+=(unsigned int value) { _s += format(value, 10); return *this; }
+    String& operator+=(long value) { _s += format(value, 10); return *this; }
+    String& operator+=(unsigned long value) { _s += format(value, 10); return *this; }
+    friend String operator+(const String& a, const String& b) { return String(a._s + b._s); }
+    friend String operator+(const String& a, const char* b) { return String(a._s + b); }
+    friend String operator+(const char* a, const String& b) { return String(a + b._s); }
+
+    bool operator==(const String& s) const { return _s == s._s; }
+    bool operator==(const char* s) const { return _s == s; }
+    bool operator!=(const String& s) const { return _s != s._s; }
+    bool operator!=(const char* s) const { return _s != s; }
+    bool operator<(const String& s) const { return _s < s._s; }
+    char operator[](unsigned int i) const { return i < _s.size() ? _s[i] : 0; }
+    char charAt(unsigned int i) const { return (*this)[i]; }
+
+    bool equals(const String& s) const { return _s == s._s; }
+    bool equalsIgnoreCase(const String& s) const;
+    bool startsWith(const String& prefix) const { return _s.compare(0, prefix._s.size(), prefix._s) == 0; }
+    bool endsWith(const String& suffix) const;
+    int indexOf(char c, unsigned int from = 0) const { return found(_s.find(c, from)); }
+    int indexOf(const String& s, unsigned int from = 0) const { return found(_s.find(s._s, from)); }
+    int lastIndexOf(char c) const { return found(_s.rfind(c)); }
+    String substring(unsigned int from) const { return substring(from, _s.size()); }
+    String substring(unsigned int from, unsigned int to) const;
+    void getBytes(unsigned char* buf, unsigned int size, unsigned int index = 0) const;
+    void remove(unsigned int index) { if (index < _s.size()) _s.erase(index); }
+    void remove(unsigned int index, unsigned int count) { if (index < _s.size()) _s.erase(index, count); }
+    void trim();
+    void toLowerCase();
+    void toUpperCase();
+    long toInt() const { return atol(_s.c_str()); }
+
+private:
+    std::string _s;
+
+    static int found(size_t pos) { return pos == std::string::npos ? -1 : (int)pos; }
+    static std::string format(long value, unsigned char base);
+    static std::string format(unsigned long value, unsigned char base);
+    static std::string format(int value, unsigned char base) { return format((long)value, base); }
+    static std::string format(unsigned int value, unsigned char base) { return format((unsigned long)value, base); }
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buf, size_t size);
+    size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+
+    size_t print(const char* s) { return write(s); }
+    size_t print(const String& s) { return write((const uint8_t*)s.c_str(), s.length()); }
+    size_t print(long value) { return print(String(value)); }
+    size_t println(const char* s = "") { return print(s) + print("\r\n"); }
+    size_t println(const String& s) { return print(s) + print("\r\n"); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    unsigned long getTimeout() const { return _timeout; }
+    size_t readBytes(char* buf, size_t length);
+    size_t readBytes(uint8_t* buf, size_t length) { return readBytes((char*)buf, length); }
+    size_t readBytesUntil(char terminator, char* buf, size_t length);
+    size_t readBytesUntil(char terminator, uint8_t* buf, size_t length) {
+        return readBytesUntil(terminator, (char*)buf, length);
+    }
+    String readStringUntil(char terminator);
+
+protected:
+    unsigned long _timeout = 1000;
+
+    int timedRead();
+};
+
+class IPAddress {
+public:
+    IPAddress() : _address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+    // Network byte order, first octet in the low byte, like the core.
+    IPAddress(uint32_t address) : _address(address) {}
+
+    operator uint32_t() const { return _address; }
+    uint8_t operator[](int i) const { return _address >> (8 * i); }
+    bool operator==(const IPAddress& other) const { return _address == other._address; }
+    bool operator!=(const IPAddress& other) const { return _address != other._address; }
+
+    bool fromString(const char* s);
+    String toString() const;
+
+private:
+    uint32_t _address;
+};
+
+class Client : public Stream {
+public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char* host, uint16_t port) = 0;
+    using Print::write;
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buf, size_t size) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t* buf, size_t size) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+};
+
+class EspClass {
+public:
+    uint8_t chipRevision = 3;
+    uint32_t freeHeap = 200000;
+    uint32_t minFreeHeap = 150000;
+
+    uint8_t getChipRevision() { return chipRevision; }
+    uint32_t getFreeHeap() { return freeHeap; }
+    uint32_t getMinFreeHeap() { return minFreeHeap; }
+    void restart() {}
+};
+
+extern EspClass ESP;
+
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long baud) {}
+    size_t write(uint8_t c) override { return 1; }
+    size_t write(const uint8_t* buf, size_t size) override { return size; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,4 @@
+#pragma once
+
+// Client is declared with Stream in Arduino.h.
+#include <Arduino.h>
@@ -0,0 +1,48 @@
+#include <FS.h>
+
+namespace fs {
+
+size_t File::write(const uint8_t* buf, size_t size) {
+    if (!_data || !_writable) return 0;
+    if (_data->size() < _position + size) _data->resize(_position + size);
+    memcpy(_data->data() + _position, buf, size);
+    _position += size;
+    return size;
+}
+
+int File::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read(uint8_t* buf, size_t size) {
+    size_t n = min(size, (size_t)available());
+    if (n) memcpy(buf, _data->data() + _position, n);
+    _position += n;
+    return n;
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+    size_t target = mode == SeekSet ? pos : mode == SeekCur ? _position + pos : size() + pos;
+    if (!_data || target > size()) return false;
+    _position = target;
+    return true;
+}
+
+File FS::open(const char* path, const char* mode, const bool create) {
+    auto it = files.find(path);
+    std::string m = mode;
+    if (m == "w" || m == "w+") {
+        auto data = std::make_shared<std::vector<uint8_t>>();
+        files[path] = data;
+        return File(data, true, 0);
+    }
+    if (it == files.end()) {
+        if (m != "a" && !create) return File();
+        it = files.emplace(path, std::make_shared<std::vector<uint8_t>>()).first;
+    }
+    if (m == "a" || m == "a+") return File(it->second, true, it->second->size());
+    return File(it->second, m == "r+", 0);
+}
+
+}  // namespace fs
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+// A handle on a file's bytes, which stay in the FS after close().
+class File : public Stream {
+public:
+    File() {}
+    File(std::shared_ptr<std::vector<uint8_t>> data, bool writable, size_t position)
+        : _data(data), _writable(writable), _position(position) {}
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t size) override;
+    int available() override { return _data ? _data->size() - _position : 0; }
+    int read() override;
+    int peek() override { return available() ? (*_data)[_position] : -1; }
+    size_t read(uint8_t* buf, size_t size);
+    bool seek(uint32_t pos, SeekMode mode = SeekSet);
+    size_t position() const { return _position; }
+    size_t size() const { return _data ? _data->size() : 0; }
+    void flush() {}
+    void close() { _data.reset(); }
+    operator bool() const { return _data != nullptr; }
+
+private:
+    std::shared_ptr<std::vector<uint8_t>> _data;
+    bool _writable = false;
+    size_t _position = 0;
+};
+
+// Files by path; tests look at and change them directly.
+class FS {
+public:
+    std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> files;
+
+    File open(const char* path, const char* mode = FILE_READ, const bool create = false);
+    File open(const String& path, const char* mode = FILE_READ, const bool create = false) {
+        return open(path.c_str(), mode, create);
+    }
+    bool exists(const char* path) { return files.count(path) > 0; }
+    bool exists(const String& path) { return exists(path.c_str()); }
+    bool remove(const char* path) { return files.erase(path) > 0; }
+    bool remove(const String& path) { return remove(path.c_str()); }
+};
+
+}  // namespace fs
+
+using fs::File;
+using fs::FS;
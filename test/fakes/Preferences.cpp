@@ -0,0 +1,64 @@
+#include <Preferences.h>
+
+namespace {
+
+std::map<std::string, std::map<std::string, std::vector<uint8_t>>> nvs;
+
+}  // namespace
+
+bool Preferences::begin(const char* name, bool readOnly, const char* partition) {
+    _name = name;
+    return true;
+}
+
+bool Preferences::clear() {
+    if (_name.empty()) return false;
+    nvs[_name].clear();
+    return true;
+}
+
+bool Preferences::remove(const char* key) {
+    return !_name.empty() && nvs[_name].erase(key) > 0;
+}
+
+bool Preferences::isKey(const char* key) {
+    return find(key) != nullptr;
+}
+
+String Preferences::getString(const char* key, String defaultValue) {
+    const std::vector<uint8_t>* value = find(key);
+    return value ? String(std::string(value->begin(), value->end())) : defaultValue;
+}
+
+size_t Preferences::getBytes(const char* key, void* buf, size_t maxLen) {
+    const std::vector<uint8_t>* value = find(key);
+    if (!value || value->size() > maxLen) return 0;
+    memcpy(buf, value->data(), value->size());
+    return value->size();
+}
+
+size_t Preferences::put(const char* key, const void* value, size_t len) {
+    if (_name.empty()) return 0;
+    const uint8_t* bytes = (const uint8_t*)value;
+    nvs[_name][key] = std::vector<uint8_t>(bytes, bytes + len);
+    return len;
+}
+
+const std::vector<uint8_t>* Preferences::find(const char* key) {
+    if (_name.empty()) return nullptr;
+    auto& values = nvs[_name];
+    auto it = values.find(key);
+    return it == values.end() ? nullptr : &it->second;
+}
+
+namespace fake {
+
+std::map<std::string, std::vector<uint8_t>>& preferences(const char* name) {
+    return nvs[name];
+}
+
+void resetPreferences() {
+    nvs.clear();
+}
+
+}  // namespace fake
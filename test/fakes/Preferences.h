@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// NVS as a map of namespaces. Values outlive the Preferences object, as
+// they outlive a reboot.
+class Preferences {
+public:
+    bool begin(const char* name, bool readOnly = false, const char* partition = nullptr);
+    void end() { _name.clear(); }
+    bool clear();
+    bool remove(const char* key);
+    bool isKey(const char* key);
+
+    size_t putUInt(const char* key, uint32_t value) { return put(key, &value, sizeof(value)); }
+    size_t putULong64(const char* key, uint64_t value) { return put(key, &value, sizeof(value)); }
+    size_t putBool(const char* key, bool value) { return put(key, &value, sizeof(value)); }
+    size_t putString(const char* key, const char* value) { return put(key, value, strlen(value)); }
+    size_t putString(const char* key, String value) { return putString(key, value.c_str()); }
+    size_t putBytes(const char* key, const void* value, size_t len) { return put(key, value, len); }
+
+    uint32_t getUInt(const char* key, uint32_t defaultValue = 0) { return get(key, defaultValue); }
+    uint64_t getULong64(const char* key, uint64_t defaultValue = 0) { return get(key, defaultValue); }
+    bool getBool(const char* key, bool defaultValue = false) { return get(key, defaultValue); }
+    String getString(const char* key, String defaultValue = String());
+    size_t getBytes(const char* key, void* buf, size_t maxLen);
+
+private:
+    std::string _name;
+
+    size_t put(const char* key, const void* value, size_t len);
+    const std::vector<uint8_t>* find(const char* key);
+
+    template <typename T>
+    T get(const char* key, T defaultValue) {
+        const std::vector<uint8_t>* value = find(key);
+        if (!value || value->size() != sizeof(T)) return defaultValue;
+        T out;
+        memcpy(&out, value->data(), sizeof(T));
+        return out;
+    }
+};
+
+namespace fake {
+
+std::map<std::string, std::vector<uint8_t>>& preferences(const char* name);
+// Forgets every namespace, as after erasing the NVS partition.
+void resetPreferences();
+
+}  // namespace fake
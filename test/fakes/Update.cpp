@@ -0,0 +1,41 @@
+#include <Update.h>
+
+UpdateClass Update;
+
+bool UpdateClass::begin(size_t size, int command) {
+    reset();
+    expectedSize = size;
+    begun = true;
+    return size != UPDATE_SIZE_UNKNOWN && size <= capacity;
+}
+
+size_t UpdateClass::write(uint8_t* data, size_t len) {
+    if (!begun || _error) return 0;
+    size_t n = min(len, min(capacity, expectedSize) - image.size());
+    image.insert(image.end(), data, data + n);
+    if (n < len) _error = true;
+    return n;
+}
+
+bool UpdateClass::end(bool evenIfRemaining) {
+    if (!begun || _error || (!evenIfRemaining && image.size() != expectedSize)) {
+        _error = true;
+        return false;
+    }
+    finished = true;
+    return true;
+}
+
+void UpdateClass::abort() {
+    aborted = true;
+    begun = false;
+}
+
+void UpdateClass::reset() {
+    image.clear();
+    expectedSize = 0;
+    begun = false;
+    finished = false;
+    aborted = false;
+    _error = false;
+}
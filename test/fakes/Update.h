@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+// Collects what would be flashed, so tests can compare it with the image.
+class UpdateClass {
+public:
+    std::vector<uint8_t> image;
+    size_t expectedSize = 0;
+    bool begun = false;
+    bool finished = false;
+    bool aborted = false;
+    // Rejects writes once the image holds this many bytes, like a full partition.
+    size_t capacity = SIZE_MAX;
+
+    bool begin(size_t size = UPDATE_SIZE_UNKNOWN, int command = 0);
+    size_t write(uint8_t* data, size_t len);
+    bool end(bool evenIfRemaining = false);
+    void abort();
+
+    bool hasError() const { return _error; }
+    bool isFinished() const { return finished; }
+    size_t remaining() const { return expectedSize - image.size(); }
+    void reset();
+
+private:
+    bool _error = false;
+};
+
+extern UpdateClass Update;
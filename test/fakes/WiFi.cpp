@@ -0,0 +1,275 @@
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <algorithm>
+#include <map>
+#include <set>
+
+WiFiClass WiFi;
+
+static std::set<WiFiUDP*>& sockets() {
+    static std::set<WiFiUDP*> all;
+    return all;
+}
+
+static std::map<std::pair<uint32_t, uint16_t>, fake::UdpHandler>& udpListeners() {
+    static std::map<std::pair<uint32_t, uint16_t>, fake::UdpHandler> listeners;
+    return listeners;
+}
+
+static std::map<std::pair<uint32_t, uint16_t>, fake::TcpAcceptor>& tcpListeners() {
+    static std::map<std::pair<uint32_t, uint16_t>, fake::TcpAcceptor> listeners;
+    return listeners;
+}
+
+static std::function<bool(const fake::Datagram&)> udpFilter;
+static uint32_t datagramsSent = 0;
+static IPAddress lastAddress;
+static uint16_t lastPort = 0;
+static int connects = 0;
+static fake::TlsHandshake tlsHandshake;
+
+static bool isMulticast(IPAddress ip) {
+    return ip[0] >= 224 && ip[0] <= 239;
+}
+
+int WiFiClass::hostByName(const char* host, IPAddress& address) {
+    systemLookups++;
+    if (address.fromString(host)) return 1;
+    auto it = hosts.find(host);
+    if (it == hosts.end()) return 0;
+    address = it->second;
+    return 1;
+}
+
+bool fake::sendUdp(const Datagram& datagram) {
+    datagramsSent++;
+    if (udpFilter && !udpFilter(datagram)) return true;
+
+    auto listener = udpListeners().find({ (uint32_t)datagram.to, datagram.toPort });
+    if (listener != udpListeners().end()) {
+        // Copied, as the handler may replace itself
+        UdpHandler handler = listener->second;
+        handler(datagram);
+        return true;
+    }
+
+    bool delivered = false;
+    for (WiFiUDP* socket : sockets()) {
+        if (socket->bound(datagram.to, datagram.toPort)) {
+            socket->deliver(datagram);
+            delivered = true;
+        }
+    }
+    return delivered;
+}
+
+void fake::listenUdp(IPAddress ip, uint16_t port, UdpHandler handler) {
+    udpListeners()[{ (uint32_t)ip, port }] = handler;
+}
+
+void fake::setUdpFilter(std::function<bool(const Datagram&)> filter) {
+    udpFilter = filter;
+}
+
+uint32_t fake::udpDatagramsSent() {
+    return datagramsSent;
+}
+
+void fake::resetNetwork() {
+    udpListeners().clear();
+    tcpListeners().clear();
+    udpFilter = nullptr;
+    datagramsSent = 0;
+    connects = 0;
+    lastAddress = IPAddress();
+    tlsHandshake = {};
+    lastPort = 0;
+}
+
+WiFiUDP::~WiFiUDP() {
+    stop();
+}
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+    stop();
+    _address = WiFi.localIP();
+    _port = port;
+    _group = IPAddress();
+    _open = true;
+    sockets().insert(this);
+    return 1;
+}
+
+uint8_t WiFiUDP::beginMulticast(IPAddress group, uint16_t port) {
+    begin(port);
+    _group = group;
+    return 1;
+}
+
+void WiFiUDP::stop() {
+    sockets().erase(this);
+    _open = false;
+    _queue.clear();
+}
+
+bool WiFiUDP::bound(IPAddress ip, uint16_t port) const {
+    if (!_open || port != _port) return false;
+    return ip == _address || (isMulticast(ip) && ip == _group);
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+    // Sending does not need begin(); the source port is then made up
+    _outgoing = { WiFi.localIP(), _open ? _port : (uint16_t)49152, ip, port, {} };
+    if (_open) _outgoing.from = _address;
+    _sending = true;
+    return 1;
+}
+
+size_t WiFiUDP::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t WiFiUDP::write(const uint8_t* buf, size_t size) {
+    if (!_sending) return 0;
+    _outgoing.data.insert(_outgoing.data.end(), buf, buf + size);
+    return size;
+}
+
+int WiFiUDP::endPacket() {
+    if (!_sending) return 0;
+    _sending = false;
+    fake::sendUdp(_outgoing);
+    return 1;
+}
+
+int WiFiUDP::parsePacket() {
+    if (_queue.empty()) return 0;
+    _current = _queue.front();
+    _queue.pop_front();
+    _readPos = 0;
+    return _current.data.size();
+}
+
+int WiFiUDP::available() {
+    return _current.data.size() - _readPos;
+}
+
+int WiFiUDP::read() {
+    return _readPos < _current.data.size() ? _current.data[_readPos++] : -1;
+}
+
+int WiFiUDP::read(uint8_t* buf, size_t len) {
+    size_t n = min(len, _current.data.size() - _readPos);
+    memcpy(buf, _current.data.data() + _readPos, n);
+    _readPos += n;
+    return n;
+}
+
+int WiFiUDP::peek() {
+    return _readPos < _current.data.size() ? _current.data[_readPos] : -1;
+}
+
+void fake::TcpConnection::send(const void* data, size_t len) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    outgoing.insert(outgoing.end(), bytes, bytes + len);
+}
+
+void fake::listenTcp(IPAddress ip, uint16_t port, TcpAcceptor acceptor) {
+    tcpListeners()[{ (uint32_t)ip, port }] = acceptor;
+}
+
+IPAddress fake::lastTcpAddress() {
+    return lastAddress;
+}
+
+uint16_t fake::lastTcpPort() {
+    return lastPort;
+}
+
+int fake::tcpConnects() {
+    return connects;
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+    stop();
+    connects++;
+    lastAddress = ip;
+    lastPort = port;
+
+    auto listener = tcpListeners().find({ (uint32_t)ip, port });
+    if (listener == tcpListeners().end()) return 0;
+    _connection = std::make_shared<fake::TcpConnection>();
+    listener->second(_connection);
+    return 1;
+}
+
+int WiFiClient::connect(const char* host, uint16_t port) {
+    IPAddress address;
+    if (!WiFi.hostByName(host, address)) return 0;
+    return connect(address, port);
+}
+
+size_t WiFiClient::write(const uint8_t* buf, size_t size) {
+    if (!_connection || !_connection->serverOpen) return 0;
+    _connection->received.append((const char*)buf, size);
+    if (_connection->onReceive) _connection->onReceive(*_connection);
+    return size;
+}
+
+int WiFiClient::available() {
+    return _connection ? _connection->outgoing.size() : 0;
+}
+
+int WiFiClient::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+// Like lwIP: 0 while the peer is open but silent, -1 once it has closed.
+int WiFiClient::read(uint8_t* buf, size_t size) {
+    if (!_connection) return -1;
+    size_t n = min(size, _connection->outgoing.size());
+    if (n == 0) return _connection->serverOpen ? 0 : -1;
+    std::copy(_connection->outgoing.begin(), _connection->outgoing.begin() + n, buf);
+    _connection->outgoing.erase(_connection->outgoing.begin(), _connection->outgoing.begin() + n);
+    return n;
+}
+
+int WiFiClient::peek() {
+    return _connection && !_connection->outgoing.empty() ? _connection->outgoing.front() : -1;
+}
+
+void WiFiClient::stop() {
+    if (_connection) _connection->clientOpen = false;
+    _connection.reset();
+}
+
+uint8_t WiFiClient::connected() {
+    return _connection && (_connection->serverOpen || !_connection->outgoing.empty());
+}
+
+const fake::TlsHandshake& fake::lastTlsHandshake() {
+    return tlsHandshake;
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port) {
+    return connect(ip, port, nullptr, _CA_cert, _cert, _private_key);
+}
+
+int WiFiClientSecure::connect(const char* host, uint16_t port) {
+    return connect(host, port, _CA_cert, _cert, _private_key);
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port, const char* host, const char* rootCA,
+                              const char* clientCert, const char* privateKey) {
+    tlsHandshake = { host ? host : "", rootCA, clientCert, _use_insecure };
+    if (!_use_insecure && !rootCA) return 0;
+    return WiFiClient::connect(ip, port);
+}
+
+int WiFiClientSecure::connect(const char* host, uint16_t port, const char* rootCA, const char* clientCert,
+                              const char* privateKey) {
+    IPAddress address;
+    if (!WiFi.hostByName(host, address)) return 0;
+    return connect(address, port, host, rootCA, clientCert, privateKey);
+}
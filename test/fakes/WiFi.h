@@ -0,0 +1,34 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <WiFiUdp.h>
+#include <map>
+#include <string>
+
+typedef enum {
+    WL_IDLE_STATUS = 0,
+    WL_CONNECTED = 3,
+    WL_DISCONNECTED = 6,
+} wl_status_t;
+
+// The device's side of the network. Tests set the fields directly; sockets
+// opened afterwards use localAddress as their own address.
+class WiFiClass {
+public:
+    wl_status_t state = WL_CONNECTED;
+    IPAddress localAddress = IPAddress(192, 168, 1, 10);
+    IPAddress dnsAddress = IPAddress(192, 168, 1, 1);
+    // What the system resolver knows, and how often it was asked.
+    std::map<std::string, IPAddress> hosts;
+    int systemLookups = 0;
+
+    int begin(const char* ssid, const char* password) { return state; }
+    bool disconnect() { return true; }
+    wl_status_t status() const { return state; }
+    IPAddress localIP() const { return localAddress; }
+    IPAddress dnsIP(uint8_t index = 0) const { return dnsAddress; }
+    int hostByName(const char* host, IPAddress& address);
+};
+
+extern WiFiClass WiFi;
@@ -0,0 +1,58 @@
+#pragma once
+
+// TCP over the in-process network. A stand-in server registered with
+// fake::listenTcp() gets a connection object per client and answers from
+// its onReceive callback, which runs whenever the client writes.
+
+#include <Arduino.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace fake {
+
+struct TcpConnection {
+    std::string received;  // From the client, not yet consumed by the server
+    std::deque<uint8_t> outgoing;  // To the client
+    bool serverOpen = true;
+    bool clientOpen = true;
+    std::function<void(TcpConnection& connection)> onReceive;
+
+    void send(const void* data, size_t len);
+    void send(const std::string& data) { send(data.data(), data.size()); }
+    void close() { serverOpen = false; }
+};
+
+typedef std::function<void(std::shared_ptr<TcpConnection> connection)> TcpAcceptor;
+
+void listenTcp(IPAddress ip, uint16_t port, TcpAcceptor acceptor);
+// Address and port of the last connection attempt, for checking resolution.
+IPAddress lastTcpAddress();
+uint16_t lastTcpPort();
+int tcpConnects();
+
+}  // namespace fake
+
+class WiFiClient : public Client {
+public:
+    virtual ~WiFiClient() {}
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char* host, uint16_t port) override;
+    virtual int connect(IPAddress ip, uint16_t port, int32_t timeout) { return connect(ip, port); }
+    virtual int connect(const char* host, uint16_t port, int32_t timeout) { return connect(host, port); }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buf, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); }
+
+protected:
+    std::shared_ptr<fake::TcpConnection> _connection;
+};
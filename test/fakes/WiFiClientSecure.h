@@ -0,0 +1,44 @@
+#pragma once
+
+// The TLS client, minus the TLS: connections are plain TCP over the fake
+// network. As in the real client, the handshake is refused when there is
+// nothing to check the server's certificate against and checking was not
+// turned off.
+
+#include <WiFi.h>
+
+namespace fake {
+
+// What the last handshake was given, for checking what reaches it.
+struct TlsHandshake {
+    std::string serverName;  // SNI and the name the certificate is checked against
+    const char* caCert;
+    const char* clientCert;
+    bool insecure;
+};
+
+const TlsHandshake& lastTlsHandshake();
+
+}  // namespace fake
+
+class WiFiClientSecure : public WiFiClient {
+public:
+    void setCACert(const char* rootCA) { _CA_cert = rootCA; }
+    void setCertificate(const char* clientCert) { _cert = clientCert; }
+    void setPrivateKey(const char* privateKey) { _private_key = privateKey; }
+    void setInsecure() { _use_insecure = true; }
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char* host, uint16_t port) override;
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) override { return connect(ip, port); }
+    int connect(const char* host, uint16_t port, int32_t timeout) override { return connect(host, port); }
+    int connect(IPAddress ip, uint16_t port, const char* host, const char* rootCA, const char* clientCert,
+                const char* privateKey);
+    int connect(const char* host, uint16_t port, const char* rootCA, const char* clientCert, const char* privateKey);
+
+protected:
+    const char* _CA_cert = nullptr;
+    const char* _cert = nullptr;
+    const char* _private_key = nullptr;
+    bool _use_insecure = false;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+// UDP over an in-process network: datagrams go straight into the receive
+// queue of every socket they are addressed to, multicast included. Stand-in
+// servers attach with fake::listenUdp().
+
+#include <Arduino.h>
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace fake {
+
+struct Datagram {
+    IPAddress from;
+    uint16_t fromPort;
+    IPAddress to;
+    uint16_t toPort;
+    std::vector<uint8_t> data;
+};
+
+typedef std::function<void(const Datagram& datagram)> UdpHandler;
+
+// Delivers to the sockets bound to the destination. Returns false when
+// nothing is listening there.
+bool sendUdp(const Datagram& datagram);
+// Hands datagrams for ip:port to a stand-in server instead of a socket.
+void listenUdp(IPAddress ip, uint16_t port, UdpHandler handler);
+// Called for every datagram; return false to drop it.
+void setUdpFilter(std::function<bool(const Datagram& datagram)> filter);
+uint32_t udpDatagramsSent();
+// Removes listeners, the filter and the counters.
+void resetNetwork();
+
+}  // namespace fake
+
+class WiFiUDP : public Stream {
+public:
+    ~WiFiUDP();
+
+    uint8_t begin(uint16_t port);
+    uint8_t beginMulticast(IPAddress group, uint16_t port);
+    void stop();
+
+    int beginPacket(IPAddress ip, uint16_t port);
+    int endPacket();
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buf, size_t size) override;
+
+    int parsePacket();
+    int available() override;
+    int read() override;
+    int read(uint8_t* buf, size_t len);
+    int read(char* buf, size_t len) { return read((uint8_t*)buf, len); }
+    int peek() override;
+    void flush() {}
+    IPAddress remoteIP() const { return _current.from; }
+    uint16_t remotePort() const { return _current.fromPort; }
+
+    // Called by the fake network.
+    void deliver(const fake::Datagram& datagram) { _queue.push_back(datagram); }
+    bool bound(IPAddress ip, uint16_t port) const;
+
+private:
+    bool _open = false;
+    IPAddress _address;
+    uint16_t _port = 0;
+    IPAddress _group;
+    fake::Datagram _outgoing;
+    bool _sending = false;
+    std::deque<fake::Datagram> _queue;
+    fake::Datagram _current;
+    size_t _readPos = 0;
+};
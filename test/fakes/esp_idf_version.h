@@ -0,0 +1,5 @@
+#pragma once
+
+// The fakes follow the ESP-IDF 5 APIs.
+#define ESP_IDF_VERSION_MAJOR 5
+#define ESP_IDF_VERSION_MINOR 1
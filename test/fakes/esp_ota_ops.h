@@ -0,0 +1,39 @@
+#pragma once
+
+// OTA slot bookkeeping over the fake partitions: the first two app
+// partitions added are ota_0 and ota_1, and the device runs from ota_0
+// unless a test says otherwise.
+
+#include <esp_partition.h>
+
+typedef struct {
+    uint32_t magic_word;
+    uint32_t secure_version;
+    uint32_t reserv1[2];
+    char version[32];
+    char project_name[32];
+    char time[16];
+    char date[16];
+    char idf_ver[32];
+    uint8_t app_elf_sha256[32];
+    uint32_t reserv2[20];
+} esp_app_desc_t;
+
+#define ESP_APP_DESC_MAGIC_WORD 0xABCD5432
+
+const esp_partition_t* esp_ota_get_running_partition();
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start_from);
+const esp_partition_t* esp_ota_get_boot_partition();
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition);
+// Reads the app description that follows the image and first segment
+// headers, as in a real image.
+esp_err_t esp_ota_get_partition_description(const esp_partition_t* partition, esp_app_desc_t* app_desc);
+
+namespace fake {
+
+void setRunningPartition(const esp_partition_t* partition);
+// Writes an image header and app description with this version at the
+// start of the partition, as a build would.
+void writeAppDescription(const esp_partition_t* partition, const char* version);
+
+}  // namespace fake
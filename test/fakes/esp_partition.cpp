@@ -0,0 +1,210 @@
+#include <esp_ota_ops.h>
+#include <memory>
+#include <string.h>
+
+namespace {
+
+struct Partition {
+    esp_partition_t info;
+    std::vector<uint8_t> data;
+};
+
+std::vector<std::unique_ptr<Partition>> partitions;
+fake::FlashStats stats;
+uint32_t operationsLeft = 0;
+bool armed = false;
+bool cut = false;
+const esp_partition_t* running = nullptr;
+const esp_partition_t* boot = nullptr;
+
+Partition* find(const esp_partition_t* partition) {
+    for (auto& p : partitions) {
+        if (&p->info == partition) return p.get();
+    }
+    return nullptr;
+}
+
+// Counts one erase or program against the power budget.
+bool powered() {
+    if (cut) return false;
+    if (armed && operationsLeft-- == 0) {
+        cut = true;
+        return false;
+    }
+    stats.operations++;
+    return true;
+}
+
+bool isOtaSlot(const esp_partition_t& info) {
+    return info.type == ESP_PARTITION_TYPE_APP && info.subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_0 &&
+           info.subtype <= ESP_PARTITION_SUBTYPE_APP_OTA_1;
+}
+
+}  // namespace
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size) {
+    Partition* p = find(partition);
+    if (!p || offset + size > p->data.size()) return ESP_ERR_INVALID_SIZE;
+    if (cut) return ESP_FAIL;
+    memcpy(dst, p->data.data() + offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* src, size_t size) {
+    Partition* p = find(partition);
+    if (!p || offset + size > p->data.size()) return ESP_ERR_INVALID_SIZE;
+    if (!powered()) return ESP_FAIL;
+
+    const uint8_t* in = (const uint8_t*)src;
+    bool overwrite = false;
+    for (size_t i = 0; i < size; i++) {
+        uint8_t& cell = p->data[offset + i];
+        overwrite |= (cell & in[i]) != in[i];
+        cell &= in[i];
+    }
+    stats.bytesProgrammed += size;
+    stats.overwrites += overwrite;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+    Partition* p = find(partition);
+    if (!p || offset + size > p->data.size()) return ESP_ERR_INVALID_SIZE;
+    if (offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE) return ESP_ERR_INVALID_ARG;
+    if (!powered()) return ESP_FAIL;
+
+    memset(p->data.data() + offset, 0xff, size);
+    stats.sectorsErased += size / SPI_FLASH_SEC_SIZE;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size,
+                             esp_partition_mmap_memory_t memory, const void** out_ptr,
+                             esp_partition_mmap_handle_t* out_handle) {
+    Partition* p = find(partition);
+    if (!p || offset + size > p->data.size()) return ESP_ERR_INVALID_SIZE;
+    *out_ptr = p->data.data() + offset;
+    *out_handle = ++stats.mappings;
+    return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle) {
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char* label) {
+    for (auto& p : partitions) {
+        const esp_partition_t& info = p->info;
+        if ((type == ESP_PARTITION_TYPE_ANY || info.type == type) &&
+            (subtype == ESP_PARTITION_SUBTYPE_ANY || info.subtype == subtype) &&
+            (!label || strcmp(info.label, label) == 0)) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
+
+const esp_partition_t* esp_ota_get_running_partition() {
+    if (running) return running;
+    for (auto& p : partitions) {
+        if (isOtaSlot(p->info)) return &p->info;
+    }
+    return nullptr;
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start_from) {
+    const esp_partition_t* from = start_from ? start_from : esp_ota_get_running_partition();
+    const esp_partition_t* first = nullptr;
+    bool passed = false;
+    for (auto& p : partitions) {
+        if (!isOtaSlot(p->info)) continue;
+        if (passed) return &p->info;
+        if (!first) first = &p->info;
+        passed = &p->info == from;
+    }
+    return first != from ? first : nullptr;
+}
+
+const esp_partition_t* esp_ota_get_boot_partition() {
+    return boot ? boot : esp_ota_get_running_partition();
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition) {
+    Partition* p = find(partition);
+    if (!p || !isOtaSlot(p->info) || p->data[0] != 0xE9) return ESP_ERR_INVALID_ARG;
+    if (!powered()) return ESP_FAIL;
+    boot = partition;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_get_partition_description(const esp_partition_t* partition, esp_app_desc_t* app_desc) {
+    esp_err_t err = esp_partition_read(partition, 32, app_desc, sizeof(esp_app_desc_t));
+    if (err != ESP_OK) return err;
+    return app_desc->magic_word == ESP_APP_DESC_MAGIC_WORD ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+const esp_partition_t* fake::addPartition(const char* label, esp_partition_type_t type,
+                                          esp_partition_subtype_t subtype, size_t size) {
+    size = (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    uint32_t address = 0x10000;
+    for (auto& p : partitions) address = p->info.address + p->info.size;
+
+    std::unique_ptr<Partition> p(new Partition());
+    p->info.type = type;
+    p->info.subtype = subtype;
+    p->info.address = address;
+    p->info.size = size;
+    p->info.erase_size = SPI_FLASH_SEC_SIZE;
+    strncpy(p->info.label, label, sizeof(p->info.label) - 1);
+    p->data.assign(size, 0xff);
+    partitions.push_back(std::move(p));
+    return &partitions.back()->info;
+}
+
+std::vector<uint8_t>& fake::flash(const esp_partition_t* partition) {
+    return find(partition)->data;
+}
+
+fake::FlashStats& fake::flashStats() {
+    return stats;
+}
+
+void fake::cutPowerAfter(uint32_t operations) {
+    armed = true;
+    operationsLeft = operations;
+    cut = false;
+}
+
+bool fake::powerCut() {
+    return cut;
+}
+
+void fake::restorePower() {
+    armed = false;
+    cut = false;
+}
+
+void fake::resetFlash() {
+    partitions.clear();
+    stats = FlashStats();
+    armed = false;
+    cut = false;
+    running = nullptr;
+    boot = nullptr;
+}
+
+void fake::setRunningPartition(const esp_partition_t* partition) {
+    running = partition;
+    boot = nullptr;
+}
+
+void fake::writeAppDescription(const esp_partition_t* partition, const char* version) {
+    std::vector<uint8_t>& data = flash(partition);
+    uint8_t header[32] = { 0xE9, 1 };
+    esp_app_desc_t desc = {};
+    desc.magic_word = ESP_APP_DESC_MAGIC_WORD;
+    strncpy(desc.version, version, sizeof(desc.version) - 1);
+    strncpy(desc.project_name, "bitflash", sizeof(desc.project_name) - 1);
+    memcpy(data.data(), header, sizeof(header));
+    memcpy(data.data() + sizeof(header), &desc, sizeof(desc));
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+// Partitions on simulated NOR flash: erase sets a sector to 0xFF and
+// programming can only clear bits, so writing over unerased data corrupts
+// it the way real flash does. Tests add partitions and inspect their
+// contents and the erase/program counters through fake::.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01,
+    ESP_PARTITION_TYPE_ANY = 0xff,
+} esp_partition_type_t;
+
+typedef enum {
+    ESP_PARTITION_SUBTYPE_APP_FACTORY = 0x00,
+    ESP_PARTITION_SUBTYPE_APP_OTA_0 = 0x10,
+    ESP_PARTITION_SUBTYPE_APP_OTA_1 = 0x11,
+    ESP_PARTITION_SUBTYPE_DATA_OTA = 0x00,
+    ESP_PARTITION_SUBTYPE_DATA_NVS = 0x02,
+    ESP_PARTITION_SUBTYPE_DATA_UNDEFINED = 0x06,
+    ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct {
+    void* flash_chip;
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    uint32_t erase_size;
+    char label[17];
+    bool encrypted;
+} esp_partition_t;
+
+typedef enum {
+    ESP_PARTITION_MMAP_DATA,
+    ESP_PARTITION_MMAP_INST,
+} esp_partition_mmap_memory_t;
+
+typedef uint32_t esp_partition_mmap_handle_t;
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size);
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size,
+                             esp_partition_mmap_memory_t memory, const void** out_ptr,
+                             esp_partition_mmap_handle_t* out_handle);
+void esp_partition_munmap(esp_partition_mmap_handle_t handle);
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char* label);
+
+namespace fake {
+
+struct FlashStats {
+    uint32_t sectorsErased = 0;
+    uint32_t bytesProgrammed = 0;
+    // Programs that tried to set a cleared bit, i.e. wrote without an erase
+    uint32_t overwrites = 0;
+    uint32_t mappings = 0;
+    // Erase, program and boot-partition calls, as counted by cutPowerAfter()
+    uint32_t operations = 0;
+};
+
+// Adds a partition filled with 0xFF. Size is rounded up to whole sectors.
+const esp_partition_t* addPartition(const char* label, esp_partition_type_t type,
+                                    esp_partition_subtype_t subtype, size_t size);
+std::vector<uint8_t>& flash(const esp_partition_t* partition);
+FlashStats& flashStats();
+// After this many more erases or programs, every flash operation fails
+// and nothing more changes: the power was cut.
+void cutPowerAfter(uint32_t operations);
+bool powerCut();
+// Back to normal operation, as after a reboot.
+void restorePower();
+// Drops all partitions, counters and OTA state.
+void resetFlash();
+
+}  // namespace fake
@@ -0,0 +1,28 @@
+#pragma once
+
+// FreeRTOS queues, semaphores and tasks on std::thread. One tick is one
+// millisecond of real time.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL 0
+#define pdPASS 1
+#define portMAX_DELAY ((TickType_t)0xffffffff)
+#define portTICK_PERIOD_MS 1
+#define portNUM_PROCESSORS 2
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskNO_AFFINITY 0x7fffffff
+
+struct FakeQueue;
+struct FakeTask;
+typedef FakeQueue* QueueHandle_t;
+typedef FakeQueue* SemaphoreHandle_t;
+typedef FakeTask* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
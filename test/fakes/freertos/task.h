@@ -0,0 +1,19 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+// Runs the task on a detached thread; the core is only recorded.
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stackSize, void* arg,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+// Only deleting the calling task is supported, and the thread ends when
+// the task function returns.
+void vTaskDelete(TaskHandle_t task);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+
+namespace fake {
+// Tasks started so far and the core of the last one.
+int tasksCreated();
+BaseType_t lastTaskCore();
+}
@@ -0,0 +1,447 @@
+#include <mbedtls/aes.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <string.h>
+#include <string>
+
+struct mbedtls_md_info_t {
+    mbedtls_md_type_t type;
+    const EVP_MD* (*md)();
+};
+
+static const mbedtls_md_info_t kSha1 = { MBEDTLS_MD_SHA1, EVP_sha1 };
+static const mbedtls_md_info_t kSha256 = { MBEDTLS_MD_SHA256, EVP_sha256 };
+
+const mbedtls_md_info_t* mbedtls_md_info_from_type(mbedtls_md_type_t type) {
+    switch (type) {
+    case MBEDTLS_MD_SHA1: return &kSha1;
+    case MBEDTLS_MD_SHA256: return &kSha256;
+    default: return nullptr;
+    }
+}
+
+unsigned char mbedtls_md_get_size(const mbedtls_md_info_t* info) {
+    return info ? EVP_MD_get_size(info->md()) : 0;
+}
+
+void mbedtls_md_init(mbedtls_md_context_t* ctx) {
+    ctx->md_info = nullptr;
+    ctx->md_ctx = nullptr;
+}
+
+void mbedtls_md_free(mbedtls_md_context_t* ctx) {
+    EVP_MD_CTX_free((EVP_MD_CTX*)ctx->md_ctx);
+    mbedtls_md_init(ctx);
+}
+
+int mbedtls_md_setup(mbedtls_md_context_t* ctx, const mbedtls_md_info_t* info, int hmac) {
+    if (!info || hmac) return -1;
+    ctx->md_info = info;
+    ctx->md_ctx = EVP_MD_CTX_new();
+    return ctx->md_ctx ? 0 : -1;
+}
+
+int mbedtls_md_starts(mbedtls_md_context_t* ctx) {
+    if (!ctx->md_ctx) return -1;
+    return EVP_DigestInit_ex((EVP_MD_CTX*)ctx->md_ctx, ctx->md_info->md(), nullptr) == 1 ? 0 : -1;
+}
+
+int mbedtls_md_update(mbedtls_md_context_t* ctx, const unsigned char* input, size_t len) {
+    if (!ctx->md_ctx) return -1;
+    return EVP_DigestUpdate((EVP_MD_CTX*)ctx->md_ctx, input, len) == 1 ? 0 : -1;
+}
+
+int mbedtls_md_finish(mbedtls_md_context_t* ctx, unsigned char* output) {
+    if (!ctx->md_ctx) return -1;
+    return EVP_DigestFinal_ex((EVP_MD_CTX*)ctx->md_ctx, output, nullptr) == 1 ? 0 : -1;
+}
+
+int mbedtls_md(const mbedtls_md_info_t* info, const unsigned char* input, size_t len, unsigned char* output) {
+    if (!info) return -1;
+    return EVP_Digest(input, len, output, nullptr, info->md(), nullptr) == 1 ? 0 : -1;
+}
+
+void mbedtls_aes_init(mbedtls_aes_context* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_aes_free(mbedtls_aes_context* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int mbedtls_aes_setkey_enc(mbedtls_aes_context* ctx, const unsigned char* key, unsigned int bits) {
+    if (bits != 128 && bits != 192 && bits != 256) return MBEDTLS_ERR_AES_INVALID_KEY_LENGTH;
+    memcpy(ctx->key, key, bits / 8);
+    ctx->bits = bits;
+    return 0;
+}
+
+static int encryptBlock(const mbedtls_aes_context* ctx, const unsigned char in[16], unsigned char out[16]) {
+    const EVP_CIPHER* cipher = ctx->bits == 128 ? EVP_aes_128_ecb() : ctx->bits == 192 ? EVP_aes_192_ecb() : EVP_aes_256_ecb();
+    EVP_CIPHER_CTX* c = EVP_CIPHER_CTX_new();
+    int n = 0;
+    bool ok = EVP_EncryptInit_ex(c, cipher, nullptr, ctx->key, nullptr) == 1 &&
+              EVP_CIPHER_CTX_set_padding(c, 0) == 1 &&
+              EVP_EncryptUpdate(c, out, &n, in, 16) == 1 && n == 16;
+    EVP_CIPHER_CTX_free(c);
+    return ok ? 0 : -1;
+}
+
+// Same bookkeeping as mbedtls: nc_off is the position in stream_block, and
+// the counter is a 128-bit big-endian number.
+int mbedtls_aes_crypt_ctr(mbedtls_aes_context* ctx, size_t length, size_t* nc_off,
+                          unsigned char nonce_counter[16], unsigned char stream_block[16],
+                          const unsigned char* input, unsigned char* output) {
+    if (!ctx->bits || *nc_off > 15) return -1;
+    size_t n = *nc_off;
+    for (size_t i = 0; i < length; i++) {
+        if (n == 0) {
+            if (encryptBlock(ctx, nonce_counter, stream_block) != 0) return -1;
+            for (int j = 15; j >= 0 && ++nonce_counter[j] == 0; j--) {
+            }
+        }
+        output[i] = input[i] ^ stream_block[n];
+        n = (n + 1) & 15;
+    }
+    *nc_off = n;
+    return 0;
+}
+
+static const char kBase64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+int mbedtls_base64_encode(unsigned char* dst, size_t dlen, size_t* olen, const unsigned char* src, size_t slen) {
+    size_t needed = (slen + 2) / 3 * 4;
+    *olen = needed + 1;
+    if (dlen < needed + 1) return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+
+    unsigned char* p = dst;
+    for (size_t i = 0; i < slen; i += 3) {
+        uint32_t v = src[i] << 16 | (i + 1 < slen ? src[i + 1] << 8 : 0) | (i + 2 < slen ? src[i + 2] : 0);
+        *p++ = kBase64[v >> 18 & 63];
+        *p++ = kBase64[v >> 12 & 63];
+        *p++ = i + 1 < slen ? kBase64[v >> 6 & 63] : '=';
+        *p++ = i + 2 < slen ? kBase64[v & 63] : '=';
+    }
+    *p = 0;
+    *olen = needed;
+    return 0;
+}
+
+// Skips line breaks like mbedtls; with dst == nullptr only reports the size.
+int mbedtls_base64_decode(unsigned char* dst, size_t dlen, size_t* olen, const unsigned char* src, size_t slen) {
+    uint32_t v = 0;
+    size_t bits = 0;
+    size_t n = 0;
+    size_t padding = 0;
+    for (size_t i = 0; i < slen; i++) {
+        if (src[i] == '\r' || src[i] == '\n' || src[i] == ' ') continue;
+        if (src[i] == '=') {
+            if (++padding > 2) return MBEDTLS_ERR_BASE64_INVALID_CHARACTER;
+            continue;
+        }
+        const char* c = (const char*)memchr(kBase64, src[i], 64);
+        if (!c || padding) return MBEDTLS_ERR_BASE64_INVALID_CHARACTER;
+        v = v << 6 | (uint32_t)(c - kBase64);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (dst && n < dlen) dst[n] = v >> bits;
+            n++;
+        }
+    }
+    *olen = n;
+    if (!dst || dlen < n) return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+    return 0;
+}
+
+void mbedtls_pk_init(mbedtls_pk_context* ctx) {
+    ctx->key = nullptr;
+}
+
+void mbedtls_pk_free(mbedtls_pk_context* ctx) {
+    EVP_PKEY_free((EVP_PKEY*)ctx->key);
+    ctx->key = nullptr;
+}
+
+// Like mbedtls, PEM keys must include the terminating NUL in keylen.
+int mbedtls_pk_parse_public_key(mbedtls_pk_context* ctx, const unsigned char* key, size_t keylen) {
+    EVP_PKEY* pkey = nullptr;
+    if (keylen > 0 && key[keylen - 1] == '\0') {
+        BIO* bio = BIO_new_mem_buf(key, keylen - 1);
+        pkey = PEM_read_bio_PUBKEY(bio, nullptr, nullptr, nullptr);
+        BIO_free(bio);
+    } else {
+        pkey = d2i_PUBKEY(nullptr, &key, keylen);
+    }
+    if (!pkey) return MBEDTLS_ERR_PK_KEY_INVALID_FORMAT;
+    mbedtls_pk_free(ctx);
+    ctx->key = pkey;
+    return 0;
+}
+
+size_t mbedtls_pk_get_len(const mbedtls_pk_context* ctx) {
+    return ctx->key ? (EVP_PKEY_get_bits((EVP_PKEY*)ctx->key) + 7) / 8 : 0;
+}
+
+int mbedtls_pk_verify(mbedtls_pk_context* ctx, mbedtls_md_type_t md_alg, const unsigned char* hash,
+                      size_t hash_len, const unsigned char* sig, size_t sig_len) {
+    const mbedtls_md_info_t* info = mbedtls_md_info_from_type(md_alg);
+    if (!ctx->key || !info) return MBEDTLS_ERR_PK_BAD_INPUT_DATA;
+
+    EVP_PKEY_CTX* c = EVP_PKEY_CTX_new((EVP_PKEY*)ctx->key, nullptr);
+    bool ok = c && EVP_PKEY_verify_init(c) == 1 &&
+              EVP_PKEY_CTX_set_signature_md(c, info->md()) == 1 &&
+              EVP_PKEY_verify(c, sig, sig_len, hash, hash_len) == 1;
+    EVP_PKEY_CTX_free(c);
+    return ok ? 0 : MBEDTLS_ERR_PK_VERIFY_FAILED;
+}
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt* crt) {
+    crt->certs = nullptr;
+}
+
+void mbedtls_x509_crt_free(mbedtls_x509_crt* crt) {
+    sk_X509_pop_free((STACK_OF(X509)*)crt->certs, X509_free);
+    crt->certs = nullptr;
+}
+
+int mbedtls_x509_crt_parse(mbedtls_x509_crt* chain, const unsigned char* buf, size_t buflen) {
+    if (buflen == 0 || buf[buflen - 1] != '\0') return MBEDTLS_ERR_X509_INVALID_FORMAT;
+    if (!chain->certs) chain->certs = sk_X509_new_null();
+
+    BIO* bio = BIO_new_mem_buf(buf, buflen - 1);
+    int parsed = 0;
+    while (X509* cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr)) {
+        sk_X509_push((STACK_OF(X509)*)chain->certs, cert);
+        parsed++;
+    }
+    BIO_free(bio);
+    return parsed > 0 ? 0 : MBEDTLS_ERR_X509_INVALID_FORMAT;
+}
+
+void mbedtls_ssl_config_init(mbedtls_ssl_config* conf) {
+    memset(conf, 0, sizeof(*conf));
+}
+
+void mbedtls_ssl_config_free(mbedtls_ssl_config* conf) {
+    mbedtls_ssl_config_init(conf);
+}
+
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config* conf, int endpoint, int transport, int preset) {
+    if (endpoint != MBEDTLS_SSL_IS_CLIENT) return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    conf->authmode = MBEDTLS_SSL_VERIFY_REQUIRED;
+    conf->max_tls_version = MBEDTLS_SSL_VERSION_TLS1_2;
+    return 0;
+}
+
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config* conf, int (*f_rng)(void*, unsigned char*, size_t), void* p_rng) {
+    conf->f_rng = f_rng;
+    conf->p_rng = p_rng;
+}
+
+void mbedtls_ssl_conf_ciphersuites(mbedtls_ssl_config* conf, const int* ciphersuites) {
+    conf->ciphersuites = ciphersuites;
+}
+
+void mbedtls_ssl_conf_groups(mbedtls_ssl_config* conf, const uint16_t* groups) {
+    conf->groups = groups;
+}
+
+void mbedtls_ssl_conf_max_tls_version(mbedtls_ssl_config* conf, mbedtls_ssl_protocol_version version) {
+    conf->max_tls_version = version;
+}
+
+int mbedtls_ssl_conf_max_frag_len(mbedtls_ssl_config* conf, unsigned char mfl_code) {
+    if (mfl_code > MBEDTLS_SSL_MAX_FRAG_LEN_4096) return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    conf->mfl_code = mfl_code;
+    return 0;
+}
+
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config* conf, mbedtls_x509_crt* ca_chain, mbedtls_x509_crl* ca_crl) {
+    conf->ca_chain = ca_chain;
+}
+
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config* conf, int authmode) {
+    conf->authmode = authmode;
+}
+
+void mbedtls_ssl_init(mbedtls_ssl_context* ssl) {
+    memset(ssl, 0, sizeof(*ssl));
+}
+
+void mbedtls_ssl_free(mbedtls_ssl_context* ssl) {
+    SSL_free((SSL*)ssl->ssl);
+    SSL_CTX_free((SSL_CTX*)ssl->ctx);
+    mbedtls_ssl_init(ssl);
+}
+
+static const char* suiteName(int suite) {
+    switch (suite) {
+    case MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256: return "ECDHE-ECDSA-AES128-GCM-SHA256";
+    case MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256: return "ECDHE-RSA-AES128-GCM-SHA256";
+    case MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384: return "ECDHE-ECDSA-AES256-GCM-SHA384";
+    case MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384: return "ECDHE-RSA-AES256-GCM-SHA384";
+    default: return nullptr;
+    }
+}
+
+static const char* groupName(uint16_t group) {
+    switch (group) {
+    case MBEDTLS_SSL_IANA_TLS_GROUP_SECP256R1: return "P-256";
+    case MBEDTLS_SSL_IANA_TLS_GROUP_SECP384R1: return "P-384";
+    case MBEDTLS_SSL_IANA_TLS_GROUP_X25519: return "X25519";
+    default: return nullptr;
+    }
+}
+
+// The BIO under the OpenSSL session calls the mbedtls callbacks. Their
+// WANT_READ and WANT_WRITE become retries.
+static int bioWrite(BIO* bio, const char* data, int len) {
+    mbedtls_ssl_context* ssl = (mbedtls_ssl_context*)BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    int n = ssl->f_send(ssl->p_bio, (const unsigned char*)data, len);
+    if (n == MBEDTLS_ERR_SSL_WANT_WRITE) BIO_set_retry_write(bio);
+    return n > 0 ? n : -1;
+}
+
+static int bioRead(BIO* bio, char* data, int len) {
+    mbedtls_ssl_context* ssl = (mbedtls_ssl_context*)BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    int n = ssl->f_recv(ssl->p_bio, (unsigned char*)data, len);
+    if (n == MBEDTLS_ERR_SSL_WANT_READ) BIO_set_retry_read(bio);
+    return n > 0 ? n : -1;
+}
+
+static long bioCtrl(BIO* bio, int cmd, long num, void* ptr) {
+    return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+}
+
+static BIO_METHOD* bioMethod() {
+    static BIO_METHOD* method = nullptr;
+    if (!method) {
+        method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "mbedtls callbacks");
+        BIO_meth_set_write(method, bioWrite);
+        BIO_meth_set_read(method, bioRead);
+        BIO_meth_set_ctrl(method, bioCtrl);
+    }
+    return method;
+}
+
+int mbedtls_ssl_setup(mbedtls_ssl_context* ssl, const mbedtls_ssl_config* conf) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    ssl->conf = conf;
+    ssl->ctx = ctx;
+
+    SSL_CTX_set_max_proto_version(ctx, conf->max_tls_version == MBEDTLS_SSL_VERSION_TLS1_3 ? TLS1_3_VERSION
+                                                                                            : TLS1_2_VERSION);
+    if (conf->ciphersuites) {
+        std::string list;
+        for (const int* suite = conf->ciphersuites; *suite; suite++) {
+            if (!suiteName(*suite)) continue;
+            list += (list.empty() ? "" : ":") + std::string(suiteName(*suite));
+        }
+        if (SSL_CTX_set_cipher_list(ctx, list.c_str()) != 1) return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+    if (conf->groups) {
+        std::string list;
+        for (const uint16_t* group = conf->groups; *group; group++) {
+            if (!groupName(*group)) continue;
+            list += (list.empty() ? "" : ":") + std::string(groupName(*group));
+        }
+        if (SSL_CTX_set1_groups_list(ctx, list.c_str()) != 1) return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+    if (conf->ca_chain && conf->ca_chain->certs) {
+        STACK_OF(X509)* certs = (STACK_OF(X509)*)conf->ca_chain->certs;
+        for (int i = 0; i < sk_X509_num(certs); i++) {
+            X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx), sk_X509_value(certs, i));
+        }
+    }
+    SSL_CTX_set_verify(ctx, conf->authmode == MBEDTLS_SSL_VERIFY_REQUIRED ? SSL_VERIFY_PEER : SSL_VERIFY_NONE,
+                       nullptr);
+    // Like mbedtls: records go out as written, and may be shorter than asked
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    SSL* session = SSL_new(ctx);
+    if (!session) return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    ssl->ssl = session;
+    if (conf->mfl_code != MBEDTLS_SSL_MAX_FRAG_LEN_NONE) {
+        SSL_set_tlsext_max_fragment_length(session, conf->mfl_code);
+    }
+    BIO* bio = BIO_new(bioMethod());
+    BIO_set_data(bio, ssl);
+    BIO_set_init(bio, 1);
+    SSL_set_bio(session, bio, bio);
+    SSL_set_connect_state(session);
+    return 0;
+}
+
+// Also the name the certificate is checked against, as in mbedtls.
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context* ssl, const char* hostname) {
+    SSL* session = (SSL*)ssl->ssl;
+    if (!session || SSL_set_tlsext_host_name(session, hostname) != 1 || SSL_set1_host(session, hostname) != 1) {
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+    return 0;
+}
+
+void mbedtls_ssl_set_bio(mbedtls_ssl_context* ssl, void* p_bio, mbedtls_ssl_send_t* f_send,
+                         mbedtls_ssl_recv_t* f_recv, mbedtls_ssl_recv_timeout_t* f_recv_timeout) {
+    ssl->p_bio = p_bio;
+    ssl->f_send = f_send;
+    ssl->f_recv = f_recv;
+}
+
+static int sslError(mbedtls_ssl_context* ssl, int ret) {
+    SSL* session = (SSL*)ssl->ssl;
+    switch (SSL_get_error(session, ret)) {
+    case SSL_ERROR_WANT_READ: return MBEDTLS_ERR_SSL_WANT_READ;
+    case SSL_ERROR_WANT_WRITE: return MBEDTLS_ERR_SSL_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN: return MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY;
+    default:
+        ERR_clear_error();
+        if (SSL_get_verify_result(session) != X509_V_OK) return MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+        return MBEDTLS_ERR_SSL_HANDSHAKE_FAILURE;
+    }
+}
+
+int mbedtls_ssl_handshake(mbedtls_ssl_context* ssl) {
+    if (!ssl->ssl || !ssl->f_send) return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    int ret = SSL_do_handshake((SSL*)ssl->ssl);
+    return ret == 1 ? 0 : sslError(ssl, ret);
+}
+
+// A read of 0 bytes only processes the next record, leaving its data for
+// mbedtls_ssl_get_bytes_avail().
+int mbedtls_ssl_read(mbedtls_ssl_context* ssl, unsigned char* buf, size_t len) {
+    if (!ssl->ssl) return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    unsigned char probe;
+    int ret = len == 0 ? SSL_peek((SSL*)ssl->ssl, &probe, 1) : SSL_read((SSL*)ssl->ssl, buf, len);
+    if (ret > 0) return len == 0 ? 0 : ret;
+    return sslError(ssl, ret);
+}
+
+int mbedtls_ssl_write(mbedtls_ssl_context* ssl, const unsigned char* buf, size_t len) {
+    if (!ssl->ssl) return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    int ret = SSL_write((SSL*)ssl->ssl, buf, len);
+    return ret > 0 ? ret : sslError(ssl, ret);
+}
+
+size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context* ssl) {
+    return ssl->ssl ? SSL_pending((SSL*)ssl->ssl) : 0;
+}
+
+int mbedtls_ssl_close_notify(mbedtls_ssl_context* ssl) {
+    if (!ssl->ssl) return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    SSL_shutdown((SSL*)ssl->ssl);
+    return 0;
+}
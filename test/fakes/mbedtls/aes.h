@@ -0,0 +1,21 @@
+#pragma once
+
+// mbedtls AES on top of OpenSSL. Only the encrypt direction, which is all
+// CTR mode needs.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MBEDTLS_ERR_AES_INVALID_KEY_LENGTH -0x0020
+
+typedef struct {
+    unsigned char key[32];
+    unsigned int bits;
+} mbedtls_aes_context;
+
+void mbedtls_aes_init(mbedtls_aes_context* ctx);
+void mbedtls_aes_free(mbedtls_aes_context* ctx);
+int mbedtls_aes_setkey_enc(mbedtls_aes_context* ctx, const unsigned char* key, unsigned int bits);
+int mbedtls_aes_crypt_ctr(mbedtls_aes_context* ctx, size_t length, size_t* nc_off,
+                          unsigned char nonce_counter[16], unsigned char stream_block[16],
+                          const unsigned char* input, unsigned char* output);
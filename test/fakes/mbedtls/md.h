@@ -0,0 +1,30 @@
+#pragma once
+
+// mbedtls message digests on top of OpenSSL.
+
+#include <stddef.h>
+
+#define MBEDTLS_MD_MAX_SIZE 64
+
+typedef enum {
+    MBEDTLS_MD_NONE = 0,
+    MBEDTLS_MD_SHA1,
+    MBEDTLS_MD_SHA256,
+} mbedtls_md_type_t;
+
+typedef struct mbedtls_md_info_t mbedtls_md_info_t;
+
+typedef struct {
+    const mbedtls_md_info_t* md_info;
+    void* md_ctx;
+} mbedtls_md_context_t;
+
+const mbedtls_md_info_t* mbedtls_md_info_from_type(mbedtls_md_type_t type);
+unsigned char mbedtls_md_get_size(const mbedtls_md_info_t* info);
+void mbedtls_md_init(mbedtls_md_context_t* ctx);
+void mbedtls_md_free(mbedtls_md_context_t* ctx);
+int mbedtls_md_setup(mbedtls_md_context_t* ctx, const mbedtls_md_info_t* info, int hmac);
+int mbedtls_md_starts(mbedtls_md_context_t* ctx);
+int mbedtls_md_update(mbedtls_md_context_t* ctx, const unsigned char* input, size_t len);
+int mbedtls_md_finish(mbedtls_md_context_t* ctx, unsigned char* output);
+int mbedtls_md(const mbedtls_md_info_t* info, const unsigned char* input, size_t len, unsigned char* output);
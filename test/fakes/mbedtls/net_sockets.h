@@ -0,0 +1,6 @@
+#pragma once
+
+// Only the error codes; connections go through the caller's callbacks.
+
+#define MBEDTLS_ERR_NET_SEND_FAILED -0x004E
+#define MBEDTLS_ERR_NET_CONN_RESET -0x0050
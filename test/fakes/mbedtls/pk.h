@@ -0,0 +1,21 @@
+#pragma once
+
+// mbedtls public keys on top of OpenSSL: PEM or DER, RSA or EC.
+
+#include <mbedtls/md.h>
+
+#define MBEDTLS_PK_SIGNATURE_MAX_SIZE 1024
+#define MBEDTLS_ERR_PK_KEY_INVALID_FORMAT -0x3D00
+#define MBEDTLS_ERR_PK_BAD_INPUT_DATA -0x3E80
+#define MBEDTLS_ERR_PK_VERIFY_FAILED -0x4300
+
+typedef struct {
+    void* key;
+} mbedtls_pk_context;
+
+void mbedtls_pk_init(mbedtls_pk_context* ctx);
+void mbedtls_pk_free(mbedtls_pk_context* ctx);
+int mbedtls_pk_parse_public_key(mbedtls_pk_context* ctx, const unsigned char* key, size_t keylen);
+size_t mbedtls_pk_get_len(const mbedtls_pk_context* ctx);
+int mbedtls_pk_verify(mbedtls_pk_context* ctx, mbedtls_md_type_t md_alg, const unsigned char* hash,
+                      size_t hash_len, const unsigned char* sig, size_t sig_len);
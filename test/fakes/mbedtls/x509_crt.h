@@ -0,0 +1,19 @@
+#pragma once
+
+// mbedtls certificate chains on top of OpenSSL: PEM only.
+
+#include <stddef.h>
+
+#define MBEDTLS_ERR_X509_CERT_VERIFY_FAILED -0x2700
+#define MBEDTLS_ERR_X509_INVALID_FORMAT -0x2180
+
+typedef struct mbedtls_x509_crl mbedtls_x509_crl;
+
+typedef struct {
+    void* certs;  // STACK_OF(X509)
+} mbedtls_x509_crt;
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt* crt);
+void mbedtls_x509_crt_free(mbedtls_x509_crt* crt);
+// Like mbedtls, PEM must include the terminating NUL in buflen.
+int mbedtls_x509_crt_parse(mbedtls_x509_crt* chain, const unsigned char* buf, size_t buflen);
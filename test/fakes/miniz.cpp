@@ -0,0 +1,47 @@
+#include <rom/miniz.h>
+#include <zlib.h>
+
+tinfl_status tinfl_decompress(tinfl_decompressor* r, const uint8_t* pIn_buf_next, size_t* pIn_buf_size,
+                              uint8_t* pOut_buf_start, uint8_t* pOut_buf_next, size_t* pOut_buf_size,
+                              const uint32_t decomp_flags) {
+    if (decomp_flags & (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF)) {
+        return TINFL_STATUS_BAD_PARAM;
+    }
+
+    // tinfl_init() only clears m_state, so a stream from an earlier run is
+    // not released here; the tests can afford that
+    z_stream* stream = (z_stream*)r->m_stream;
+    if (r->m_state == 0) {
+        stream = new z_stream();
+        if (inflateInit2(stream, -15) != Z_OK ||
+            inflateSetDictionary(stream, pOut_buf_start, TINFL_LZ_DICT_SIZE) != Z_OK) {
+            return TINFL_STATUS_FAILED;
+        }
+        r->m_stream = stream;
+        r->m_state = 1;
+    } else if (r->m_state == 2) {
+        *pIn_buf_size = 0;
+        *pOut_buf_size = 0;
+        return TINFL_STATUS_DONE;
+    }
+
+    stream->next_in = (Bytef*)pIn_buf_next;
+    stream->avail_in = *pIn_buf_size;
+    stream->next_out = pOut_buf_next;
+    stream->avail_out = *pOut_buf_size;
+    int ret = inflate(stream, Z_NO_FLUSH);
+    *pIn_buf_size -= stream->avail_in;
+    *pOut_buf_size -= stream->avail_out;
+
+    if (ret == Z_STREAM_END) {
+        inflateEnd(stream);
+        delete stream;
+        r->m_stream = nullptr;
+        r->m_state = 2;
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) return TINFL_STATUS_FAILED;
+    if (stream->avail_out == 0) return TINFL_STATUS_HAS_MORE_OUTPUT;
+    return decomp_flags & TINFL_FLAG_HAS_MORE_INPUT ? TINFL_STATUS_NEEDS_MORE_INPUT
+                                                    : TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS;
+}
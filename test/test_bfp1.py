@@ -0,0 +1,66 @@
+import os
+import tempfile
+import unittest
+
+import bfp1
+from bench_patches import synthetic_releases
+
+
+class Bfp1Test(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.releases = synthetic_releases(4, 120000)
+        cls.old = cls.releases["1.0.0"]
+        cls.new = cls.releases["1.0.3"]
+
+    def test_rebuilds_the_new_image(self):
+        patch = bfp1.diff(self.old, self.new)
+        self.assertEqual(self.new, bfp1.apply(self.old, patch))
+        self.assertLess(len(patch), len(self.new) // 5)
+
+    def test_in_place_patch_only_reads_ahead(self):
+        patch = bfp1.diff(self.old, self.new, in_place=True)
+        self.assertEqual(self.new, bfp1.apply(self.old, patch, in_place=True))
+        self.assertEqual(self.new, bfp1.apply(self.old, patch))
+
+    def test_shifted_code_needs_an_in_place_patch(self):
+        # Everything moves back by 100 bytes, so an A/B patch copies from
+        # sectors an in-place update has already rewritten
+        new = bytes(100) + self.old
+        patch = bfp1.diff(self.old, new)
+        self.assertEqual(new, bfp1.apply(self.old, patch))
+        with self.assertRaises(ValueError):
+            bfp1.apply(self.old, patch, in_place=True)
+
+        patch = bfp1.diff(self.old, new, in_place=True)
+        self.assertEqual(new, bfp1.apply(self.old, patch, in_place=True))
+
+    def test_unchanged_image_is_one_copy(self):
+        patch = bfp1.diff(self.old, self.old)
+        self.assertEqual(16 + 9, len(patch))
+        self.assertEqual(self.old, bfp1.apply(self.old, patch, in_place=True))
+
+    def test_small_and_empty_images(self):
+        for new in (b"", b"\xe9", b"\xe9short image"):
+            patch = bfp1.diff(self.old, new)
+            self.assertEqual(new, bfp1.apply(self.old, patch))
+
+    def test_rejects_malformed_patches(self):
+        patch = bfp1.diff(self.old, self.new)
+        for bad in (b"XFP1" + patch[4:], patch[:-1], patch + b"\x02\x01\x00\x00\x00x", patch + b"\x07"):
+            with self.assertRaises(ValueError):
+                bfp1.apply(self.old, bad)
+
+    def test_command_line(self):
+        with tempfile.TemporaryDirectory() as directory:
+            paths = [os.path.join(directory, name) for name in ("old.bin", "new.bin", "p.bfp")]
+            for path, data in zip(paths, (self.old, self.new)):
+                with open(path, "wb") as f:
+                    f.write(data)
+            self.assertEqual(0, bfp1.main(["--in-place"] + paths))
+            with open(paths[2], "rb") as f:
+                self.assertEqual(self.new, bfp1.apply(self.old, f.read(), in_place=True))
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,119 @@
+#include "BitFlash_Checksum.h"
+#include "BitFlash_Stages.h"
+#include "test_data.h"
+#include <gtest/gtest.h>
+#include <zlib.h>
+#include <random>
+
+namespace {
+
+uint32_t crcOf(const char* text) {
+    return BitFlash_Checksum::crc32(0, (const uint8_t*)text, strlen(text));
+}
+
+uint32_t adlerOf(const char* text) {
+    return BitFlash_Checksum::adler32(1, (const uint8_t*)text, strlen(text));
+}
+
+// One byte at a time, straight from the definitions.
+uint32_t referenceCrc(uint32_t crc, const uint8_t* data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+uint32_t referenceAdler(uint32_t adler, const uint8_t* data, size_t len) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    for (size_t i = 0; i < len; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+class ChecksumTest : public ::testing::Test {
+protected:
+    void SetUp() override { Update.reset(); }
+};
+
+TEST_F(ChecksumTest, MatchesKnownAnswers) {
+    EXPECT_EQ(0xCBF43926u, crcOf("123456789"));
+    EXPECT_EQ(0x414FA339u, crcOf("The quick brown fox jumps over the lazy dog"));
+    EXPECT_EQ(0u, crcOf(""));
+
+    EXPECT_EQ(0x11E60398u, adlerOf("Wikipedia"));
+    EXPECT_EQ(0x024D0127u, adlerOf("abc"));
+    EXPECT_EQ(1u, adlerOf(""));
+}
+
+// Every length around the eight-byte steps, from every alignment, so the
+// lead-in, the unrolled loop and the tail all get their turn.
+TEST_F(ChecksumTest, MatchesTheReferenceAtEveryLengthAndAlignment) {
+    std::vector<uint8_t> data = randomBytes(128, 1);
+    for (size_t start = 0; start < 8; start++) {
+        for (size_t len = 0; len + start <= 80; len++) {
+            const uint8_t* p = data.data() + start;
+            EXPECT_EQ(referenceCrc(0, p, len), BitFlash_Checksum::crc32(0, p, len)) << start << "+" << len;
+            EXPECT_EQ(referenceAdler(1, p, len), BitFlash_Checksum::adler32(1, p, len)) << start << "+" << len;
+        }
+    }
+}
+
+TEST_F(ChecksumTest, ContinuesAcrossCalls) {
+    std::vector<uint8_t> data = randomBytes(20000, 2);
+    uint32_t crc = 0;
+    uint32_t adler = 1;
+    std::mt19937 generator(3);
+    for (size_t pos = 0; pos < data.size(); ) {
+        size_t n = std::min<size_t>(generator() % 3000, data.size() - pos);
+        crc = BitFlash_Checksum::crc32(crc, data.data() + pos, n);
+        adler = BitFlash_Checksum::adler32(adler, data.data() + pos, n);
+        pos += n;
+    }
+    EXPECT_EQ(::crc32(0, data.data(), data.size()), crc);
+    EXPECT_EQ(::adler32(1, data.data(), data.size()), adler);
+}
+
+// All 0xff is the worst case for the sums between two reductions.
+TEST_F(ChecksumTest, AdlerSumsDoNotOverflowBetweenReductions) {
+    std::vector<uint8_t> data(5552 * 3 + 7, 0xff);
+    EXPECT_EQ(::adler32(1, data.data(), data.size()), BitFlash_Checksum::adler32(1, data.data(), data.size()));
+    // Continuing from the largest possible state
+    uint32_t start = (65520u << 16) | 65520;
+    EXPECT_EQ(referenceAdler(start, data.data(), data.size()),
+              BitFlash_Checksum::adler32(start, data.data(), data.size()));
+}
+
+TEST_F(ChecksumTest, StageCommitsOnlyMatchingImages) {
+    std::vector<uint8_t> image = randomBytes(9999, 4);
+    uint32_t crc = ::crc32(0, image.data(), image.size());
+    uint32_t adler = ::adler32(1, image.data(), image.size());
+
+    struct Case {
+        BitFlash_ChecksumStage::Algorithm algorithm;
+        uint32_t expected;
+        bool ok;
+    } cases[] = {
+        { BitFlash_ChecksumStage::kCrc32, crc, true },
+        { BitFlash_ChecksumStage::kCrc32, crc ^ 1, false },
+        { BitFlash_ChecksumStage::kAdler32, adler, true },
+        { BitFlash_ChecksumStage::kAdler32, crc, false },
+    };
+    for (const Case& c : cases) {
+        Update.reset();
+        BitFlash_Pipeline pipeline;
+        pipeline.add(new BitFlash_ChecksumStage(c.algorithm, c.expected));
+        ASSERT_TRUE(pipeline.begin(image.size()));
+        for (size_t pos = 0; pos < image.size(); pos += 1000) {
+            ASSERT_TRUE(pipeline.write(image.data() + pos, std::min<size_t>(1000, image.size() - pos)));
+        }
+        EXPECT_EQ(c.ok, pipeline.end());
+        EXPECT_EQ(c.ok, Update.isFinished());
+    }
+}
+
+}  // namespace
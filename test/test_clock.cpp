@@ -0,0 +1,67 @@
+#include "BitFlash_Clock.h"
+#include "BitFlash_Freshness.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+class ClockTest : public ::testing::Test {
+protected:
+    BitFlash_Clock clock;
+
+    void SetUp() override { fake::unsetClock(); }
+    void TearDown() override { fake::resetClock(); }
+};
+
+TEST_F(ClockTest, DateHeaderSetsAnUnsetClock) {
+    EXPECT_FALSE(BitFlash_Clock::valid());
+
+    time_t date = BitFlash_Freshness::parseHttpDate("Tue, 14 Nov 2023 22:13:20 GMT");
+    BitFlash_Clock::bootstrap(date);
+    EXPECT_TRUE(BitFlash_Clock::valid());
+    EXPECT_NEAR(date, time(nullptr), 1);
+
+    // Without waiting for SNTP, which was never started
+    unsigned long start = millis();
+    EXPECT_TRUE(clock.ensure());
+    EXPECT_LT(millis() - start, 100u);
+    EXPECT_EQ(0, fake::ntpStarts());
+}
+
+TEST_F(ClockTest, LeavesASetClockToSntp) {
+    BitFlash_Clock::bootstrap(1700000000);
+    BitFlash_Clock::bootstrap(1800000000);
+    EXPECT_NEAR(1700000000, time(nullptr), 1);
+
+    // A missing or malformed Date changes nothing
+    fake::unsetClock();
+    BitFlash_Clock::bootstrap(0);
+    EXPECT_FALSE(BitFlash_Clock::valid());
+}
+
+TEST_F(ClockTest, StartsSntpOnce) {
+    clock.start();
+    clock.start();
+    EXPECT_EQ(1, fake::ntpStarts());
+}
+
+TEST_F(ClockTest, WaitsForSntpWhenNoDateCame) {
+    fake::ntpAnswerAfter(3000);
+    unsigned long start = millis();
+    EXPECT_TRUE(clock.ensure());
+    EXPECT_GE(millis() - start, 3000u);
+    EXPECT_LT(millis() - start, 3500u);
+    EXPECT_EQ(1, fake::ntpStarts());
+}
+
+TEST_F(ClockTest, GivesUpAfterTheTimeout) {
+    unsigned long start = millis();
+    EXPECT_FALSE(clock.ensure());
+    EXPECT_GE(millis() - start, BitFlash_Clock::kTimeout);
+    EXPECT_LT(millis() - start, BitFlash_Clock::kTimeout + 500);
+
+    // Later checks wait again, but SNTP keeps its one start
+    EXPECT_FALSE(clock.ensure());
+    EXPECT_EQ(1, fake::ntpStarts());
+}
+
+}  // namespace
@@ -0,0 +1,226 @@
+#include "BitFlash_Coap.h"
+#include "coap_server.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+class CoapTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        fake::resetNetwork();
+        WiFi.hosts["ota.example.com"] = IPAddress(10, 0, 0, 5);
+    }
+
+    static std::vector<uint8_t> image(size_t size) {
+        std::vector<uint8_t> data(size);
+        for (size_t i = 0; i < size; i++) data[i] = i * 31 + (i >> 8);
+        return data;
+    }
+};
+
+// Collects what get() hands over. Size2 comes with the first block only.
+struct Collector {
+    std::vector<uint8_t> data;
+    std::vector<size_t> blocks;
+    size_t total = 0;
+
+    BitFlash_Coap::BlockHandler handler() {
+        return [this](uint8_t* block, size_t len, size_t size) {
+            if (blocks.empty()) total = size;
+            data.insert(data.end(), block, block + len);
+            blocks.push_back(len);
+            return true;
+        };
+    }
+};
+
+TEST_F(CoapTest, FetchesBlockByBlock) {
+    CoapServer server;
+    server.resources["fw/app.bin"] = image(5000);
+
+    BitFlash_Coap coap;
+    coap.setBlockSize(512);
+    Collector collector;
+    ASSERT_TRUE(coap.get("coap://ota.example.com/fw/app.bin", collector.handler()));
+    EXPECT_EQ(server.resources["fw/app.bin"], collector.data);
+    EXPECT_EQ(5000u, collector.total);
+    EXPECT_EQ(10u, collector.blocks.size());
+    EXPECT_EQ(512u, collector.blocks.front());
+
+    // Size2 is asked for with the first block only
+    ASSERT_EQ(10u, server.requests.size());
+    EXPECT_TRUE(server.requests[0].wantsSize2);
+    EXPECT_FALSE(server.requests[1].wantsSize2);
+    EXPECT_EQ("fw/app.bin", server.requests[0].path);
+    EXPECT_GT(coap.bytesReceived(), 5000u);
+    EXPECT_GT(coap.bytesSent(), 0u);
+}
+
+TEST_F(CoapTest, FollowsSmallerServerBlocks) {
+    CoapServer server;
+    server.maxSzx = 2;  // 64 bytes
+    server.resources["fw/app.bin"] = image(1000);
+
+    BitFlash_Coap coap;
+    coap.setBlockSize(1024);
+    Collector collector;
+    ASSERT_TRUE(coap.get("coap://ota.example.com/fw/app.bin", collector.handler()));
+    EXPECT_EQ(server.resources["fw/app.bin"], collector.data);
+    EXPECT_EQ(16u, collector.blocks.size());
+    EXPECT_EQ(6u, server.requests[0].block2 & 7);
+    EXPECT_EQ(2u, server.requests[1].block2 & 7);
+}
+
+TEST_F(CoapTest, TakesAResponseInOnePiece) {
+    CoapServer server;
+    server.blockwise = false;
+    server.resources["manifest"] = image(700);
+
+    BitFlash_Coap coap;
+    Collector collector;
+    ASSERT_TRUE(coap.get("coap://ota.example.com/manifest", collector.handler()));
+    EXPECT_EQ(server.resources["manifest"], collector.data);
+    EXPECT_EQ(700u, collector.total);
+    EXPECT_EQ(1u, server.requests.size());
+}
+
+TEST_F(CoapTest, SendsPathSegmentsAndQueryToTheGivenPort) {
+    CoapServer server(IPAddress(10, 0, 0, 5), 5684);
+    server.resources["fw/v2/manifest"] = { '{', '}' };
+
+    BitFlash_Coap coap;
+    Collector collector;
+    ASSERT_TRUE(coap.get("coap://ota.example.com:5684/fw/v2/manifest?board=s3&channel=beta", collector.handler()));
+    EXPECT_EQ("fw/v2/manifest", server.requests[0].path);
+    EXPECT_EQ("board=s3&channel=beta", server.requests[0].query);
+}
+
+TEST_F(CoapTest, RejectsBadUrlsAndMissingResources) {
+    CoapServer server;
+    BitFlash_Coap coap;
+    Collector collector;
+    EXPECT_FALSE(coap.get("http://ota.example.com/fw", collector.handler()));
+    EXPECT_FALSE(coap.get("coap://unknown.example.com/fw", collector.handler()));
+    EXPECT_TRUE(server.requests.empty());
+
+    EXPECT_FALSE(coap.get("coap://ota.example.com/missing", collector.handler()));
+    EXPECT_EQ(1u, server.requests.size());
+    EXPECT_TRUE(collector.data.empty());
+}
+
+TEST_F(CoapTest, RetransmitsWithBackoff) {
+    CoapServer server;
+    server.resources["fw/app.bin"] = image(300);
+    server.dropRequests = 3;
+
+    BitFlash_Coap coap;
+    Collector collector;
+    unsigned long start = millis();
+    ASSERT_TRUE(coap.get("coap://ota.example.com/fw/app.bin", collector.handler()));
+    EXPECT_EQ(server.resources["fw/app.bin"], collector.data);
+    // Waits of at least 2, 4 and 8 seconds before the fourth copy got through
+    EXPECT_GE(millis() - start, 14000u);
+    EXPECT_LT(millis() - start, 21000u);
+}
+
+TEST_F(CoapTest, GivesUpAfterFourRetransmissions) {
+    CoapServer server;
+    server.resources["fw/app.bin"] = image(300);
+    server.dropRequests = 5;
+
+    BitFlash_Coap coap;
+    Collector collector;
+    EXPECT_FALSE(coap.get("coap://ota.example.com/fw/app.bin", collector.handler()));
+    EXPECT_TRUE(server.requests.empty());
+}
+
+TEST_F(CoapTest, WaitsForASeparateResponseAndAcknowledgesIt) {
+    CoapServer server;
+    server.separate = true;
+    server.resources["fw/app.bin"] = image(2000);
+
+    BitFlash_Coap coap;
+    coap.setBlockSize(1024);
+    Collector collector;
+    ASSERT_TRUE(coap.get("coap://ota.example.com/fw/app.bin", collector.handler()));
+    EXPECT_EQ(server.resources["fw/app.bin"], collector.data);
+    // One request per block, no retransmissions, each response acknowledged
+    EXPECT_EQ(2u, server.requests.size());
+    EXPECT_EQ(2u, server.acks.size());
+}
+
+TEST_F(CoapTest, HandlerStopsTheTransfer) {
+    CoapServer server;
+    server.resources["fw/app.bin"] = image(4096);
+
+    BitFlash_Coap coap;
+    int calls = 0;
+    EXPECT_FALSE(coap.get("coap://ota.example.com/fw/app.bin", [&](uint8_t*, size_t, size_t) {
+        return ++calls < 2;
+    }));
+    EXPECT_EQ(2, calls);
+    EXPECT_EQ(2u, server.requests.size());
+}
+
+TEST_F(CoapTest, ObservesAResource) {
+    CoapServer server;
+    server.resources["fw/manifest"] = { '{', '}' };
+
+    BitFlash_Coap coap;
+    ASSERT_TRUE(coap.observe("coap://ota.example.com/fw/manifest"));
+    EXPECT_TRUE(coap.observing());
+    EXPECT_TRUE(server.requests[0].observe);
+    EXPECT_FALSE(coap.poll());
+
+    server.notify("fw/manifest");
+    EXPECT_TRUE(coap.poll());
+    EXPECT_FALSE(coap.poll());
+
+    // Confirmable notifications are acknowledged
+    server.notify("fw/manifest", true);
+    EXPECT_TRUE(coap.poll());
+    EXPECT_EQ(1u, server.acks.size());
+
+    // An error ends the observation
+    server.notify("fw/manifest", false, 0x84);
+    EXPECT_FALSE(coap.poll());
+    EXPECT_FALSE(coap.observing());
+}
+
+TEST_F(CoapTest, ReregistersAfterTenMinutes) {
+    CoapServer server;
+    server.resources["fw/manifest"] = { '{', '}' };
+
+    BitFlash_Coap coap;
+    ASSERT_TRUE(coap.observe("coap://ota.example.com/fw/manifest"));
+    coap.poll();
+    EXPECT_EQ(1u, server.requests.size());
+
+    fake::advance(600000);
+    coap.poll();
+    EXPECT_EQ(2u, server.requests.size());
+    EXPECT_TRUE(server.requests[1].observe);
+    EXPECT_TRUE(coap.observing());
+}
+
+TEST_F(CoapTest, NotificationsDuringADownloadAreKept) {
+    CoapServer server;
+    server.resources["fw/manifest"] = { '{', '}' };
+    server.resources["fw/app.bin"] = image(2048);
+
+    BitFlash_Coap coap;
+    ASSERT_TRUE(coap.observe("coap://ota.example.com/fw/manifest"));
+    Collector collector;
+    bool notified = false;
+    ASSERT_TRUE(coap.get("coap://ota.example.com/fw/app.bin", [&](uint8_t* data, size_t len, size_t total) {
+        if (!notified) {
+            server.notify("fw/manifest");
+            notified = true;
+        }
+        return collector.handler()(data, len, total);
+    }));
+    EXPECT_EQ(server.resources["fw/app.bin"], collector.data);
+    EXPECT_TRUE(coap.poll());
+}
+
+}  // namespace
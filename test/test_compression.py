@@ -0,0 +1,81 @@
+import contextlib
+import hashlib
+import io
+import json
+import os
+import tempfile
+import unittest
+
+import bench_compression
+import train_dictionary
+from bench_patches import synthetic_releases
+
+
+class TrainDictionaryTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.releases = synthetic_releases(5, 50000)
+        cls.history = [cls.releases["1.0.%d" % n] for n in range(4)]
+        cls.next = cls.releases["1.0.4"]
+
+    def test_dictionary_shrinks_the_next_release(self):
+        dictionary = train_dictionary.train(self.history)
+        self.assertLessEqual(len(dictionary), train_dictionary.WINDOW)
+        self.assertGreater(len(dictionary), train_dictionary.WINDOW // 2)
+
+        plain = train_dictionary.compress(self.next)
+        primed = train_dictionary.compress(self.next, dictionary)
+        self.assertLess(len(primed), len(plain) * 2 // 3)
+        self.assertEqual(self.next, train_dictionary.decompress(primed, dictionary))
+        self.assertEqual(self.next, train_dictionary.decompress(plain))
+
+    def test_leaves_room_for_bytes_inserted_at_the_start(self):
+        old = self.history[0]
+        new = old[:100] + bytes(range(250)) * 2 + old[100:]
+        self.assertEqual(500, train_dictionary.start_shift(old, new))
+        self.assertEqual(0, train_dictionary.start_shift(old, old))
+        self.assertEqual(train_dictionary.WINDOW - 500, len(train_dictionary.train([old, new])))
+        self.assertEqual(old[:train_dictionary.WINDOW], train_dictionary.train([old]))
+
+    def test_command_line(self):
+        with tempfile.TemporaryDirectory() as directory:
+            paths = []
+            for n, image in enumerate(self.history):
+                paths.append(os.path.join(directory, "%d.bin" % n))
+                with open(paths[-1], "wb") as f:
+                    f.write(image)
+            image_path = os.path.join(directory, "next.bin")
+            with open(image_path, "wb") as f:
+                f.write(self.next)
+
+            out = io.StringIO()
+            dictionary_path = os.path.join(directory, "dict")
+            compressed_path = os.path.join(directory, "next.deflate")
+            with contextlib.redirect_stdout(out):
+                train_dictionary.main([dictionary_path] + paths + ["--compress", image_path, compressed_path])
+            compression = json.loads(out.getvalue())
+
+            with open(dictionary_path, "rb") as f:
+                dictionary = f.read()
+            with open(compressed_path, "rb") as f:
+                compressed = f.read()
+            self.assertEqual("deflate", compression["format"])
+            self.assertEqual(hashlib.sha256(dictionary).hexdigest(), compression["dict"])
+            self.assertEqual(len(self.next), compression["size"])
+            self.assertEqual(self.next, train_dictionary.decompress(compressed, dictionary))
+
+
+class BenchmarkTest(unittest.TestCase):
+    def test_compares_the_three_methods(self):
+        out = io.StringIO()
+        results = bench_compression.run(synthetic_releases(4, 40000), out)
+        self.assertEqual({"deflate", "deflate+dict", "bfp1 delta"}, set(results))
+        self.assertLess(results["deflate+dict"][0], results["deflate"][0])
+        self.assertLess(results["bfp1 delta"][0], results["deflate+dict"][0])
+        for size, rate in results.values():
+            self.assertGreater(rate, 0)
+        self.assertIn("deflate+dict", out.getvalue())
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,60 @@
+#pragma once
+
+// Inputs shared by the tests and benchmarks: seeded random bytes and app
+// images, compressible code-like data, raw deflate as the server stores
+// compressed images, and SHA-256.
+
+#include <openssl/evp.h>
+#include <zlib.h>
+#include <random>
+#include <vector>
+
+inline std::vector<uint8_t> randomBytes(size_t len, uint32_t seed) {
+    std::mt19937 generator(seed);
+    std::vector<uint8_t> data(len);
+    for (uint8_t& b : data) b = generator();
+    return data;
+}
+
+// Random bytes behind the app image magic, which the boot partition check
+// looks for.
+inline std::vector<uint8_t> randomImage(size_t len, uint32_t seed) {
+    std::vector<uint8_t> data = randomBytes(len, seed);
+    data[0] = 0xE9;
+    return data;
+}
+
+// Compressible bytes: runs picked from a small vocabulary, like code.
+inline std::vector<uint8_t> codeLike(size_t len, uint32_t seed) {
+    std::vector<uint8_t> words = randomBytes(512, 99);
+    std::mt19937 generator(seed);
+    std::vector<uint8_t> data;
+    while (data.size() < len) {
+        size_t at = generator() % 480;
+        data.insert(data.end(), words.begin() + at, words.begin() + at + 4 + generator() % 28);
+    }
+    data.resize(len);
+    return data;
+}
+
+inline std::vector<uint8_t> deflateRaw(const std::vector<uint8_t>& data, const std::vector<uint8_t>& dictionary = {},
+                                       int level = 9) {
+    z_stream stream = {};
+    deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    if (!dictionary.empty()) deflateSetDictionary(&stream, dictionary.data(), dictionary.size());
+    std::vector<uint8_t> out(deflateBound(&stream, data.size()));
+    stream.next_in = (Bytef*)data.data();
+    stream.avail_in = data.size();
+    stream.next_out = out.data();
+    stream.avail_out = out.size();
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+
+inline std::vector<uint8_t> sha256(const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> digest(32);
+    EVP_Digest(data.data(), data.size(), digest.data(), nullptr, EVP_sha256(), nullptr);
+    return digest;
+}
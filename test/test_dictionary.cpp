@@ -0,0 +1,122 @@
+#include "BitFlash_Dictionary.h"
+#include "BitFlash_Stages.h"
+#include "test_data.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+constexpr size_t kSector = SPI_FLASH_SEC_SIZE;
+
+class DictionaryTest : public ::testing::Test {
+protected:
+    const esp_partition_t* partition;
+
+    void SetUp() override {
+        fake::resetFlash();
+        partition = fake::addPartition("bfdict", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_UNDEFINED,
+                                       10 * kSector);
+    }
+
+    // Downloads the dictionary in pieces of 1000 bytes, as the client does.
+    bool store(const std::vector<uint8_t>& dictionary, const std::vector<uint8_t>& id) {
+        BitFlash_Dictionary cache("bfdict");
+        if (!cache.begin(dictionary.size())) return false;
+        for (size_t pos = 0; pos < dictionary.size(); pos += 1000) {
+            if (!cache.write(&dictionary[pos], std::min<size_t>(1000, dictionary.size() - pos))) return false;
+        }
+        return cache.end(id.data());
+    }
+};
+
+TEST_F(DictionaryTest, KeepsADictionaryByHash) {
+    std::vector<uint8_t> dictionary = randomBytes(32768, 1);
+    std::vector<uint8_t> id = sha256(dictionary);
+    ASSERT_TRUE(store(dictionary, id));
+
+    BitFlash_Dictionary cache("bfdict");
+    ASSERT_TRUE(cache.available());
+    EXPECT_TRUE(cache.has(id.data()));
+    size_t len = 0;
+    const uint8_t* mapped = cache.map(len);
+    ASSERT_NE(nullptr, mapped);
+    EXPECT_EQ(dictionary, std::vector<uint8_t>(mapped, mapped + len));
+
+    std::vector<uint8_t> other = sha256(randomBytes(100, 2));
+    EXPECT_FALSE(cache.has(other.data()));
+}
+
+TEST_F(DictionaryTest, ReplacesTheCachedDictionary) {
+    std::vector<uint8_t> first = randomBytes(20000, 1);
+    std::vector<uint8_t> second = randomBytes(30000, 2);
+    ASSERT_TRUE(store(first, sha256(first)));
+    ASSERT_TRUE(store(second, sha256(second)));
+
+    BitFlash_Dictionary cache("bfdict");
+    EXPECT_FALSE(cache.has(sha256(first).data()));
+    EXPECT_TRUE(cache.has(sha256(second).data()));
+    EXPECT_EQ(0u, fake::flashStats().overwrites);
+}
+
+TEST_F(DictionaryTest, RejectsADownloadThatDoesNotMatchItsHash) {
+    std::vector<uint8_t> dictionary = randomBytes(10000, 1);
+    std::vector<uint8_t> id = sha256(dictionary);
+    dictionary[5000] ^= 1;
+    EXPECT_FALSE(store(dictionary, id));
+
+    BitFlash_Dictionary cache("bfdict");
+    EXPECT_FALSE(cache.has(id.data()));
+    size_t len;
+    EXPECT_EQ(nullptr, cache.map(len));
+}
+
+TEST_F(DictionaryTest, InterruptedDownloadLeavesNoEntry) {
+    std::vector<uint8_t> first = randomBytes(20000, 1);
+    std::vector<uint8_t> second = randomBytes(20000, 2);
+    ASSERT_TRUE(store(first, sha256(first)));
+
+    fake::cutPowerAfter(10);
+    EXPECT_FALSE(store(second, sha256(second)));
+    fake::restorePower();
+
+    BitFlash_Dictionary cache("bfdict");
+    EXPECT_FALSE(cache.has(sha256(first).data()));
+    EXPECT_FALSE(cache.has(sha256(second).data()));
+    size_t len;
+    EXPECT_EQ(nullptr, cache.map(len));
+}
+
+TEST_F(DictionaryTest, RejectsWhatDoesNotFit) {
+    std::vector<uint8_t> dictionary = randomBytes(9 * kSector + 1, 1);
+    EXPECT_FALSE(store(dictionary, sha256(dictionary)));
+    EXPECT_FALSE(BitFlash_Dictionary("missing").available());
+    EXPECT_FALSE(BitFlash_Dictionary("missing").begin(100));
+}
+
+// The cached dictionary, mapped from flash, primes the inflater for an
+// image compressed against it.
+TEST_F(DictionaryTest, PrimesTheInflater) {
+    std::vector<uint8_t> dictionary = randomBytes(32768, 1);
+    ASSERT_TRUE(store(dictionary, sha256(dictionary)));
+    std::vector<uint8_t> image(dictionary.begin() + 1000, dictionary.end());
+    image[0] = 0xE9;
+
+    std::vector<uint8_t> compressed = deflateRaw(image, dictionary);
+    ASSERT_LT(compressed.size(), image.size() / 10);
+
+    BitFlash_Dictionary cache("bfdict");
+    size_t len = 0;
+    const uint8_t* mapped = cache.map(len);
+    ASSERT_NE(nullptr, mapped);
+
+    Update.reset();
+    BitFlash_Pipeline pipeline;
+    BitFlash_InflateStage* inflate = new BitFlash_InflateStage(image.size());
+    inflate->setDictionary(mapped, len);
+    pipeline.add(inflate);
+    ASSERT_TRUE(pipeline.begin(compressed.size()));
+    ASSERT_TRUE(pipeline.write(compressed.data(), compressed.size()));
+    ASSERT_TRUE(pipeline.end());
+    EXPECT_EQ(image, Update.image);
+}
+
+}  // namespace
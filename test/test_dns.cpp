@@ -0,0 +1,100 @@
+#include "BitFlash_Dns.h"
+#include "dns_server.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+class DnsTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        fake::resetNetwork();
+    }
+};
+
+TEST_F(DnsTest, FindsTxtRecordByPrefix) {
+    DnsServer server;
+    server.addTxt("_fw.example.com", { "google-site-verification=abc" }, 60);
+    server.addTxt("_fw.example.com", { "v=1.1.0;h=9f86d081884c7d65;", "u=https://example.com/m.json" }, 300);
+
+    BitFlash_Dns dns;
+    String value;
+    uint32_t ttl = 0;
+    ASSERT_TRUE(dns.queryTxt("_fw.example.com", "v=", value, ttl));
+    // Character-strings of one record are joined
+    EXPECT_STREQ("v=1.1.0;h=9f86d081884c7d65;u=https://example.com/m.json", value.c_str());
+    EXPECT_EQ(300u, ttl);
+
+    EXPECT_FALSE(dns.queryTxt("_fw.example.com", "x=", value, ttl));
+    EXPECT_FALSE(dns.queryTxt("missing.example.com", "v=", value, ttl));
+}
+
+TEST_F(DnsTest, FollowsCnameWithShortestTtl) {
+    DnsServer server;
+    server.addCname("ota.example.com", "edge.cdn.example.net", 120);
+    server.addA("edge.cdn.example.net", IPAddress(203, 0, 113, 7), 3600);
+
+    BitFlash_Dns dns;
+    IPAddress address;
+    uint32_t ttl = 0;
+    ASSERT_TRUE(dns.queryA("ota.example.com", address, ttl));
+    EXPECT_EQ(IPAddress(203, 0, 113, 7), address);
+    EXPECT_EQ(120u, ttl);
+}
+
+TEST_F(DnsTest, UsesExplicitServer) {
+    DnsServer fallback;
+    DnsServer server(IPAddress(9, 9, 9, 9));
+    server.addA("ota.example.com", IPAddress(198, 51, 100, 1), 60);
+
+    BitFlash_Dns dns;
+    dns.setServer(IPAddress(9, 9, 9, 9));
+    IPAddress address;
+    uint32_t ttl;
+    ASSERT_TRUE(dns.queryA("ota.example.com", address, ttl));
+    EXPECT_EQ(IPAddress(198, 51, 100, 1), address);
+    EXPECT_EQ(0, fallback.queries);
+}
+
+TEST_F(DnsTest, RetriesOnceAfterSilence) {
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(198, 51, 100, 1), 60);
+    server.fault = DnsServer::kSilent;
+    server.faultCount = 1;
+
+    BitFlash_Dns dns;
+    IPAddress address;
+    uint32_t ttl;
+    EXPECT_TRUE(dns.queryA("ota.example.com", address, ttl));
+    EXPECT_EQ(2, server.queries);
+
+    server.faultCount = 2;
+    EXPECT_FALSE(dns.queryA("ota.example.com", address, ttl));
+    EXPECT_EQ(4, server.queries);
+}
+
+TEST_F(DnsTest, IgnoresMismatchedTruncatedAndFailedAnswers) {
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(198, 51, 100, 1), 60);
+    BitFlash_Dns dns;
+    IPAddress address;
+    uint32_t ttl;
+
+    for (DnsServer::Fault fault : { DnsServer::kWrongId, DnsServer::kTruncated, DnsServer::kServerFailure }) {
+        server.fault = fault;
+        server.faultCount = 2;
+        EXPECT_FALSE(dns.queryA("ota.example.com", address, ttl)) << fault;
+    }
+}
+
+TEST_F(DnsTest, RejectsMalformedNames) {
+    DnsServer server;
+    BitFlash_Dns dns;
+    IPAddress address;
+    uint32_t ttl;
+
+    EXPECT_FALSE(dns.queryA("bad..example.com", address, ttl));
+    EXPECT_FALSE(dns.queryA((std::string(64, 'a') + ".example.com").c_str(), address, ttl));
+    EXPECT_EQ(0, server.queries);
+}
+
+}  // namespace
@@ -0,0 +1,214 @@
+#include "BitFlash_DnsCache.h"
+#include "dns_server.h"
+#include <WiFiClientSecure.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+class DnsCacheTest : public ::testing::Test {
+protected:
+    BitFlash_DnsCache cache;
+
+    void SetUp() override {
+        fake::resetNetwork();
+        WiFi.hosts.clear();
+        WiFi.systemLookups = 0;
+        // The table is in RTC memory and outlives the object
+        cache.clear();
+    }
+};
+
+TEST_F(DnsCacheTest, ReusesARecordUntilItsTtlRunsOut) {
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(203, 0, 113, 7), 300);
+
+    IPAddress address;
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+    EXPECT_EQ(IPAddress(203, 0, 113, 7), address);
+    EXPECT_EQ(1, server.queries);
+
+    // time() counts whole seconds, so stay clear of the boundary
+    fake::advance(298 * 1000);
+    address = IPAddress();
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+    EXPECT_EQ(IPAddress(203, 0, 113, 7), address);
+    EXPECT_EQ(1, server.queries);
+
+    fake::advance(2000);
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+    EXPECT_EQ(2, server.queries);
+    EXPECT_EQ(1u, cache.hits());
+    EXPECT_EQ(2u, cache.misses());
+}
+
+TEST_F(DnsCacheTest, SurvivesANewInstance) {
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(203, 0, 113, 7), 300);
+    IPAddress address;
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+
+    // As after waking from deep sleep
+    BitFlash_DnsCache woken;
+    ASSERT_TRUE(woken.resolve("ota.example.com", address));
+    EXPECT_EQ(IPAddress(203, 0, 113, 7), address);
+    EXPECT_EQ(1, server.queries);
+    EXPECT_EQ(1u, woken.hits());
+}
+
+TEST_F(DnsCacheTest, TakesIpLiteralsAsTheyAre) {
+    DnsServer server;
+    IPAddress address;
+    ASSERT_TRUE(cache.resolve("10.1.2.3", address));
+    EXPECT_EQ(IPAddress(10, 1, 2, 3), address);
+    EXPECT_EQ(0, server.queries);
+    EXPECT_EQ(0u, cache.misses());
+}
+
+TEST_F(DnsCacheTest, FallsBackToTheSystemResolverForAMinute) {
+    // The DNS server does not know the name, the system resolver does
+    DnsServer server;
+    WiFi.hosts["ota.example.com"] = IPAddress(198, 51, 100, 4);
+
+    IPAddress address;
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+    EXPECT_EQ(IPAddress(198, 51, 100, 4), address);
+    EXPECT_EQ(1, WiFi.systemLookups);
+
+    fake::advance(58 * 1000);
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+    EXPECT_EQ(1, WiFi.systemLookups);
+    fake::advance(2000);
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+    EXPECT_EQ(2, WiFi.systemLookups);
+
+    EXPECT_FALSE(cache.resolve("missing.example.com", address));
+}
+
+TEST_F(DnsCacheTest, RefreshesRecentlyUsedRecordsBeforeTheyExpire) {
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(203, 0, 113, 7), 300);
+    IPAddress address;
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+
+    cache.refresh();
+    EXPECT_EQ(1, server.queries);
+
+    // Within 30 seconds of expiry, the new address is fetched ahead
+    server.records.clear();
+    server.addA("ota.example.com", IPAddress(203, 0, 113, 8), 300);
+    fake::advance(271 * 1000);
+    cache.refresh();
+    EXPECT_EQ(2, server.queries);
+    EXPECT_EQ(1u, cache.refreshes());
+
+    fake::advance(100 * 1000);
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+    EXPECT_EQ(IPAddress(203, 0, 113, 8), address);
+    EXPECT_EQ(2, server.queries);
+}
+
+TEST_F(DnsCacheTest, LeavesShortLivedAndIdleRecordsToExpire) {
+    DnsServer server;
+    server.addA("short.example.com", IPAddress(203, 0, 113, 1), 40);
+    server.addA("idle.example.com", IPAddress(203, 0, 113, 2), 7200);
+    IPAddress address;
+    ASSERT_TRUE(cache.resolve("idle.example.com", address));
+    ASSERT_TRUE(cache.resolve("short.example.com", address));
+
+    // The short record expires, the long one has gone unused for two hours
+    fake::advance(7180 * 1000);
+    cache.refresh();
+    EXPECT_EQ(2, server.queries);
+    EXPECT_EQ(0u, cache.refreshes());
+}
+
+TEST_F(DnsCacheTest, ReplacesTheLeastRecentlyUsedHost) {
+    DnsServer server;
+    for (int i = 0; i < 5; i++) {
+        server.addA("h" + std::to_string(i) + ".example.com", IPAddress(203, 0, 113, i), 3600);
+    }
+    IPAddress address;
+    for (int i = 0; i < 4; i++) {
+        ASSERT_TRUE(cache.resolve(("h" + std::to_string(i) + ".example.com").c_str(), address));
+        fake::advance(1000);
+    }
+    // h0 is used again, so h1 makes room for h4
+    ASSERT_TRUE(cache.resolve("h0.example.com", address));
+    ASSERT_TRUE(cache.resolve("h4.example.com", address));
+    EXPECT_EQ(5, server.queries);
+
+    ASSERT_TRUE(cache.resolve("h0.example.com", address));
+    EXPECT_EQ(5, server.queries);
+    ASSERT_TRUE(cache.resolve("h1.example.com", address));
+    EXPECT_EQ(6, server.queries);
+}
+
+TEST_F(DnsCacheTest, DistrustsRecordsAfterTheClockWentBack) {
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(203, 0, 113, 7), 300);
+    IPAddress address;
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+
+    fake::shiftClock(-3600);
+    ASSERT_TRUE(cache.resolve("ota.example.com", address));
+    EXPECT_EQ(2, server.queries);
+    fake::shiftClock(3600);
+}
+
+TEST_F(DnsCacheTest, ClientConnectsToTheCachedAddress) {
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(203, 0, 113, 7), 300);
+    fake::listenTcp(IPAddress(203, 0, 113, 7), 80, [](std::shared_ptr<fake::TcpConnection>) {});
+
+    BitFlash_CachedClient client(cache);
+    ASSERT_TRUE(client.connect("ota.example.com", 80));
+    client.stop();
+    ASSERT_TRUE(client.connect("ota.example.com", 80, 5000));
+    EXPECT_EQ(IPAddress(203, 0, 113, 7), fake::lastTcpAddress());
+    EXPECT_EQ(1, server.queries);
+    EXPECT_EQ(0, WiFi.systemLookups);
+    EXPECT_EQ(1u, cache.hits());
+
+    EXPECT_FALSE(client.connect("missing.example.com", 80));
+}
+
+TEST_F(DnsCacheTest, SecureClientKeepsItsCertificates) {
+    static const char* kCaCert = "-----BEGIN CERTIFICATE-----\nroot\n-----END CERTIFICATE-----\n";
+    static const char* kClientCert = "-----BEGIN CERTIFICATE-----\ndevice\n-----END CERTIFICATE-----\n";
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(203, 0, 113, 7), 300);
+    fake::listenTcp(IPAddress(203, 0, 113, 7), 443, [](std::shared_ptr<fake::TcpConnection>) {});
+
+    // What createClient() sets up for dnsCache with caCert
+    BitFlash_CachedSecureClient client(cache);
+    client.setCACert(kCaCert);
+    client.setCertificate(kClientCert);
+    ASSERT_TRUE(client.connect("ota.example.com", 443));
+    EXPECT_EQ(kCaCert, fake::lastTlsHandshake().caCert);
+    EXPECT_EQ(kClientCert, fake::lastTlsHandshake().clientCert);
+    // The name still goes into SNI and the certificate check
+    EXPECT_EQ("ota.example.com", fake::lastTlsHandshake().serverName);
+    EXPECT_FALSE(fake::lastTlsHandshake().insecure);
+    client.stop();
+
+    // The timeout overload takes the same path
+    ASSERT_TRUE(client.connect("ota.example.com", 443, 5000));
+    EXPECT_EQ(kCaCert, fake::lastTlsHandshake().caCert);
+    EXPECT_EQ(IPAddress(203, 0, 113, 7), fake::lastTcpAddress());
+    EXPECT_EQ(1, server.queries);
+    EXPECT_EQ(0, WiFi.systemLookups);
+}
+
+TEST_F(DnsCacheTest, SecureClientWithoutCaNeedsInsecure) {
+    DnsServer server;
+    server.addA("ota.example.com", IPAddress(203, 0, 113, 7), 300);
+    fake::listenTcp(IPAddress(203, 0, 113, 7), 443, [](std::shared_ptr<fake::TcpConnection>) {});
+
+    BitFlash_CachedSecureClient client(cache);
+    EXPECT_FALSE(client.connect("ota.example.com", 443));
+    client.setInsecure();
+    ASSERT_TRUE(client.connect("ota.example.com", 443));
+    EXPECT_TRUE(fake::lastTlsHandshake().insecure);
+}
+
+}  // namespace
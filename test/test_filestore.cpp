@@ -0,0 +1,130 @@
+#include "BitFlash_FileStore.h"
+#include "test_data.h"
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+
+namespace {
+
+constexpr size_t kChunk = 4000;
+
+class FileStoreTest : public ::testing::Test {
+protected:
+    fs::FS storage;
+    std::vector<uint8_t> image = randomBytes(3 * kChunk + 1234, 1);
+    std::string url = "https://updates.example.com/firmware/" + std::string(200, 'x') + "/1.2.0.bin";
+
+    std::vector<uint8_t> chunkHash(size_t index) {
+        size_t from = index * kChunk;
+        size_t n = std::min(kChunk, image.size() - from);
+        std::vector<uint8_t> digest(32);
+        EVP_Digest(&image[from], n, digest.data(), nullptr, EVP_sha256(), nullptr);
+        return digest;
+    }
+
+    // Sends the next chunk in pieces of 1000, or only its first cut bytes.
+    bool fetchChunk(BitFlash_FileStore& store, size_t cut = SIZE_MAX) {
+        size_t index = store.verified() / kChunk;
+        size_t from = store.verified();
+        size_t n = std::min(std::min(kChunk, image.size() - from), cut);
+        if (!store.beginChunk()) return false;
+        for (size_t pos = 0; pos < n; pos += 1000) {
+            if (!store.write(&image[from + pos], std::min<size_t>(1000, n - pos))) return false;
+        }
+        return store.endChunk(chunkHash(index).data());
+    }
+
+    std::vector<uint8_t> stored() {
+        fs::File file = storage.open("/update.bin");
+        std::vector<uint8_t> data(file.size());
+        file.read(data.data(), data.size());
+        return data;
+    }
+};
+
+TEST_F(FileStoreTest, StoresChunkByChunk) {
+    BitFlash_FileStore store(storage, "/update.bin");
+    ASSERT_TRUE(store.open(url.c_str(), image.size(), kChunk));
+    while (!store.complete()) {
+        ASSERT_TRUE(fetchChunk(store));
+    }
+    EXPECT_EQ(image, stored());
+
+    fs::File file = store.read();
+    ASSERT_TRUE(file);
+    EXPECT_EQ(image.size(), file.size());
+    store.remove();
+    EXPECT_FALSE(storage.exists("/update.bin"));
+    EXPECT_FALSE(storage.exists("/update.bin.state"));
+}
+
+// Image ids are often URLs, longer than any fixed field
+TEST_F(FileStoreTest, ResumesAcrossSessionsWithLongIds) {
+    ASSERT_GT(url.size(), 200u);
+    {
+        BitFlash_FileStore store(storage, "/update.bin");
+        ASSERT_TRUE(store.open(url.c_str(), image.size(), kChunk));
+        ASSERT_TRUE(fetchChunk(store));
+        ASSERT_TRUE(fetchChunk(store));
+        // The connection drops half way through the third chunk
+        EXPECT_FALSE(fetchChunk(store, 2500));
+    }
+
+    BitFlash_FileStore store(storage, "/update.bin");
+    ASSERT_TRUE(store.open(url.c_str(), image.size(), kChunk));
+    EXPECT_EQ(2 * kChunk, store.verified());
+    while (!store.complete()) {
+        ASSERT_TRUE(fetchChunk(store));
+    }
+    EXPECT_EQ(image, stored());
+}
+
+TEST_F(FileStoreTest, StartsOverForAnotherImage) {
+    {
+        BitFlash_FileStore store(storage, "/update.bin");
+        ASSERT_TRUE(store.open(url.c_str(), image.size(), kChunk));
+        ASSERT_TRUE(fetchChunk(store));
+    }
+
+    // Same first 200 characters, then a different version
+    std::string other = url;
+    other.replace(other.size() - 9, 5, "1.3.0");
+    BitFlash_FileStore store(storage, "/update.bin");
+    ASSERT_TRUE(store.open(other.c_str(), image.size(), kChunk));
+    EXPECT_EQ(0u, store.verified());
+
+    // And for the same id with another size or chunk size
+    ASSERT_TRUE(fetchChunk(store));
+    ASSERT_TRUE(store.open(other.c_str(), image.size() + 1, kChunk));
+    EXPECT_EQ(0u, store.verified());
+    ASSERT_TRUE(fetchChunk(store));
+    ASSERT_TRUE(store.open(other.c_str(), image.size(), kChunk * 2));
+    EXPECT_EQ(0u, store.verified());
+}
+
+TEST_F(FileStoreTest, CorruptChunkIsNotCounted) {
+    BitFlash_FileStore store(storage, "/update.bin");
+    ASSERT_TRUE(store.open(url.c_str(), image.size(), kChunk));
+    ASSERT_TRUE(fetchChunk(store));
+
+    image[kChunk + 10] ^= 1;
+    std::vector<uint8_t> expected = chunkHash(1);
+    image[kChunk + 10] ^= 1;
+    ASSERT_TRUE(store.beginChunk());
+    ASSERT_TRUE(store.write(&image[kChunk], kChunk));
+    EXPECT_FALSE(store.endChunk(expected.data()));
+    EXPECT_EQ(kChunk, store.verified());
+
+    // Too many bytes for the chunk
+    ASSERT_TRUE(store.beginChunk());
+    std::vector<uint8_t> extra(kChunk + 1);
+    EXPECT_FALSE(store.write(extra.data(), extra.size()));
+}
+
+TEST_F(FileStoreTest, RejectsEmptyImages) {
+    BitFlash_FileStore store(storage, "/update.bin");
+    EXPECT_FALSE(store.open(url.c_str(), 0, kChunk));
+    EXPECT_FALSE(store.open(url.c_str(), image.size(), 0));
+    EXPECT_TRUE(store.open("", image.size(), kChunk));
+}
+
+}  // namespace
@@ -0,0 +1,134 @@
+#include "BitFlash_Freshness.h"
+#include <gtest/gtest.h>
+#include <functional>
+
+namespace {
+
+constexpr uint32_t kHour = 3600 * 1000;
+constexpr time_t kStart = 1700000000;
+
+struct Response {
+    int code = 200;
+    String retryAfter;
+    String cacheControl;
+    String expires;
+};
+
+String httpDate(time_t t) {
+    char text[32];
+    tm parts;
+    gmtime_r(&t, &parts);
+    strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    return text;
+}
+
+// Runs a day of handle() calls, one per second: a check at the start and
+// then whenever the delay since the last one has passed, paced by what the
+// server answers.
+int requestsPerDay(std::function<Response(time_t now)> server, uint32_t checkInterval = kHour) {
+    uint32_t nextCheckDelay = checkInterval;
+    uint32_t lastCheck = 0;
+    int requests = 0;
+    for (uint32_t ms = 0; ms < 24 * kHour; ms += 1000) {
+        if (requests > 0 && ms - lastCheck < nextCheckDelay) continue;
+        time_t now = kStart + ms / 1000;
+        Response response = server(now);
+        BitFlash_Freshness freshness;
+        freshness.parse(response.code, httpDate(now), response.retryAfter, response.cacheControl, response.expires);
+        nextCheckDelay = freshness.nextCheckDelay(checkInterval);
+        lastCheck = ms;
+        requests++;
+    }
+    return requests;
+}
+
+Response headers(int code, const char* retryAfter, const char* cacheControl = "", const char* expires = "") {
+    Response response;
+    response.code = code;
+    response.retryAfter = retryAfter;
+    response.cacheControl = cacheControl;
+    response.expires = expires;
+    return response;
+}
+
+TEST(FreshnessTest, KeepsTheIntervalWithoutHeaders) {
+    EXPECT_EQ(24, requestsPerDay([](time_t) { return Response(); }));
+    EXPECT_EQ(48, requestsPerDay([](time_t) { return Response(); }, kHour / 2));
+}
+
+TEST(FreshnessTest, MaxAgeSetsThePace) {
+    EXPECT_EQ(4, requestsPerDay([](time_t) { return headers(200, "", "public, max-age=21600"); }));
+    EXPECT_EQ(96, requestsPerDay([](time_t) { return headers(200, "", "max-age=900"); }));
+
+    // Zero or no-cache leaves the interval alone
+    EXPECT_EQ(24, requestsPerDay([](time_t) { return headers(200, "", "max-age=0"); }));
+    EXPECT_EQ(24, requestsPerDay([](time_t) { return headers(200, "", "no-cache, max-age=21600"); }));
+}
+
+TEST(FreshnessTest, ExpiresCountsFromTheServersDate) {
+    EXPECT_EQ(12, requestsPerDay([](time_t now) { return headers(200, "", "", httpDate(now + 7200).c_str()); }));
+
+    // Already expired, or overridden by max-age
+    EXPECT_EQ(24, requestsPerDay([](time_t now) { return headers(200, "", "", httpDate(now - 60).c_str()); }));
+    EXPECT_EQ(6, requestsPerDay([](time_t now) {
+        return headers(200, "", "max-age=14400", httpDate(now + 7200).c_str());
+    }));
+}
+
+TEST(FreshnessTest, BusyServerSpreadsTheFleet) {
+    EXPECT_EQ(8, requestsPerDay([](time_t) { return headers(503, "10800"); }));
+    EXPECT_EQ(3, requestsPerDay([](time_t now) { return headers(429, httpDate(now + 28800).c_str()); }));
+
+    // Busy without Retry-After: back to the interval
+    EXPECT_EQ(24, requestsPerDay([](time_t) { return headers(503, ""); }));
+}
+
+TEST(FreshnessTest, RetryAfterWinsOverMaxAge) {
+    EXPECT_EQ(2, requestsPerDay([](time_t) { return headers(200, "43200", "max-age=900"); }));
+
+    // Other errors do not get to pace the fleet
+    EXPECT_EQ(96, requestsPerDay([](time_t) { return headers(404, "43200", "max-age=900"); }));
+}
+
+TEST(FreshnessTest, RecoversWhenTheServerStopsAskingForMore) {
+    // Busy for the first six hours, then quiet
+    int requests = requestsPerDay([](time_t now) {
+        return now - kStart < 6 * 3600 ? headers(503, "7200") : Response();
+    });
+    EXPECT_EQ(3 + 18, requests);
+}
+
+TEST(FreshnessTest, BackoffOnlyForRetryAfter) {
+    BitFlash_Freshness freshness;
+    freshness.parse(503, httpDate(kStart), "120", "", "");
+    EXPECT_TRUE(freshness.backoff());
+    EXPECT_EQ(120000u, freshness.nextCheckDelay(kHour));
+    EXPECT_EQ(kStart, freshness.date());
+
+    freshness.parse(200, httpDate(kStart), "", "max-age=120", "");
+    EXPECT_FALSE(freshness.backoff());
+    EXPECT_EQ(120000u, freshness.nextCheckDelay(kHour));
+}
+
+TEST(FreshnessTest, ClampsToAWeek) {
+    BitFlash_Freshness freshness;
+    freshness.parse(200, "", "", "max-age=99999999", "");
+    EXPECT_EQ((uint32_t)BitFlash_Freshness::kMaxSeconds * 1000, freshness.nextCheckDelay(kHour));
+}
+
+TEST(FreshnessTest, ParsesHttpDates) {
+    EXPECT_EQ(784111777, BitFlash_Freshness::parseHttpDate("Sun, 06 Nov 1994 08:49:37 GMT"));
+    EXPECT_EQ(951782400, BitFlash_Freshness::parseHttpDate("Tue, 29 Feb 2000 00:00:00 GMT"));
+    EXPECT_EQ(kStart, BitFlash_Freshness::parseHttpDate(httpDate(kStart)));
+    EXPECT_EQ(0, BitFlash_Freshness::parseHttpDate(""));
+    EXPECT_EQ(0, BitFlash_Freshness::parseHttpDate("Sun, 06 Foo 1994 08:49:37 GMT"));
+    EXPECT_EQ(0, BitFlash_Freshness::parseHttpDate("Sunday, 06-Nov-94 08:49:37 GMT"));
+
+    // Without a Date, an absolute Expires or Retry-After means nothing
+    BitFlash_Freshness freshness;
+    freshness.parse(503, "", "Sun, 06 Nov 1994 08:49:37 GMT", "", "Sun, 06 Nov 1994 08:49:37 GMT");
+    EXPECT_FALSE(freshness.backoff());
+    EXPECT_EQ(kHour, freshness.nextCheckDelay(kHour));
+}
+
+}  // namespace
@@ -0,0 +1,300 @@
+#include "BitFlash_Lan.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <memory>
+
+namespace {
+
+constexpr uint16_t kPort = 4210;
+
+struct Manifest {
+    std::string body;
+    std::string signature;
+};
+
+// One device on the fake LAN, recording the manifests its leader relays
+// and the versions peers announce to it.
+struct Device {
+    BitFlash_Lan lan;
+    std::vector<Manifest> manifests;
+    bool accept = true;
+    std::string heard;
+
+    Device(uint64_t id, IPAddress address, bool elect, uint8_t fanout) {
+        WiFi.localAddress = address;
+        lan.setManifestHandler([this](const char* body, size_t length, const String& signature) {
+            manifests.push_back({ std::string(body, length), signature.c_str() });
+            return accept;
+        });
+        lan.setAnnounceHandler([this](const char* version) { heard += version; });
+        lan.begin(kPort, id, elect, fanout);
+    }
+};
+
+std::string makeBody(size_t length) {
+    std::string body = "{\"version\":\"2.0.0\",\"pad\":\"";
+    while (body.size() < length - 2) body += (char)('a' + body.size() % 26);
+    return body + "\"}";
+}
+
+bool isHeartbeat(const fake::Datagram& datagram) {
+    return datagram.data.size() > 4 && datagram.data[3] == 'L';
+}
+
+class LanTest : public ::testing::Test {
+protected:
+    std::vector<std::unique_ptr<Device>> devices;
+
+    void SetUp() override {
+        fake::resetNetwork();
+    }
+
+    Device& add(uint64_t id, bool elect = true, uint8_t fanout = 0) {
+        size_t n = devices.size();
+        devices.emplace_back(new Device(id, IPAddress(10, 0, n / 250, 1 + n % 250), elect, fanout));
+        return *devices.back();
+    }
+
+    // Polls every device once per simulated second.
+    void run(uint32_t seconds) {
+        for (uint32_t i = 0; i < seconds; i++) {
+            fake::advance(1000);
+            for (auto& device : devices) device->lan.poll();
+        }
+    }
+
+    // The leader elected after the listening period, with followers settled.
+    Device& elect() {
+        run(20);
+        for (auto& device : devices) {
+            if (device->lan.isLeader()) return *device;
+        }
+        ADD_FAILURE() << "no leader";
+        return *devices.front();
+    }
+};
+
+TEST_F(LanTest, LowestIdLeads) {
+    add(3);
+    add(1);
+    add(2);
+
+    Device& leader = elect();
+    EXPECT_EQ(devices[1].get(), &leader);
+    EXPECT_FALSE(devices[0]->lan.isLeader());
+    EXPECT_TRUE(devices[0]->lan.isFollower());
+    EXPECT_TRUE(devices[2]->lan.isFollower());
+}
+
+TEST_F(LanTest, NextLowestTakesOverWhenLeaderGoesQuiet) {
+    add(3);
+    add(1);
+    add(2);
+    elect();
+
+    devices[1]->lan.end();
+    run(10);
+    EXPECT_FALSE(devices[2]->lan.isLeader());
+    run(10);
+    EXPECT_TRUE(devices[2]->lan.isLeader());
+    EXPECT_TRUE(devices[0]->lan.isFollower());
+}
+
+TEST_F(LanTest, GossipOnlyDevicesPollForThemselves) {
+    Device& device = add(5, false);
+    run(20);
+    EXPECT_FALSE(device.lan.isLeader());
+    EXPECT_FALSE(device.lan.isFollower());
+}
+
+TEST_F(LanTest, LargeManifestArrivesIntactInFragments) {
+    add(1);
+    Device& follower = add(2);
+    Device& leader = elect();
+
+    std::string body = makeBody(5000);
+    String signature("MEUCIQDsignatureInBase64==");
+    uint32_t heartbeats = 0;
+    fake::setUdpFilter([&](const fake::Datagram& datagram) {
+        heartbeats += isHeartbeat(datagram);
+        return true;
+    });
+    leader.lan.publishManifest(body.c_str(), body.size(), signature);
+    follower.lan.poll();
+
+    EXPECT_GE(heartbeats, 4u);
+    ASSERT_EQ(1u, follower.manifests.size());
+    EXPECT_EQ(body, follower.manifests[0].body);
+    EXPECT_EQ("MEUCIQDsignatureInBase64==", follower.manifests[0].signature);
+    EXPECT_TRUE(follower.lan.leaderRelaysManifest());
+
+    // Later heartbeats repeat it, but it was taken already
+    run(15);
+    EXPECT_EQ(1u, follower.manifests.size());
+}
+
+TEST_F(LanTest, ManifestTooBigToRelaySendsFollowersToTheOrigin) {
+    add(1);
+    Device& follower = add(2);
+    Device& leader = elect();
+
+    std::string body = makeBody(10000);
+    leader.lan.publishManifest(body.c_str(), body.size(), String("sig"));
+    run(6);
+
+    EXPECT_TRUE(follower.manifests.empty());
+    EXPECT_FALSE(follower.lan.leaderRelaysManifest());
+    EXPECT_TRUE(follower.lan.isFollower());
+
+    // Back to relaying once the manifest fits again
+    std::string small = makeBody(500);
+    leader.lan.publishManifest(small.c_str(), small.size(), String("sig"));
+    run(6);
+    EXPECT_TRUE(follower.lan.leaderRelaysManifest());
+    ASSERT_EQ(1u, follower.manifests.size());
+    EXPECT_EQ(small, follower.manifests[0].body);
+}
+
+TEST_F(LanTest, ManifestNotActedOnIsOfferedAgain) {
+    add(1);
+    Device& follower = add(2);
+    Device& leader = elect();
+
+    follower.accept = false;
+    std::string body = makeBody(200);
+    leader.lan.publishManifest(body.c_str(), body.size(), String("sig"));
+    follower.lan.poll();
+    ASSERT_EQ(1u, follower.manifests.size());
+
+    // Still busy at the next heartbeat, done at the one after
+    run(5);
+    ASSERT_EQ(2u, follower.manifests.size());
+    follower.accept = true;
+    run(5);
+    ASSERT_EQ(3u, follower.manifests.size());
+    EXPECT_EQ(body, follower.manifests[2].body);
+
+    run(15);
+    EXPECT_EQ(3u, follower.manifests.size());
+}
+
+TEST_F(LanTest, NewManifestIsDeliveredOnce) {
+    add(1);
+    Device& follower = add(2);
+    Device& leader = elect();
+
+    std::string first = makeBody(300);
+    std::string second = makeBody(400);
+    leader.lan.publishManifest(first.c_str(), first.size(), String("sig"));
+    run(6);
+    leader.lan.publishManifest(first.c_str(), first.size(), String("sig"));
+    run(6);
+    leader.lan.publishManifest(second.c_str(), second.size(), String("sig"));
+    run(6);
+
+    ASSERT_EQ(2u, follower.manifests.size());
+    EXPECT_EQ(first, follower.manifests[0].body);
+    EXPECT_EQ(second, follower.manifests[1].body);
+}
+
+TEST_F(LanTest, LostFragmentIsRecoveredFromTheNextHeartbeat) {
+    add(1);
+    Device& follower = add(2);
+    Device& leader = elect();
+
+    uint32_t fragment = 0;
+    fake::setUdpFilter([&](const fake::Datagram& datagram) {
+        return !isHeartbeat(datagram) || ++fragment != 2;
+    });
+    std::string body = makeBody(3000);
+    leader.lan.publishManifest(body.c_str(), body.size(), String("sig"));
+    follower.lan.poll();
+    EXPECT_TRUE(follower.manifests.empty());
+
+    run(5);
+    ASSERT_EQ(1u, follower.manifests.size());
+    EXPECT_EQ(body, follower.manifests[0].body);
+}
+
+class GossipTest : public LanTest {
+protected:
+    // Gossip-only devices that have all heard each other's hello.
+    void addFleet(size_t size, uint8_t fanout) {
+        for (size_t i = 0; i < size; i++) {
+            add(i + 1, false, fanout);
+        }
+        run(2);
+    }
+
+    size_t reached() const {
+        return std::count_if(devices.begin(), devices.end(), [](const std::unique_ptr<Device>& device) {
+            return !device->heard.empty();
+        });
+    }
+};
+
+TEST_F(GossipTest, RumorIsPassedOnOnce) {
+    addFleet(4, 2);
+    uint32_t announcements = 0;
+    fake::setUdpFilter([&](const fake::Datagram& datagram) {
+        announcements += datagram.data.size() > 4 && datagram.data[3] == 'A';
+        return true;
+    });
+
+    devices[0]->lan.announce("2.0.0", "9f86d081884c7d65");
+    devices[0]->lan.announce("2.0.0", "9f86d081884c7d65");
+    run(3);
+
+    // Each device sends it to two peers at most once, and hears it once
+    EXPECT_LE(announcements, 4u * 2);
+    EXPECT_EQ("", devices[0]->heard);
+    for (size_t i = 1; i < devices.size(); i++) {
+        EXPECT_EQ("2.0.0", devices[i]->heard) << "device " << i;
+    }
+
+    // A different manifest for the same version is news again
+    devices[1]->lan.announce("2.0.0", "0123456789abcdef");
+    run(3);
+    EXPECT_EQ("2.0.0", devices[0]->heard);
+    EXPECT_EQ("2.0.02.0.0", devices[2]->heard);
+}
+
+TEST_F(GossipTest, NoGossipWithoutFanout) {
+    addFleet(3, 0);
+    devices[0]->lan.announce("2.0.0", "9f86d081884c7d65");
+    run(3);
+    EXPECT_EQ(0u, reached());
+}
+
+// Rounds of one poll per device until the rumor stops spreading, for a few
+// fleet sizes. Each round stands for one pass of handle(), so the result is
+// the delay in polls rather than checkIntervals.
+TEST_F(GossipTest, DisseminationTimeByFleetSize) {
+    for (size_t size : { 4, 16, 64, 200 }) {
+        devices.clear();
+        fake::resetNetwork();
+        addFleet(size, 3);
+
+        devices[0]->lan.announce("2.0.0", "9f86d081884c7d65");
+        size_t rounds = 0;
+        size_t last = 0;
+        size_t half = 0;
+        for (size_t quiet = 0; quiet < 3; rounds++) {
+            run(1);
+            size_t now = reached();
+            if (!half && now * 2 >= size - 1) half = rounds + 1;
+            quiet = now == last ? quiet + 1 : 0;
+            last = now;
+        }
+        printf("fleet %3zu: half reached after %zu polls, %zu of %zu after %zu\n", size, half, last, size - 1,
+               rounds - 3);
+        RecordProperty("fleet" + std::to_string(size), std::to_string(last) + "/" + std::to_string(rounds - 3));
+
+        // Infect-once gossip misses about e^-fanout of the fleet; those
+        // devices find the release at their next regular check
+        EXPECT_GE(last * 10, (size - 1) * 8) << "fleet " << size;
+        EXPECT_LE(rounds - 3, 10u) << "fleet " << size;
+    }
+}
+
+}  // namespace
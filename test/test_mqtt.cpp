@@ -0,0 +1,185 @@
+#include "BitFlash_Mqtt.h"
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+#include <deque>
+#include <sstream>
+
+namespace {
+
+// The update server's side: answers requests with chunks, which wait in a
+// queue until the test delivers them, like messages in the broker.
+struct ChunkServer {
+    std::vector<uint8_t> image;
+    std::vector<std::string> requests;
+    std::deque<std::vector<uint8_t>> outbox;
+
+    BitFlash_Mqtt::Publisher publisher() {
+        return [this](const char* topic, const uint8_t* payload, size_t length) {
+            EXPECT_STREQ("fw/request", topic);
+            std::string message((const char*)payload, length);
+            requests.push_back(message);
+
+            std::istringstream in(message);
+            std::string device, name;
+            size_t offset, size;
+            in >> device >> name >> offset >> size;
+            EXPECT_EQ("00aa", device);
+            outbox.push_back(chunk(offset, std::min(size, image.size() - offset)));
+            return true;
+        };
+    }
+
+    std::vector<uint8_t> chunk(size_t offset, size_t length) const {
+        std::vector<uint8_t> message(40);
+        for (int i = 0; i < 4; i++) {
+            message[i] = offset >> (8 * i);
+            message[4 + i] = image.size() >> (8 * i);
+        }
+        SHA256(image.data() + offset, length, message.data() + 8);
+        message.insert(message.end(), image.begin() + offset, image.begin() + offset + length);
+        return message;
+    }
+
+    // Hands every queued chunk to the client, in order.
+    void deliver(BitFlash_Mqtt& mqtt) {
+        while (!outbox.empty()) {
+            std::vector<uint8_t> message = outbox.front();
+            outbox.pop_front();
+            mqtt.onChunk(message.data(), message.size());
+        }
+    }
+};
+
+class MqttTest : public ::testing::Test {
+protected:
+    ChunkServer server;
+    std::vector<uint8_t> received;
+    int handlerCalls = 0;
+
+    void SetUp() override {
+        server.image.resize(10000);
+        for (size_t i = 0; i < server.image.size(); i++) server.image[i] = i * 7 + (i >> 9);
+    }
+
+    BitFlash_Mqtt::DataHandler collect() {
+        return [this](uint8_t* data, size_t len, size_t total) {
+            EXPECT_EQ(server.image.size(), total);
+            received.insert(received.end(), data, data + len);
+            handlerCalls++;
+            return true;
+        };
+    }
+
+    // Polls and delivers until the download ends or rounds run out.
+    void run(BitFlash_Mqtt& mqtt, int rounds = 100) {
+        for (int i = 0; i < rounds && mqtt.active(); i++) {
+            mqtt.poll();
+            server.deliver(mqtt);
+        }
+    }
+};
+
+TEST_F(MqttTest, DownloadsWithAWindowOfRequests) {
+    BitFlash_Mqtt mqtt("fw", "00aa", server.publisher());
+    EXPECT_STREQ("fw/manifest", mqtt.manifestTopic().c_str());
+    EXPECT_STREQ("fw/00aa/chunk", mqtt.chunkTopic().c_str());
+
+    ASSERT_TRUE(mqtt.begin("app-1.2.0", 1024, 4, collect()));
+    // One chunk until the size is known, then the window
+    mqtt.poll();
+    ASSERT_EQ(1u, server.requests.size());
+    EXPECT_EQ("00aa app-1.2.0 0 1024", server.requests[0]);
+    server.deliver(mqtt);
+    mqtt.poll();
+    EXPECT_EQ(5u, server.requests.size());
+
+    run(mqtt);
+    EXPECT_TRUE(mqtt.complete());
+    EXPECT_EQ(server.image, received);
+    EXPECT_EQ(10u, server.requests.size());
+}
+
+TEST_F(MqttTest, HandsChunksOnOnlyFromPoll) {
+    BitFlash_Mqtt mqtt("fw", "00aa", server.publisher());
+    ASSERT_TRUE(mqtt.begin("app", 1000, 3, collect()));
+    mqtt.poll();
+    server.deliver(mqtt);
+    EXPECT_EQ(0, handlerCalls);
+    mqtt.poll();
+    EXPECT_EQ(1000u, received.size());
+
+    // Three more chunks queued, none written from the MQTT callback
+    server.deliver(mqtt);
+    EXPECT_EQ(1000u, received.size());
+    mqtt.poll();
+    EXPECT_EQ(4000u, received.size());
+    run(mqtt);
+    EXPECT_TRUE(mqtt.complete());
+    EXPECT_EQ(server.image, received);
+}
+
+TEST_F(MqttTest, WrapsAroundTheQueue) {
+    server.image.resize(5000);
+    BitFlash_Mqtt mqtt("fw", "00aa", server.publisher());
+    ASSERT_TRUE(mqtt.begin("app", 700, 2, collect()));
+    run(mqtt);
+    EXPECT_TRUE(mqtt.complete());
+    EXPECT_EQ(server.image, received);
+}
+
+TEST_F(MqttTest, DropsBadAndOutOfOrderChunks) {
+    BitFlash_Mqtt mqtt("fw", "00aa", server.publisher());
+    ASSERT_TRUE(mqtt.begin("app", 1024, 4, collect()));
+    mqtt.poll();
+    server.deliver(mqtt);
+    mqtt.poll();
+    ASSERT_EQ(4u, server.outbox.size());
+
+    // Corrupt the first, so the three behind it have overtaken a missing one
+    server.outbox[0].back() ^= 1;
+    server.deliver(mqtt);
+    mqtt.poll();
+    EXPECT_EQ(1024u, received.size());
+    EXPECT_EQ(5u, server.requests.size());
+
+    // A duplicate of data already received changes nothing
+    std::vector<uint8_t> duplicate = server.chunk(0, 1024);
+    mqtt.onChunk(duplicate.data(), duplicate.size());
+    mqtt.poll();
+    EXPECT_EQ(1024u, received.size());
+
+    // After the timeout everything outstanding is asked for again
+    fake::advance(5000);
+    run(mqtt);
+    EXPECT_TRUE(mqtt.complete());
+    EXPECT_EQ(server.image, received);
+    EXPECT_EQ("00aa app 1024 1024", server.requests[5]);
+}
+
+TEST_F(MqttTest, FailsAfterRetriesRunOut) {
+    BitFlash_Mqtt mqtt("fw", "00aa", server.publisher());
+    ASSERT_TRUE(mqtt.begin("app", 1024, 4, collect()));
+    for (int i = 0; i < 10 && mqtt.active(); i++) {
+        mqtt.poll();
+        server.outbox.clear();
+        fake::advance(5000);
+    }
+    EXPECT_TRUE(mqtt.failed());
+    EXPECT_EQ(6u, server.requests.size());
+}
+
+TEST_F(MqttTest, HandlerAbortsTheDownload) {
+    BitFlash_Mqtt mqtt("fw", "00aa", server.publisher());
+    ASSERT_TRUE(mqtt.begin("app", 1024, 4, [](uint8_t*, size_t, size_t) { return false; }));
+    run(mqtt);
+    EXPECT_TRUE(mqtt.failed());
+}
+
+TEST_F(MqttTest, RefusesToBeginWithoutChunksOrPublisher) {
+    BitFlash_Mqtt mqtt("fw", "00aa", server.publisher());
+    EXPECT_FALSE(mqtt.begin("app", 0, 4, collect()));
+    BitFlash_Mqtt silent("fw", "00aa", nullptr);
+    EXPECT_FALSE(silent.begin("app", 1024, 4, collect()));
+}
+
+}  // namespace
@@ -0,0 +1,197 @@
+#include "BitFlash_Partition.h"
+#include "BitFlash_Stages.h"
+#include <WiFi.h>
+#include <esp_ota_ops.h>
+#include "test_data.h"
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+
+namespace {
+
+constexpr size_t kSector = SPI_FLASH_SEC_SIZE;
+
+struct Flashed {
+    bool ok;
+    uint32_t written;
+    uint32_t skipped;
+};
+
+class PartitionSinkTest : public ::testing::Test {
+protected:
+    const esp_partition_t* running;
+    const esp_partition_t* next;
+
+    void SetUp() override {
+        fake::resetFlash();
+        running = fake::addPartition("app0", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 64 * kSector);
+        next = fake::addPartition("app1", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 64 * kSector);
+    }
+
+    // Streams the image through a pipeline ending in the sink, received
+    // into the sink's buffer where it offers one, in reads of up to 1000.
+    Flashed flash(const std::vector<uint8_t>& image, bool compare) {
+        BitFlash_Pipeline pipeline;
+        BitFlash_PartitionSink* sink = new BitFlash_PartitionSink(nullptr, compare);
+        pipeline.setSink(sink);
+        bool ok = pipeline.begin(image.size());
+
+        for (size_t pos = 0; ok && pos < image.size(); ) {
+            size_t space = 0;
+            uint8_t* buffer = pipeline.writeBuffer(space);
+            size_t n = min(image.size() - pos, (size_t)1000);
+            if (buffer) {
+                n = min(n, space);
+                memcpy(buffer, image.data() + pos, n);
+            } else {
+                buffer = (uint8_t*)image.data() + pos;
+            }
+            ok = pipeline.write(buffer, n);
+            pos += n;
+        }
+        ok = ok && pipeline.end();
+        return { ok, sink->sectorsWritten(), sink->sectorsSkipped() };
+    }
+
+    struct Received {
+        bool ok;
+        size_t inPlace;   // Read straight into a buffer the pipeline offered
+        size_t buffered;  // Read into a buffer of our own first
+    };
+
+    // The download loop of installFromStream(), reading a socket that
+    // delivers data in TCP-sized segments.
+    Received receive(BitFlash_Pipeline& pipeline, const std::vector<uint8_t>& data) {
+        fake::resetNetwork();
+        fake::listenTcp(IPAddress(10, 0, 0, 9), 80, [&data](std::shared_ptr<fake::TcpConnection> connection) {
+            connection->send(data.data(), data.size());
+            connection->close();
+        });
+        WiFiClient client;
+        Received result = { client.connect(IPAddress(10, 0, 0, 9), 80) && pipeline.begin(data.size()), 0, 0 };
+
+        uint8_t buff[1024];
+        size_t written = 0;
+        while (result.ok && written < data.size()) {
+            size_t room = 0;
+            uint8_t* target = pipeline.writeBuffer(room);
+            bool direct = target != nullptr;
+            if (!direct) {
+                target = buff;
+                room = sizeof(buff);
+            }
+            int n = client.readBytes(target, min((size_t)client.available(), min(room, (size_t)1460)));
+            result.ok = n > 0 && pipeline.write(target, n);
+            written += n;
+            (direct ? result.inPlace : result.buffered) += n;
+        }
+        result.ok = result.ok && written == data.size() && pipeline.end();
+        return result;
+    }
+
+    std::vector<uint8_t> contents(size_t len) {
+        const std::vector<uint8_t>& data = fake::flash(next);
+        return std::vector<uint8_t>(data.begin(), data.begin() + len);
+    }
+};
+
+TEST_F(PartitionSinkTest, WritesIntoTheNextSlotAndBootsIt) {
+    std::vector<uint8_t> image = randomImage(10 * kSector + 123, 1);
+    ASSERT_TRUE(flash(image, true).ok);
+
+    EXPECT_EQ(image, contents(image.size()));
+    EXPECT_EQ(next, esp_ota_get_boot_partition());
+    EXPECT_EQ(11u, fake::flashStats().sectorsErased);
+    EXPECT_EQ(0u, fake::flashStats().overwrites);
+}
+
+TEST_F(PartitionSinkTest, SkipsSectorsThatAlreadyMatch) {
+    std::vector<uint8_t> image = randomImage(16 * kSector, 2);
+    ASSERT_TRUE(flash(image, true).ok);
+
+    // Same image again, then one byte changed in sector 5
+    fake::flashStats() = fake::FlashStats();
+    Flashed result = flash(image, true);
+    ASSERT_TRUE(result.ok);
+    EXPECT_EQ(0u, result.written);
+    EXPECT_EQ(16u, result.skipped);
+    EXPECT_EQ(0u, fake::flashStats().sectorsErased);
+    EXPECT_EQ(0u, fake::flashStats().bytesProgrammed);
+
+    image[5 * kSector + 77] ^= 0x40;
+    result = flash(image, true);
+    ASSERT_TRUE(result.ok);
+    EXPECT_EQ(1u, result.written);
+    EXPECT_EQ(15u, result.skipped);
+    EXPECT_EQ(1u, fake::flashStats().sectorsErased);
+    EXPECT_EQ(image, contents(image.size()));
+}
+
+TEST_F(PartitionSinkTest, WritesEverySectorWithoutCompare) {
+    std::vector<uint8_t> image = randomImage(4 * kSector, 3);
+    ASSERT_TRUE(flash(image, true).ok);
+
+    Flashed result = flash(image, false);
+    ASSERT_TRUE(result.ok);
+    EXPECT_EQ(4u, result.written);
+    EXPECT_EQ(0u, result.skipped);
+    EXPECT_EQ(image, contents(image.size()));
+}
+
+TEST_F(PartitionSinkTest, RejectsImagesThatDoNotFit) {
+    std::vector<uint8_t> image = randomImage(65 * kSector, 4);
+    EXPECT_FALSE(flash(image, true).ok);
+    EXPECT_EQ(running, esp_ota_get_boot_partition());
+}
+
+TEST_F(PartitionSinkTest, ReceivesThroughInPlaceStagesIntoTheSectorBuffer) {
+    std::vector<uint8_t> image = randomImage(6 * kSector + 500, 6);
+    uint8_t key[16], iv[16], digest[32];
+    for (int i = 0; i < 16; i++) key[i] = i * 3, iv[i] = 0xf0 + i;
+    EVP_Digest(image.data(), image.size(), digest, nullptr, EVP_sha256(), nullptr);
+
+    std::vector<uint8_t> cipher(image.size());
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    int n = 0;
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), nullptr, key, iv);
+    EVP_EncryptUpdate(ctx, cipher.data(), &n, image.data(), image.size());
+    EVP_CIPHER_CTX_free(ctx);
+
+    // Decrypt and hash work in place, so the socket is read straight into
+    // the sink's sector buffer and nothing is copied on the way to flash
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_DecryptStage(key, sizeof(key), iv));
+    pipeline.add(new BitFlash_HashStage(digest));
+    pipeline.setSink(new BitFlash_PartitionSink(nullptr, false));
+    Received result = receive(pipeline, cipher);
+    ASSERT_TRUE(result.ok);
+    EXPECT_EQ(image.size(), result.inPlace);
+    EXPECT_EQ(0u, result.buffered);
+    EXPECT_EQ(image, contents(image.size()));
+    EXPECT_EQ(next, esp_ota_get_boot_partition());
+}
+
+TEST_F(PartitionSinkTest, CopiesAheadOfStagesThatChangeTheData) {
+    std::vector<uint8_t> image = randomImage(3 * kSector, 7);
+    std::vector<uint8_t> packed = deflateRaw(image, {}, 1);
+
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_InflateStage(image.size()));
+    pipeline.setSink(new BitFlash_PartitionSink(nullptr, false));
+    Received result = receive(pipeline, packed);
+    ASSERT_TRUE(result.ok);
+    EXPECT_EQ(0u, result.inPlace);
+    EXPECT_EQ(packed.size(), result.buffered);
+    EXPECT_EQ(image, contents(image.size()));
+}
+
+TEST_F(PartitionSinkTest, DoesNotBootAShortImage) {
+    std::vector<uint8_t> image = randomImage(3 * kSector, 5);
+    BitFlash_Pipeline pipeline;
+    pipeline.setSink(new BitFlash_PartitionSink());
+    ASSERT_TRUE(pipeline.begin(image.size() + 1));
+    ASSERT_TRUE(pipeline.write(image.data(), image.size()));
+    EXPECT_FALSE(pipeline.end());
+    EXPECT_EQ(running, esp_ota_get_boot_partition());
+}
+
+}  // namespace
@@ -0,0 +1,275 @@
+#include "BitFlash_Patch.h"
+#include <esp_ota_ops.h>
+#include "test_data.h"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <iterator>
+
+namespace {
+
+constexpr size_t kSector = SPI_FLASH_SEC_SIZE;
+
+void putLE32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back(value >> (8 * i));
+}
+
+// BFP1 from a list of operations, as BitFlash_Patch.h describes it.
+class PatchBuilder {
+public:
+    explicit PatchBuilder(uint32_t newSize) {
+        bytes.insert(bytes.end(), { 'B', 'F', 'P', '1' });
+        putLE32(bytes, newSize);
+        putLE32(bytes, kSector);
+        putLE32(bytes, 0);
+    }
+
+    void copy(uint32_t from, uint32_t length) {
+        bytes.push_back(0x01);
+        putLE32(bytes, from);
+        putLE32(bytes, length);
+    }
+
+    void data(const uint8_t* p, uint32_t length) {
+        bytes.push_back(0x02);
+        putLE32(bytes, length);
+        bytes.insert(bytes.end(), p, p + length);
+    }
+
+    std::vector<uint8_t> bytes;
+};
+
+// Per sector of the new image: a COPY from the same or a later offset of
+// the old one where the bytes are there, literal DATA otherwise. Sources
+// never lie before the output, so the patch also works in place.
+std::vector<uint8_t> makePatch(const std::vector<uint8_t>& from, const std::vector<uint8_t>& to, size_t shift) {
+    PatchBuilder patch(to.size());
+    for (size_t offset = 0; offset < to.size(); offset += kSector) {
+        size_t n = std::min(kSector, to.size() - offset);
+        bool copied = false;
+        for (size_t source : { offset, offset + shift }) {
+            if (source + n <= from.size() && memcmp(&from[source], &to[offset], n) == 0) {
+                patch.copy(source, n);
+                copied = true;
+                break;
+            }
+        }
+        if (!copied) patch.data(&to[offset], n);
+    }
+    return patch.bytes;
+}
+
+std::vector<uint8_t> readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+class PatchTest : public ::testing::Test {
+protected:
+    static constexpr uint32_t kPatchId = 0x1234;
+    const esp_partition_t* loader;
+    const esp_partition_t* app;
+    const esp_partition_t* scratch;
+    std::vector<uint8_t> oldImage;
+    std::vector<uint8_t> newImage;
+    std::vector<uint8_t> patch;
+
+    void SetUp() override {
+        fake::resetFlash();
+        loader = fake::addPartition("app0", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 64 * kSector);
+        app = fake::addPartition("app1", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 64 * kSector);
+        scratch = fake::addPartition("bfscratch", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_UNDEFINED,
+                                     4 * kSector);
+
+        // The new release changes a sector, moves a run of code forward by
+        // 100 bytes, and grows by a partial sector of new code
+        oldImage = randomBytes(24 * kSector, 1);
+        oldImage[0] = 0xE9;
+        newImage = oldImage;
+        std::vector<uint8_t> changed = randomBytes(kSector, 2);
+        std::copy(changed.begin(), changed.end(), newImage.begin() + 3 * kSector);
+        std::copy(oldImage.begin() + 10 * kSector + 100, oldImage.begin() + 20 * kSector + 100,
+                  newImage.begin() + 10 * kSector);
+        std::vector<uint8_t> tail = randomBytes(kSector + 1000, 3);
+        newImage.insert(newImage.end(), tail.begin(), tail.end());
+        patch = makePatch(oldImage, newImage, 100);
+
+        installOld(app);
+    }
+
+    void installOld(const esp_partition_t* partition) {
+        std::copy(oldImage.begin(), oldImage.end(), fake::flash(partition).begin());
+    }
+
+    std::unique_ptr<BitFlash_PatchSink> inPlaceSink(uint32_t patchId = kPatchId) {
+        std::unique_ptr<BitFlash_PatchSink> sink(new BitFlash_PatchSink(app, app, scratch, patchId));
+        sink->setImageHash(sha256(newImage).data());
+        return sink;
+    }
+
+    // Streams the patch from where the sink resumes, as a 206 would, or
+    // from the start when the server ignores the Range request.
+    bool apply(BitFlash_PatchSink& sink, bool honourRange = true, size_t chunk = 700) {
+        size_t start = honourRange ? sink.resumeOffset() : 0;
+        sink.setStreamStart(start);
+        if (!sink.begin(patch.size() - start)) return false;
+        for (size_t pos = start; pos < patch.size(); pos += chunk) {
+            size_t n = std::min(chunk, patch.size() - pos);
+            if (!sink.write(&patch[pos], n)) {
+                sink.abort();
+                return false;
+            }
+        }
+        return sink.end();
+    }
+
+    bool holdsNewImage(const esp_partition_t* partition) {
+        const std::vector<uint8_t>& flash = fake::flash(partition);
+        return std::equal(newImage.begin(), newImage.end(), flash.begin());
+    }
+};
+
+TEST_F(PatchTest, RebuildsIntoTheOtherSlot) {
+    installOld(loader);
+    BitFlash_PatchSink sink(loader, app, nullptr, kPatchId);
+    sink.setImageHash(sha256(newImage).data());
+    ASSERT_TRUE(apply(sink));
+    EXPECT_TRUE(holdsNewImage(app));
+    EXPECT_EQ(app, esp_ota_get_boot_partition());
+}
+
+TEST_F(PatchTest, RebuildsInPlaceAndClearsTheJournal) {
+    auto sink = inPlaceSink();
+    ASSERT_TRUE(apply(*sink));
+    EXPECT_TRUE(holdsNewImage(app));
+    EXPECT_EQ(app, esp_ota_get_boot_partition());
+    EXPECT_EQ(0u, fake::flashStats().overwrites);
+
+    uint32_t pending;
+    EXPECT_FALSE(BitFlash_PatchSink::pendingPatch(scratch, pending));
+}
+
+TEST_F(PatchTest, RejectsAWrongImageHash) {
+    auto sink = inPlaceSink();
+    std::vector<uint8_t> wrong(32, 0);
+    sink->setImageHash(wrong.data());
+    EXPECT_FALSE(apply(*sink));
+    EXPECT_EQ(loader, esp_ota_get_boot_partition());
+}
+
+// Cuts the power before every single erase and program of an in-place
+// update in turn, then reboots until the update goes through.
+TEST_F(PatchTest, SurvivesAPowerCutAtEveryStep) {
+    ASSERT_TRUE(apply(*inPlaceSink()));
+    uint32_t steps = fake::flashStats().operations;
+    ASSERT_GT(steps, 50u);
+
+    for (uint32_t cut = 0; cut < steps; cut++) {
+        SetUp();
+        fake::cutPowerAfter(cut);
+        // Only the journal is left to clear when the last step fails
+        EXPECT_EQ(cut == steps - 1, apply(*inPlaceSink())) << "cut " << cut;
+        ASSERT_TRUE(fake::powerCut());
+
+        // Power back; every other server ignores Range
+        fake::restorePower();
+        auto sink = inPlaceSink();
+        ASSERT_FALSE(sink->foreignJournal());
+        ASSERT_TRUE(apply(*sink, cut % 2 == 0)) << "cut " << cut;
+        ASSERT_TRUE(holdsNewImage(app)) << "cut " << cut;
+        EXPECT_EQ(app, esp_ota_get_boot_partition());
+        EXPECT_EQ(0u, fake::flashStats().overwrites) << "cut " << cut;
+        uint32_t pending;
+        EXPECT_FALSE(BitFlash_PatchSink::pendingPatch(scratch, pending));
+    }
+}
+
+TEST_F(PatchTest, FinishesAFullyJournaledPatchWithoutData) {
+    ASSERT_TRUE(apply(*inPlaceSink()));
+    uint32_t steps = fake::flashStats().operations;
+
+    // Every sector is written, then the power goes as the boot partition
+    // is set
+    SetUp();
+    fake::cutPowerAfter(steps - 2);
+    ASSERT_FALSE(apply(*inPlaceSink()));
+    fake::restorePower();
+
+    auto sink = inPlaceSink();
+    ASSERT_TRUE(sink->complete());
+    EXPECT_EQ(patch.size(), sink->resumeOffset());
+    ASSERT_TRUE(sink->begin(0));
+    ASSERT_TRUE(sink->end());
+    EXPECT_TRUE(holdsNewImage(app));
+    EXPECT_EQ(app, esp_ota_get_boot_partition());
+}
+
+TEST_F(PatchTest, RefusesToMixWithAnotherPatch) {
+    fake::cutPowerAfter(40);
+    ASSERT_FALSE(apply(*inPlaceSink()));
+    fake::restorePower();
+
+    uint32_t pending = 0;
+    ASSERT_TRUE(BitFlash_PatchSink::pendingPatch(scratch, pending));
+    EXPECT_EQ(kPatchId, pending);
+
+    auto other = inPlaceSink(0x5678);
+    EXPECT_TRUE(other->foreignJournal());
+    EXPECT_FALSE(other->begin(patch.size()));
+
+    // Once the partition was rewritten another way the journal can go
+    ASSERT_TRUE(BitFlash_PatchSink::clearJournal(scratch));
+    EXPECT_FALSE(BitFlash_PatchSink::pendingPatch(scratch, pending));
+    EXPECT_FALSE(inPlaceSink(0x5678)->foreignJournal());
+}
+
+TEST_F(PatchTest, RejectsMalformedPatches) {
+    std::vector<uint8_t> good = patch;
+
+    patch[0] = 'X';
+    EXPECT_FALSE(apply(*inPlaceSink()));
+
+    // In place, a COPY may not read from sectors already rewritten
+    SetUp();
+    PatchBuilder backwards(2 * kSector);
+    backwards.copy(0, kSector);
+    backwards.copy(0, kSector);
+    patch = backwards.bytes;
+    EXPECT_FALSE(apply(*inPlaceSink(0x9999)));
+
+    // Bytes past the end of the image
+    SetUp();
+    patch = good;
+    patch.push_back(0x02);
+    EXPECT_FALSE(apply(*inPlaceSink(0xaaaa)));
+}
+
+// Patches built by tools/bfp1.py, written by tool_patches.py at build time
+TEST_F(PatchTest, AppliesPatchesFromTheServerTool) {
+#ifndef TOOL_PATCHES
+    GTEST_SKIP() << "no Python to build the patches";
+#else
+    const std::string dir = TOOL_PATCHES;
+    oldImage = readFile(dir + "/old.bin");
+    newImage = readFile(dir + "/new.bin");
+    ASSERT_FALSE(oldImage.empty());
+    ASSERT_FALSE(newImage.empty());
+
+    patch = readFile(dir + "/ab.bfp");
+    installOld(loader);
+    BitFlash_PatchSink sink(loader, app, nullptr, kPatchId);
+    sink.setImageHash(sha256(newImage).data());
+    ASSERT_TRUE(apply(sink));
+    EXPECT_TRUE(holdsNewImage(app));
+
+    SetUp();
+    oldImage = readFile(dir + "/old.bin");
+    newImage = readFile(dir + "/new.bin");
+    patch = readFile(dir + "/inplace.bfp");
+    installOld(app);
+    ASSERT_TRUE(apply(*inPlaceSink()));
+    EXPECT_TRUE(holdsNewImage(app));
+    EXPECT_EQ(0u, fake::flashStats().overwrites);
+#endif
+}
+
+}  // namespace
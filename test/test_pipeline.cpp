@@ -0,0 +1,198 @@
+#include "BitFlash_Pipeline.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+// Remembers what went past and where it was.
+class RecordingStage : public BitFlash_Stage {
+public:
+    std::vector<uint8_t> data;
+    std::vector<const uint8_t*> pointers;
+    size_t announced = 0;
+    bool ended = false;
+    bool aborted = false;
+    bool failEnd = false;
+    bool inPlace = false;
+
+    bool begin(size_t size) override {
+        announced = size;
+        return BitFlash_Stage::begin(size);
+    }
+    bool write(uint8_t* buf, size_t len) override {
+        pointers.push_back(buf);
+        data.insert(data.end(), buf, buf + len);
+        return emit(buf, len);
+    }
+    bool end() override {
+        ended = true;
+        return !failEnd && BitFlash_Stage::end();
+    }
+    void abort() override {
+        aborted = true;
+        BitFlash_Stage::abort();
+    }
+    bool passesInPlace() const override { return inPlace; }
+};
+
+// Adds one to every byte, in place.
+class IncrementStage : public BitFlash_Stage {
+public:
+    bool write(uint8_t* buf, size_t len) override {
+        for (size_t i = 0; i < len; i++) buf[i]++;
+        return emit(buf, len);
+    }
+};
+
+// Hands on only the first half of each write and says so in begin().
+class HalveStage : public BitFlash_Stage {
+public:
+    bool begin(size_t size) override { return BitFlash_Stage::begin(size / 2); }
+    bool write(uint8_t* buf, size_t len) override { return emit(buf, len / 2); }
+};
+
+// A sink with a buffer of its own to receive into.
+class BufferSink : public RecordingStage {
+public:
+    uint8_t buffer[64];
+
+    uint8_t* writeBuffer(size_t& len) override {
+        len = sizeof(buffer);
+        return buffer;
+    }
+};
+
+class PipelineTest : public ::testing::Test {
+protected:
+    void SetUp() override { Update.reset(); }
+};
+
+}  // namespace
+
+TEST_F(PipelineTest, WithoutStagesWritesThroughUpdate) {
+    BitFlash_Pipeline pipeline;
+    uint8_t data[] = { 1, 2, 3, 4 };
+
+    ASSERT_TRUE(pipeline.begin(sizeof(data)));
+    ASSERT_TRUE(pipeline.write(data, sizeof(data)));
+    ASSERT_TRUE(pipeline.end());
+
+    EXPECT_TRUE(Update.isFinished());
+    EXPECT_EQ(Update.image, std::vector<uint8_t>(data, data + sizeof(data)));
+}
+
+TEST_F(PipelineTest, StagesRunInOrderAheadOfTheSink) {
+    BitFlash_Pipeline pipeline;
+    RecordingStage* first = new RecordingStage;
+    RecordingStage* sink = new RecordingStage;
+    pipeline.add(first);
+    pipeline.add(new IncrementStage);
+    pipeline.setSink(sink);
+
+    uint8_t data[] = { 10, 20, 30 };
+    ASSERT_TRUE(pipeline.begin(sizeof(data)));
+    ASSERT_TRUE(pipeline.write(data, sizeof(data)));
+    ASSERT_TRUE(pipeline.end());
+
+    EXPECT_EQ(first->data, std::vector<uint8_t>({ 10, 20, 30 }));
+    EXPECT_EQ(sink->data, std::vector<uint8_t>({ 11, 21, 31 }));
+    EXPECT_TRUE(first->ended);
+    EXPECT_TRUE(sink->ended);
+    EXPECT_TRUE(Update.image.empty());
+}
+
+TEST_F(PipelineTest, BuffersArePassedWithoutCopies) {
+    BitFlash_Pipeline pipeline;
+    RecordingStage* sink = new RecordingStage;
+    pipeline.add(new IncrementStage);
+    pipeline.add(new RecordingStage);
+    pipeline.setSink(sink);
+
+    uint8_t data[256] = {};
+    ASSERT_TRUE(pipeline.begin(sizeof(data)));
+    ASSERT_TRUE(pipeline.write(data, 100));
+    ASSERT_TRUE(pipeline.write(data + 100, 156));
+
+    ASSERT_EQ(sink->pointers.size(), 2u);
+    EXPECT_EQ(sink->pointers[0], data);
+    EXPECT_EQ(sink->pointers[1], data + 100);
+}
+
+TEST_F(PipelineTest, StagesThatChangeTheLengthAnnounceTheNewSize) {
+    BitFlash_Pipeline pipeline;
+    RecordingStage* sink = new RecordingStage;
+    pipeline.add(new HalveStage);
+    pipeline.setSink(sink);
+
+    uint8_t data[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    ASSERT_TRUE(pipeline.begin(sizeof(data)));
+    ASSERT_TRUE(pipeline.write(data, sizeof(data)));
+
+    EXPECT_EQ(sink->announced, 4u);
+    EXPECT_EQ(sink->data, std::vector<uint8_t>({ 1, 2, 3, 4 }));
+}
+
+TEST_F(PipelineTest, FailedEndAbortsTheWholeChain) {
+    BitFlash_Pipeline pipeline;
+    RecordingStage* check = new RecordingStage;
+    RecordingStage* sink = new RecordingStage;
+    check->failEnd = true;
+    pipeline.add(check);
+    pipeline.setSink(sink);
+
+    uint8_t data[4] = {};
+    ASSERT_TRUE(pipeline.begin(sizeof(data)));
+    ASSERT_TRUE(pipeline.write(data, sizeof(data)));
+    EXPECT_FALSE(pipeline.end());
+
+    EXPECT_FALSE(sink->ended);
+    EXPECT_TRUE(check->aborted);
+    EXPECT_TRUE(sink->aborted);
+}
+
+TEST_F(PipelineTest, SinkFailureReachesTheCaller) {
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new IncrementStage);
+    Update.capacity = 2;
+
+    uint8_t data[4] = {};
+    ASSERT_TRUE(pipeline.begin(2));
+    EXPECT_FALSE(pipeline.write(data, sizeof(data)));
+    Update.capacity = SIZE_MAX;
+}
+
+TEST_F(PipelineTest, ReceivesIntoTheSinkOnlyPastInPlaceStages) {
+    BitFlash_Pipeline pipeline;
+    RecordingStage* check = new RecordingStage;
+    BufferSink* sink = new BufferSink;
+    pipeline.add(check);
+    pipeline.setSink(sink);
+
+    size_t len = 0;
+    EXPECT_EQ(pipeline.writeBuffer(len), nullptr);
+
+    check->inPlace = true;
+    uint8_t* buffer = pipeline.writeBuffer(len);
+    ASSERT_EQ(buffer, sink->buffer);
+    EXPECT_EQ(len, sizeof(sink->buffer));
+
+    memset(buffer, 7, 10);
+    ASSERT_TRUE(pipeline.begin(10));
+    ASSERT_TRUE(pipeline.write(buffer, 10));
+    EXPECT_EQ(sink->pointers[0], sink->buffer);
+    EXPECT_EQ(check->data, std::vector<uint8_t>(10, 7));
+}
+
+TEST_F(PipelineTest, ClearRestoresTheUpdateSink) {
+    BitFlash_Pipeline pipeline;
+    RecordingStage* sink = new RecordingStage;
+    pipeline.add(new IncrementStage);
+    pipeline.setSink(sink);
+    pipeline.clear();
+    EXPECT_TRUE(pipeline.empty());
+
+    uint8_t data[] = { 5 };
+    ASSERT_TRUE(pipeline.begin(1));
+    ASSERT_TRUE(pipeline.write(data, 1));
+    ASSERT_TRUE(pipeline.end());
+    EXPECT_EQ(Update.image, std::vector<uint8_t>({ 5 }));
+}
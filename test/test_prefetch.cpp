@@ -0,0 +1,162 @@
+#include "BitFlash_Prefetch.h"
+#include <esp_ota_ops.h>
+#include "test_data.h"
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+
+namespace {
+
+constexpr size_t kSector = SPI_FLASH_SEC_SIZE;
+constexpr size_t kSlice = 16384;
+
+class PrefetchTest : public ::testing::Test {
+protected:
+    const esp_partition_t* next;
+    std::vector<uint8_t> image;
+    uint8_t hash[32];
+
+    void SetUp() override {
+        fake::resetFlash();
+        fake::resetPreferences();
+        fake::addPartition("app0", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 32 * kSector);
+        next = fake::addPartition("app1", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 32 * kSector);
+        image = randomImage(10 * kSector + 500, 1);
+        EVP_Digest(image.data(), image.size(), hash, nullptr, EVP_sha256(), nullptr);
+    }
+
+    // Receives up to len bytes from offset() the way prefetchChunk() does,
+    // in reads of 1000, without committing.
+    bool receive(BitFlash_Prefetch& prefetch, size_t len) {
+        size_t end = std::min(prefetch.offset() + len, image.size());
+        while (prefetch.offset() < end) {
+            size_t n = std::min<size_t>(1000, end - prefetch.offset());
+            if (!prefetch.write(&image[prefetch.offset()], n)) return false;
+        }
+        return true;
+    }
+
+    // Slices with a commit after each until staged, rebooting whenever the
+    // power goes; reboots are counted.
+    int stageThroughReboots() {
+        int reboots = 0;
+        for (int attempts = 0; attempts < 100; attempts++) {
+            BitFlash_Prefetch prefetch;
+            prefetch.begin();
+            if (!prefetch.pending() && !prefetch.ready()) {
+                prefetch.announce("2.0.0", "http://ota/fw.bin", hash, image.size(), 0);
+            }
+            while (prefetch.pending() && receive(prefetch, kSlice) && prefetch.commit()) {
+            }
+            if (prefetch.ready()) return reboots;
+            fake::restorePower();
+            reboots++;
+        }
+        return -1;
+    }
+
+    bool staged() {
+        const std::vector<uint8_t>& flash = fake::flash(next);
+        return std::equal(image.begin(), image.end(), flash.begin());
+    }
+};
+
+TEST_F(PrefetchTest, StagesSliceBySliceAndActivates) {
+    BitFlash_Prefetch prefetch;
+    prefetch.begin();
+    ASSERT_TRUE(prefetch.announce("2.0.0", "http://ota/fw.bin", hash, image.size(), 0));
+    while (prefetch.pending()) {
+        ASSERT_TRUE(receive(prefetch, kSlice));
+        ASSERT_TRUE(prefetch.commit());
+    }
+    ASSERT_TRUE(prefetch.ready());
+    EXPECT_TRUE(staged());
+
+    // Still staged after a reboot
+    BitFlash_Prefetch after;
+    after.begin();
+    EXPECT_TRUE(after.ready());
+    EXPECT_STREQ("2.0.0", after.version().c_str());
+    ASSERT_TRUE(after.activate());
+    EXPECT_EQ(next, esp_ota_get_boot_partition());
+}
+
+// A reboot after part of a slice was written but before its commit: the
+// bytes past the recorded offset are already programmed.
+TEST_F(PrefetchTest, RebootMidSliceResumesAtASectorBoundary) {
+    {
+        BitFlash_Prefetch prefetch;
+        prefetch.begin();
+        prefetch.announce("2.0.0", "http://ota/fw.bin", hash, image.size(), 0);
+        // A short slice ends mid-sector, then the next one is cut short
+        ASSERT_TRUE(receive(prefetch, 2 * kSector + 1500));
+        ASSERT_TRUE(prefetch.commit());
+        ASSERT_TRUE(receive(prefetch, kSector + 700));
+    }
+
+    BitFlash_Prefetch prefetch;
+    prefetch.begin();
+    ASSERT_TRUE(prefetch.pending());
+    EXPECT_EQ(2 * kSector, prefetch.offset());
+    while (prefetch.pending()) {
+        ASSERT_TRUE(receive(prefetch, kSlice));
+        ASSERT_TRUE(prefetch.commit());
+    }
+    EXPECT_TRUE(prefetch.ready());
+    EXPECT_TRUE(staged());
+    EXPECT_EQ(0u, fake::flashStats().overwrites);
+}
+
+TEST_F(PrefetchTest, OffsetRecordedMidSectorIsRoundedDown) {
+    {
+        BitFlash_Prefetch prefetch;
+        prefetch.begin();
+        prefetch.announce("2.0.0", "http://ota/fw.bin", hash, image.size(), 0);
+        ASSERT_TRUE(receive(prefetch, 3 * kSector + 10));
+    }
+    // As an earlier release recorded it
+    uint32_t offset = kSector + 100;
+    fake::preferences("bitflash-pf")["off"].assign((uint8_t*)&offset, (uint8_t*)&offset + 4);
+
+    BitFlash_Prefetch prefetch;
+    prefetch.begin();
+    EXPECT_EQ(kSector, prefetch.offset());
+    while (prefetch.pending() && receive(prefetch, kSlice) && prefetch.commit()) {
+    }
+    EXPECT_TRUE(prefetch.ready());
+    EXPECT_EQ(0u, fake::flashStats().overwrites);
+}
+
+TEST_F(PrefetchTest, FailedWriteStartsTheSectorOver) {
+    BitFlash_Prefetch prefetch;
+    prefetch.begin();
+    prefetch.announce("2.0.0", "http://ota/fw.bin", hash, image.size(), 0);
+    ASSERT_TRUE(receive(prefetch, kSector + 300));
+
+    // The next program fails; the bytes it covered may be half written
+    fake::cutPowerAfter(0);
+    EXPECT_FALSE(receive(prefetch, 1000));
+    fake::restorePower();
+    EXPECT_EQ(kSector, prefetch.offset());
+
+    while (prefetch.pending() && receive(prefetch, kSlice) && prefetch.commit()) {
+    }
+    EXPECT_TRUE(prefetch.ready());
+    EXPECT_EQ(0u, fake::flashStats().overwrites);
+}
+
+// Cuts the power before every erase and program of a staging in turn.
+TEST_F(PrefetchTest, SurvivesAPowerCutAtEveryStep) {
+    ASSERT_EQ(0, stageThroughReboots());
+    uint32_t steps = fake::flashStats().operations;
+    ASSERT_GT(steps, 20u);
+
+    for (uint32_t cut = 0; cut < steps; cut++) {
+        SetUp();
+        fake::cutPowerAfter(cut);
+        EXPECT_EQ(1, stageThroughReboots()) << "cut " << cut;
+        EXPECT_TRUE(staged()) << "cut " << cut;
+        EXPECT_EQ(0u, fake::flashStats().overwrites) << "cut " << cut;
+    }
+}
+
+}  // namespace
@@ -0,0 +1,254 @@
+import hashlib
+import io
+import json
+import os
+import shutil
+import tempfile
+import threading
+import time
+import unittest
+import urllib.request
+
+import bench_patches
+import bfp1
+from bitflash_server import InstalledBase, PatchCache, Releases, Server, UpdateServer
+
+
+class ReleaseDirTest(unittest.TestCase):
+    """Five releases on disk, 1.0.4 the newest."""
+
+    @classmethod
+    def setUpClass(cls):
+        cls.images = bench_patches.synthetic_releases(5, 60000)
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.dir)
+        for version, image in self.images.items():
+            with open(os.path.join(self.dir, version + ".bin"), "wb") as f:
+                f.write(image)
+        self.releases = Releases(self.dir)
+        self.cache = PatchCache(os.path.join(self.dir, "patches"))
+
+    def report(self, updates, counts):
+        n = 0
+        for version, count in counts.items():
+            for _ in range(count):
+                updates.report("dev%d" % n, version)
+                n += 1
+
+
+class InstalledBaseTest(unittest.TestCase):
+    def test_counts_each_device_once(self):
+        base = InstalledBase()
+        self.assertTrue(base.report("a", "1.0.0"))
+        self.assertFalse(base.report("a", "1.0.0"))
+        self.assertTrue(base.report("b", "1.0.0"))
+        self.assertTrue(base.report("a", "1.1.0"))
+        self.assertEqual({"1.0.0": 1, "1.1.0": 1}, dict(base.counts()))
+
+    def test_top_versions_below_the_newest(self):
+        base = InstalledBase()
+        for n, version in enumerate(["1.0.0"] * 3 + ["1.0.9"] * 5 + ["1.0.10"] * 3 + ["2.0.0"] * 9 + ["0.9.0"]):
+            base.report(str(n), version)
+        # Ties go to the newer version; 2.0.0 is the release itself
+        self.assertEqual(["1.0.9", "1.0.10", "1.0.0"], base.top(3, "2.0.0"))
+        self.assertEqual(["1.0.9"], base.top(1, "1.0.10"))
+
+    def test_survives_a_restart(self):
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "installed.json")
+            InstalledBase(path).report("a", "1.0.0")
+            self.assertEqual({"1.0.0": 1}, dict(InstalledBase(path).counts()))
+
+
+class PatchCacheTest(ReleaseDirTest):
+    def pairs(self, versions):
+        return [(self.releases.images[v], self.releases.hashes[v],
+                 self.releases.images["1.0.4"], self.releases.hashes["1.0.4"]) for v in versions]
+
+    def test_patches_are_named_by_their_hash(self):
+        entries = self.cache.build(self.pairs(["1.0.1", "1.0.2", "1.0.3"]), workers=2)
+        self.assertEqual(3, len(entries))
+        for version in ("1.0.1", "1.0.2", "1.0.3"):
+            entry = entries[self.releases.hashes[version]]
+            with open(self.cache.path(entry["sha256"]), "rb") as f:
+                patch = f.read()
+            self.assertEqual(entry["sha256"], hashlib.sha256(patch).hexdigest())
+            self.assertEqual(entry["size"], len(patch))
+            self.assertEqual(self.images["1.0.4"], bfp1.apply(self.images[version], patch))
+
+    def test_builds_each_pair_once(self):
+        self.cache.build(self.pairs(["1.0.2"]))
+        # A second build would have to read the image
+        os.rename(self.releases.images["1.0.2"], self.releases.images["1.0.2"] + ".moved")
+        entries = self.cache.build(self.pairs(["1.0.2"]))
+        self.assertIsNotNone(entries[self.releases.hashes["1.0.2"]])
+
+        # Index and patches outlive the process
+        again = PatchCache(self.cache.directory)
+        self.assertIsNotNone(again.lookup(self.releases.hashes["1.0.2"], self.releases.hashes["1.0.4"]))
+        self.assertIsNone(PatchCache(self.cache.directory, in_place=True).lookup(
+            self.releases.hashes["1.0.2"], self.releases.hashes["1.0.4"]))
+
+    def test_in_place_patches(self):
+        cache = PatchCache(os.path.join(self.dir, "inplace"), in_place=True)
+        entry = cache.build(self.pairs(["1.0.0"]))[self.releases.hashes["1.0.0"]]
+        with open(cache.path(entry["sha256"]), "rb") as f:
+            patch = f.read()
+        self.assertEqual(self.images["1.0.4"], bfp1.apply(self.images["1.0.0"], patch, in_place=True))
+
+
+class UpdateServerTest(ReleaseDirTest):
+    def test_offers_each_device_the_patch_from_its_version(self):
+        updates = UpdateServer(self.releases, self.cache, top=2, workers=2)
+        self.report(updates, {"1.0.0": 1, "1.0.1": 4, "1.0.3": 3, "1.0.4": 6})
+        updates.refresh()
+
+        for version in ("1.0.1", "1.0.3"):
+            manifest = updates.manifest(version, "http://ota")
+            self.assertEqual("1.0.4", manifest["version"])
+            self.assertEqual("http://ota/fw/1.0.4.bin", manifest["firmware_url"])
+            self.assertEqual(self.releases.hashes["1.0.4"], manifest["sha256"])
+            self.assertEqual(len(self.images["1.0.4"]), manifest["size"])
+            patch = manifest["patch"]
+            self.assertEqual(version, patch["from"])
+            self.assertEqual("http://ota/p/" + patch["sha256"], patch["url"])
+            self.assertNotIn("patches", manifest)
+
+        # Too few devices on 1.0.0, and nothing to patch on the newest
+        for version in ("1.0.0", "1.0.4", "0.1.0", None):
+            self.assertNotIn("patch", updates.manifest(version, "http://ota"))
+
+    def test_asks_for_a_refresh_when_the_top_versions_change(self):
+        updates = UpdateServer(self.releases, self.cache, top=1)
+        self.assertTrue(updates.report("a", "1.0.2"))
+        updates.refresh()
+        self.assertFalse(updates.report("b", "1.0.2"))
+        self.assertFalse(updates.report("c", "1.0.4"))
+        self.assertFalse(updates.report("c", "1.0.3"))
+        self.assertTrue(updates.report("d", "1.0.3"))
+
+    def test_download_paths(self):
+        updates = UpdateServer(self.releases, self.cache, top=1)
+        updates.report("a", "1.0.2")
+        updates.refresh()
+        digest = updates.manifest("1.0.2", "")["patch"]["sha256"]
+        self.assertEqual(self.releases.images["1.0.3"], updates.file_for("/fw/1.0.3.bin"))
+        self.assertEqual(self.cache.path(digest), updates.file_for("/p/" + digest))
+        for path in ("/fw/9.9.9.bin", "/p/" + "0" * 64, "/p/index.json", "/fw/../1.0.3.bin"):
+            self.assertIsNone(updates.file_for(path))
+
+    def test_single_round_trip_sends_the_patch_or_the_image(self):
+        updates = UpdateServer(self.releases, self.cache, top=1)
+        updates.report("a", "1.0.2")
+        updates.refresh()
+
+        manifest, path = updates.update_for("1.0.2", "")
+        self.assertEqual(self.cache.path(manifest["patch"]["sha256"]), path)
+        self.assertEqual(os.path.getsize(path), manifest["patch"]["size"])
+
+        manifest, path = updates.update_for("1.0.1", "")
+        self.assertNotIn("patch", manifest)
+        self.assertEqual(self.releases.images["1.0.4"], path)
+
+        self.assertIsNone(updates.update_for("1.0.4", ""))
+        self.assertIsNone(updates.update_for("2.0.0", ""))
+
+
+class HttpTest(ReleaseDirTest):
+    def setUp(self):
+        super().setUp()
+        self.updates = UpdateServer(self.releases, self.cache, top=3)
+        self.server = Server(("127.0.0.1", 0), self.updates)
+        threading.Thread(target=self.server.serve_forever, daemon=True).start()
+        self.addCleanup(self.server.server_close)
+        self.addCleanup(self.server.shutdown)
+        self.url = "http://127.0.0.1:%d" % self.server.server_address[1]
+
+    def get(self, path, headers=None):
+        request = urllib.request.Request(path if path.startswith("http") else self.url + path, headers=headers or {})
+        with urllib.request.urlopen(request) as response:
+            return response.status, response.read()
+
+    def manifest(self, device, version):
+        headers = {"X-BitFlash-Device": device, "X-BitFlash-Version": version, "X-BitFlash-Patch": "bfp1"}
+        return json.loads(self.get("/manifest.json", headers)[1])
+
+    def test_device_reports_and_gets_a_patch(self):
+        self.assertNotIn("patch", self.manifest("aa01", "1.0.2"))
+
+        # The report started a build in the background
+        deadline = time.time() + 30
+        while "patch" not in self.manifest("aa01", "1.0.2"):
+            self.assertLess(time.time(), deadline)
+            time.sleep(0.05)
+
+        manifest = self.manifest("aa01", "1.0.2")
+        status, patch = self.get(manifest["patch"]["url"])
+        self.assertEqual(200, status)
+        self.assertEqual(manifest["patch"]["sha256"], hashlib.sha256(patch).hexdigest())
+        image = bfp1.apply(self.images["1.0.2"], patch)
+        self.assertEqual(manifest["sha256"], hashlib.sha256(image).hexdigest())
+
+        status, image = self.get(manifest["firmware_url"])
+        self.assertEqual(self.images["1.0.4"], image)
+        self.assertEqual({"1.0.2": 1}, dict(self.updates.base.counts()))
+
+    def check(self, device, version):
+        """The single round trip, split the way the device splits it."""
+        headers = {"X-BitFlash-Device": device, "X-BitFlash-Version": version}
+        request = urllib.request.Request(self.url + "/check", headers=headers)
+        with urllib.request.urlopen(request) as response:
+            length = int(response.headers.get("Content-Length", 0))
+            body = response.read()
+        self.assertEqual(length, len(body))
+        if response.status == 204:
+            return response.status, None, body
+        line, _, rest = body.partition(b"\n")
+        return response.status, json.loads(line), rest
+
+    def test_single_round_trip(self):
+        self.assertEqual((204, None, b""), self.check("aa01", "1.0.4"))
+
+        status, manifest, image = self.check("aa02", "1.0.2")
+        self.assertEqual(200, status)
+        self.assertNotIn("patch", manifest)
+        self.assertEqual(manifest["size"], len(image))
+        self.assertEqual(self.images["1.0.4"], image)
+
+        # Once the report has built the patch, the patch follows the line
+        deadline = time.time() + 30
+        while "patch" not in manifest:
+            self.assertLess(time.time(), deadline)
+            time.sleep(0.05)
+            status, manifest, patch = self.check("aa02", "1.0.2")
+        self.assertEqual("1.0.2", manifest["patch"]["from"])
+        self.assertEqual(manifest["patch"]["size"], len(patch))
+        self.assertEqual(manifest["patch"]["sha256"], hashlib.sha256(patch).hexdigest())
+        self.assertEqual(self.images["1.0.4"], bfp1.apply(self.images["1.0.2"], patch))
+
+    def test_resumes_with_range(self):
+        status, tail = self.get("/fw/1.0.4.bin", {"Range": "bytes=1000-"})
+        self.assertEqual(206, status)
+        self.assertEqual(self.images["1.0.4"][1000:], tail)
+
+        with self.assertRaises(urllib.error.HTTPError) as error:
+            self.get("/fw/5.0.0.bin")
+        self.assertEqual(404, error.exception.code)
+
+
+class BenchmarkTest(unittest.TestCase):
+    def test_times_every_pair(self):
+        releases = bench_patches.synthetic_releases(4, 50000)
+        out = io.StringIO()
+        results, serial, parallel = bench_patches.run(releases, workers=2, out=out)
+        self.assertEqual({"1.0.0", "1.0.1", "1.0.2"}, set(results))
+        for size, seconds in results.values():
+            self.assertLess(size, len(releases["1.0.3"]))
+            self.assertGreater(seconds, 0)
+        self.assertIn("3 pairs", out.getvalue())
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,94 @@
+#include "BitFlash_Signature.h"
+#include <gtest/gtest.h>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+namespace {
+
+// A throwaway key pair and what the server side would do with it.
+class KeyPair {
+public:
+    explicit KeyPair(EVP_PKEY* key) : _key(key) {}
+    ~KeyPair() { EVP_PKEY_free(_key); }
+
+    static KeyPair rsa(unsigned int bits) { return KeyPair(EVP_RSA_gen(bits)); }
+    static KeyPair ec() { return KeyPair(EVP_EC_gen("P-256")); }
+
+    std::string publicPem() const {
+        BIO* bio = BIO_new(BIO_s_mem());
+        PEM_write_bio_PUBKEY(bio, _key);
+        char* data;
+        long len = BIO_get_mem_data(bio, &data);
+        std::string pem(data, len);
+        BIO_free(bio);
+        return pem;
+    }
+
+    String sign(const std::string& body) const {
+        EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+        size_t len = 0;
+        EVP_DigestSignInit(ctx, nullptr, EVP_sha256(), nullptr, _key);
+        EVP_DigestSign(ctx, nullptr, &len, (const uint8_t*)body.data(), body.size());
+        std::vector<uint8_t> sig(len);
+        EVP_DigestSign(ctx, sig.data(), &len, (const uint8_t*)body.data(), body.size());
+        EVP_MD_CTX_free(ctx);
+
+        std::vector<char> encoded(4 * ((len + 2) / 3) + 1);
+        EVP_EncodeBlock((uint8_t*)encoded.data(), sig.data(), len);
+        return String(encoded.data());
+    }
+
+private:
+    EVP_PKEY* _key;
+};
+
+const std::string kManifest = R"({"version":"1.2.0","url":"https://example.com/fw.bin"})";
+
+bool verify(const std::string& key, const std::string& body, const String& signature) {
+    return BitFlash_Signature::verify(key.c_str(), body.data(), body.size(), signature);
+}
+
+}  // namespace
+
+TEST(SignatureTest, AcceptsEcdsaP256) {
+    KeyPair key = KeyPair::ec();
+    EXPECT_TRUE(verify(key.publicPem(), kManifest, key.sign(kManifest)));
+}
+
+TEST(SignatureTest, AcceptsRsaOfCommonSizes) {
+    // 3072-bit signatures are 384 bytes, more than any fixed small buffer
+    for (unsigned int bits : { 2048u, 3072u }) {
+        KeyPair key = KeyPair::rsa(bits);
+        EXPECT_TRUE(verify(key.publicPem(), kManifest, key.sign(kManifest))) << bits << "-bit RSA";
+    }
+}
+
+TEST(SignatureTest, RejectsModifiedBody) {
+    KeyPair key = KeyPair::ec();
+    String signature = key.sign(kManifest);
+    std::string modified = kManifest;
+    modified[14] = '3';
+    EXPECT_FALSE(verify(key.publicPem(), modified, signature));
+}
+
+TEST(SignatureTest, RejectsOtherKeys) {
+    KeyPair signer = KeyPair::ec();
+    KeyPair other = KeyPair::ec();
+    EXPECT_FALSE(verify(other.publicPem(), kManifest, signer.sign(kManifest)));
+}
+
+TEST(SignatureTest, RejectsMissingOrMalformedSignatures) {
+    KeyPair key = KeyPair::ec();
+    EXPECT_FALSE(verify(key.publicPem(), kManifest, String("")));
+    EXPECT_FALSE(verify(key.publicPem(), kManifest, String("not base64!")));
+    EXPECT_FALSE(verify(key.publicPem(), kManifest, String("AAAA")));
+    EXPECT_FALSE(verify("not a key", kManifest, key.sign(kManifest)));
+    EXPECT_FALSE(BitFlash_Signature::verify(nullptr, kManifest.data(), kManifest.size(), key.sign(kManifest)));
+}
+
+TEST(SignatureTest, RejectsOversizedSignatures) {
+    KeyPair key = KeyPair::ec();
+    std::string huge(2000, 'A');
+    EXPECT_FALSE(verify(key.publicPem(), kManifest, String(huge.c_str())));
+}
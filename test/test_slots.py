@@ -0,0 +1,150 @@
+import io
+import json
+import os
+import shutil
+import tempfile
+import threading
+import time
+import unittest
+import urllib.request
+
+import simulate_slots
+from bitflash_server import PatchCache, Releases, Server, SlotPool, UpdateServer
+
+
+class Clock:
+    def __init__(self):
+        self.now = 1000.0
+
+    def __call__(self):
+        return self.now
+
+
+class SlotPoolTest(unittest.TestCase):
+    def setUp(self):
+        self.clock = Clock()
+        self.pool = SlotPool(2, lease=300, clock=self.clock)
+
+    def test_grants_up_to_the_limit(self):
+        a, wait = self.pool.acquire("a")
+        self.assertTrue(a)
+        self.assertEqual(0, wait)
+        self.assertTrue(self.pool.acquire("b")[0])
+        token, wait = self.pool.acquire("c")
+        self.assertIsNone(token)
+        self.assertGreater(wait, 0)
+        self.assertEqual(2, self.pool.active())
+
+        # Asking again keeps the same slot
+        self.assertEqual(a, self.pool.acquire("a")[0])
+        self.assertEqual(2, self.pool.active())
+
+    def test_waiting_devices_go_first(self):
+        self.pool.acquire("a")
+        tokens = [self.pool.acquire("b")[0]]
+        _, first = self.pool.acquire("c")
+        _, second = self.pool.acquire("d")
+        self.assertGreaterEqual(second, first)
+
+        # A freed slot is kept for c, not for the device that asked last
+        self.pool.release(tokens[0])
+        self.assertIsNone(self.pool.acquire("e")[0])
+        self.assertTrue(self.pool.acquire("c")[0])
+
+    def test_later_devices_wait_longer(self):
+        self.pool.acquire("a")
+        self.pool.acquire("b")
+        waits = [self.pool.acquire("dev%d" % n)[1] for n in range(10)]
+        self.assertEqual(sorted(waits), waits)
+        self.assertGreater(waits[-1], waits[0])
+
+    def test_finished_downloads_set_the_wait(self):
+        for n in range(20):
+            token, _ = self.pool.acquire("dev%d" % n)
+            self.clock.now += 5
+            self.pool.release(token)
+        self.pool.acquire("a")
+        self.pool.acquire("b")
+        # About 5 s per download, two at a time
+        self.assertLessEqual(self.pool.acquire("c")[1], 5)
+
+    def test_leases_run_out(self):
+        self.pool.acquire("a")
+        self.pool.acquire("b")
+        self.clock.now += 299
+        self.assertIsNone(self.pool.acquire("c")[0])
+        self.clock.now += 1
+        self.assertTrue(self.pool.acquire("c")[0])
+
+    def test_devices_that_never_return_lose_their_place(self):
+        self.pool.acquire("a")
+        token = self.pool.acquire("b")[0]
+        _, wait = self.pool.acquire("c")
+        self.pool.release(token)
+        # c was given its wait and the typical 60 s on top to come back
+        self.clock.now += wait + 61
+        self.assertTrue(self.pool.acquire("d")[0])
+
+    def test_unknown_tokens_are_ignored(self):
+        self.pool.acquire("a")
+        self.pool.release("nope")
+        self.assertEqual(1, self.pool.active())
+
+
+class SimulationTest(unittest.TestCase):
+    def test_slots_bound_concurrent_downloads(self):
+        out = io.StringIO()
+        results = simulate_slots.run(200, [None, 5, 20], out=out)
+        for limit in (5, 20):
+            self.assertLessEqual(results[limit]["peak"], limit)
+            self.assertEqual(200, results[limit]["finished"])
+        self.assertEqual(5, results[5]["peak"])
+        self.assertGreater(results[None]["peak"], 20)
+        self.assertEqual(200, results[None]["requests"])
+        # Fewer slots take longer, but devices do not poll hot meanwhile
+        self.assertGreater(results[5]["seconds"], results[20]["seconds"])
+        self.assertLess(results[5]["requests"] / 200, 10)
+        self.assertIn("200 devices", out.getvalue())
+
+
+class HttpSlotTest(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.dir)
+        with open(os.path.join(self.dir, "1.0.1.bin"), "wb") as f:
+            f.write(os.urandom(100000))
+        self.slots = SlotPool(1)
+        updates = UpdateServer(Releases(self.dir), PatchCache(os.path.join(self.dir, "patches")), slots=self.slots)
+        self.server = Server(("127.0.0.1", 0), updates)
+        threading.Thread(target=self.server.serve_forever, daemon=True).start()
+        self.addCleanup(self.server.server_close)
+        self.addCleanup(self.server.shutdown)
+        self.url = "http://127.0.0.1:%d" % self.server.server_address[1]
+
+    def get(self, url, headers):
+        with urllib.request.urlopen(urllib.request.Request(url, headers=headers)) as response:
+            return response.read()
+
+    def test_token_then_download(self):
+        headers = {"X-BitFlash-Device": "aa01", "X-BitFlash-Version": "1.0.0"}
+        manifest = json.loads(self.get(self.url + "/manifest.json", headers))
+        self.assertEqual(self.url + "/slot", manifest["slot_url"])
+
+        token = json.loads(self.get(manifest["slot_url"], headers))["token"]
+        other = json.loads(self.get(manifest["slot_url"], {"X-BitFlash-Device": "aa02"}))
+        self.assertNotIn("token", other)
+        self.assertGreater(other["wait"], 0)
+
+        image = self.get(manifest["firmware_url"], {"X-BitFlash-Token": token})
+        self.assertEqual(manifest["size"], len(image))
+
+        # Freed once the last byte has been sent
+        deadline = time.time() + 10
+        while self.slots.active() > 0:
+            self.assertLess(time.time(), deadline)
+            time.sleep(0.01)
+        self.assertIn("token", json.loads(self.get(manifest["slot_url"], {"X-BitFlash-Device": "aa02"})))
+
+
+if __name__ == "__main__":
+    unittest.main()
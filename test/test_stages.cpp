@@ -0,0 +1,323 @@
+#include "BitFlash_Stages.h"
+#include "test_data.h"
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+#include <atomic>
+#include <future>
+#include <thread>
+
+namespace {
+
+// Independent reference: OpenSSL's own CTR mode.
+std::vector<uint8_t> encryptCtr(const std::vector<uint8_t>& plain, const std::vector<uint8_t>& key, const uint8_t iv[16]) {
+    const EVP_CIPHER* cipher = key.size() == 16 ? EVP_aes_128_ctr() : EVP_aes_256_ctr();
+    std::vector<uint8_t> out(plain.size());
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    int n = 0;
+    EVP_EncryptInit_ex(ctx, cipher, nullptr, key.data(), iv);
+    EVP_EncryptUpdate(ctx, out.data(), &n, plain.data(), plain.size());
+    EVP_CIPHER_CTX_free(ctx);
+    return out;
+}
+
+// Pushes data through the pipeline in chunks of the given sizes, cycling.
+bool pushInChunks(BitFlash_Pipeline& pipeline, std::vector<uint8_t> data, std::vector<size_t> chunks) {
+    if (!pipeline.begin(data.size())) return false;
+    size_t pos = 0;
+    for (size_t i = 0; pos < data.size(); i++) {
+        size_t n = min(chunks[i % chunks.size()], data.size() - pos);
+        if (!pipeline.write(data.data() + pos, n)) return false;
+        pos += n;
+    }
+    return pipeline.end();
+}
+
+// An image starting with an ESP-IDF header for the given chip ID, legacy
+// minimum revision byte and full revision range.
+std::vector<uint8_t> makeImage(uint16_t chipId, uint8_t minMajor, uint16_t minFull, uint16_t maxFull) {
+    std::vector<uint8_t> image = randomBytes(8192, chipId + minFull);
+    uint8_t header[24] = { 0xE9, 4, 2, 0x20, 0, 0, 0, 0, 0xEE, 0, 0, 0,
+                           (uint8_t)chipId, (uint8_t)(chipId >> 8), minMajor,
+                           (uint8_t)minFull, (uint8_t)(minFull >> 8), (uint8_t)maxFull, (uint8_t)(maxFull >> 8) };
+    memcpy(image.data(), header, sizeof(header));
+    return image;
+}
+
+bool passesImageCheck(const std::vector<uint8_t>& image, uint16_t chipId, uint16_t chipRevision) {
+    Update.reset();
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_ImageCheckStage(chipId, chipRevision));
+    return pushInChunks(pipeline, image, { 5, 1000 });
+}
+
+// Hands data on from whichever thread calls it, once the gate opens, and
+// notes the threads it ran on.
+class GatedStage : public BitFlash_Stage {
+public:
+    std::shared_future<void> gate;
+    std::vector<std::thread::id> threads;
+    bool fail = false;
+
+    explicit GatedStage(std::shared_future<void> gate) : gate(gate) {}
+
+    bool write(uint8_t* data, size_t len) override {
+        gate.wait();
+        threads.push_back(std::this_thread::get_id());
+        return !fail && emit(data, len);
+    }
+};
+
+std::shared_future<void> openGate() {
+    std::promise<void> promise;
+    promise.set_value();
+    return promise.get_future().share();
+}
+
+class StagesTest : public ::testing::Test {
+protected:
+    void SetUp() override { Update.reset(); }
+};
+
+}  // namespace
+
+TEST_F(StagesTest, DecryptsCtrInAnyChunking) {
+    const uint8_t iv[16] = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+                             0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+    std::vector<uint8_t> plain = randomBytes(10000, 1);
+
+    for (size_t keyLength : { 16, 32 }) {
+        std::vector<uint8_t> key = randomBytes(keyLength, keyLength);
+        std::vector<uint8_t> cipher = encryptCtr(plain, key, iv);
+
+        for (auto chunks : std::vector<std::vector<size_t>>{ { 1 }, { 7, 16, 17 }, { 1024 }, { 10000 } }) {
+            BitFlash_Pipeline pipeline;
+            BitFlash_DecryptStage* stage = new BitFlash_DecryptStage(key.data(), key.size(), iv);
+            ASSERT_TRUE(stage->valid());
+            pipeline.add(stage);
+
+            ASSERT_TRUE(pushInChunks(pipeline, cipher, chunks));
+            EXPECT_EQ(Update.image, plain) << "key " << keyLength << ", first chunk " << chunks[0];
+        }
+    }
+}
+
+TEST_F(StagesTest, DecryptCounterCarriesAcrossBlocks) {
+    // The low bytes overflow within the first blocks, so the carry must ripple
+    uint8_t iv[16];
+    memset(iv, 0xff, sizeof(iv));
+    iv[0] = 0;
+    std::vector<uint8_t> key = randomBytes(16, 7);
+    std::vector<uint8_t> plain = randomBytes(64, 8);
+
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_DecryptStage(key.data(), key.size(), iv));
+    ASSERT_TRUE(pushInChunks(pipeline, encryptCtr(plain, key, iv), { 5 }));
+    EXPECT_EQ(Update.image, plain);
+}
+
+TEST_F(StagesTest, DecryptRejectsBadKeyLengths) {
+    uint8_t key[20] = {};
+    uint8_t iv[16] = {};
+    EXPECT_FALSE(BitFlash_DecryptStage(key, sizeof(key), iv).valid());
+    EXPECT_TRUE(BitFlash_DecryptStage(key, 16, iv).valid());
+}
+
+TEST_F(StagesTest, HashStageCommitsOnlyMatchingImages) {
+    std::vector<uint8_t> image = randomBytes(5000, 3);
+    uint8_t digest[32];
+    EVP_Digest(image.data(), image.size(), digest, nullptr, EVP_sha256(), nullptr);
+
+    BitFlash_Pipeline good;
+    good.add(new BitFlash_HashStage(digest));
+    EXPECT_TRUE(pushInChunks(good, image, { 333 }));
+    EXPECT_TRUE(Update.isFinished());
+
+    Update.reset();
+    digest[0] ^= 1;
+    BitFlash_Pipeline bad;
+    bad.add(new BitFlash_HashStage(digest));
+    EXPECT_FALSE(pushInChunks(bad, image, { 333 }));
+    EXPECT_FALSE(Update.isFinished());
+    EXPECT_TRUE(Update.aborted);
+}
+
+TEST_F(StagesTest, InflatesInAnyChunking) {
+    // Longer than the 32 KB window, so output wraps around it
+    std::vector<uint8_t> image = codeLike(100000, 4);
+    std::vector<uint8_t> compressed = deflateRaw(image);
+    ASSERT_LT(compressed.size(), image.size() / 2);
+
+    for (std::vector<size_t> chunks : std::vector<std::vector<size_t>>{ { 1 }, { 7, 4096 }, { 65536 } }) {
+        Update.reset();
+        BitFlash_Pipeline pipeline;
+        pipeline.add(new BitFlash_InflateStage(image.size()));
+        EXPECT_TRUE(pushInChunks(pipeline, compressed, chunks)) << chunks[0];
+        EXPECT_EQ(Update.image, image);
+    }
+}
+
+TEST_F(StagesTest, InflatesAgainstAPresetDictionary) {
+    // The next release shares most of its bytes with the dictionary; on
+    // their own they would not compress at all
+    std::vector<uint8_t> dictionary = randomBytes(40000, 5);
+    std::vector<uint8_t> image(dictionary.begin() + 10000, dictionary.end());
+    std::vector<uint8_t> extra = randomBytes(5000, 6);
+    image.insert(image.end(), extra.begin(), extra.end());
+    image[100] ^= 1;
+    std::vector<uint8_t> compressed = deflateRaw(image, dictionary);
+    EXPECT_LT(compressed.size() * 2, deflateRaw(image).size());
+
+    BitFlash_Pipeline pipeline;
+    BitFlash_InflateStage* inflate = new BitFlash_InflateStage(image.size());
+    ASSERT_TRUE(inflate->valid());
+    // Only the last 32 KB of it can be referenced
+    inflate->setDictionary(dictionary.data(), dictionary.size());
+    pipeline.add(inflate);
+    EXPECT_TRUE(pushInChunks(pipeline, compressed, { 1000 }));
+    EXPECT_EQ(Update.image, image);
+
+    // Without the dictionary the back references read an empty window; a
+    // hash stage is what catches that
+    Update.reset();
+    BitFlash_Pipeline without;
+    without.add(new BitFlash_InflateStage(image.size()));
+    pushInChunks(without, compressed, { 1000 });
+    EXPECT_NE(Update.image, image);
+}
+
+TEST_F(StagesTest, InflateChecksTheDecompressedSize) {
+    std::vector<uint8_t> image = codeLike(20000, 7);
+    std::vector<uint8_t> compressed = deflateRaw(image);
+
+    for (size_t size : { image.size() - 1, image.size() + 1 }) {
+        Update.reset();
+        BitFlash_Pipeline pipeline;
+        pipeline.add(new BitFlash_InflateStage(size));
+        EXPECT_FALSE(pushInChunks(pipeline, compressed, { 512 })) << size;
+        EXPECT_FALSE(Update.isFinished());
+    }
+
+    // Nothing may follow the end of the stream
+    Update.reset();
+    compressed.push_back(0);
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_InflateStage(image.size()));
+    EXPECT_FALSE(pushInChunks(pipeline, compressed, { 512 }));
+}
+
+TEST_F(StagesTest, ImageCheckComparesFullChipRevisionRange) {
+    // ESP32-S3 (chip ID 9) images for v0.1 up to v1.99
+    std::vector<uint8_t> image = makeImage(9, 0, 1, 199);
+    EXPECT_TRUE(passesImageCheck(image, 9, 1));
+    EXPECT_TRUE(passesImageCheck(image, 9, 102));
+    EXPECT_TRUE(passesImageCheck(image, 9, 199));
+    EXPECT_EQ(Update.image, image);
+
+    EXPECT_FALSE(passesImageCheck(image, 9, 0));
+    EXPECT_FALSE(passesImageCheck(image, 9, 200));
+    // Only bytes before the end of the header were passed on, and Update
+    // holds those in its sector buffer
+    EXPECT_LT(Update.image.size(), 24u);
+}
+
+TEST_F(StagesTest, ImageCheckRejectsOtherChipsAndNonImages) {
+    std::vector<uint8_t> image = makeImage(5, 0, 0, 0xFFFF);
+    EXPECT_TRUE(passesImageCheck(image, 5, 3));
+    EXPECT_FALSE(passesImageCheck(image, 9, 3));
+
+    image[0] = 0xE8;
+    EXPECT_FALSE(passesImageCheck(image, 5, 3));
+}
+
+TEST_F(StagesTest, ImageCheckFallsBackToLegacyMajorRevision) {
+    // Built before ESP-IDF 5: only byte 14 is set, to major revision 3
+    std::vector<uint8_t> image = makeImage(0, 3, 0, 0);
+    EXPECT_TRUE(passesImageCheck(image, 0, 300));
+    EXPECT_TRUE(passesImageCheck(image, 0, 301));
+    EXPECT_FALSE(passesImageCheck(image, 0, 201));
+}
+
+TEST_F(StagesTest, WorkerRunsLaterStagesOnItsOwnTask) {
+    std::vector<uint8_t> image = randomBytes(10000, 11);
+    int tasks = fake::tasksCreated();
+
+    BitFlash_Pipeline pipeline;
+    BitFlash_WorkerStage* worker = new BitFlash_WorkerStage(0, 1024, 3);
+    ASSERT_TRUE(worker->valid());
+    GatedStage* later = new GatedStage(openGate());
+    pipeline.add(worker);
+    pipeline.add(later);
+
+    ASSERT_TRUE(pushInChunks(pipeline, image, { 100, 3000, 7 }));
+    EXPECT_EQ(image, Update.image);
+    EXPECT_TRUE(Update.isFinished());
+    EXPECT_EQ(tasks + 1, fake::tasksCreated());
+    EXPECT_EQ(0, fake::lastTaskCore());
+    ASSERT_FALSE(later->threads.empty());
+    for (std::thread::id id : later->threads) {
+        EXPECT_NE(std::this_thread::get_id(), id);
+    }
+    // Full buffers, then the rest at end()
+    EXPECT_EQ(10u, later->threads.size());
+}
+
+TEST_F(StagesTest, WorkerHoldsBackTheWriterWhenBuffersRunOut) {
+    std::vector<uint8_t> image = randomBytes(8 * 1024, 12);
+    std::promise<void> gate;
+
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_WorkerStage(1, 1024, 3));
+    pipeline.add(new GatedStage(gate.get_future().share()));
+    ASSERT_TRUE(pipeline.begin(image.size()));
+
+    std::atomic<int> written{ 0 };
+    std::thread writer([&] {
+        for (size_t pos = 0; pos < image.size(); pos += 1024) {
+            if (!pipeline.write(image.data() + pos, 1024)) return;
+            written++;
+        }
+    });
+
+    // One buffer with the stuck stage, two queued, none left to fill
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(3, written.load());
+
+    gate.set_value();
+    writer.join();
+    EXPECT_EQ(8, written.load());
+    ASSERT_TRUE(pipeline.end());
+    EXPECT_EQ(image, Update.image);
+}
+
+TEST_F(StagesTest, WorkerReportsFailuresOfLaterStages) {
+    std::vector<uint8_t> image = randomBytes(6000, 13);
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_WorkerStage(0, 1024, 2));
+    GatedStage* later = new GatedStage(openGate());
+    later->fail = true;
+    pipeline.add(later);
+
+    EXPECT_FALSE(pushInChunks(pipeline, image, { 512 }));
+    EXPECT_TRUE(Update.image.empty());
+    EXPECT_FALSE(Update.isFinished());
+}
+
+TEST_F(StagesTest, WorkerOffersItsBufferToReceiveInto) {
+    std::vector<uint8_t> image = randomBytes(5000, 14);
+    BitFlash_Pipeline pipeline;
+    pipeline.add(new BitFlash_WorkerStage(0, 1024, 2));
+    pipeline.add(new GatedStage(openGate()));
+    ASSERT_TRUE(pipeline.begin(image.size()));
+
+    for (size_t pos = 0; pos < image.size(); ) {
+        size_t room = 0;
+        uint8_t* buffer = pipeline.writeBuffer(room);
+        ASSERT_NE(nullptr, buffer);
+        size_t n = min(min(room, (size_t)300), image.size() - pos);
+        memcpy(buffer, image.data() + pos, n);
+        ASSERT_TRUE(pipeline.write(buffer, n));
+        pos += n;
+    }
+    ASSERT_TRUE(pipeline.end());
+    EXPECT_EQ(image, Update.image);
+}
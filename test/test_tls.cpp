@@ -0,0 +1,120 @@
+#include "BitFlash_Tls.h"
+#include "tls_server.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+class TlsTest : public ::testing::Test {
+protected:
+    TlsServer server;
+
+    void SetUp() override {
+        WiFi.hosts["ota.example.com"] = IPAddress(10, 0, 0, 5);
+        server.response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello";
+    }
+
+    void TearDown() override {
+        fake::resetNetwork();
+    }
+
+    static std::string get(BitFlash_TlsClient& client, size_t expected) {
+        const char request[] = "GET /manifest.json HTTP/1.1\r\nHost: ota.example.com\r\n\r\n";
+        if (client.write((const uint8_t*)request, sizeof(request) - 1) != sizeof(request) - 1) return "<write>";
+        std::string out;
+        uint8_t buff[1500];
+        while (out.size() < expected) {
+            int n = client.read(buff, sizeof(buff));
+            if (n <= 0) break;
+            out.append((const char*)buff, n);
+        }
+        return out;
+    }
+};
+
+TEST_F(TlsTest, HandshakesAndExchangesData) {
+    BitFlash_TlsClient client(true, server.caPem.c_str(), 4096);
+    ASSERT_TRUE(client.connect("ota.example.com", 443));
+    EXPECT_TRUE(client.connected());
+    EXPECT_EQ("ota.example.com", server.serverName);
+    EXPECT_EQ("ECDHE-ECDSA-AES128-GCM-SHA256", server.cipher);
+
+    EXPECT_EQ(server.response, get(client, server.response.size()));
+    EXPECT_EQ(0u, server.received.find("GET /manifest.json HTTP/1.1\r\n"));
+
+    // Once the response is read, nothing is left, but the session stays up
+    EXPECT_EQ(0, client.available());
+    EXPECT_TRUE(client.connected());
+    client.stop();
+    EXPECT_FALSE(client.connected());
+}
+
+TEST_F(TlsTest, AvailableAndPeekDecryptWithoutConsuming) {
+    BitFlash_TlsClient client(true, server.caPem.c_str(), 4096);
+    ASSERT_TRUE(client.connect("ota.example.com", 443));
+    const char request[] = "GET / HTTP/1.1\r\n\r\n";
+    client.write((const uint8_t*)request, sizeof(request) - 1);
+
+    EXPECT_EQ((int)server.response.size(), client.available());
+    EXPECT_EQ('H', client.peek());
+    EXPECT_EQ((int)server.response.size(), client.available());
+    EXPECT_EQ('H', client.read());
+    EXPECT_EQ('T', client.read());
+}
+
+TEST_F(TlsTest, AsksForTheMaxFragmentLength) {
+    // A large response, so records would otherwise be 16 KB
+    server.response = std::string(40000, 'x');
+    for (uint16_t length : { 512, 1024, 2048, 4096 }) {
+        server.largestRecord = 0;
+        BitFlash_TlsClient client(true, server.caPem.c_str(), length);
+        ASSERT_TRUE(client.connect("ota.example.com", 443));
+        EXPECT_EQ(length, server.maxFragment);
+        EXPECT_EQ(server.response, get(client, server.response.size()));
+
+        // Header, explicit nonce and GCM tag around at most length bytes
+        EXPECT_LE(server.largestRecord, length + 5u + 8 + 16);
+        EXPECT_GT(server.largestRecord, length);
+        client.stop();
+    }
+}
+
+TEST_F(TlsTest, ChecksTheServerUnlessToldNotTo) {
+    TlsServer other(IPAddress(10, 0, 0, 6));
+
+    // A CA that did not sign the server, a name that is not the server's,
+    // and nothing to check against
+    BitFlash_TlsClient wrongCa(true, other.caPem.c_str(), 4096);
+    EXPECT_FALSE(wrongCa.connect("ota.example.com", 443));
+    EXPECT_FALSE(wrongCa.connected());
+    WiFi.hosts["alias.example.com"] = IPAddress(10, 0, 0, 5);
+    BitFlash_TlsClient wrongName(true, server.caPem.c_str(), 4096);
+    EXPECT_FALSE(wrongName.connect("alias.example.com", 443));
+    BitFlash_TlsClient noCa(true, nullptr, 4096);
+    EXPECT_FALSE(noCa.connect("ota.example.com", 443));
+
+    BitFlash_TlsClient insecure(false, nullptr, 4096);
+    ASSERT_TRUE(insecure.connect("ota.example.com", 443));
+    EXPECT_EQ(server.response, get(insecure, server.response.size()));
+}
+
+TEST_F(TlsTest, ReconnectsWithAFreshSession) {
+    BitFlash_TlsClient client(true, server.caPem.c_str(), 1024);
+    ASSERT_TRUE(client.connect("ota.example.com", 443));
+    client.stop();
+    ASSERT_TRUE(client.connect("ota.example.com", 443));
+    EXPECT_EQ(2, server.handshakes);
+    EXPECT_EQ(server.response, get(client, server.response.size()));
+}
+
+TEST_F(TlsTest, ReadsMinusOneOnceTheServerHasGone) {
+    BitFlash_TlsClient client(false, nullptr, 4096);
+    ASSERT_TRUE(client.connect("ota.example.com", 443));
+    uint8_t buff[16];
+    EXPECT_EQ(0, client.read(buff, sizeof(buff)));
+
+    server.close();
+    EXPECT_EQ(-1, client.read(buff, sizeof(buff)));
+    EXPECT_FALSE(client.connected());
+}
+
+}  // namespace
@@ -0,0 +1,302 @@
+#include "BitFlash_WebSocket.h"
+#include "wire_cost.h"
+#include <WiFi.h>
+#include <WiFiClient.h>
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <vector>
+
+namespace {
+
+// WebSocket server on the fake network: answers the upgrade, unmasks and
+// records the client's frames, and sends the frames a test gives it.
+class WsServer {
+public:
+    struct Frame {
+        uint8_t opcode;
+        std::string payload;
+        bool masked;
+    };
+
+    std::string request;
+    std::vector<Frame> frames;
+    bool wrongAccept = false;
+    bool answersPings = false;
+    std::shared_ptr<fake::TcpConnection> connection;
+
+    WsServer(IPAddress ip, uint16_t port) {
+        fake::listenTcp(ip, port, [this](std::shared_ptr<fake::TcpConnection> c) {
+            connection = c;
+            _upgraded = false;
+            c->onReceive = [this](fake::TcpConnection& c) { onData(c); };
+        });
+    }
+
+    static std::string accept(const std::string& key) {
+        std::string text = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        SHA1((const unsigned char*)text.data(), text.size(), digest);
+        char encoded[64];
+        int n = EVP_EncodeBlock((unsigned char*)encoded, digest, sizeof(digest));
+        return std::string(encoded, n);
+    }
+
+    void send(uint8_t opcode, const std::string& payload, bool final = true, bool masked = false) {
+        std::string frame;
+        frame += (char)((final ? 0x80 : 0) | opcode);
+        uint8_t maskBit = masked ? 0x80 : 0;
+        if (payload.size() < 126) {
+            frame += (char)(maskBit | payload.size());
+        } else if (payload.size() < 65536) {
+            frame += (char)(maskBit | 126);
+            frame += (char)(payload.size() >> 8);
+            frame += (char)(payload.size() & 0xff);
+        } else {
+            frame += (char)(maskBit | 127);
+            for (int i = 7; i >= 0; i--) frame += (char)((uint64_t)payload.size() >> (i * 8));
+        }
+        if (masked) frame += std::string(4, '\0');
+        connection->send(frame + payload);
+    }
+
+private:
+    bool _upgraded = false;
+
+    void onData(fake::TcpConnection& c) {
+        if (!_upgraded) {
+            size_t end = c.received.find("\r\n\r\n");
+            if (end == std::string::npos) return;
+            request = c.received.substr(0, end + 4);
+            c.received.erase(0, end + 4);
+
+            size_t at = request.find("Sec-WebSocket-Key: ");
+            std::string key = at == std::string::npos ? "" : request.substr(at + 19, request.find("\r\n", at) - at - 19);
+            c.send("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: " + (wrongAccept ? accept("other") : accept(key)) + "\r\n\r\n");
+            _upgraded = true;
+        }
+
+        // The client writes the header and the payload separately
+        for (;;) {
+            const std::string& in = c.received;
+            if (in.size() < 2) return;
+            bool masked = in[1] & 0x80;
+            size_t length = in[1] & 0x7f;
+            size_t at = 2;
+            if (length == 126) {
+                if (in.size() < 4) return;
+                length = ((uint8_t)in[2] << 8) | (uint8_t)in[3];
+                at = 4;
+            }
+            size_t payloadAt = at + (masked ? 4 : 0);
+            if (in.size() < payloadAt + length) return;
+
+            std::string payload = in.substr(payloadAt, length);
+            for (size_t i = 0; masked && i < length; i++) payload[i] ^= in[at + (i & 3)];
+            frames.push_back({ (uint8_t)(in[0] & 0x0f), payload, masked });
+            c.received.erase(0, payloadAt + length);
+            if (answersPings && frames.back().opcode == BitFlash_WebSocket::kPing) {
+                send(BitFlash_WebSocket::kPong, payload);
+            }
+        }
+    }
+};
+
+class WebSocketTest : public ::testing::Test {
+protected:
+    WsServer server{ IPAddress(10, 0, 0, 5), 80 };
+    BitFlash_WebSocket socket;
+
+    void SetUp() override {
+        WiFi.hosts["ota.example.com"] = IPAddress(10, 0, 0, 5);
+    }
+
+    void TearDown() override {
+        socket.close();
+        fake::resetNetwork();
+    }
+
+    bool connect(const char* url = "ws://ota.example.com/control") {
+        return socket.connect(url, std::unique_ptr<Client>(new WiFiClient()));
+    }
+
+    std::string receive(BitFlash_WebSocket::Opcode* opcode = nullptr, uint32_t timeout = 100) {
+        uint8_t* data;
+        size_t length;
+        BitFlash_WebSocket::Opcode op;
+        if (!socket.receive(data, length, op, timeout)) return "<none>";
+        if (opcode) *opcode = op;
+        return std::string((const char*)data, length);
+    }
+};
+
+TEST_F(WebSocketTest, AcceptKeyMatchesRfc6455) {
+    EXPECT_EQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", WsServer::accept("dGhlIHNhbXBsZSBub25jZQ=="));
+}
+
+TEST_F(WebSocketTest, UpgradesAndExchangesText) {
+    ASSERT_TRUE(connect());
+    EXPECT_EQ(0u, server.request.find("GET /control HTTP/1.1\r\n"));
+    EXPECT_NE(std::string::npos, server.request.find("Host: ota.example.com\r\n"));
+    EXPECT_NE(std::string::npos, server.request.find("Sec-WebSocket-Version: 13\r\n"));
+    EXPECT_TRUE(socket.connected());
+
+    ASSERT_TRUE(socket.sendText("{\"version\":\"1.0.0\"}"));
+    ASSERT_EQ(1u, server.frames.size());
+    EXPECT_EQ(BitFlash_WebSocket::kText, server.frames[0].opcode);
+    EXPECT_EQ("{\"version\":\"1.0.0\"}", server.frames[0].payload);
+    EXPECT_TRUE(server.frames[0].masked);
+
+    server.send(BitFlash_WebSocket::kText, "{\"cmd\":\"check\"}");
+    BitFlash_WebSocket::Opcode opcode;
+    EXPECT_EQ("{\"cmd\":\"check\"}", receive(&opcode));
+    EXPECT_EQ(BitFlash_WebSocket::kText, opcode);
+
+    EXPECT_GT(socket.bytesSent(), server.request.size());
+    EXPECT_GT(socket.bytesReceived(), 15u);
+}
+
+TEST_F(WebSocketTest, TakesPortAndPathFromTheUrl) {
+    WsServer other(IPAddress(10, 0, 0, 6), 8080);
+    ASSERT_TRUE(socket.connect("ws://10.0.0.6:8080", std::unique_ptr<Client>(new WiFiClient())));
+    EXPECT_EQ(0u, other.request.find("GET / HTTP/1.1\r\n"));
+    EXPECT_NE(std::string::npos, other.request.find("Host: 10.0.0.6:8080\r\n"));
+}
+
+TEST_F(WebSocketTest, RefusesAServerThatDoesNotProveTheUpgrade) {
+    server.wrongAccept = true;
+    EXPECT_FALSE(connect());
+    EXPECT_FALSE(socket.connected());
+
+    EXPECT_FALSE(connect("http://ota.example.com/control"));
+    EXPECT_FALSE(socket.connect("ws://ota.example.com/", nullptr));
+}
+
+TEST_F(WebSocketTest, LongMessagesBothWays) {
+    ASSERT_TRUE(connect());
+    std::string text(300, 'a');
+    for (size_t i = 0; i < text.size(); i++) text[i] = 'a' + i % 26;
+    ASSERT_TRUE(socket.sendText(text.c_str()));
+    ASSERT_EQ(1u, server.frames.size());
+    EXPECT_EQ(text, server.frames[0].payload);
+
+    std::string image(5000, '\x5a');
+    server.send(BitFlash_WebSocket::kBinary, image);
+    BitFlash_WebSocket::Opcode opcode;
+    EXPECT_EQ(image, receive(&opcode));
+    EXPECT_EQ(BitFlash_WebSocket::kBinary, opcode);
+}
+
+TEST_F(WebSocketTest, ReassemblesFragments) {
+    ASSERT_TRUE(connect());
+    server.send(BitFlash_WebSocket::kBinary, "first,", false);
+    server.send(0, "second,", false);
+    server.send(0, "last", true);
+    BitFlash_WebSocket::Opcode opcode;
+    EXPECT_EQ("first,second,last", receive(&opcode));
+    EXPECT_EQ(BitFlash_WebSocket::kBinary, opcode);
+}
+
+TEST_F(WebSocketTest, AnswersPingsBetweenMessages) {
+    ASSERT_TRUE(connect());
+    server.send(BitFlash_WebSocket::kPing, "abc");
+    server.send(BitFlash_WebSocket::kText, "after");
+    EXPECT_EQ("after", receive());
+    ASSERT_EQ(1u, server.frames.size());
+    EXPECT_EQ(BitFlash_WebSocket::kPong, server.frames[0].opcode);
+    EXPECT_EQ("abc", server.frames[0].payload);
+}
+
+TEST_F(WebSocketTest, WaitsForTheTimeoutWhenNothingComes) {
+    ASSERT_TRUE(connect());
+    unsigned long start = millis();
+    EXPECT_EQ("<none>", receive(nullptr, 500));
+    EXPECT_GE(millis() - start, 500u);
+    EXPECT_TRUE(socket.connected());
+}
+
+TEST_F(WebSocketTest, EndsTheSessionOnCloseOrBadFrames) {
+    ASSERT_TRUE(connect());
+    server.send(BitFlash_WebSocket::kClose, "");
+    EXPECT_EQ("<none>", receive());
+    EXPECT_FALSE(socket.connected());
+
+    // Servers must not mask
+    ASSERT_TRUE(connect());
+    server.send(BitFlash_WebSocket::kText, "masked", true, true);
+    EXPECT_EQ("<none>", receive());
+    EXPECT_FALSE(socket.connected());
+
+    // More than the message buffer holds
+    ASSERT_TRUE(connect());
+    server.send(BitFlash_WebSocket::kBinary, std::string(8193, 'x'));
+    EXPECT_EQ("<none>", receive());
+    EXPECT_FALSE(socket.connected());
+}
+
+TEST_F(WebSocketTest, PingsAQuietLineAndDropsADeadOne) {
+    ASSERT_TRUE(connect());
+    fake::advance(30000);
+    EXPECT_TRUE(socket.connected());
+    ASSERT_EQ(1u, server.frames.size());
+    EXPECT_EQ(BitFlash_WebSocket::kPing, server.frames[0].opcode);
+
+    // Any frame from the server counts as a sign of life
+    server.send(BitFlash_WebSocket::kPong, "");
+    EXPECT_EQ("<none>", receive(nullptr, 10));
+    fake::advance(74000);
+    EXPECT_TRUE(socket.connected());
+
+    fake::advance(1000);
+    EXPECT_FALSE(socket.connected());
+    EXPECT_EQ(BitFlash_WebSocket::kClose, server.frames.back().opcode);
+}
+
+TEST_F(WebSocketTest, KeepingTheChannelOpenForADayAgainstPolling) {
+    server.answersPings = true;
+    ASSERT_TRUE(connect());
+    size_t upgradeSent = socket.bytesSent();
+    size_t upgradeReceived = socket.bytesReceived();
+
+    // A day of handle() calls, once a second, with a release pushed at 13:07:21
+    const unsigned long kDay = 86400000;
+    const unsigned long kRelease = 47241000;
+    long latency = -1;
+    for (unsigned long t = 0; t <= kDay; t += 1000) {
+        if (t == kRelease) server.send(BitFlash_WebSocket::kText, "check");
+        ASSERT_TRUE(socket.connected());
+        if (receive(nullptr, 0) == "check") latency = t - kRelease;
+        fake::advance(1000);
+    }
+    EXPECT_EQ(0, latency);
+
+    // A ping for every quiet 30 s, each answered
+    size_t pings = 0;
+    for (const WsServer::Frame& frame : server.frames) pings += frame.opcode == BitFlash_WebSocket::kPing;
+    EXPECT_EQ(kDay / 30000, pings);
+    EXPECT_EQ(upgradeSent + pings * 6, socket.bytesSent());
+    EXPECT_EQ(upgradeReceived + pings * 2 + 2 + 5, socket.bytesReceived());
+
+    // On the air, each ping and each pong is a segment, and the pong is
+    // acknowledged on its own; so is the release
+    size_t channel = socket.bytesSent() + socket.bytesReceived() + tcpOverhead(upgradeSent, upgradeReceived) +
+                     (pings * 3 + 2) * kTcpHeaders;
+
+    // Polling: one plain HTTP check per interval, each on a new connection,
+    // which finds the release at the next check
+    std::string request = httpRequest("/manifest.json");
+    std::string response = httpResponse("application/json", "{\"version\":\"1.0.1\",\"firmware_url\":"
+                                        "\"http://ota.example.com/fw/app.bin\",\"size\":1048576}");
+    size_t check = request.size() + response.size() + tcpOverhead(request.size(), response.size());
+    const unsigned long kHour = 3600000;
+    EXPECT_EQ(3159000u, kHour - kRelease % kHour);
+
+    // The open channel finds the release at once, where hourly checks take
+    // 52 minutes here, but its keepalives cost as much a day as checking
+    // every 4 minutes
+    EXPECT_GT(channel, 288 * check);
+    EXPECT_LT(channel, 480 * check);
+}
+
+}  // namespace
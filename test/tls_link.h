@@ -0,0 +1,222 @@
+#pragma once
+
+// A TLS 1.2 session between two OpenSSL endpoints in memory, standing in for
+// the HTTPS link to the update server. It counts what each side puts on the
+// wire, so transfers can be costed against other transports. The server
+// sends a leaf and an intermediate certificate.
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+class TlsLink {
+public:
+    // Payload bytes each side wrote: TLS records, not counting TCP/IP
+    size_t clientBytes = 0;
+    size_t serverBytes = 0;
+    // Time spent in the client's TLS calls, and in stream's receiver
+    double clientSeconds = 0;
+
+    // RSA suites get RSA-2048 certificates, the others P-256.
+    explicit TlsLink(const char* cipher = "ECDHE-ECDSA-AES128-GCM-SHA256", size_t maxRecord = 0) {
+        bool rsa = strstr(cipher, "-RSA-") != nullptr;
+        EVP_PKEY* caKey = rsa ? EVP_RSA_gen(2048) : EVP_EC_gen("P-256");
+        EVP_PKEY* key = rsa ? EVP_RSA_gen(2048) : EVP_EC_gen("P-256");
+        X509* ca = certificate("BitFlash Test CA", caKey, "BitFlash Test CA", caKey);
+        X509* leaf = certificate("ota.example.com", key, "BitFlash Test CA", caKey);
+
+        _serverContext = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_set_min_proto_version(_serverContext, TLS1_2_VERSION);
+        SSL_CTX_set_max_proto_version(_serverContext, TLS1_2_VERSION);
+        SSL_CTX_set_cipher_list(_serverContext, cipher);
+        SSL_CTX_use_certificate(_serverContext, leaf);
+        SSL_CTX_use_PrivateKey(_serverContext, key);
+        X509_up_ref(ca);
+        SSL_CTX_add_extra_chain_cert(_serverContext, ca);
+
+        _clientContext = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_max_proto_version(_clientContext, TLS1_2_VERSION);
+        SSL_CTX_set_cipher_list(_clientContext, cipher);
+        X509_STORE_add_cert(SSL_CTX_get_cert_store(_clientContext), ca);
+        SSL_CTX_set_verify(_clientContext, SSL_VERIFY_PEER, nullptr);
+
+        _server = SSL_new(_serverContext);
+        _client = SSL_new(_clientContext);
+        SSL_set_tlsext_host_name(_client, "ota.example.com");
+        if (maxRecord) {
+            SSL_set_max_send_fragment(_server, maxRecord);
+        }
+        BIO* toServer = BIO_new(BIO_s_mem());
+        BIO* toClient = BIO_new(BIO_s_mem());
+        // One reference for each end
+        BIO_up_ref(toServer);
+        BIO_up_ref(toClient);
+        SSL_set_bio(_client, toClient, toServer);
+        SSL_set_bio(_server, toServer, toClient);
+        _toServer = toServer;
+        _toClient = toClient;
+        SSL_set_connect_state(_client);
+        SSL_set_accept_state(_server);
+
+        X509_free(ca);
+        X509_free(leaf);
+        EVP_PKEY_free(caKey);
+        EVP_PKEY_free(key);
+    }
+
+    ~TlsLink() {
+        SSL_free(_client);
+        SSL_free(_server);
+        SSL_CTX_free(_clientContext);
+        SSL_CTX_free(_serverContext);
+    }
+
+    TlsLink(const TlsLink&) = delete;
+    TlsLink& operator=(const TlsLink&) = delete;
+
+    bool handshake() {
+        for (int round = 0; round < 10; round++) {
+            auto start = std::chrono::steady_clock::now();
+            int c = SSL_do_handshake(_client);
+            clientSeconds += since(start);
+            move();
+            int s = SSL_do_handshake(_server);
+            move();
+            if (c == 1 && s == 1) return true;
+        }
+        return false;
+    }
+
+    // Both sides send close_notify, as the client does before it drops the
+    // connection.
+    void close() {
+        SSL_shutdown(_client);
+        move();
+        SSL_shutdown(_server);
+        move();
+    }
+
+    // The client sends request; the server reads it and answers with
+    // response, which comes back in full.
+    std::string exchange(const std::string& request, const std::string& response) {
+        auto start = std::chrono::steady_clock::now();
+        send(_client, request);
+        clientSeconds += since(start);
+        std::string got = readAll(_server, request.size());
+        if (got != request) return "";
+        send(_server, response);
+        start = std::chrono::steady_clock::now();
+        got = readAll(_client, response.size());
+        clientSeconds += since(start);
+        return got;
+    }
+
+    // The server sends data; the client reads it in pieces of up to chunk
+    // bytes and hands each to received. The bytes on the wire are in
+    // serverBytes.
+    template <typename Receiver>
+    bool stream(const std::vector<uint8_t>& data, size_t chunk, Receiver received) {
+        std::vector<uint8_t> buff(chunk);
+        auto target = [&buff](size_t& room) {
+            room = buff.size();
+            return buff.data();
+        };
+        return streamInto(data, target, received);
+    }
+
+    // As stream(), but each read goes where target(room) says, up to room
+    // bytes.
+    template <typename Target, typename Receiver>
+    bool streamInto(const std::vector<uint8_t>& data, Target target, Receiver received) {
+        size_t sent = 0;
+        size_t got = 0;
+        while (got < data.size()) {
+            if (sent < data.size()) {
+                size_t n = std::min<size_t>(16384, data.size() - sent);
+                SSL_write(_server, data.data() + sent, n);
+                sent += n;
+                move();
+            }
+            auto start = std::chrono::steady_clock::now();
+            for (;;) {
+                size_t room = 0;
+                uint8_t* into = target(room);
+                int n = SSL_read(_client, into, room);
+                if (n <= 0) break;
+                received(into, (size_t)n);
+                got += n;
+            }
+            clientSeconds += since(start);
+        }
+        return got == data.size();
+    }
+
+    // A certificate for subject, signed by issuer; a CA when they are the same
+    // key.
+    static X509* certificate(const char* subject, EVP_PKEY* key, const char* issuer, EVP_PKEY* issuerKey) {
+        X509* cert = X509_new();
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 90 * 86400);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                                   (const unsigned char*)subject, -1, -1, 0);
+        X509_NAME_add_entry_by_txt(X509_get_issuer_name(cert), "CN", MBSTRING_ASC,
+                                   (const unsigned char*)issuer, -1, -1, 0);
+        X509_set_pubkey(cert, key);
+        if (key == issuerKey) {
+            X509_EXTENSION* ext = X509V3_EXT_conf_nid(nullptr, nullptr, NID_basic_constraints, "critical,CA:TRUE");
+            X509_add_ext(cert, ext, -1);
+            X509_EXTENSION_free(ext);
+        }
+        X509_sign(cert, issuerKey, EVP_sha256());
+        return cert;
+    }
+
+private:
+    SSL_CTX* _serverContext;
+    SSL_CTX* _clientContext;
+    SSL* _server;
+    SSL* _client;
+    BIO* _toServer;
+    BIO* _toClient;
+    size_t _countedToServer = 0;
+    size_t _countedToClient = 0;
+
+    static double since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Counts what each side wrote since the last call. The memory BIOs are
+    // the wire; the peers read from them directly.
+    void move() {
+        size_t toServer = BIO_number_written(_toServer);
+        size_t toClient = BIO_number_written(_toClient);
+        clientBytes += toServer - _countedToServer;
+        serverBytes += toClient - _countedToClient;
+        _countedToServer = toServer;
+        _countedToClient = toClient;
+    }
+
+    void send(SSL* ssl, const std::string& data) {
+        SSL_write(ssl, data.data(), data.size());
+        move();
+    }
+
+    std::string readAll(SSL* ssl, size_t expected) {
+        std::string out;
+        char buff[4096];
+        while (out.size() < expected) {
+            int n = SSL_read(ssl, buff, sizeof(buff));
+            if (n <= 0) break;
+            out.append(buff, n);
+        }
+        return out;
+    }
+};
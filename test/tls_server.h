@@ -0,0 +1,137 @@
+#pragma once
+
+// A TLS 1.2 server on the fake network, on OpenSSL, for clients built
+// against the mbedtls fake. It answers each request that ends in a blank
+// line with response, and records what the handshake settled on.
+
+#include "tls_link.h"
+#include <WiFi.h>
+#include <openssl/pem.h>
+#include <functional>
+
+class TlsServer {
+public:
+    std::string caPem;     // What a client checks the server against
+    std::string response;  // Sent once per request
+
+    std::string serverName;     // SNI
+    std::string cipher;
+    size_t maxFragment = 0;     // Negotiated maximum fragment length, 0 for none
+    size_t largestRecord = 0;   // Largest application data record sent, header included
+    std::string received;       // Decrypted requests
+    int handshakes = 0;
+
+    // Called with true on entering the server's code and false on leaving,
+    // so that a client's allocations can be told from the server's.
+    std::function<void(bool)> serving;
+
+    explicit TlsServer(IPAddress address = IPAddress(10, 0, 0, 5), uint16_t port = 443,
+                       const char* name = "ota.example.com") {
+        EVP_PKEY* caKey = EVP_EC_gen("P-256");
+        EVP_PKEY* key = EVP_EC_gen("P-256");
+        X509* ca = TlsLink::certificate("BitFlash Test CA", caKey, "BitFlash Test CA", caKey);
+        X509* leaf = TlsLink::certificate(name, key, "BitFlash Test CA", caKey);
+
+        _context = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_set_max_proto_version(_context, TLS1_2_VERSION);
+        SSL_CTX_use_certificate(_context, leaf);
+        SSL_CTX_use_PrivateKey(_context, key);
+        X509_up_ref(ca);
+        SSL_CTX_add_extra_chain_cert(_context, ca);
+
+        BIO* pem = BIO_new(BIO_s_mem());
+        PEM_write_bio_X509(pem, ca);
+        char* text;
+        long length = BIO_get_mem_data(pem, &text);
+        caPem.assign(text, length);
+        BIO_free(pem);
+
+        X509_free(ca);
+        X509_free(leaf);
+        EVP_PKEY_free(caKey);
+        EVP_PKEY_free(key);
+
+        fake::listenTcp(address, port, [this](std::shared_ptr<fake::TcpConnection> c) {
+            SSL_free(_ssl);
+            _ssl = SSL_new(_context);
+            BIO* in = BIO_new(BIO_s_mem());
+            BIO* out = BIO_new(BIO_s_mem());
+            SSL_set_bio(_ssl, in, out);
+            SSL_set_accept_state(_ssl);
+            _in = in;
+            _out = out;
+            _established = false;
+            _request.clear();
+            _connection = c;
+            c->onReceive = [this](fake::TcpConnection& c) { onData(c); };
+        });
+    }
+
+    ~TlsServer() {
+        SSL_free(_ssl);
+        SSL_CTX_free(_context);
+    }
+
+    TlsServer(const TlsServer&) = delete;
+    TlsServer& operator=(const TlsServer&) = delete;
+
+    // Drops the connection without a close_notify.
+    void close() {
+        if (_connection) _connection->close();
+    }
+
+private:
+    SSL_CTX* _context;
+    SSL* _ssl = nullptr;
+    BIO* _in = nullptr;
+    BIO* _out = nullptr;
+    bool _established = false;
+    std::string _request;
+    std::shared_ptr<fake::TcpConnection> _connection;
+
+    void onData(fake::TcpConnection& c) {
+        if (serving) serving(true);
+        BIO_write(_in, c.received.data(), c.received.size());
+        c.received.clear();
+
+        if (!_established && SSL_do_handshake(_ssl) == 1) {
+            _established = true;
+            handshakes++;
+            const char* name = SSL_get_servername(_ssl, TLSEXT_NAMETYPE_host_name);
+            serverName = name ? name : "";
+            cipher = SSL_get_cipher_name(_ssl);
+            uint8_t code = SSL_SESSION_get_max_fragment_length(SSL_get_session(_ssl));
+            maxFragment = code ? 256u << code : 0;
+        }
+        if (_established) {
+            char buff[4096];
+            int n;
+            while ((n = SSL_read(_ssl, buff, sizeof(buff))) > 0) {
+                _request.append(buff, n);
+                received.append(buff, n);
+            }
+            size_t end;
+            while ((end = _request.find("\r\n\r\n")) != std::string::npos) {
+                _request.erase(0, end + 4);
+                for (size_t at = 0; at < response.size(); at += 16384) {
+                    SSL_write(_ssl, response.data() + at, std::min<size_t>(16384, response.size() - at));
+                }
+            }
+        }
+        flush(c);
+        if (serving) serving(false);
+    }
+
+    // Sends what OpenSSL wrote, noting the largest application data record.
+    void flush(fake::TcpConnection& c) {
+        char* data;
+        long length = BIO_get_mem_data(_out, &data);
+        for (long at = 0; at + 5 <= length; ) {
+            size_t record = 5 + ((uint8_t)data[at + 3] << 8 | (uint8_t)data[at + 4]);
+            if (data[at] == 23) largestRecord = std::max(largestRecord, record);
+            at += record;
+        }
+        if (length > 0) c.send(data, length);
+        (void)BIO_reset(_out);
+    }
+};
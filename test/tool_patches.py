@@ -0,0 +1,32 @@
+"""Writes a release pair and the patches tools/bfp1.py builds between them,
+so test_patch can apply them with BitFlash_PatchSink.
+
+Usage: tool_patches.py DIR
+"""
+
+import os
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "tools"))
+
+import bfp1
+from bench_patches import synthetic_releases
+
+
+def main(directory):
+    os.makedirs(directory, exist_ok=True)
+    releases = synthetic_releases(3, 150000)
+    files = {
+        "old.bin": releases["1.0.0"],
+        "new.bin": releases["1.0.2"],
+        "ab.bfp": bfp1.diff(releases["1.0.0"], releases["1.0.2"]),
+        "inplace.bfp": bfp1.diff(releases["1.0.0"], releases["1.0.2"], in_place=True),
+    }
+    for name, data in files.items():
+        with open(os.path.join(directory, name), "wb") as f:
+            f.write(data)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1]))
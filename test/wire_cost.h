@@ -0,0 +1,60 @@
+#pragma once
+
+// Bytes that IPv4, UDP and TCP add to a transfer, for costing what a
+// transport puts on the air rather than only its payload, and the HTTP
+// messages of a version check as the client exchanges them.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+
+constexpr size_t kUdpHeaders = 28;
+constexpr size_t kTcpHeaders = 40;
+constexpr size_t kMss = 1460;
+
+inline size_t tcpSegments(size_t bytes) {
+    return (bytes + kMss - 1) / kMss;
+}
+
+// One connection: SYN, SYN-ACK, ACK, two FINs and their ACKs; data
+// segments both ways and an ACK for every other one.
+inline size_t tcpOverhead(size_t sent, size_t received) {
+    size_t data = tcpSegments(sent) + tcpSegments(received);
+    size_t acks = (tcpSegments(sent) + 1) / 2 + (tcpSegments(received) + 1) / 2;
+    return (7 + data + acks) * kTcpHeaders;
+}
+
+// What HTTPClient sends, with the client's device headers.
+inline std::string httpRequest(const char* path) {
+    char text[512];
+    snprintf(text, sizeof(text),
+             "GET %s HTTP/1.1\r\n"
+             "Host: ota.example.com\r\n"
+             "User-Agent: ESP32HTTPClient\r\n"
+             "Connection: close\r\n"
+             "Accept-Encoding: identity;q=1,chunked;q=0.1,*;q=0\r\n"
+             "X-BitFlash-Device: 24a160c3e8f0\r\n"
+             "X-BitFlash-Version: 1.0.0\r\n"
+             "X-BitFlash-Chip: ESP32-S3\r\n"
+             "X-BitFlash-Flash-Size: 8388608\r\n"
+             "X-BitFlash-Psram: 1\r\n"
+             "X-BitFlash-Partition-Size: 3342336\r\n"
+             "X-BitFlash-Patch: bfp1\r\n"
+             "\r\n",
+             path);
+    return text;
+}
+
+// A response with body and any extra header lines, each ending in \r\n.
+inline std::string httpResponse(const char* type, const std::string& body, const std::string& headers = "") {
+    char text[256];
+    snprintf(text, sizeof(text),
+             "HTTP/1.1 200 OK\r\n"
+             "Date: Tue, 14 Nov 2023 22:13:20 GMT\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %zu\r\n"
+             "Cache-Control: max-age=3600\r\n"
+             "Connection: close\r\n",
+             type, body.size());
+    return text + headers + "\r\n" + body;
+}
@@ -0,0 +1,76 @@
+"""Compares ways to ship the newest release: plain deflate, deflate with a
+dictionary trained on the releases before it, and a BFP1 delta from the
+previous release, by size and by decode speed.
+
+Usage: bench_compression.py [RELEASES] [--synthetic N] [--size BYTES]
+"""
+
+import argparse
+import os
+import sys
+import time
+
+import bfp1
+import train_dictionary
+from bench_patches import synthetic_releases
+from bitflash_server import version_key
+
+
+def _rate(function, size, repeat=3):
+    """Best MB/s over a few runs."""
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        function()
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return size / max(best, 1e-9) / 1e6
+
+
+def run(releases, out=sys.stdout):
+    versions = sorted(releases, key=version_key)
+    latest = releases[versions[-1]]
+    previous = releases[versions[-2]]
+    dictionary = train_dictionary.train([releases[v] for v in versions[:-1]])
+
+    plain = train_dictionary.compress(latest)
+    primed = train_dictionary.compress(latest, dictionary)
+    delta = bfp1.diff(previous, latest)
+    results = {
+        "deflate": (len(plain), _rate(lambda: train_dictionary.decompress(plain), len(latest))),
+        "deflate+dict": (len(primed), _rate(lambda: train_dictionary.decompress(primed, dictionary), len(latest))),
+        "bfp1 delta": (len(delta), _rate(lambda: bfp1.apply(previous, delta), len(latest))),
+    }
+
+    out.write("%s, %d bytes, dictionary from %d releases (%d bytes)\n" % (
+        versions[-1], len(latest), len(versions) - 1, len(dictionary)))
+    out.write("%-14s %10s %7s %12s\n" % ("method", "bytes", "ratio", "decode MB/s"))
+    for name, (size, rate) in results.items():
+        out.write("%-14s %10d %6.1f%% %12.1f\n" % (name, size, 100.0 * size / len(latest), rate))
+    return results
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Compares compression with and without a dictionary to deltas.")
+    parser.add_argument("releases", nargs="?", help="directory of <version>.bin images")
+    parser.add_argument("--synthetic", type=int, default=6, help="synthetic versions when no directory is given")
+    parser.add_argument("--size", type=int, default=1 << 20, help="synthetic image size")
+    args = parser.parse_args(argv)
+
+    if args.releases:
+        releases = {}
+        for name in os.listdir(args.releases):
+            if name.endswith(".bin"):
+                with open(os.path.join(args.releases, name), "rb") as f:
+                    releases[name[:-4]] = f.read()
+    else:
+        releases = synthetic_releases(args.synthetic, args.size)
+    if len(releases) < 2:
+        parser.error("need at least two releases")
+
+    run(releases)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
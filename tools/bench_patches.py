@@ -0,0 +1,107 @@
+"""Measures BFP1 patch generation per version pair.
+
+Uses the <version>.bin images in a directory, or a synthetic release history
+when none is given. Every older version is diffed against the newest, once
+on its own for the per-pair time and then all pairs across the worker
+processes the server would use.
+
+Usage: bench_patches.py [RELEASES] [--synthetic N] [--size BYTES] [--workers N] [--in-place]
+"""
+
+import argparse
+import concurrent.futures
+import os
+import random
+import sys
+import time
+
+import bfp1
+from bitflash_server import version_key
+
+
+def synthetic_release(previous, seed):
+    """The next release of a synthetic firmware: a few functions inserted and
+    removed, which shifts everything after them, and scattered words changed
+    the way relocated addresses change."""
+    rng = random.Random(seed)
+    image = bytearray(previous)
+    for _ in range(4):
+        at = rng.randrange(len(image))
+        image[at:at] = rng.randbytes(rng.randrange(64, 2048))
+        at = rng.randrange(len(image))
+        del image[at:at + rng.randrange(64, 1024)]
+    for _ in range(len(image) // 4096):
+        at = rng.randrange(len(image) - 4) & ~3
+        image[at:at + 4] = rng.randbytes(4)
+    image[0] = 0xE9
+    return bytes(image)
+
+
+def synthetic_releases(count, size, seed=1):
+    """Versions 1.0.0 to 1.0.<count - 1>, each built on the previous one."""
+    rng = random.Random(seed)
+    # Code-like: a small alphabet with repeats, unlike random bytes
+    alphabet = rng.randbytes(48)
+    image = bytes([0xE9]) + bytes(rng.choice(alphabet) for _ in range(size - 1))
+    releases = {}
+    for n in range(count):
+        releases["1.0.%d" % n] = image
+        image = synthetic_release(image, seed * 1000 + n)
+    return releases
+
+
+def _timed_diff(old, new, in_place):
+    start = time.perf_counter()
+    patch = bfp1.diff(old, new, in_place)
+    return len(patch), time.perf_counter() - start
+
+
+def run(releases, workers=None, in_place=False, out=sys.stdout):
+    latest = max(releases, key=version_key)
+    older = sorted((v for v in releases if v != latest), key=version_key, reverse=True)
+    new = releases[latest]
+
+    results = {}
+    out.write("%-10s %-10s %10s %10s %7s %9s\n" % ("from", "to", "image", "patch", "ratio", "seconds"))
+    for version in older:
+        size, seconds = _timed_diff(releases[version], new, in_place)
+        results[version] = (size, seconds)
+        out.write("%-10s %-10s %10d %10d %6.1f%% %9.3f\n" % (
+            version, latest, len(new), size, 100.0 * size / len(new), seconds))
+
+    serial = sum(seconds for _, seconds in results.values())
+    start = time.perf_counter()
+    with concurrent.futures.ProcessPoolExecutor(max_workers=workers) as pool:
+        list(pool.map(_timed_diff, [releases[v] for v in older], [new] * len(older), [in_place] * len(older)))
+    parallel = time.perf_counter() - start
+    out.write("%d pairs: %.3f s one after another, %.3f s on %d processes\n" % (
+        len(older), serial, parallel, workers or os.cpu_count()))
+    return results, serial, parallel
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Measures BFP1 patch generation per version pair.")
+    parser.add_argument("releases", nargs="?", help="directory of <version>.bin images")
+    parser.add_argument("--synthetic", type=int, default=6, help="synthetic versions when no directory is given")
+    parser.add_argument("--size", type=int, default=1 << 20, help="synthetic image size")
+    parser.add_argument("--workers", type=int)
+    parser.add_argument("--in-place", action="store_true")
+    args = parser.parse_args(argv)
+
+    if args.releases:
+        releases = {}
+        for name in os.listdir(args.releases):
+            if name.endswith(".bin"):
+                with open(os.path.join(args.releases, name), "rb") as f:
+                    releases[name[:-4]] = f.read()
+    else:
+        releases = synthetic_releases(args.synthetic, args.size)
+    if len(releases) < 2:
+        parser.error("need at least two releases")
+
+    run(releases, args.workers, args.in_place)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,201 @@
+"""BFP1 delta patches, as applied by BitFlash_PatchSink (src/BitFlash_Patch.h).
+
+    header  "BFP1" | new size (u32) | sector size (u32, 4096) | reserved (u32)
+    0x01    COPY   source offset (u32) | length (u32)   bytes of the old image
+    0x02    DATA   length (u32) | bytes                  literal bytes
+
+Usage: bfp1.py [--in-place] OLD NEW PATCH
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = b"BFP1"
+SECTOR = 4096
+OP_COPY = 1
+OP_DATA = 2
+
+# The old image is indexed by BLOCK-byte blocks every STRIDE bytes, so every
+# run of at least BLOCK + STRIDE - 1 equal bytes is found. A COPY costs nine
+# bytes and splits a DATA run, so shorter matches stay literal.
+BLOCK = 16
+STRIDE = 8
+MIN_COPY = 24
+# Offsets kept per block; the last slot always holds the latest one
+CANDIDATES = 8
+
+
+def _index(old):
+    index = {}
+    for j in range(0, len(old) - BLOCK + 1, STRIDE):
+        offsets = index.setdefault(old[j:j + BLOCK], [])
+        if len(offsets) < CANDIDATES:
+            offsets.append(j)
+        else:
+            offsets[-1] = j
+    return index
+
+
+def _forward(a, ai, b, bi, limit):
+    n = 0
+    while n + 64 <= limit and a[ai + n:ai + n + 64] == b[bi + n:bi + n + 64]:
+        n += 64
+    while n < limit and a[ai + n] == b[bi + n]:
+        n += 1
+    return n
+
+
+def _in_place_length(source, target, length):
+    """How much of a COPY the sink accepts in place: it may only read from
+    the sector being built or later ones."""
+    if source >= target:
+        return length
+    sector_start = target - target % SECTOR
+    if source < sector_start:
+        return 0
+    # Reading behind the target is fine until the next sector starts
+    return min(length, sector_start + SECTOR - target)
+
+
+def diff(old, new, in_place=False):
+    """Returns a patch that rebuilds new from old. With in_place, the patch
+    can also be applied over old in the same partition."""
+    old = bytes(old)
+    new = bytes(new)
+    index = _index(old)
+    ops = []
+    literal = 0
+    i = 0
+
+    while i + BLOCK <= len(new):
+        best_length = 0
+        for j in index.get(new[i:i + BLOCK], ()):
+            most_back = i - literal
+            if in_place and j < i:
+                # Reading behind the target only works within its sector
+                sector_start = i - i % SECTOR
+                if j < sector_start:
+                    continue
+                most_back = min(most_back, j - sector_start)
+
+            # Grow backwards into the pending literal bytes, then forwards
+            back = 0
+            while back < most_back and back < j and old[j - back - 1] == new[i - back - 1]:
+                back += 1
+            limit = min(len(old) - j, len(new) - i) - BLOCK
+            if in_place:
+                allowed = _in_place_length(j - back, i - back, len(new))
+                limit = min(limit, allowed - back - BLOCK)
+            length = back + BLOCK + _forward(old, j + BLOCK, new, i + BLOCK, max(0, limit))
+            if in_place:
+                length = min(length, allowed)
+            if length > best_length:
+                best_length, best_source, best_target = length, j - back, i - back
+
+        if best_length < MIN_COPY:
+            i += 1
+            continue
+
+        if best_target > literal:
+            ops.append((OP_DATA, new[literal:best_target]))
+        ops.append((OP_COPY, best_source, best_length))
+        i = literal = best_target + best_length
+
+    if literal < len(new):
+        ops.append((OP_DATA, new[literal:]))
+
+    out = bytearray(MAGIC + struct.pack("<III", len(new), SECTOR, 0))
+    for op in ops:
+        if op[0] == OP_COPY:
+            out += struct.pack("<BII", OP_COPY, op[1], op[2])
+        else:
+            out += struct.pack("<BI", OP_DATA, len(op[1])) + op[1]
+    return bytes(out)
+
+
+def _commit(image, out, committed, in_place):
+    """In place, each finished sector replaces the old one."""
+    while in_place and committed + SECTOR <= len(out):
+        image[committed:committed + SECTOR] = out[committed:committed + SECTOR]
+        committed += SECTOR
+    return committed
+
+
+def apply(old, patch, in_place=False):
+    """Rebuilds the new image the way the sink does, sector by sector. In
+    place, sectors already rebuilt replace the old bytes, and a COPY that
+    reads behind the sector being built raises ValueError like the sink
+    refuses it."""
+    if len(patch) < 16 or patch[:4] != MAGIC:
+        raise ValueError("not a BFP1 patch")
+    new_size, sector_size, _ = struct.unpack_from("<III", patch, 4)
+    if sector_size != SECTOR:
+        raise ValueError("unsupported sector size")
+
+    if in_place:
+        # The partition: old image, then erased flash
+        image = bytearray(old) + b"\xff" * max(0, new_size - len(old))
+    else:
+        image = old
+    out = bytearray()
+    committed = 0
+    pos = 16
+    while pos < len(patch):
+        op = patch[pos]
+        if pos + (9 if op == OP_COPY else 5) > len(patch):
+            raise ValueError("truncated operation")
+        if op == OP_COPY:
+            source, length = struct.unpack_from("<II", patch, pos + 1)
+            pos += 9
+            while length > 0:
+                sector_start = len(out) - len(out) % SECTOR
+                n = min(length, sector_start + SECTOR - len(out))
+                if in_place and source < sector_start:
+                    raise ValueError("COPY reads a sector that was already rebuilt")
+                if source + n > len(image):
+                    raise ValueError("COPY beyond the old image")
+                out += image[source:source + n]
+                source += n
+                length -= n
+                committed = _commit(image, out, committed, in_place)
+        elif op == OP_DATA:
+            (length,) = struct.unpack_from("<I", patch, pos + 1)
+            pos += 5
+            if pos + length > len(patch):
+                raise ValueError("truncated DATA")
+            out += patch[pos:pos + length]
+            pos += length
+            committed = _commit(image, out, committed, in_place)
+        else:
+            raise ValueError("unknown operation %d" % op)
+        if len(out) > new_size:
+            raise ValueError("patch writes beyond the new size")
+
+    if len(out) != new_size:
+        raise ValueError("patch ends early")
+    return bytes(out)
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Builds a BFP1 patch from OLD to NEW.")
+    parser.add_argument("--in-place", action="store_true",
+                        help="only COPY from the sector being built or later ones")
+    parser.add_argument("old")
+    parser.add_argument("new")
+    parser.add_argument("patch")
+    args = parser.parse_args(argv)
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+    patch = diff(old, new, args.in_place)
+    with open(args.patch, "wb") as f:
+        f.write(patch)
+    print("%d bytes, %.1f%% of the image" % (len(patch), 100.0 * len(patch) / max(1, len(new))))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,481 @@
+"""Reference update server for BitFlash_Client.
+
+Serves the releases in a directory, named <version>.bin, and a manifest for
+the newest one. Every manifest request reports the device's installed
+version (X-BitFlash-Version); the server counts devices per version and
+keeps BFP1 patches from the most common ones to the newest release. Patches
+are built in parallel, one process per version pair, and stored under the
+SHA-256 of their content. Each device is offered only the patch from its
+own version.
+
+Devices with singleRoundTrip ask the check path instead. The answer is 204
+when they are current, or one manifest line followed by the patch from
+their version, or by the image when there is no patch.
+
+With --slots N, manifests carry a slot_url and at most N devices hold a
+download token at once. The others are told how long to wait.
+
+Usage: bitflash_server.py RELEASES [--cache DIR] [--top N] [--port PORT]
+"""
+
+import argparse
+import collections
+import concurrent.futures
+import hashlib
+import http.server
+import json
+import os
+import re
+import secrets
+import sys
+import tempfile
+import threading
+import time
+
+import bfp1
+
+
+def version_key(version):
+    """Orders versions the way BitFlash_Client::compareVersions() does."""
+    parts = [int(p) for p in re.findall(r"\d+", version)[:3]]
+    return tuple(parts + [0] * (3 - len(parts)))
+
+
+def sha256_file(path):
+    digest = hashlib.sha256()
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(65536), b""):
+            digest.update(block)
+    return digest.hexdigest()
+
+
+class Releases:
+    """The images in a directory, by version."""
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.images = {}
+        self.hashes = {}
+        self.reload()
+
+    def reload(self):
+        images = {}
+        for name in os.listdir(self.directory):
+            if name.endswith(".bin"):
+                images[name[:-4]] = os.path.join(self.directory, name)
+        self.hashes = {v: self.hashes.get(v) or sha256_file(p) for v, p in images.items()}
+        self.images = images
+
+    def latest(self):
+        return max(self.images, key=version_key) if self.images else None
+
+
+class InstalledBase:
+    """The version each device last reported, optionally kept in a file so
+    the counts survive a restart."""
+
+    def __init__(self, path=None):
+        self.path = path
+        self.lock = threading.Lock()
+        self.devices = {}
+        if path and os.path.exists(path):
+            with open(path) as f:
+                self.devices = json.load(f)
+
+    def report(self, device, version):
+        """Records a report; True when it changed the counts."""
+        with self.lock:
+            if self.devices.get(device) == version:
+                return False
+            self.devices[device] = version
+            if self.path:
+                _write_atomic(self.path, json.dumps(self.devices, indent=1, sort_keys=True).encode())
+            return True
+
+    def counts(self):
+        with self.lock:
+            return collections.Counter(self.devices.values())
+
+    def top(self, n, below):
+        """The n versions older than below that most devices run."""
+        older = [(count, v) for v, count in self.counts().items() if version_key(v) < version_key(below)]
+        older.sort(key=lambda item: (-item[0], [-k for k in version_key(item[1])]))
+        return [v for _, v in older[:n]]
+
+
+def _write_atomic(path, data):
+    handle, temp = tempfile.mkstemp(dir=os.path.dirname(path) or ".")
+    with os.fdopen(handle, "wb") as f:
+        f.write(data)
+    os.replace(temp, path)
+
+
+def _build_patch(old_path, new_path, in_place, directory):
+    """Runs in a worker process. Returns the patch's hash, size and the time
+    the diff took."""
+    with open(old_path, "rb") as f:
+        old = f.read()
+    with open(new_path, "rb") as f:
+        new = f.read()
+    start = time.perf_counter()
+    patch = bfp1.diff(old, new, in_place)
+    seconds = time.perf_counter() - start
+
+    digest = hashlib.sha256(patch).hexdigest()
+    path = os.path.join(directory, digest)
+    if not os.path.exists(path):
+        _write_atomic(path, patch)
+    return digest, len(patch), seconds
+
+
+class PatchCache:
+    """Patches stored under their own SHA-256, indexed by the hashes of the
+    two images they connect, so a rebuilt release or a renamed version finds
+    the same patch."""
+
+    def __init__(self, directory, in_place=False):
+        self.directory = directory
+        self.in_place = in_place
+        self.lock = threading.Lock()
+        os.makedirs(directory, exist_ok=True)
+        self.index_path = os.path.join(directory, "index.json")
+        self.index = {}
+        if os.path.exists(self.index_path):
+            with open(self.index_path) as f:
+                self.index = json.load(f)
+
+    def key(self, old_hash, new_hash):
+        return "%s-%s-%s" % (old_hash, new_hash, "inplace" if self.in_place else "ab")
+
+    def lookup(self, old_hash, new_hash):
+        with self.lock:
+            entry = self.index.get(self.key(old_hash, new_hash))
+        if entry and os.path.exists(self.path(entry["sha256"])):
+            return entry
+        return None
+
+    def path(self, digest):
+        return os.path.join(self.directory, digest)
+
+    def build(self, pairs, workers=None):
+        """Builds the patches for (old path, old hash, new path, new hash)
+        pairs that are not cached yet, one process per pair. Returns the
+        entries by old hash."""
+        missing = [p for p in pairs if not self.lookup(p[1], p[3])]
+        if missing:
+            with concurrent.futures.ProcessPoolExecutor(max_workers=workers) as pool:
+                jobs = {pool.submit(_build_patch, p[0], p[2], self.in_place, self.directory): p for p in missing}
+                for job in concurrent.futures.as_completed(jobs):
+                    old_path, old_hash, new_path, new_hash = jobs[job]
+                    digest, size, seconds = job.result()
+                    with self.lock:
+                        self.index[self.key(old_hash, new_hash)] = {
+                            "sha256": digest, "size": size, "seconds": round(seconds, 3)}
+            with self.lock:
+                _write_atomic(self.index_path, json.dumps(self.index, indent=1, sort_keys=True).encode())
+        return {p[1]: self.lookup(p[1], p[3]) for p in pairs}
+
+
+class SlotPool:
+    """Download slots. Up to limit devices hold a token at once; a slot is
+    free again when its download has been sent to the end, or when the
+    lease runs out. Waiting devices are served in the order they first
+    asked, and each is told to come back about when its turn should be."""
+
+    def __init__(self, limit, lease=600, clock=time.monotonic):
+        self.limit = limit
+        self.lease = lease
+        self.clock = clock
+        self.lock = threading.Lock()
+        self.holders = {}
+        self.tokens = {}
+        self.waiting = collections.OrderedDict()
+        # Seconds a download takes, until one has been seen
+        self.typical = 60.0
+
+    def _expire(self, now):
+        for device, (token, granted) in list(self.holders.items()):
+            if now - granted >= self.lease:
+                del self.holders[device]
+                del self.tokens[token]
+        # Devices that did not come back when told to have given up
+        for device, due in list(self.waiting.items()):
+            if now > due:
+                del self.waiting[device]
+
+    def acquire(self, device):
+        """(token, 0) for a device that may download, or (None, seconds)."""
+        with self.lock:
+            now = self.clock()
+            self._expire(now)
+            if device in self.holders:
+                return self.holders[device][0], 0
+
+            free = self.limit - len(self.holders)
+            queue = list(self.waiting)
+            position = queue.index(device) if device in queue else len(queue)
+            if position < free:
+                self.waiting.pop(device, None)
+                token = secrets.token_hex(16)
+                self.holders[device] = (token, now)
+                self.tokens[token] = device
+                return token, 0
+
+            # Slots free up at about limit per typical download time
+            ahead = position - free + 1
+            wait = max(1, int(ahead * self.typical / self.limit + 0.999))
+            self.waiting[device] = now + wait + self.typical
+            return None, wait
+
+    def release(self, token):
+        """Frees the slot of a finished download."""
+        with self.lock:
+            device = self.tokens.pop(token, None)
+            if device is None:
+                return
+            _, granted = self.holders.pop(device)
+            self.typical = 0.8 * self.typical + 0.2 * max(1.0, self.clock() - granted)
+
+    def active(self):
+        with self.lock:
+            return len(self.holders)
+
+
+class UpdateServer:
+    """Manifests, images and patches, independent of the HTTP layer."""
+
+    def __init__(self, releases, cache, base=None, top=5, workers=None, slots=None):
+        self.releases = releases
+        self.cache = cache
+        self.base = base or InstalledBase()
+        self.top = top
+        self.workers = workers
+        self.slots = slots
+        self._refresh_lock = threading.Lock()
+        self._refresh_again = False
+
+    def refresh(self):
+        """Builds the missing patches from the top versions to the newest.
+        A call while a refresh runs makes it run once more afterwards."""
+        if not self._refresh_lock.acquire(blocking=False):
+            self._refresh_again = True
+            return
+        try:
+            while True:
+                self._refresh_again = False
+                latest = self.releases.latest()
+                if latest:
+                    pairs = [(self.releases.images[v], self.releases.hashes[v],
+                              self.releases.images[latest], self.releases.hashes[latest])
+                             for v in self.base.top(self.top, latest) if v in self.releases.images]
+                    self.cache.build(pairs, self.workers)
+                if not self._refresh_again:
+                    break
+        finally:
+            self._refresh_lock.release()
+
+    def report(self, device, version):
+        """Counts a device; True when a patch for the new counts is missing."""
+        if not device or not version or not self.base.report(device, version):
+            return False
+        latest = self.releases.latest()
+        if not latest:
+            return False
+        for v in self.base.top(self.top, latest):
+            if v in self.releases.images and not self.cache.lookup(self.releases.hashes[v],
+                                                                   self.releases.hashes[latest]):
+                return True
+        return False
+
+    def manifest(self, installed, base_url):
+        """The manifest for a device on version installed, listing the patch
+        from that version when one is ready."""
+        latest = self.releases.latest()
+        if not latest:
+            return None
+        path = self.releases.images[latest]
+        manifest = {
+            "version": latest,
+            "firmware_url": "%s/fw/%s.bin" % (base_url, latest),
+            "sha256": self.releases.hashes[latest],
+            "size": os.path.getsize(path),
+        }
+        if self.slots:
+            manifest["slot_url"] = "%s/slot" % base_url
+        if installed in self.releases.images and installed != latest:
+            entry = self.cache.lookup(self.releases.hashes[installed], self.releases.hashes[latest])
+            if entry:
+                manifest["patch"] = {
+                    "from": installed,
+                    "url": "%s/p/%s" % (base_url, entry["sha256"]),
+                    "sha256": entry["sha256"],
+                    "size": entry["size"],
+                }
+        return manifest
+
+    def update_for(self, installed, base_url):
+        """The single round trip answer: the manifest and the file that
+        follows it, or None when installed is current."""
+        manifest = self.manifest(installed, base_url)
+        if manifest is None or version_key(installed or "") >= version_key(manifest["version"]):
+            return None
+        if "patch" in manifest:
+            return manifest, self.cache.path(manifest["patch"]["sha256"])
+        return manifest, self.releases.images[manifest["version"]]
+
+    def file_for(self, path):
+        """The file behind a download path, or None."""
+        match = re.fullmatch(r"/fw/([^/]+)\.bin", path)
+        if match:
+            return self.releases.images.get(match.group(1))
+        match = re.fullmatch(r"/p/([0-9a-f]{64})", path)
+        if match and os.path.exists(self.cache.path(match.group(1))):
+            return self.cache.path(match.group(1))
+        return None
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    server_version = "BitFlashServer/1.0"
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        updates = self.server.updates
+        path = self.path.split("?")[0]
+        if path == self.server.manifest_path:
+            self.send_manifest(updates)
+            return
+        if path == self.server.check_path:
+            self.send_update(updates)
+            return
+        if path == "/slot" and updates.slots:
+            self.send_slot(updates.slots)
+            return
+
+        file_path = updates.file_for(path)
+        if not file_path:
+            self.send_error(404)
+            return
+        self.send_file(file_path)
+
+    def report(self, updates):
+        device = self.headers.get("X-BitFlash-Device") or self.client_address[0]
+        installed = self.headers.get("X-BitFlash-Version")
+        if updates.report(device, installed):
+            threading.Thread(target=updates.refresh, daemon=True).start()
+        return installed
+
+    def send_manifest(self, updates):
+        installed = self.report(updates)
+        manifest = updates.manifest(installed, "http://%s" % self.headers.get("Host", "localhost"))
+        if manifest is None:
+            self.send_error(404)
+            return
+        body = json.dumps(manifest).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_update(self, updates):
+        """Check and download in one response. The length covers the line
+        and the file, so the device can tell a cut-off body."""
+        installed = self.report(updates)
+        update = updates.update_for(installed, "http://%s" % self.headers.get("Host", "localhost"))
+        if update is None:
+            self.send_response(204)
+            self.end_headers()
+            return
+        manifest, path = update
+        line = json.dumps(manifest).encode() + b"\n"
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(line) + os.path.getsize(path)))
+        self.end_headers()
+        self.wfile.write(line)
+        with open(path, "rb") as f:
+            for block in iter(lambda: f.read(65536), b""):
+                self.wfile.write(block)
+
+    def send_slot(self, slots):
+        device = self.headers.get("X-BitFlash-Device") or self.client_address[0]
+        token, wait = slots.acquire(device)
+        body = json.dumps({"token": token} if token else {"wait": wait}).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_file(self, path):
+        """Sends a file, or the part a Range request asks for; resumed
+        patches and prefetches use bytes=N-. A download that reaches the
+        end of the file frees the slot of its token."""
+        size = os.path.getsize(path)
+        start = 0
+        match = re.fullmatch(r"bytes=(\d+)-", self.headers.get("Range", ""))
+        if match and int(match.group(1)) < size:
+            start = int(match.group(1))
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, size - 1, size))
+        else:
+            self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(size - start))
+        self.end_headers()
+        with open(path, "rb") as f:
+            f.seek(start)
+            for block in iter(lambda: f.read(65536), b""):
+                self.wfile.write(block)
+
+        slots = self.server.updates.slots
+        token = self.headers.get("X-BitFlash-Token")
+        if slots and token:
+            slots.release(token)
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            super().log_message(format, *args)
+
+
+class Server(http.server.ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, address, updates, manifest_path="/manifest.json", verbose=False, check_path="/check"):
+        super().__init__(address, Handler)
+        self.updates = updates
+        self.manifest_path = manifest_path
+        self.check_path = check_path
+        self.verbose = verbose
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Reference update server for BitFlash_Client.")
+    parser.add_argument("releases", help="directory of <version>.bin images")
+    parser.add_argument("--cache", help="patch cache directory (default: RELEASES/patches)")
+    parser.add_argument("--state", help="file that keeps the installed base across restarts")
+    parser.add_argument("--top", type=int, default=5, help="versions to keep patches from")
+    parser.add_argument("--workers", type=int, help="patch processes (default: one per core)")
+    parser.add_argument("--in-place", action="store_true",
+                        help="build patches that can also be applied in place")
+    parser.add_argument("--slots", type=int, help="devices that may download at once")
+    parser.add_argument("--manifest-path", default="/manifest.json")
+    parser.add_argument("--check-path", default="/check", help="single round trip endpoint")
+    parser.add_argument("--bind", default="")
+    parser.add_argument("--port", type=int, default=8080)
+    args = parser.parse_args(argv)
+
+    releases = Releases(args.releases)
+    cache = PatchCache(args.cache or os.path.join(args.releases, "patches"), args.in_place)
+    slots = SlotPool(args.slots) if args.slots else None
+    updates = UpdateServer(releases, cache, InstalledBase(args.state), args.top, args.workers, slots)
+    updates.refresh()
+
+    server = Server((args.bind, args.port), updates, args.manifest_path, verbose=True, check_path=args.check_path)
+    print("Serving %s on port %d" % (releases.latest(), server.server_address[1]))
+    server.serve_forever()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,77 @@
+"""Simulates a fleet fetching a new release through the slot server.
+
+Every device notices the release within the spread, then asks for a slot
+the way BitFlash_Client does: with a token it downloads at its own link
+rate, otherwise it comes back after the wait it was given. The peak shows
+how many downloads ran at once, against the same fleet without slots.
+
+Usage: simulate_slots.py [--devices N] [--limits N...] [--size BYTES] [--spread SECONDS]
+"""
+
+import argparse
+import heapq
+import random
+import sys
+
+from bitflash_server import SlotPool
+
+
+def simulate(devices, limit, size=1 << 20, rates=(20000, 200000), spread=60, seed=1):
+    """Runs the fleet on a simulated clock; limit None means no slots."""
+    rng = random.Random(seed)
+    now = [0.0]
+    pool = SlotPool(limit, clock=lambda: now[0]) if limit else None
+    events = [(rng.uniform(0, spread), n, None) for n in range(devices)]
+    heapq.heapify(events)
+
+    active = peak = requests = finished = 0
+    end = 0.0
+    while events:
+        now[0], n, token = heapq.heappop(events)
+        if token is not None:
+            # A download finished
+            active -= 1
+            finished += 1
+            end = now[0]
+            if pool:
+                pool.release(token)
+            continue
+
+        requests += 1
+        token, wait = pool.acquire("dev%d" % n) if pool else ("", 0)
+        if token is None:
+            heapq.heappush(events, (now[0] + wait, n, None))
+            continue
+        active += 1
+        peak = max(peak, active)
+        heapq.heappush(events, (now[0] + size / rng.uniform(*rates), n, token))
+
+    return {"peak": peak, "seconds": end, "requests": requests, "finished": finished}
+
+
+def run(devices, limits, size=1 << 20, spread=60, out=sys.stdout):
+    results = {}
+    out.write("%d devices, %d byte image\n" % (devices, size))
+    out.write("%-10s %6s %9s %15s\n" % ("slots", "peak", "seconds", "requests/device"))
+    for limit in limits:
+        result = simulate(devices, limit, size, spread=spread)
+        results[limit] = result
+        out.write("%-10s %6d %9.0f %15.1f\n" % (
+            limit or "none", result["peak"], result["seconds"], result["requests"] / devices))
+    return results
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Simulates a fleet downloading through download slots.")
+    parser.add_argument("--devices", type=int, default=500)
+    parser.add_argument("--limits", type=int, nargs="+", default=[5, 20, 50])
+    parser.add_argument("--size", type=int, default=1 << 20, help="image size")
+    parser.add_argument("--spread", type=float, default=60, help="seconds over which devices notice the release")
+    args = parser.parse_args(argv)
+
+    run(args.devices, [None] + args.limits, args.size, args.spread)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,98 @@
+"""Trains a preset dictionary for compressed images from recent releases.
+
+Deflate only refers back 32 KB, so a dictionary helps with the first 32 KB
+of an image: that is where the new release can still reach it. The next
+release will start much like the newest one, so the dictionary is the
+start of the newest release. Bytes inserted near the start push the rest
+further away from the dictionary. The dictionary is shortened by the
+largest such shift seen between consecutive releases, so the matching
+bytes stay within reach.
+
+Usage: train_dictionary.py DICT RELEASE... [--compress IMAGE OUT]
+"""
+
+import argparse
+import hashlib
+import json
+import struct
+import sys
+import zlib
+
+import bfp1
+
+# zlib's compressor refers back at most 32 KB less 262 bytes
+WINDOW = 32768 - 262
+
+
+def start_shift(old, new, size=WINDOW):
+    """How far bytes of old moved forward in the first size bytes of new."""
+    patch = bfp1.diff(old[:2 * size], new[:size])
+    shift = 0
+    pos = 16
+    target = 0
+    while pos < len(patch):
+        if patch[pos] == bfp1.OP_COPY:
+            source, length = struct.unpack_from("<II", patch, pos + 1)
+            shift = max(shift, target - source)
+            pos += 9
+        else:
+            (length,) = struct.unpack_from("<I", patch, pos + 1)
+            pos += 5 + length
+        target += length
+    return shift
+
+
+def train(releases, size=WINDOW):
+    """A dictionary of up to size bytes from releases, oldest first."""
+    shift = max([start_shift(old, new, size) for old, new in zip(releases, releases[1:])] or [0])
+    return releases[-1][:max(0, size - shift)]
+
+
+def compress(image, dictionary=None):
+    """Raw deflate, as BitFlash_InflateStage expects it."""
+    if dictionary:
+        compressor = zlib.compressobj(9, zlib.DEFLATED, -15, zdict=dictionary)
+    else:
+        compressor = zlib.compressobj(9, zlib.DEFLATED, -15)
+    return compressor.compress(image) + compressor.flush()
+
+
+def decompress(data, dictionary=None):
+    if dictionary:
+        decompressor = zlib.decompressobj(-15, zdict=dictionary)
+    else:
+        decompressor = zlib.decompressobj(-15)
+    return decompressor.decompress(data) + decompressor.flush()
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Trains a preset dictionary from recent releases.")
+    parser.add_argument("dictionary", help="output file")
+    parser.add_argument("releases", nargs="+", help="release images, oldest first")
+    parser.add_argument("--size", type=int, default=WINDOW)
+    parser.add_argument("--compress", nargs=2, metavar=("IMAGE", "OUT"),
+                        help="also compress IMAGE against the dictionary")
+    args = parser.parse_args(argv)
+
+    releases = []
+    for path in args.releases:
+        with open(path, "rb") as f:
+            releases.append(f.read())
+    dictionary = train(releases, args.size)
+    with open(args.dictionary, "wb") as f:
+        f.write(dictionary)
+
+    # The manifest's "compression" object, with the URLs left to fill in
+    manifest = {"format": "deflate", "dict": hashlib.sha256(dictionary).hexdigest()}
+    if args.compress:
+        with open(args.compress[0], "rb") as f:
+            image = f.read()
+        with open(args.compress[1], "wb") as f:
+            f.write(compress(image, dictionary))
+        manifest["size"] = len(image)
+    print(json.dumps(manifest, indent=4))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())